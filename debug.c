@@ -1,63 +1,258 @@
 #include "debug.h"
 #include "color.h"
 
-int8_t dbglvl() {
-    if (_dbg_lvl == INT8_MIN) {
-        errno = 0;
-        const char *s = getenv("DEBUG");
-        if (s != NULL) {
-            char *e;
-            long val;
-            val = strtol(s, &e, 10);
-            if (e == s || *e != '\0' || errno == EINVAL || errno == ERANGE) {
-                printf("invalid value for DEBUG=\"%s\"; defaulting to 0\n", s);
-                _dbg_lvl = 0;
-            } else {
-                _dbg_lvl = (int8_t) val;
-                if (_dbg_lvl < 0) {
-                    printf("invalid range for DEBUG=\"%d\"; defaulting to 0\n", _dbg_lvl);
-                    _dbg_lvl = 0;
-                }
-            }
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#define DBG_RING_MASK (DBG_RING_SIZE - 1)
+_Static_assert((DBG_RING_SIZE & DBG_RING_MASK) == 0, "DBG_RING_SIZE must be a power of 2");
+
+// bounded multi-producer ring buffer (Vyukov): a slot is free for position pos when seq == pos
+// and holds a complete line when seq == pos + 1
+typedef struct {
+    atomic_size_t seq;
+    size_t len;
+    char line[DBG_LINE_SIZE];
+} dbg_slot_t;
+
+static const char *const _dbg_names[DBG_NMOD] = { "ALLOC", "SHAPE", "REDUCE", "EWOP" };
+static _Atomic int8_t _dbg_lvl[DBG_NMOD];
+static pthread_once_t _dbg_lvl_once = PTHREAD_ONCE_INIT;
+
+static dbg_slot_t _dbg_ring[DBG_RING_SIZE];
+static atomic_size_t _dbg_head; // next position to be claimed by a producer
+static atomic_size_t _dbg_tail; // next position to be written out (only advanced by the writer, after flushing)
+static atomic_uint_fast64_t _dbg_dropped;
+static _Atomic(FILE *) _dbg_stream;
+
+static pthread_once_t _dbg_ring_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t _dbg_writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t _dbg_writer;
+static atomic_bool _dbg_running;
+static atomic_bool _dbg_stop;
+
+static _Thread_local char _dbg_line[DBG_LINE_SIZE];
+static _Thread_local size_t _dbg_len;
+
+static int8_t envlvl(const char *name, int8_t def) {
+    const char *s = getenv(name);
+    if (s == NULL) return def;
+    errno = 0;
+    char *e;
+    long val = strtol(s, &e, 10);
+    if (e == s || *e != '\0' || errno == EINVAL || errno == ERANGE) {
+        fprintf(stderr, "invalid value for %s=\"%s\"; defaulting to %d\n", name, s, def);
+        return def;
+    }
+    if (val < 0 || val > INT8_MAX) {
+        fprintf(stderr, "invalid range for %s=\"%ld\"; defaulting to %d\n", name, val, def);
+        return def;
+    }
+    return (int8_t) val;
+}
+
+static void dbglvl_init() {
+    int8_t lvl = envlvl("DEBUG", 0);
+    char name[32];
+    for (int m = 0; m < DBG_NMOD; m++) {
+        snprintf(name, sizeof(name), "DEBUG_%s", _dbg_names[m]);
+        atomic_store_explicit(&_dbg_lvl[m], envlvl(name, lvl), memory_order_relaxed);
+    }
+}
+
+/**
+ * Returns the debug level of a module (read from the environment on first use)
+ *
+ * @param mod module to get the level of
+ * @return debug level of the module
+ */
+int8_t dbglvl(dbg_mod_t mod) {
+    assert(mod < DBG_NMOD);
+    pthread_once(&_dbg_lvl_once, dbglvl_init);
+    return atomic_load_explicit(&_dbg_lvl[mod], memory_order_relaxed);
+}
+
+/**
+ * Overrides the debug level of a module (DBG_NMOD sets all modules)
+ *
+ * @param mod module to set the level of
+ * @param lvl new debug level
+ */
+void dbgset(dbg_mod_t mod, int8_t lvl) {
+    assert(mod <= DBG_NMOD);
+    pthread_once(&_dbg_lvl_once, dbglvl_init);
+    for (int m = 0; m < DBG_NMOD; m++) {
+        if (mod == DBG_NMOD || m == (int) mod) atomic_store_explicit(&_dbg_lvl[m], lvl, memory_order_relaxed);
+    }
+}
+
+/**
+ * Sets the stream the background writer outputs debug lines to (stdout by default)
+ *
+ * @param stream stream to write to
+ */
+void dbgfile(FILE *stream) {
+    assert(stream != NULL);
+    atomic_store(&_dbg_stream, stream);
+}
+
+static void ring_init() {
+    for (size_t i = 0; i < DBG_RING_SIZE; i++) atomic_store_explicit(&_dbg_ring[i].seq, i, memory_order_relaxed);
+    if (atomic_load(&_dbg_stream) == NULL) atomic_store(&_dbg_stream, stdout);
+}
+
+// pops and writes out all complete lines; returns the number of written lines
+static size_t ring_drain() {
+    FILE *stream = atomic_load(&_dbg_stream);
+    size_t n = 0;
+    size_t pos = atomic_load_explicit(&_dbg_tail, memory_order_relaxed);
+    for (;;) {
+        dbg_slot_t *slot = &_dbg_ring[pos & DBG_RING_MASK];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1) break;
+        fwrite(slot->line, 1, slot->len, stream);
+        atomic_store_explicit(&slot->seq, pos + DBG_RING_SIZE, memory_order_release);
+        pos++;
+        n++;
+    }
+    // publish the tail only once the lines reached the stream so dbgflush() never returns early
+    if (n > 0) {
+        fflush(stream);
+        atomic_store_explicit(&_dbg_tail, pos, memory_order_release);
+    }
+    return n;
+}
+
+static void *writer(void *arg) {
+    (void) arg;
+    const struct timespec idle = { .tv_sec = 0, .tv_nsec = 1000000 };
+    while (!atomic_load(&_dbg_stop)) {
+        if (ring_drain() == 0) nanosleep(&idle, NULL);
+    }
+    ring_drain();
+    return NULL;
+}
+
+static void writer_stop() {
+    pthread_mutex_lock(&_dbg_writer_lock);
+    if (atomic_load(&_dbg_running)) {
+        atomic_store(&_dbg_stop, true);
+        pthread_join(_dbg_writer, NULL);
+        atomic_store(&_dbg_running, false);
+        atomic_store(&_dbg_stop, false);
+    }
+    pthread_mutex_unlock(&_dbg_writer_lock);
+}
+
+// the writer thread does not survive a fork; let the child start its own on its next line
+static void writer_atfork_child() {
+    pthread_mutex_init(&_dbg_writer_lock, NULL);
+    atomic_store(&_dbg_running, false);
+    atomic_store(&_dbg_stop, false);
+}
+
+static void writer_start() {
+    if (atomic_load_explicit(&_dbg_running, memory_order_acquire)) return;
+    pthread_mutex_lock(&_dbg_writer_lock);
+    if (!atomic_load(&_dbg_running)) {
+        static bool registered = false;
+        if (!registered) {
+            atexit(writer_stop);
+            pthread_atfork(NULL, NULL, writer_atfork_child);
+            registered = true;
+        }
+        int rc = pthread_create(&_dbg_writer, NULL, writer, NULL);
+        assert(rc == 0);
+        if (rc == 0) atomic_store_explicit(&_dbg_running, true, memory_order_release);
+    }
+    pthread_mutex_unlock(&_dbg_writer_lock);
+}
+
+// claims a slot and copies the line into it; drops the line if the ring is full
+static void ring_push(const char *line, size_t len) {
+    pthread_once(&_dbg_ring_once, ring_init);
+    writer_start();
+
+    dbg_slot_t *slot;
+    size_t pos = atomic_load_explicit(&_dbg_head, memory_order_relaxed);
+    for (;;) {
+        slot = &_dbg_ring[pos & DBG_RING_MASK];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&_dbg_head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit(&_dbg_dropped, 1, memory_order_relaxed);
+            return;
         } else {
-            _dbg_lvl = 0;
+            pos = atomic_load_explicit(&_dbg_head, memory_order_relaxed);
         }
     }
-    return _dbg_lvl;
-}
-
-// uint8_t dbg_start(int8_t lvl, const char *name) {
-//     assert(_dbg_last <= UINT8_MAX);
-//     uint8_t id = 0;
-//     if (dbglvl() >= lvl) {
-//         id = _dbg_last++;
-//         if (id > 0 && _dbg_mod[id-1] == 1) printf("\n");
-//         printf("%*s", id * DBG_ALIGN, ""); \
-//         printf(YEL "%s" RST " ", name);
-//         _dbg_mod[id] = 1;
-//     }
-//     return id;
-// }
-
-// void dbg(uint8_t id, int8_t lvl, const char *fmt, ...) {
-//     if (dbglvl() >= (int8_t)(lvl)) {
-//         for (uint8_t i = 0; i <= id; i++) _dbg_mod[i] = 1;
-//         if (_dbg_mod[id + 1] == 1) {
-//             printf("\n%*s", id * DBG_ALIGN, "");
-//             _dbg_mod[id + 1] = 0;
-//         }
-//         va_list args;
-//         va_start(args, fmt);
-//         vprintf(fmt, args);
-//         va_end(args);
-//     }
-// }
-
-// void dbg_end(uint8_t id, int8_t lvl) {
-//     if (_dbg_last == 0) return;
-//     if (dbglvl() >= lvl) {
-//         if (_dbg_mod[id] == 1) printf("\n");
-//         for (uint8_t i = 0; i <= id; i++) _dbg_mod[i] = 0;
-//         _dbg_last--;
-//     }
-// }
\ No newline at end of file
+
+    memcpy(slot->line, line, len);
+    slot->len = len;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+/**
+ * Waits until every line queued before the call has been written out
+ */
+void dbgflush() {
+    size_t head = atomic_load(&_dbg_head);
+    const struct timespec wait = { .tv_sec = 0, .tv_nsec = 100000 };
+    while (atomic_load_explicit(&_dbg_running, memory_order_acquire) && atomic_load(&_dbg_tail) < head) nanosleep(&wait, NULL);
+}
+
+/**
+ * Returns the number of lines dropped because the ring buffer was full
+ */
+uint64_t dbgdropped() {
+    return atomic_load_explicit(&_dbg_dropped, memory_order_relaxed);
+}
+
+// appends formatted text to the calling thread's line (silently truncates)
+static void line_append(const char *fmt, va_list args) {
+    if (_dbg_len >= DBG_LINE_SIZE - 1) return;
+    int w = vsnprintf(&_dbg_line[_dbg_len], DBG_LINE_SIZE - 1 - _dbg_len, fmt, args);
+    if (w > 0) _dbg_len = _dbg_len + w < DBG_LINE_SIZE - 1 ? _dbg_len + w : DBG_LINE_SIZE - 2;
+}
+
+static void line_printf(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    line_append(fmt, args);
+    va_end(args);
+}
+
+/**
+ * Starts a new debug line for the calling thread, prefixed with the name of the function logging it
+ *
+ * @param name name of the function
+ */
+void dbg_start(const char *name) {
+    _dbg_len = 0;
+    line_printf(YEL "%*s " RST, DBG_ALIGN, name);
+}
+
+/**
+ * Appends formatted text to the calling thread's current debug line
+ *
+ * @param fmt printf-style format
+ */
+void dbg(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    line_append(fmt, args);
+    va_end(args);
+}
+
+/**
+ * Terminates the calling thread's current debug line and queues it for writing
+ */
+void dbg_end() {
+    _dbg_line[_dbg_len++] = '\n';
+    ring_push(_dbg_line, _dbg_len);
+    _dbg_len = 0;
+}
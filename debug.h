@@ -12,22 +12,34 @@
 #include "color.h"
 
 #define DBG_ALIGN 14
+#define DBG_LINE_SIZE 512 // max length of a single debug line (longer lines are truncated)
+#define DBG_RING_SIZE 1024 // number of lines the ring buffer can hold before dropping (must be a power of 2)
 
-static int8_t _dbg_lvl = INT8_MIN;
-static volatile uint8_t _dbg_last = 0;
-static volatile uint8_t _dbg_mod[UINT8_MAX] = { 0 };
+// modules with independent debug levels; DEBUG=<lvl> sets all of them and DEBUG_<MODULE>=<lvl> overrides one
+typedef enum {
+    DBG_ALLOC,
+    DBG_SHAPE,
+    DBG_REDUCE,
+    DBG_EWOP,
+    DBG_NMOD
+} dbg_mod_t;
 
-#define DBG(lvl, code) { \
-    if (dbglvl() >= (int8_t)(lvl)) { \
-        printf(YEL "%*s " RST, DBG_ALIGN, __func__); \
+// formats a debug line into a thread-local buffer and queues it to the background writer (never blocks)
+#define DBG(mod, lvl, code) { \
+    if (dbglvl(mod) >= (int8_t)(lvl)) { \
+        dbg_start(__func__); \
         do { code } while (0); \
-        printf("\n"); \
+        dbg_end(); \
     } \
 } \
 
-int8_t dbglvl();
-// uint8_t dbg_start(int8_t lvl, const char *name);
-// void dbg(uint8_t id, int8_t lvl, const char *fmt, ...);
-// void dbg_end(uint8_t id, int8_t lvl);
+int8_t dbglvl(dbg_mod_t mod);
+void dbgset(dbg_mod_t mod, int8_t lvl);
+void dbgfile(FILE *stream);
+void dbgflush();
+uint64_t dbgdropped();
+void dbg_start(const char *name);
+void dbg(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void dbg_end();
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,118 @@
+#include "dispatch.h"
+#include "kernels.h"
+
+#include <pthread.h>
+
+static kernel_t _kernels[OP_NOPS][DTYPE_NTYPES][ISA_NISAS][LAYOUT_NLAYOUTS];
+static pthread_once_t _dispatch_once = PTHREAD_ONCE_INIT;
+static isa_t _dispatch_cap; // best instruction set the cpu supports, capped with TENSOR_ISA
+static isa_t _dispatch_isa; // _dispatch_cap, further capped with dispatch_max_isa
+static uint32_t _dispatch_gen; // bumped whenever resolving could give a different kernel
+
+static const char *const _isa_names[ISA_NISAS] = { "scalar", "avx2", "avxvnni" };
+
+// best instruction set of the cpu
+static isa_t cpu_isa() {
+    return cpu_avxvnni() ? ISA_AVXVNNI : cpu_avx2() ? ISA_AVX2 : ISA_SCALAR;
+}
+
+static void dispatch_init() {
+    _dispatch_isa = cpu_isa();
+    const char *s = getenv("TENSOR_ISA");
+    if (s != NULL) {
+        isa_t isa = ISA_NISAS;
+        for (int i = 0; i < ISA_NISAS; i++) if (strcmp(s, _isa_names[i]) == 0) isa = i;
+        if (isa == ISA_NISAS) fprintf(stderr, "invalid value for TENSOR_ISA=\"%s\"; using %s\n", s, _isa_names[_dispatch_isa]);
+        else if (isa < _dispatch_isa) _dispatch_isa = isa;
+    }
+    _dispatch_cap = _dispatch_isa;
+    kernels_init();
+}
+
+/**
+ * Returns the instruction set kernels are resolved for
+ */
+isa_t dispatch_isa() {
+    pthread_once(&_dispatch_once, dispatch_init);
+    return __atomic_load_n(&_dispatch_isa, __ATOMIC_RELAXED);
+}
+
+/**
+ * Caps the instruction set kernels are resolved for (never above what the cpu supports or TENSOR_ISA allows);
+ * used to test the fallbacks
+ *
+ * @param isa highest instruction set to use
+ * @return previous cap
+ */
+isa_t dispatch_max_isa(isa_t isa) {
+    assert(isa < ISA_NISAS);
+    pthread_once(&_dispatch_once, dispatch_init);
+    isa_t prev = __atomic_load_n(&_dispatch_isa, __ATOMIC_RELAXED);
+    if (isa > _dispatch_cap) isa = _dispatch_cap;
+    __atomic_store_n(&_dispatch_isa, isa, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&_dispatch_gen, 1, __ATOMIC_RELEASE);
+    return prev;
+}
+
+/**
+ * Returns a counter that changes every time a kernel is registered or the instruction set is capped; kernels
+ * resolved (and cached) under an older generation may be stale
+ */
+uint32_t dispatch_generation() {
+    pthread_once(&_dispatch_once, dispatch_init);
+    return __atomic_load_n(&_dispatch_gen, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Classifies the strides of the innermost run of n operands
+ *
+ * @param n number of operands
+ * @param strides stride of each operand
+ * @return most specific layout class covering every operand
+ */
+layout_t layout_of(uint32_t n, const stride_t *strides) {
+    layout_t l = LAYOUT_CONTIGUOUS;
+    for (uint32_t i = 0; i < n; i++) {
+        if (strides[i] == 0) l = LAYOUT_BROADCAST;
+        else if (strides[i] != 1) return LAYOUT_STRIDED;
+    }
+    return l;
+}
+
+/**
+ * Registers a kernel (replacing the one registered for the same key); register new kernels before ops using
+ * them run on other threads
+ *
+ * @param op op the kernel implements
+ * @param dtype element type
+ * @param isa instruction set the kernel needs
+ * @param layout most general layout class the kernel handles
+ * @param k kernel (its type must match the kind of op)
+ */
+void kernel_register(tensor_op_t op, dtype_t dtype, isa_t isa, layout_t layout, kernel_t k) {
+    assert(op < OP_NOPS && dtype < DTYPE_NTYPES && isa < ISA_NISAS && layout < LAYOUT_NLAYOUTS);
+    __atomic_store_n(&_kernels[op][dtype][isa][layout].any, k.any, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&_dispatch_gen, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Finds the kernel for an op: the best instruction set available first and, within it, the most specific
+ * layout class that covers the requested one. Resolve once per call, outside the loops.
+ *
+ * @param op op to run
+ * @param dtype element type
+ * @param layout layout class of the operands (see layout_of)
+ * @return kernel (aborts if none was registered)
+ */
+kernel_t kernel_resolve(tensor_op_t op, dtype_t dtype, layout_t layout) {
+    assert(op < OP_NOPS && dtype < DTYPE_NTYPES && layout < LAYOUT_NLAYOUTS);
+    isa_t best = dispatch_isa();
+    for (int isa = best; isa >= ISA_SCALAR; isa--) {
+        for (int l = layout; l < LAYOUT_NLAYOUTS; l++) {
+            kernel_t k = { .any = __atomic_load_n(&_kernels[op][dtype][isa][l].any, __ATOMIC_ACQUIRE) };
+            if (k.any != NULL) return k;
+        }
+    }
+    assert(false && "no kernel registered");
+    return (kernel_t){ .any = NULL };
+}
@@ -0,0 +1,111 @@
+#ifndef __DISPATCH_H__
+#define __DISPATCH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "tensor.h"
+
+typedef enum {
+    DTYPE_F32,
+    DTYPE_I8,
+    DTYPE_Q4, // blocks of 4-bit values (q4_block_t)
+    DTYPE_NTYPES
+} dtype_t;
+
+// instruction sets kernels can be written for (in order; a cpu supporting one supports the ones before it)
+typedef enum {
+    ISA_SCALAR,
+    ISA_AVX2, // AVX2 + FMA + F16C
+    ISA_AVXVNNI, // AVX2 + FMA + AVX-VNNI (int8 dot products)
+    ISA_NISAS
+} isa_t;
+
+// layout class of the innermost run of the operands, from the most to the least specific; a kernel registered
+// for a class also handles the more specific ones
+typedef enum {
+    LAYOUT_CONTIGUOUS, // every stride is 1
+    LAYOUT_BROADCAST, // strides are 1 or 0 (inner broadcast)
+    LAYOUT_STRIDED, // any stride
+    LAYOUT_NLAYOUTS
+} layout_t;
+
+#define OP_IS_BINARY(op) ((op) <= OP_GT)
+#define OP_IS_UNARY(op) ((op) >= OP_EXP && (op) <= OP_GELU)
+#define OP_IS_TERNARY(op) ((op) == OP_FMA || (op) == OP_WHERE)
+#define OP_IS_REDUCE(op) ((op) >= OP_SUM && (op) <= OP_MAX)
+
+// dst and src of unary kernels are contiguous; dst of the others too
+typedef void (*unary_fn_t)(float *dst, const float *src, size_t n, bool fast);
+typedef void (*binary_fn_t)(float *dst, const float *a, stride_t as, const float *b, stride_t bs, size_t n);
+typedef void (*ternary_fn_t)(float *dst, const float *a, stride_t as, const float *b, stride_t bs, const float *c, stride_t cs, size_t n);
+// folds n elements into acc and returns it
+typedef float (*reduce_fn_t)(const float *src, stride_t s, size_t n, float acc);
+
+// GEMM_MR x GEMM_NR tile c (row stride ldc) = a * b (+ c when acc) from a panel of a and one of b (k_pack_a/b)
+typedef void (*gemm_fn_t)(size_t k, const float *a, const float *b, float *c, size_t ldc, bool acc);
+
+typedef float (*dot_fn_t)(const float *a, stride_t as, const float *b, stride_t bs, size_t n);
+// OP_GEMV: y[i] = row i of m . x (rows rs apart, contiguous, n long)
+// OP_GEMV_T: y (n values) = sum over the rows of x[i] * row i of m
+typedef void (*gemv_fn_t)(float *y, const float *m, size_t rs, const float *x, size_t rows, size_t n);
+
+// Q8_MR x Q8_NR int32 tile c (row stride ldc) = a * b exactly from int8 panels of a and b (k_pack_q8_a/b, kg
+// groups of 4 k); bsum holds the sums of the Q8_NR columns of the panel of b (for kernels that bias a)
+typedef void (*gemm_q8_fn_t)(size_t kg, const int8_t *a, const int8_t *b, const int32_t *bsum, int32_t *c, size_t ldc);
+
+// OP_QUANTIZE: dst[i] = clamp(round(src[i] * inv_scale) + zero, -Q8_MAX, Q8_MAX) (round to nearest even; nan goes
+// to the low end)
+typedef void (*quantize_fn_t)(int8_t *dst, const float *src, size_t n, float inv_scale, int32_t zero);
+// OP_DEQUANTIZE: dst[i] = scale * (src[i] - zero)
+typedef void (*dequantize_fn_t)(float *dst, const int8_t *src, size_t n, float scale, int32_t zero);
+
+// y[i] = row i of m . x for rows of nb blocks (rs blocks apart) and x of nb * Q4_BLOCK values
+typedef void (*gemv_q4_fn_t)(float *y, const q4_block_t *m, size_t rs, const float *x, size_t rows, size_t nb);
+
+// direct convolution of npix output pixels (channels last): for every pixel p, out[p * o + j] += sum over the
+// ntaps taps t and the c input channels i of in[t][p * sx + i] * w[t][i * op + j] (op is o rounded up to CONV_NR,
+// with zero padding); OP_CONV_DW (depthwise, o == c): out[p * c + i] += sum over t of in[t][p * sx + i] * w[t][i]
+typedef void (*conv_fn_t)(float *out, const float *const *in, const float *const *w, size_t ntaps, size_t sx, size_t c, size_t o, size_t npix);
+
+// softmax of each of the w columns of n values ds apart (src[j * ds + i], j < n, i < w) into dst (same layout);
+// OP_LOGSUMEXP writes dst[i] = log of the sum of exp over column i instead. w == 1 and ds == 1 is one contiguous row
+typedef void (*softmax_fn_t)(float *dst, const float *src, size_t n, size_t ds, size_t w);
+
+// mean[i] and m2[i] get the mean and the sum of squared deviations (Welford) of column i of w columns of n values
+// ds apart (src[j * ds + i], j < n); the means are of the values minus the first one of their column (src[i]), which
+// keeps their rounding relative to the spread of the values. w == 1 and ds == 1 is one contiguous row
+typedef void (*moments_fn_t)(float *mean, float *m2, const float *src, size_t n, size_t ds, size_t w);
+
+// normalizes rows contiguous rows of n values: OP_LAYERNORM dst = (x - mean) / sqrt(var + eps) * gamma + beta,
+// OP_RMSNORM dst = x / sqrt(mean(x^2) + eps) * gamma (gamma and beta are n values, NULL for none; rmsnorm ignores beta)
+typedef void (*norm_fn_t)(float *dst, const float *x, size_t rows, size_t n, const float *gamma, const float *beta, float eps);
+
+typedef union {
+    void (*any)(void);
+    unary_fn_t unary;
+    binary_fn_t binary;
+    ternary_fn_t ternary;
+    reduce_fn_t reduce;
+    gemm_fn_t gemm;
+    dot_fn_t dot;
+    gemv_fn_t gemv;
+    gemm_q8_fn_t gemm_q8;
+    quantize_fn_t quantize;
+    dequantize_fn_t dequantize;
+    gemv_q4_fn_t gemv_q4;
+    conv_fn_t conv;
+    softmax_fn_t softmax;
+    norm_fn_t norm;
+    moments_fn_t moments;
+} kernel_t;
+
+isa_t dispatch_isa();
+isa_t dispatch_max_isa(isa_t isa);
+uint32_t dispatch_generation();
+layout_t layout_of(uint32_t n, const stride_t *strides);
+void kernel_register(tensor_op_t op, dtype_t dtype, isa_t isa, layout_t layout, kernel_t k);
+kernel_t kernel_resolve(tensor_op_t op, dtype_t dtype, layout_t layout);
+
+#endif
@@ -0,0 +1,1637 @@
+#include "kernels.h"
+#include "dispatch.h"
+
+#include <immintrin.h>
+#include <math.h>
+#include <limits.h>
+#include <float.h>
+#include <string.h>
+#include <assert.h>
+
+#define AVX2 __attribute__((target("avx2,fma,f16c")))
+#define AVXVNNI __attribute__((target("avx2,fma,f16c,avxvnni")))
+
+bool cpu_avx2() {
+    static int8_t has = -1;
+    if (has < 0) {
+        __builtin_cpu_init();
+        has = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c");
+    }
+    return has;
+}
+
+bool cpu_avxvnni() {
+    static int8_t has = -1;
+    if (has < 0) {
+        __builtin_cpu_init();
+        has = cpu_avx2() && __builtin_cpu_supports("avxvnni");
+    }
+    return has;
+}
+
+/************************* FILL *************************/
+
+AVX2 static void fill_avx2(float *dst, size_t n, float value) {
+    __m256 v = _mm256_set1_ps(value);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        _mm256_storeu_ps(dst + i, v);
+        _mm256_storeu_ps(dst + i + 8, v);
+        _mm256_storeu_ps(dst + i + 16, v);
+        _mm256_storeu_ps(dst + i + 24, v);
+    }
+    for (; i + 8 <= n; i += 8) _mm256_storeu_ps(dst + i, v);
+    for (; i < n; i++) dst[i] = value;
+}
+
+static void fill_scalar(float *dst, size_t n, float value) {
+    for (size_t i = 0; i < n; i++) dst[i] = value;
+}
+
+void k_fill(float *dst, size_t n, float value) {
+    if (cpu_avx2()) fill_avx2(dst, n, value);
+    else fill_scalar(dst, n, value);
+}
+
+/************************* ARANGE *************************/
+
+AVX2 static void arange_avx2(float *dst, size_t n, float start, float step, size_t first) {
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256 vstart = _mm256_set1_ps(start), vstep = _mm256_set1_ps(step);
+    size_t i = 0;
+    // indices are converted from int32 so every element rounds exactly like the scalar path
+    for (; i + 8 <= n && first + i + 8 <= INT32_MAX; i += 8) {
+        __m256 idx = _mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32((int32_t) (first + i)), lane));
+        _mm256_storeu_ps(dst + i, _mm256_fmadd_ps(idx, vstep, vstart));
+    }
+    for (; i < n; i++) dst[i] = fmaf((float) (first + i), step, start);
+}
+
+static void arange_scalar(float *dst, size_t n, float start, float step, size_t first) {
+    for (size_t i = 0; i < n; i++) dst[i] = fmaf((float) (first + i), step, start);
+}
+
+void k_arange(float *dst, size_t n, float start, float step, size_t first) {
+    if (cpu_avx2()) arange_avx2(dst, n, start, step, first);
+    else arange_scalar(dst, n, start, step, first);
+}
+
+/************************* MATH *************************/
+
+// the scalar versions mirror the SIMD ones operation by operation (same constants, same fmas) so both paths
+// give the same bits; they are kept out of line so the compiler cannot contract them differently
+
+#define LOG_SQRTHF 0.707106781186547524f
+
+static inline float bits2f(uint32_t u) { float f; memcpy(&f, &u, sizeof(f)); return f; }
+static inline uint32_t f2bits(float f) { uint32_t u; memcpy(&u, &f, sizeof(u)); return u; }
+
+// natural log of normal positive floats (cephes logf, max error ~1 ulp)
+__attribute__((noinline)) static float s_log(float x) {
+    uint32_t bits = f2bits(x);
+    int32_t e = (int32_t) (bits >> 23) - 126;
+    float m = bits2f((bits & 0x007fffff) | 0x3f000000); // [0.5, 1)
+    bool small = m < LOG_SQRTHF;
+    e -= small;
+    float f = (m - 1.0f) + (small ? m : 0.0f);
+    float ef = (float) e;
+    float z = f * f;
+    float p = 7.0376836292e-2f;
+    p = fmaf(p, f, -1.1514610310e-1f);
+    p = fmaf(p, f, 1.1676998740e-1f);
+    p = fmaf(p, f, -1.2420140846e-1f);
+    p = fmaf(p, f, 1.4249322787e-1f);
+    p = fmaf(p, f, -1.6668057665e-1f);
+    p = fmaf(p, f, 2.0000714765e-1f);
+    p = fmaf(p, f, -2.4999993993e-1f);
+    p = fmaf(p, f, 3.3333331174e-1f);
+    float y = (z * f) * p;
+    y = fmaf(ef, -2.12194440e-4f, y);
+    y = fmaf(z, -0.5f, y);
+    float r = f + y;
+    return fmaf(ef, 0.693359375f, r);
+}
+
+AVX2 static __m256 v_log(__m256 x) {
+    __m256i bits = _mm256_castps_si256(x);
+    __m256i e = _mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(126));
+    __m256 m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff)), _mm256_set1_epi32(0x3f000000)));
+    __m256 small = _mm256_cmp_ps(m, _mm256_set1_ps(LOG_SQRTHF), _CMP_LT_OQ);
+    e = _mm256_add_epi32(e, _mm256_castps_si256(small)); // the mask is -1 where small
+    __m256 f = _mm256_add_ps(_mm256_sub_ps(m, _mm256_set1_ps(1.0f)), _mm256_and_ps(small, m));
+    __m256 ef = _mm256_cvtepi32_ps(e);
+    __m256 z = _mm256_mul_ps(f, f);
+    __m256 p = _mm256_set1_ps(7.0376836292e-2f);
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(-1.1514610310e-1f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(1.1676998740e-1f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(-1.2420140846e-1f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(1.4249322787e-1f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(-1.6668057665e-1f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(2.0000714765e-1f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(-2.4999993993e-1f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(3.3333331174e-1f));
+    __m256 y = _mm256_mul_ps(_mm256_mul_ps(z, f), p);
+    y = _mm256_fmadd_ps(ef, _mm256_set1_ps(-2.12194440e-4f), y);
+    y = _mm256_fmadd_ps(z, _mm256_set1_ps(-0.5f), y);
+    __m256 r = _mm256_add_ps(f, y);
+    return _mm256_fmadd_ps(ef, _mm256_set1_ps(0.693359375f), r);
+}
+
+#define SC_PIO2 1.57079632679489661923f
+#define SC_S0 -1.9515295891e-4f
+#define SC_S1 8.3321608736e-3f
+#define SC_S2 -1.6666654611e-1f
+#define SC_C0 2.443315711809948e-5f
+#define SC_C1 -1.388731625493765e-3f
+#define SC_C2 4.166664568298827e-2f
+
+// sin and cos of 2 * pi * u for u in [0, 1) (the reduction to [-pi/4, pi/4] is exact; absolute error below 2^-23)
+__attribute__((noinline)) static void s_sincos2pi(float u, float *s, float *c) {
+    float t = u * 4.0f;
+    float q = nearbyintf(t);
+    uint32_t qi = (uint32_t) (int32_t) q;
+    float r = (t - q) * SC_PIO2;
+    float z = r * r;
+    float ps = fmaf(fmaf(SC_S0, z, SC_S1), z, SC_S2);
+    float sr = fmaf(ps * z, r, r);
+    float pc = fmaf(fmaf(SC_C0, z, SC_C1), z, SC_C2);
+    float cr = fmaf(pc * z, z, fmaf(z, -0.5f, 1.0f));
+    bool swap = qi & 1;
+    *s = bits2f(f2bits(swap ? cr : sr) ^ ((qi & 2) << 30));
+    *c = bits2f(f2bits(swap ? sr : cr) ^ (((qi + 1) & 2) << 30));
+}
+
+AVX2 static void v_sincos2pi(__m256 u, __m256 *s, __m256 *c) {
+    __m256 t = _mm256_mul_ps(u, _mm256_set1_ps(4.0f));
+    __m256 q = _mm256_round_ps(t, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256i qi = _mm256_cvtps_epi32(q);
+    __m256 r = _mm256_mul_ps(_mm256_sub_ps(t, q), _mm256_set1_ps(SC_PIO2));
+    __m256 z = _mm256_mul_ps(r, r);
+    __m256 ps = _mm256_fmadd_ps(_mm256_fmadd_ps(_mm256_set1_ps(SC_S0), z, _mm256_set1_ps(SC_S1)), z, _mm256_set1_ps(SC_S2));
+    __m256 sr = _mm256_fmadd_ps(_mm256_mul_ps(ps, z), r, r);
+    __m256 pc = _mm256_fmadd_ps(_mm256_fmadd_ps(_mm256_set1_ps(SC_C0), z, _mm256_set1_ps(SC_C1)), z, _mm256_set1_ps(SC_C2));
+    __m256 cr = _mm256_fmadd_ps(_mm256_mul_ps(pc, z), z, _mm256_fmadd_ps(z, _mm256_set1_ps(-0.5f), _mm256_set1_ps(1.0f)));
+    __m256 swap = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(qi, _mm256_set1_epi32(1)), _mm256_set1_epi32(1)));
+    __m256 ssign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(qi, _mm256_set1_epi32(2)), 30));
+    __m256 csign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(_mm256_add_epi32(qi, _mm256_set1_epi32(1)), _mm256_set1_epi32(2)), 30));
+    *s = _mm256_xor_ps(_mm256_blendv_ps(sr, cr, swap), ssign);
+    *c = _mm256_xor_ps(_mm256_blendv_ps(cr, sr, swap), csign);
+}
+
+/************************* RANDOM *************************/
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+typedef enum {
+    RNG_UNIFORM,
+    RNG_NORMAL,
+    RNG_INT
+} rng_kind_t;
+
+typedef struct {
+    rng_kind_t kind;
+    float a, b; // low and high - low (uniform) or mean and std (normal)
+    float max; // largest value below high (uniform)
+    int32_t low; // RNG_INT
+    uint32_t range; // RNG_INT
+} rng_params_t;
+
+/**
+ * Philox4x32-10 block function (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3")
+ *
+ * @param ctr 128-bit counter (replaced by the 128 random bits for it)
+ * @param key 64-bit key
+ */
+void k_philox(uint32_t ctr[4], uint64_t key) {
+    uint32_t k0 = (uint32_t) key, k1 = (uint32_t) (key >> 32);
+    for (int r = 0; r < 10; r++) {
+        uint64_t p0 = (uint64_t) PHILOX_M0 * ctr[0], p1 = (uint64_t) PHILOX_M1 * ctr[2];
+        uint32_t c0 = (uint32_t) (p1 >> 32) ^ ctr[1] ^ k0;
+        uint32_t c2 = (uint32_t) (p0 >> 32) ^ ctr[3] ^ k1;
+        ctr[0] = c0;
+        ctr[1] = (uint32_t) p1;
+        ctr[2] = c2;
+        ctr[3] = (uint32_t) p0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+}
+
+// uniform in [0, 1) and (0, 1] from the top 24 bits of x (exact in float)
+#define U01(x) ((float) ((x) >> 8) * 0x1p-24f)
+#define U01_OPEN(x) ((float) (((x) >> 8) + 1) * 0x1p-24f)
+
+// turns the 4 words of one block into 4 values (a pair of Box-Muller normals per 2 words)
+static void rng_block_scalar(float out[4], const uint32_t x[4], const rng_params_t *p) {
+    switch (p->kind) {
+        case RNG_UNIFORM:
+            // low + u * (high - low) can round up to high; clamp to keep the range half-open
+            for (int i = 0; i < 4; i++) out[i] = fminf(fmaf(U01(x[i]), p->b, p->a), p->max);
+            break;
+        case RNG_NORMAL:
+            for (int i = 0; i < 4; i += 2) {
+                float r = sqrtf(-2.0f * s_log(U01_OPEN(x[i])));
+                float s, c;
+                s_sincos2pi(U01(x[i+1]), &s, &c);
+                out[i] = fmaf(r * c, p->b, p->a);
+                out[i+1] = fmaf(r * s, p->b, p->a);
+            }
+            break;
+        case RNG_INT:
+            // multiply-shift maps x onto [0, range) (bias below range / 2^32)
+            for (int i = 0; i < 4; i++) out[i] = (float) (int32_t) ((uint32_t) p->low + (uint32_t) (((uint64_t) x[i] * p->range) >> 32));
+            break;
+    }
+}
+
+AVX2 static __m256i v_mulhi(__m256i a, __m256i m) {
+    __m256i even = _mm256_mul_epu32(a, m);
+    __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), m);
+    return _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+}
+
+AVX2 static __m256i v_mullo(__m256i a, __m256i m) {
+    return _mm256_mullo_epi32(a, m);
+}
+
+// generates blocks [block, block + 8) (32 values) into dst
+AVX2 static void rng8_avx2(float *dst, uint64_t block, uint64_t key, uint64_t stream, const rng_params_t *p) {
+    __m256i c[4];
+    uint32_t lo[8], hi[8];
+    for (int j = 0; j < 8; j++) {
+        lo[j] = (uint32_t) (block + j);
+        hi[j] = (uint32_t) ((block + j) >> 32);
+    }
+    c[0] = _mm256_loadu_si256((__m256i *) lo);
+    c[1] = _mm256_loadu_si256((__m256i *) hi);
+    c[2] = _mm256_set1_epi32((int32_t) (uint32_t) stream);
+    c[3] = _mm256_set1_epi32((int32_t) (uint32_t) (stream >> 32));
+    const __m256i m0 = _mm256_set1_epi32((int32_t) PHILOX_M0), m1 = _mm256_set1_epi32((int32_t) PHILOX_M1);
+    uint32_t k0 = (uint32_t) key, k1 = (uint32_t) (key >> 32);
+    for (int r = 0; r < 10; r++) {
+        __m256i hi0 = v_mulhi(c[0], m0), lo0 = v_mullo(c[0], m0);
+        __m256i hi1 = v_mulhi(c[2], m1), lo1 = v_mullo(c[2], m1);
+        c[0] = _mm256_xor_si256(_mm256_xor_si256(hi1, c[1]), _mm256_set1_epi32((int32_t) k0));
+        c[1] = lo1;
+        c[2] = _mm256_xor_si256(_mm256_xor_si256(hi0, c[3]), _mm256_set1_epi32((int32_t) k1));
+        c[3] = lo0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+
+    // word w of block j goes to dst[4 * j + w]
+    __m256 v[4];
+    switch (p->kind) {
+        case RNG_UNIFORM: {
+            __m256 a = _mm256_set1_ps(p->a), b = _mm256_set1_ps(p->b), scale = _mm256_set1_ps(0x1p-24f);
+            __m256 max = _mm256_set1_ps(p->max);
+            for (int w = 0; w < 4; w++) {
+                __m256 u = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(c[w], 8)), scale);
+                v[w] = _mm256_min_ps(_mm256_fmadd_ps(u, b, a), max);
+            }
+            break;
+        }
+        case RNG_NORMAL: {
+            __m256 a = _mm256_set1_ps(p->a), b = _mm256_set1_ps(p->b), scale = _mm256_set1_ps(0x1p-24f);
+            for (int w = 0; w < 4; w += 2) {
+                __m256 u1 = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_srli_epi32(c[w], 8), _mm256_set1_epi32(1))), scale);
+                __m256 u2 = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(c[w+1], 8)), scale);
+                __m256 r = _mm256_sqrt_ps(_mm256_mul_ps(_mm256_set1_ps(-2.0f), v_log(u1)));
+                __m256 s, co;
+                v_sincos2pi(u2, &s, &co);
+                v[w] = _mm256_fmadd_ps(_mm256_mul_ps(r, co), b, a);
+                v[w+1] = _mm256_fmadd_ps(_mm256_mul_ps(r, s), b, a);
+            }
+            break;
+        }
+        case RNG_INT: {
+            __m256i low = _mm256_set1_epi32(p->low), range = _mm256_set1_epi32((int32_t) p->range);
+            for (int w = 0; w < 4; w++) v[w] = _mm256_cvtepi32_ps(_mm256_add_epi32(low, v_mulhi(c[w], range)));
+            break;
+        }
+    }
+
+    // 4x4 transposes inside each 128-bit half: rows become blocks 0-3 (low halves) and 4-7 (high halves)
+    __m256 t0 = _mm256_unpacklo_ps(v[0], v[1]), t1 = _mm256_unpackhi_ps(v[0], v[1]);
+    __m256 t2 = _mm256_unpacklo_ps(v[2], v[3]), t3 = _mm256_unpackhi_ps(v[2], v[3]);
+    __m256 b04 = _mm256_castpd_ps(_mm256_unpacklo_pd(_mm256_castps_pd(t0), _mm256_castps_pd(t2)));
+    __m256 b15 = _mm256_castpd_ps(_mm256_unpackhi_pd(_mm256_castps_pd(t0), _mm256_castps_pd(t2)));
+    __m256 b26 = _mm256_castpd_ps(_mm256_unpacklo_pd(_mm256_castps_pd(t1), _mm256_castps_pd(t3)));
+    __m256 b37 = _mm256_castpd_ps(_mm256_unpackhi_pd(_mm256_castps_pd(t1), _mm256_castps_pd(t3)));
+    _mm256_storeu_ps(dst, _mm256_permute2f128_ps(b04, b15, 0x20));
+    _mm256_storeu_ps(dst + 8, _mm256_permute2f128_ps(b26, b37, 0x20));
+    _mm256_storeu_ps(dst + 16, _mm256_permute2f128_ps(b04, b15, 0x31));
+    _mm256_storeu_ps(dst + 24, _mm256_permute2f128_ps(b26, b37, 0x31));
+}
+
+// element i of a stream comes from word i % 4 of block i / 4, so any range can be generated on its own
+static void rng_run(float *dst, size_t n, uint64_t key, uint64_t stream, size_t first, const rng_params_t *p) {
+    bool avx2 = cpu_avx2();
+    size_t i = 0;
+    while (i < n) {
+        size_t e = first + i, lane = e & 3;
+        if (avx2 && lane == 0 && n - i >= 32) {
+            rng8_avx2(dst + i, e / 4, key, stream, p);
+            i += 32;
+            continue;
+        }
+        uint32_t x[4] = { (uint32_t) (e / 4), (uint32_t) ((uint64_t) (e / 4) >> 32), (uint32_t) stream, (uint32_t) (stream >> 32) };
+        k_philox(x, key);
+        float out[4];
+        rng_block_scalar(out, x, p);
+        size_t m = 4 - lane < n - i ? 4 - lane : n - i;
+        memcpy(dst + i, out + lane, m * sizeof(*dst));
+        i += m;
+    }
+}
+
+void k_rand_uniform(float *dst, size_t n, uint64_t key, uint64_t stream, size_t first, float low, float high) {
+    rng_params_t p = { .kind = RNG_UNIFORM, .a = low, .b = high - low, .max = nextafterf(high, low) };
+    rng_run(dst, n, key, stream, first, &p);
+}
+
+void k_rand_normal(float *dst, size_t n, uint64_t key, uint64_t stream, size_t first, float mean, float std) {
+    rng_params_t p = { .kind = RNG_NORMAL, .a = mean, .b = std };
+    rng_run(dst, n, key, stream, first, &p);
+}
+
+void k_rand_int(float *dst, size_t n, uint64_t key, uint64_t stream, size_t first, int32_t low, uint32_t range) {
+    rng_params_t p = { .kind = RNG_INT, .low = low, .range = range };
+    rng_run(dst, n, key, stream, first, &p);
+}
+
+/************************* UNARY *************************/
+
+#define EXP_HI 88.7228393555f // above this expf overflows
+#define EXP_LO -103.972084045f // below this expf underflows to 0
+#define EXP_FAST_HI 88.0f
+#define EXP_FAST_LO -87.0f // fast exp stays in the normal range
+#define LOG2E 1.44269504088896341f
+#define TANH_SMALL 0.625f // below this tanh uses its own polynomial (no cancellation)
+#define GELU_K2 1.59576912160573071f // 2 sqrt(2/pi)
+#define GELU_C 0.044715f
+
+// 2^n for n in [-150, 128] as a product of two normal powers (so denormal and near overflow results are right)
+AVX2 static __m256 v_ldexp(__m256 y, __m256i n) {
+    __m256i h = _mm256_srai_epi32(n, 1);
+    __m256 p1 = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(h, _mm256_set1_epi32(127)), 23));
+    __m256 p2 = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(_mm256_sub_epi32(n, h), _mm256_set1_epi32(127)), 23));
+    return _mm256_mul_ps(_mm256_mul_ps(y, p1), p2);
+}
+
+// cephes expf: two-step reduction by ln2 and a degree 5 polynomial
+AVX2 static __m256 v_exp(__m256 x) {
+    __m256 xc = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(EXP_LO)), _mm256_set1_ps(EXP_HI));
+    __m256 n = _mm256_round_ps(_mm256_mul_ps(xc, _mm256_set1_ps(LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_fmadd_ps(n, _mm256_set1_ps(-0.693359375f), xc);
+    r = _mm256_fmadd_ps(n, _mm256_set1_ps(2.12194440e-4f), r);
+    __m256 z = _mm256_mul_ps(r, r);
+    __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+    __m256 y = _mm256_add_ps(_mm256_fmadd_ps(p, z, r), _mm256_set1_ps(1.0f));
+    y = v_ldexp(y, _mm256_cvtps_epi32(n));
+    y = _mm256_andnot_ps(_mm256_cmp_ps(x, _mm256_set1_ps(EXP_LO), _CMP_LT_OQ), y);
+    y = _mm256_blendv_ps(y, _mm256_set1_ps(INFINITY), _mm256_cmp_ps(x, _mm256_set1_ps(EXP_HI), _CMP_GT_OQ));
+    return _mm256_blendv_ps(y, x, _mm256_cmp_ps(x, x, _CMP_UNORD_Q));
+}
+
+// one-step reduction, degree 4 polynomial, no special cases (results are clamped to the normal range)
+AVX2 static __m256 v_exp_fast(__m256 x) {
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(EXP_FAST_LO)), _mm256_set1_ps(EXP_FAST_HI));
+    __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_fmadd_ps(n, _mm256_set1_ps(-0.693147180559945f), x);
+    __m256 p = _mm256_set1_ps(4.1277735264e-2f);
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6753514370e-1f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0005116173e-1f));
+    __m256 y = _mm256_add_ps(_mm256_fmadd_ps(p, _mm256_mul_ps(r, r), r), _mm256_set1_ps(1.0f));
+    __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(y, _mm256_castsi256_ps(e));
+}
+
+// v_log extended to the whole float range (denormals are scaled up first; log(0) = -inf, log(x < 0) = nan)
+AVX2 static __m256 v_log_full(__m256 x) {
+    __m256 denorm = _mm256_cmp_ps(x, _mm256_set1_ps(0x1p-126f), _CMP_LT_OQ);
+    __m256 y = v_log(_mm256_blendv_ps(x, _mm256_mul_ps(x, _mm256_set1_ps(0x1p23f)), denorm));
+    y = _mm256_sub_ps(y, _mm256_and_ps(denorm, _mm256_set1_ps(23 * 0.693147180559945f)));
+    y = _mm256_blendv_ps(y, _mm256_set1_ps(-INFINITY), _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_EQ_OQ));
+    y = _mm256_blendv_ps(y, _mm256_set1_ps(NAN), _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_LT_OQ));
+    y = _mm256_blendv_ps(y, x, _mm256_cmp_ps(x, _mm256_set1_ps(INFINITY), _CMP_EQ_OQ));
+    return _mm256_blendv_ps(y, x, _mm256_cmp_ps(x, x, _CMP_UNORD_Q));
+}
+
+// log(1 + f) = f - f^2/2 + f^3 * P(f) with P of degree 3; positive normal inputs only
+AVX2 static __m256 v_log_fast(__m256 x) {
+    __m256i bits = _mm256_castps_si256(x);
+    __m256i e = _mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(126));
+    __m256 m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff)), _mm256_set1_epi32(0x3f000000)));
+    __m256 small = _mm256_cmp_ps(m, _mm256_set1_ps(LOG_SQRTHF), _CMP_LT_OQ);
+    e = _mm256_add_epi32(e, _mm256_castps_si256(small));
+    __m256 f = _mm256_add_ps(_mm256_sub_ps(m, _mm256_set1_ps(1.0f)), _mm256_and_ps(small, m));
+    __m256 z = _mm256_mul_ps(f, f);
+    __m256 p = _mm256_set1_ps(-1.4592424081e-1f);
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(2.1776495835e-1f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(-2.5245006961e-1f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(3.3285471490e-1f));
+    __m256 y = _mm256_fmadd_ps(_mm256_mul_ps(z, f), p, _mm256_fmadd_ps(z, _mm256_set1_ps(-0.5f), f));
+    return _mm256_fmadd_ps(_mm256_cvtepi32_ps(e), _mm256_set1_ps(0.693147180559945f), y);
+}
+
+// 1 / d: exact division, or rcp refined with one newton step (~1 ulp short of it)
+AVX2 static __m256 v_recip(__m256 d, bool fast) {
+    if (!fast) return _mm256_div_ps(_mm256_set1_ps(1.0f), d);
+    __m256 r = _mm256_rcp_ps(d);
+    return _mm256_mul_ps(r, _mm256_fnmadd_ps(d, r, _mm256_set1_ps(2.0f)));
+}
+
+// cephes tanhf: polynomial for |x| < 0.625, 1 - 2 / (exp(2|x|) + 1) above (sign restored)
+AVX2 static __m256 v_tanh(__m256 x, bool fast) {
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 ax = _mm256_andnot_ps(sign, x);
+    __m256 z = _mm256_mul_ps(x, x);
+    __m256 p = _mm256_set1_ps(-5.70498872745e-3f);
+    p = _mm256_fmadd_ps(p, z, _mm256_set1_ps(2.06390887954e-2f));
+    p = _mm256_fmadd_ps(p, z, _mm256_set1_ps(-5.37397155531e-2f));
+    p = _mm256_fmadd_ps(p, z, _mm256_set1_ps(1.33314422036e-1f));
+    p = _mm256_fmadd_ps(p, z, _mm256_set1_ps(-3.33332819422e-1f));
+    __m256 small = _mm256_fmadd_ps(_mm256_mul_ps(p, z), x, x);
+
+    __m256 ax2 = _mm256_add_ps(ax, ax);
+    __m256 e = fast ? v_exp_fast(ax2) : v_exp(ax2);
+    __m256 large = _mm256_fnmadd_ps(_mm256_set1_ps(2.0f), v_recip(_mm256_add_ps(e, _mm256_set1_ps(1.0f)), fast), _mm256_set1_ps(1.0f));
+    large = _mm256_or_ps(large, _mm256_and_ps(x, sign));
+    return _mm256_blendv_ps(large, small, _mm256_cmp_ps(ax, _mm256_set1_ps(TANH_SMALL), _CMP_LT_OQ));
+}
+
+// e / (1 + e) with e = exp(-|x|), mirrored for x >= 0, so large negative inputs keep their (tiny) values
+AVX2 static __m256 v_sigmoid(__m256 x, bool fast) {
+    __m256 nax = _mm256_or_ps(x, _mm256_set1_ps(-0.0f));
+    __m256 e = fast ? v_exp_fast(nax) : v_exp(nax);
+    __m256 r = v_recip(_mm256_add_ps(e, _mm256_set1_ps(1.0f)), fast);
+    return _mm256_blendv_ps(r, _mm256_mul_ps(e, r), x); // blendv picks by the sign bit
+}
+
+// x * sigmoid(2u) = 0.5x(1 + tanh(u)) with u = sqrt(2/pi) (x + 0.044715 x^3)
+AVX2 static __m256 v_gelu(__m256 x, bool fast) {
+    __m256 x2 = _mm256_mul_ps(x, x);
+    __m256 u2 = _mm256_mul_ps(_mm256_fmadd_ps(_mm256_set1_ps(GELU_C * GELU_K2), x2, _mm256_set1_ps(GELU_K2)), x);
+    return _mm256_mul_ps(x, v_sigmoid(u2, fast));
+}
+
+AVX2 static __m256 v_unary(tensor_op_t op, __m256 x, bool fast) {
+    switch (op) {
+        case OP_EXP: return fast ? v_exp_fast(x) : v_exp(x);
+        case OP_LOG: return fast ? v_log_fast(x) : v_log_full(x);
+        case OP_TANH: return v_tanh(x, fast);
+        case OP_SIGMOID: return v_sigmoid(x, fast);
+        case OP_SQRT: return _mm256_sqrt_ps(x);
+        case OP_RELU: return _mm256_max_ps(_mm256_setzero_ps(), x); // max returns its second operand for nan
+        case OP_GELU: return v_gelu(x, fast);
+        default: assert(false); return x;
+    }
+}
+
+// the op and the fast flag are constants in each loop so the switch in v_unary folds away; tails are padded
+// through the same vector code so every element gets the same bits
+#define UNARY_AVX2_LOOP(OP, FAST) do { \
+        size_t i = 0; \
+        for (; i + 8 <= n; i += 8) _mm256_storeu_ps(dst + i, v_unary(OP, _mm256_loadu_ps(src + i), FAST)); \
+        if (i < n) { \
+            float tail[8] = { 0 }; \
+            memcpy(tail, src + i, (n - i) * sizeof(*tail)); \
+            _mm256_storeu_ps(tail, v_unary(OP, _mm256_loadu_ps(tail), FAST)); \
+            memcpy(dst + i, tail, (n - i) * sizeof(*tail)); \
+        } \
+    } while (0)
+
+#define UNARY_AVX2(OP) \
+    AVX2 static void unary_avx2_##OP(float *dst, const float *src, size_t n, bool fast) { \
+        if (fast) UNARY_AVX2_LOOP(OP, true); \
+        else UNARY_AVX2_LOOP(OP, false); \
+    }
+
+UNARY_AVX2(OP_EXP)
+UNARY_AVX2(OP_LOG)
+UNARY_AVX2(OP_TANH)
+UNARY_AVX2(OP_SIGMOID)
+UNARY_AVX2(OP_SQRT)
+UNARY_AVX2(OP_RELU)
+UNARY_AVX2(OP_GELU)
+
+static inline float s_sigmoid(float x) {
+    return x < 0 ? expf(x) / (1.0f + expf(x)) : 1.0f / (1.0f + expf(-x));
+}
+
+// libm one element at a time (the fast flag is ignored)
+#define UNARY_SCALAR(OP, EXPR) \
+    static void unary_scalar_##OP(float *dst, const float *src, size_t n, bool fast) { \
+        (void) fast; \
+        for (size_t i = 0; i < n; i++) { \
+            float x = src[i]; \
+            dst[i] = (EXPR); \
+        } \
+    }
+
+UNARY_SCALAR(OP_EXP, expf(x))
+UNARY_SCALAR(OP_LOG, logf(x))
+UNARY_SCALAR(OP_TANH, tanhf(x))
+UNARY_SCALAR(OP_SIGMOID, s_sigmoid(x))
+UNARY_SCALAR(OP_SQRT, sqrtf(x))
+UNARY_SCALAR(OP_RELU, x < 0 ? 0 : x)
+UNARY_SCALAR(OP_GELU, x * s_sigmoid(GELU_K2 * fmaf(GELU_C * x, x * x, x)))
+
+/************************* BINARY *************************/
+
+// the binary ops are exact in IEEE arithmetic, so the scalar loops (tails and strided runs) give the same
+// bits as the SIMD ones; maximum/minimum propagate nan
+static inline float s_binary(tensor_op_t op, float a, float b) {
+    switch (op) {
+        case OP_ADD: return a + b;
+        case OP_MUL: return a * b;
+        case OP_SUB: return a - b;
+        case OP_DIV: return a / b;
+        case OP_POW: return powf(a, b);
+        case OP_MAXIMUM: return isnan(a) ? a : (a > b ? a : b);
+        case OP_MINIMUM: return isnan(a) ? a : (a < b ? a : b);
+        case OP_EQ: return a == b;
+        case OP_LT: return a < b;
+        case OP_GT: return a > b;
+        default: assert(false); return 0;
+    }
+}
+
+AVX2 static __m256 v_binary(tensor_op_t op, __m256 a, __m256 b) {
+    const __m256 one = _mm256_set1_ps(1.0f);
+    switch (op) {
+        case OP_ADD: return _mm256_add_ps(a, b);
+        case OP_MUL: return _mm256_mul_ps(a, b);
+        case OP_SUB: return _mm256_sub_ps(a, b);
+        case OP_DIV: return _mm256_div_ps(a, b);
+        case OP_MAXIMUM: return _mm256_blendv_ps(_mm256_max_ps(a, b), a, _mm256_cmp_ps(a, a, _CMP_UNORD_Q));
+        case OP_MINIMUM: return _mm256_blendv_ps(_mm256_min_ps(a, b), a, _mm256_cmp_ps(a, a, _CMP_UNORD_Q));
+        case OP_EQ: return _mm256_and_ps(_mm256_cmp_ps(a, b, _CMP_EQ_OQ), one);
+        case OP_LT: return _mm256_and_ps(_mm256_cmp_ps(a, b, _CMP_LT_OQ), one);
+        case OP_GT: return _mm256_and_ps(_mm256_cmp_ps(a, b, _CMP_GT_OQ), one);
+        default: assert(false); return a;
+    }
+}
+
+// LAYOUT_CONTIGUOUS
+#define BINARY_AVX2(OP) \
+    AVX2 static void binary_avx2_##OP(float *dst, const float *a, stride_t as, const float *b, stride_t bs, size_t n) { \
+        (void) as; \
+        (void) bs; \
+        size_t i = 0; \
+        for (; i + 8 <= n; i += 8) _mm256_storeu_ps(dst + i, v_binary(OP, _mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i))); \
+        for (; i < n; i++) dst[i] = s_binary(OP, a[i], b[i]); \
+    }
+
+// LAYOUT_BROADCAST: strides of 0 or 1 (a broadcast operand is loaded once)
+#define BINARY_AVX2_BCAST(OP) \
+    AVX2 static void binary_avx2_bcast_##OP(float *dst, const float *a, stride_t as, const float *b, stride_t bs, size_t n) { \
+        const __m256 va0 = _mm256_set1_ps(a[0]), vb0 = _mm256_set1_ps(b[0]); \
+        size_t i = 0; \
+        for (; i + 8 <= n; i += 8) { \
+            __m256 va = as ? _mm256_loadu_ps(a + i) : va0; \
+            __m256 vb = bs ? _mm256_loadu_ps(b + i) : vb0; \
+            _mm256_storeu_ps(dst + i, v_binary(OP, va, vb)); \
+        } \
+        for (; i < n; i++) dst[i] = s_binary(OP, a[i * as], b[i * bs]); \
+    }
+
+// LAYOUT_STRIDED
+#define BINARY_SCALAR(OP) \
+    static void binary_scalar_##OP(float *dst, const float *a, stride_t as, const float *b, stride_t bs, size_t n) { \
+        for (size_t i = 0; i < n; i++) dst[i] = s_binary(OP, a[i * as], b[i * bs]); \
+    }
+
+#define BINARY(OP) BINARY_AVX2(OP) BINARY_AVX2_BCAST(OP) BINARY_SCALAR(OP)
+
+BINARY(OP_ADD)
+BINARY(OP_MUL)
+BINARY(OP_SUB)
+BINARY(OP_DIV)
+BINARY(OP_MAXIMUM)
+BINARY(OP_MINIMUM)
+BINARY(OP_EQ)
+BINARY(OP_LT)
+BINARY(OP_GT)
+BINARY_SCALAR(OP_POW)
+
+/************************* TERNARY *************************/
+
+// where(c, a, b) and fma(a, b, c) with strides of 0 or 1
+AVX2 static void where_avx2(float *dst, const float *c, stride_t cs, const float *a, stride_t as, const float *b, stride_t bs, size_t n) {
+    const __m256 vc0 = _mm256_set1_ps(c[0]), va0 = _mm256_set1_ps(a[0]), vb0 = _mm256_set1_ps(b[0]);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 vc = cs ? _mm256_loadu_ps(c + i) : vc0;
+        __m256 va = as ? _mm256_loadu_ps(a + i) : va0;
+        __m256 vb = bs ? _mm256_loadu_ps(b + i) : vb0;
+        // nan conditions are true (!= 0), like the scalar loop
+        _mm256_storeu_ps(dst + i, _mm256_blendv_ps(va, vb, _mm256_cmp_ps(vc, _mm256_setzero_ps(), _CMP_EQ_OQ)));
+    }
+    for (; i < n; i++) dst[i] = c[i * cs] != 0 ? a[i * as] : b[i * bs];
+}
+
+static void where_scalar(float *dst, const float *c, stride_t cs, const float *a, stride_t as, const float *b, stride_t bs, size_t n) {
+    for (size_t i = 0; i < n; i++) dst[i] = c[i * cs] != 0 ? a[i * as] : b[i * bs];
+}
+
+AVX2 static void fma_avx2(float *dst, const float *a, stride_t as, const float *b, stride_t bs, const float *c, stride_t cs, size_t n) {
+    const __m256 va0 = _mm256_set1_ps(a[0]), vb0 = _mm256_set1_ps(b[0]), vc0 = _mm256_set1_ps(c[0]);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 va = as ? _mm256_loadu_ps(a + i) : va0;
+        __m256 vb = bs ? _mm256_loadu_ps(b + i) : vb0;
+        __m256 vc = cs ? _mm256_loadu_ps(c + i) : vc0;
+        _mm256_storeu_ps(dst + i, _mm256_fmadd_ps(va, vb, vc));
+    }
+    for (; i < n; i++) dst[i] = fmaf(a[i * as], b[i * bs], c[i * cs]);
+}
+
+static void fma_scalar(float *dst, const float *a, stride_t as, const float *b, stride_t bs, const float *c, stride_t cs, size_t n) {
+    for (size_t i = 0; i < n; i++) dst[i] = fmaf(a[i * as], b[i * bs], c[i * cs]);
+}
+
+/************************* REDUCE *************************/
+
+// min/max skip nan elements (unless acc is already nan), the same way in both paths: x < acc ? x : acc
+AVX2 static float sum_avx2(const float *src, stride_t s, size_t n, float acc) {
+    (void) s;
+    __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps(), a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        a0 = _mm256_add_ps(a0, _mm256_loadu_ps(src + i));
+        a1 = _mm256_add_ps(a1, _mm256_loadu_ps(src + i + 8));
+        a2 = _mm256_add_ps(a2, _mm256_loadu_ps(src + i + 16));
+        a3 = _mm256_add_ps(a3, _mm256_loadu_ps(src + i + 24));
+    }
+    for (; i + 8 <= n; i += 8) a0 = _mm256_add_ps(a0, _mm256_loadu_ps(src + i));
+    __m256 v = _mm256_add_ps(_mm256_add_ps(a0, a1), _mm256_add_ps(a2, a3));
+    __m128 h = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+    h = _mm_add_ss(h, _mm_movehdup_ps(h));
+    float r = _mm_cvtss_f32(h);
+    for (; i < n; i++) r += src[i];
+    return acc + r;
+}
+
+#define MINMAX_AVX2(NAME, VOP, CMP) \
+    AVX2 static float NAME##_avx2(const float *src, stride_t s, size_t n, float acc) { \
+        (void) s; \
+        __m256 m = _mm256_set1_ps(acc); \
+        size_t i = 0; \
+        for (; i + 8 <= n; i += 8) m = VOP(_mm256_loadu_ps(src + i), m); \
+        float lanes[8]; \
+        _mm256_storeu_ps(lanes, m); \
+        for (int l = 0; l < 8; l++) acc = lanes[l] CMP acc ? lanes[l] : acc; \
+        for (; i < n; i++) acc = src[i] CMP acc ? src[i] : acc; \
+        return acc; \
+    }
+
+MINMAX_AVX2(min, _mm256_min_ps, <)
+MINMAX_AVX2(max, _mm256_max_ps, >)
+
+static float sum_scalar(const float *src, stride_t s, size_t n, float acc) {
+    for (size_t i = 0; i < n; i++) acc += src[i * s];
+    return acc;
+}
+
+static float min_scalar(const float *src, stride_t s, size_t n, float acc) {
+    for (size_t i = 0; i < n; i++) acc = src[i * s] < acc ? src[i * s] : acc;
+    return acc;
+}
+
+static float max_scalar(const float *src, stride_t s, size_t n, float acc) {
+    for (size_t i = 0; i < n; i++) acc = src[i * s] > acc ? src[i * s] : acc;
+    return acc;
+}
+
+/************************* GEMM *************************/
+
+// a packed block of a is a sequence of panels of GEMM_MR rows and b one of panels of GEMM_NR columns; within
+// a panel the values of each step of k are next to each other so the micro-kernels read both sequentially
+void k_pack_a(float *dst, const float *a, size_t rs, size_t cs, size_t mc, size_t kc) {
+    for (size_t i = 0; i < mc; i += GEMM_MR) {
+        size_t mr = mc - i < GEMM_MR ? mc - i : GEMM_MR;
+        const float *src = a + i * rs;
+        for (size_t p = 0; p < kc; p++) {
+            size_t r = 0;
+            for (; r < mr; r++) dst[r] = src[r * rs + p * cs];
+            for (; r < GEMM_MR; r++) dst[r] = 0;
+            dst += GEMM_MR;
+        }
+    }
+}
+
+void k_pack_b(float *dst, const float *b, size_t rs, size_t cs, size_t kc, size_t nc) {
+    for (size_t j = 0; j < nc; j += GEMM_NR) {
+        size_t nr = nc - j < GEMM_NR ? nc - j : GEMM_NR;
+        const float *src = b + j * cs;
+        for (size_t p = 0; p < kc; p++) {
+            size_t c = 0;
+            if (cs == 1) {
+                memcpy(dst, src + p * rs, nr * sizeof(*dst));
+                c = nr;
+            }
+            for (; c < nr; c++) dst[c] = src[p * rs + c * cs];
+            for (; c < GEMM_NR; c++) dst[c] = 0;
+            dst += GEMM_NR;
+        }
+    }
+}
+
+// 6x16 tile: 12 accumulators, 2 loads of b and 6 broadcasts of a per step of k
+#define GEMM_ROW(R) do { \
+        __m256 ar = _mm256_broadcast_ss(a + R); \
+        c##R##0 = _mm256_fmadd_ps(ar, b0, c##R##0); \
+        c##R##1 = _mm256_fmadd_ps(ar, b1, c##R##1); \
+    } while (0)
+
+#define GEMM_STORE(R) do { \
+        float *cr = c + R * ldc; \
+        if (acc) { \
+            c##R##0 = _mm256_add_ps(c##R##0, _mm256_loadu_ps(cr)); \
+            c##R##1 = _mm256_add_ps(c##R##1, _mm256_loadu_ps(cr + 8)); \
+        } \
+        _mm256_storeu_ps(cr, c##R##0); \
+        _mm256_storeu_ps(cr + 8, c##R##1); \
+    } while (0)
+
+_Static_assert(GEMM_MR == 6 && GEMM_NR == 16, "gemm_avx2 computes 6x16 tiles");
+
+AVX2 static void gemm_avx2(size_t k, const float *a, const float *b, float *c, size_t ldc, bool acc) {
+    __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps(), c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+    __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps(), c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+    __m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps(), c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+    for (size_t p = 0; p < k; p++) {
+        __m256 b0 = _mm256_loadu_ps(b), b1 = _mm256_loadu_ps(b + 8);
+        GEMM_ROW(0);
+        GEMM_ROW(1);
+        GEMM_ROW(2);
+        GEMM_ROW(3);
+        GEMM_ROW(4);
+        GEMM_ROW(5);
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+    GEMM_STORE(0);
+    GEMM_STORE(1);
+    GEMM_STORE(2);
+    GEMM_STORE(3);
+    GEMM_STORE(4);
+    GEMM_STORE(5);
+}
+
+static void gemm_scalar(size_t k, const float *a, const float *b, float *c, size_t ldc, bool acc) {
+    float t[GEMM_MR][GEMM_NR] = { 0 };
+    for (size_t p = 0; p < k; p++) {
+        for (int r = 0; r < GEMM_MR; r++) {
+            for (int j = 0; j < GEMM_NR; j++) t[r][j] += a[r] * b[j];
+        }
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+    for (int r = 0; r < GEMM_MR; r++) {
+        for (int j = 0; j < GEMM_NR; j++) c[r * ldc + j] = acc ? c[r * ldc + j] + t[r][j] : t[r][j];
+    }
+}
+
+/************************* GEMV *************************/
+
+// 4 accumulators of 8 lanes (enough independent fmas to cover their latency while streaming from memory)
+AVX2 static float dot_avx2(const float *a, stride_t as, const float *b, stride_t bs, size_t n) {
+    (void) as;
+    (void) bs;
+    __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps(), a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        a0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), a0);
+        a1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), a1);
+        a2 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 16), _mm256_loadu_ps(b + i + 16), a2);
+        a3 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 24), _mm256_loadu_ps(b + i + 24), a3);
+    }
+    for (; i + 8 <= n; i += 8) a0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), a0);
+    __m256 v = _mm256_add_ps(_mm256_add_ps(a0, a1), _mm256_add_ps(a2, a3));
+    __m128 h = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+    h = _mm_add_ss(h, _mm_movehdup_ps(h));
+    float r = _mm_cvtss_f32(h);
+    for (; i < n; i++) r = fmaf(a[i], b[i], r);
+    return r;
+}
+
+static float dot_scalar(const float *a, stride_t as, const float *b, stride_t bs, size_t n) {
+    float r = 0;
+    for (size_t i = 0; i < n; i++) r += a[i * as] * b[i * bs];
+    return r;
+}
+
+// four rows at a time with two accumulators each (x is loaded once for the four rows and eight fma chains
+// are in flight)
+AVX2 static void gemv_avx2(float *y, const float *m, size_t rs, const float *x, size_t rows, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= rows; i += 4) {
+        const float *m0 = m + i * rs, *m1 = m0 + rs, *m2 = m1 + rs, *m3 = m2 + rs;
+        __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps(), a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+        __m256 b0 = _mm256_setzero_ps(), b1 = _mm256_setzero_ps(), b2 = _mm256_setzero_ps(), b3 = _mm256_setzero_ps();
+        size_t j = 0;
+        for (; j + 16 <= n; j += 16) {
+            __m256 xa = _mm256_loadu_ps(x + j), xb = _mm256_loadu_ps(x + j + 8);
+            a0 = _mm256_fmadd_ps(_mm256_loadu_ps(m0 + j), xa, a0);
+            a1 = _mm256_fmadd_ps(_mm256_loadu_ps(m1 + j), xa, a1);
+            a2 = _mm256_fmadd_ps(_mm256_loadu_ps(m2 + j), xa, a2);
+            a3 = _mm256_fmadd_ps(_mm256_loadu_ps(m3 + j), xa, a3);
+            b0 = _mm256_fmadd_ps(_mm256_loadu_ps(m0 + j + 8), xb, b0);
+            b1 = _mm256_fmadd_ps(_mm256_loadu_ps(m1 + j + 8), xb, b1);
+            b2 = _mm256_fmadd_ps(_mm256_loadu_ps(m2 + j + 8), xb, b2);
+            b3 = _mm256_fmadd_ps(_mm256_loadu_ps(m3 + j + 8), xb, b3);
+        }
+        // horizontal sums of the four rows at once
+        __m256 s01 = _mm256_hadd_ps(_mm256_add_ps(a0, b0), _mm256_add_ps(a1, b1));
+        __m256 s23 = _mm256_hadd_ps(_mm256_add_ps(a2, b2), _mm256_add_ps(a3, b3));
+        __m256 s = _mm256_hadd_ps(s01, s23);
+        __m128 r = _mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1));
+        float out[4];
+        _mm_storeu_ps(out, r);
+        for (; j < n; j++) {
+            out[0] = fmaf(m0[j], x[j], out[0]);
+            out[1] = fmaf(m1[j], x[j], out[1]);
+            out[2] = fmaf(m2[j], x[j], out[2]);
+            out[3] = fmaf(m3[j], x[j], out[3]);
+        }
+        memcpy(y + i, out, sizeof(out));
+    }
+    for (; i < rows; i++) y[i] = dot_avx2(m + i * rs, 1, x, 1, n);
+}
+
+static void gemv_scalar(float *y, const float *m, size_t rs, const float *x, size_t rows, size_t n) {
+    for (size_t i = 0; i < rows; i++) y[i] = dot_scalar(m + i * rs, 1, x, 1, n);
+}
+
+// four rows at a time so y is read and written once per four rows (it stays in L1, the rows are streamed)
+AVX2 static void gemv_t_avx2(float *y, const float *m, size_t rs, const float *x, size_t rows, size_t n) {
+    memset(y, 0, n * sizeof(*y));
+    size_t i = 0;
+    for (; i + 4 <= rows; i += 4) {
+        const float *m0 = m + i * rs, *m1 = m0 + rs, *m2 = m1 + rs, *m3 = m2 + rs;
+        __m256 x0 = _mm256_set1_ps(x[i]), x1 = _mm256_set1_ps(x[i + 1]), x2 = _mm256_set1_ps(x[i + 2]), x3 = _mm256_set1_ps(x[i + 3]);
+        size_t j = 0;
+        for (; j + 8 <= n; j += 8) {
+            __m256 acc = _mm256_fmadd_ps(x0, _mm256_loadu_ps(m0 + j), _mm256_loadu_ps(y + j));
+            acc = _mm256_fmadd_ps(x1, _mm256_loadu_ps(m1 + j), acc);
+            acc = _mm256_fmadd_ps(x2, _mm256_loadu_ps(m2 + j), acc);
+            acc = _mm256_fmadd_ps(x3, _mm256_loadu_ps(m3 + j), acc);
+            _mm256_storeu_ps(y + j, acc);
+        }
+        for (; j < n; j++) y[j] = fmaf(x[i + 3], m3[j], fmaf(x[i + 2], m2[j], fmaf(x[i + 1], m1[j], fmaf(x[i], m0[j], y[j]))));
+    }
+    for (; i < rows; i++) {
+        const float *m0 = m + i * rs;
+        __m256 x0 = _mm256_set1_ps(x[i]);
+        size_t j = 0;
+        for (; j + 8 <= n; j += 8) _mm256_storeu_ps(y + j, _mm256_fmadd_ps(x0, _mm256_loadu_ps(m0 + j), _mm256_loadu_ps(y + j)));
+        for (; j < n; j++) y[j] = fmaf(x[i], m0[j], y[j]);
+    }
+}
+
+static void gemv_t_scalar(float *y, const float *m, size_t rs, const float *x, size_t rows, size_t n) {
+    memset(y, 0, n * sizeof(*y));
+    for (size_t i = 0; i < rows; i++) {
+        for (size_t j = 0; j < n; j++) y[j] += x[i] * m[i * rs + j];
+    }
+}
+
+/************************* INT8 *************************/
+
+#define Q8_CLAMP 256.0f // scaled values are clamped to this before the conversion to int (then to Q8_MAX)
+
+AVX2 static void quantize_avx2(int8_t *dst, const float *src, size_t n, float inv_scale, int32_t zero) {
+    const __m256 inv = _mm256_set1_ps(inv_scale), lo = _mm256_set1_ps(-Q8_CLAMP), hi = _mm256_set1_ps(Q8_CLAMP);
+    const __m256i z = _mm256_set1_epi32(zero), qlo = _mm256_set1_epi32(-Q8_MAX), qhi = _mm256_set1_epi32(Q8_MAX);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        // max/min return their second operand for nan, like fmaxf/fminf in the scalar loop
+        __m256 f = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(src + i), inv), lo), hi);
+        __m256i q = _mm256_add_epi32(_mm256_cvtps_epi32(f), z);
+        q = _mm256_min_epi32(_mm256_max_epi32(q, qlo), qhi);
+        __m128i w = _mm_packs_epi32(_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1));
+        _mm_storel_epi64((__m128i *) (dst + i), _mm_packs_epi16(w, w));
+    }
+    for (; i < n; i++) {
+        int32_t q = (int32_t) lrintf(fminf(fmaxf(src[i] * inv_scale, -Q8_CLAMP), Q8_CLAMP)) + zero;
+        dst[i] = (int8_t) (q < -Q8_MAX ? -Q8_MAX : q > Q8_MAX ? Q8_MAX : q);
+    }
+}
+
+static void quantize_scalar(int8_t *dst, const float *src, size_t n, float inv_scale, int32_t zero) {
+    for (size_t i = 0; i < n; i++) {
+        int32_t q = (int32_t) lrintf(fminf(fmaxf(src[i] * inv_scale, -Q8_CLAMP), Q8_CLAMP)) + zero;
+        dst[i] = (int8_t) (q < -Q8_MAX ? -Q8_MAX : q > Q8_MAX ? Q8_MAX : q);
+    }
+}
+
+AVX2 static void dequantize_avx2(float *dst, const int8_t *src, size_t n, float scale, int32_t zero) {
+    const __m256 s = _mm256_set1_ps(scale);
+    const __m256i z = _mm256_set1_epi32(zero);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i q = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *) (src + i)));
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(s, _mm256_cvtepi32_ps(_mm256_sub_epi32(q, z))));
+    }
+    for (; i < n; i++) dst[i] = scale * (float) (src[i] - zero);
+}
+
+static void dequantize_scalar(float *dst, const int8_t *src, size_t n, float scale, int32_t zero) {
+    for (size_t i = 0; i < n; i++) dst[i] = scale * (float) (src[i] - zero);
+}
+
+void k_pack_q8_a(int8_t *dst, int32_t *sum, const int8_t *a, size_t rs, size_t mc, size_t k) {
+    size_t kp = (k + 3) & ~(size_t) 3;
+    for (size_t i = 0; i < mc; i += Q8_MR) {
+        for (size_t r = 0; r < Q8_MR; r++) {
+            int32_t s = 0;
+            for (size_t p = 0; p < kp; p++) {
+                int8_t v = i + r < mc && p < k ? a[(i + r) * rs + p] : 0;
+                dst[(p / 4) * Q8_MR * 4 + r * 4 + p % 4] = v;
+                s += v;
+            }
+            if (i + r < mc) sum[i + r] = s;
+        }
+        dst += Q8_MR * kp;
+    }
+}
+
+void k_pack_q8_b(int8_t *dst, int32_t *sum, const int8_t *b, size_t rs, size_t k, size_t nc) {
+    size_t kp = (k + 3) & ~(size_t) 3;
+    for (size_t j = 0; j < nc; j += Q8_NR) {
+        int32_t s[Q8_NR] = { 0 };
+        for (size_t p = 0; p < kp; p++) {
+            for (size_t c = 0; c < Q8_NR; c++) {
+                int8_t v = j + c < nc && p < k ? b[p * rs + j + c] : 0;
+                dst[(p / 4) * Q8_NR * 4 + c * 4 + p % 4] = v;
+                s[c] += v;
+            }
+        }
+        memcpy(sum + j, s, sizeof(s));
+        dst += Q8_NR * kp;
+    }
+}
+
+_Static_assert(Q8_MR == 4 && Q8_NR == 16, "the int8 micro-kernels compute 4x16 tiles");
+
+// vpdpbusd multiplies unsigned bytes by signed ones: a is fed as a + 128 (flipping the sign bit) and 128 times
+// the column sums of b is taken back out at the end; the products are summed in int32 without saturation
+AVXVNNI static void gemm_q8_avxvnni(size_t kg, const int8_t *a, const int8_t *b, const int32_t *bsum, int32_t *c, size_t ldc) {
+    const __m256i flip = _mm256_set1_epi32((int32_t) 0x80808080u);
+    __m256i acc[Q8_MR][2];
+    for (int r = 0; r < Q8_MR; r++) acc[r][0] = acc[r][1] = _mm256_setzero_si256();
+    for (size_t g = 0; g < kg; g++) {
+        __m256i b0 = _mm256_loadu_si256((const __m256i *) b), b1 = _mm256_loadu_si256((const __m256i *) (b + 32));
+        for (int r = 0; r < Q8_MR; r++) {
+            int32_t a4;
+            memcpy(&a4, a + r * 4, sizeof(a4));
+            __m256i ar = _mm256_xor_si256(_mm256_set1_epi32(a4), flip);
+            acc[r][0] = _mm256_dpbusd_avx_epi32(acc[r][0], ar, b0);
+            acc[r][1] = _mm256_dpbusd_avx_epi32(acc[r][1], ar, b1);
+        }
+        a += Q8_MR * 4;
+        b += Q8_NR * 4;
+    }
+    __m256i s0 = _mm256_slli_epi32(_mm256_loadu_si256((const __m256i *) bsum), 7);
+    __m256i s1 = _mm256_slli_epi32(_mm256_loadu_si256((const __m256i *) (bsum + 8)), 7);
+    for (int r = 0; r < Q8_MR; r++) {
+        _mm256_storeu_si256((__m256i *) (c + r * ldc), _mm256_sub_epi32(acc[r][0], s0));
+        _mm256_storeu_si256((__m256i *) (c + r * ldc + 8), _mm256_sub_epi32(acc[r][1], s1));
+    }
+}
+
+// vpmaddubsw also wants an unsigned operand: |a| times b with the sign of a; with both in [-127, 127] the
+// int16 pair sums (at most 2 * 127 * 127) never saturate, then vpmaddwd widens them to int32
+AVX2 static void gemm_q8_avx2(size_t kg, const int8_t *a, const int8_t *b, const int32_t *bsum, int32_t *c, size_t ldc) {
+    (void) bsum;
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i acc[Q8_MR][2];
+    for (int r = 0; r < Q8_MR; r++) acc[r][0] = acc[r][1] = _mm256_setzero_si256();
+    for (size_t g = 0; g < kg; g++) {
+        __m256i b0 = _mm256_loadu_si256((const __m256i *) b), b1 = _mm256_loadu_si256((const __m256i *) (b + 32));
+        for (int r = 0; r < Q8_MR; r++) {
+            int32_t a4;
+            memcpy(&a4, a + r * 4, sizeof(a4));
+            __m256i ar = _mm256_set1_epi32(a4), ua = _mm256_abs_epi8(ar);
+            acc[r][0] = _mm256_add_epi32(acc[r][0], _mm256_madd_epi16(_mm256_maddubs_epi16(ua, _mm256_sign_epi8(b0, ar)), ones));
+            acc[r][1] = _mm256_add_epi32(acc[r][1], _mm256_madd_epi16(_mm256_maddubs_epi16(ua, _mm256_sign_epi8(b1, ar)), ones));
+        }
+        a += Q8_MR * 4;
+        b += Q8_NR * 4;
+    }
+    for (int r = 0; r < Q8_MR; r++) {
+        _mm256_storeu_si256((__m256i *) (c + r * ldc), acc[r][0]);
+        _mm256_storeu_si256((__m256i *) (c + r * ldc + 8), acc[r][1]);
+    }
+}
+
+static void gemm_q8_scalar(size_t kg, const int8_t *a, const int8_t *b, const int32_t *bsum, int32_t *c, size_t ldc) {
+    (void) bsum;
+    int32_t t[Q8_MR][Q8_NR] = { 0 };
+    for (size_t g = 0; g < kg; g++) {
+        for (int r = 0; r < Q8_MR; r++) {
+            for (int j = 0; j < Q8_NR; j++) {
+                for (int q = 0; q < 4; q++) t[r][j] += a[r * 4 + q] * b[j * 4 + q];
+            }
+        }
+        a += Q8_MR * 4;
+        b += Q8_NR * 4;
+    }
+    for (int r = 0; r < Q8_MR; r++) memcpy(c + r * ldc, t[r], sizeof(t[r]));
+}
+
+/************************* INT4 *************************/
+
+uint16_t k_f32_to_f16(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint16_t sign = (x >> 16) & 0x8000;
+    uint32_t ax = x & 0x7fffffff;
+    if (ax >= 0x7f800000) return sign | 0x7c00 | (ax > 0x7f800000 ? 0x200 : 0); // inf, nan
+    if (ax >= 0x477ff000) return sign | 0x7c00; // rounds to 65520 or more
+    if (ax < 0x38800000) {
+        // subnormal: a multiple of 2^-24 (the scaling is exact and lrintf rounds to nearest even)
+        float v;
+        memcpy(&v, &ax, sizeof(v));
+        return sign | (uint16_t) lrintf(v * 16777216.0f);
+    }
+    // rebias the exponent and round the 13 dropped mantissa bits to nearest even (a carry bumps the exponent)
+    uint32_t h = (ax - 0x38000000) >> 13, rem = ax & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) h++;
+    return sign | (uint16_t) h;
+}
+
+float k_f16_to_f32(uint16_t h) {
+    uint32_t sign = (uint32_t) (h & 0x8000) << 16, e = (h >> 10) & 0x1f, m = h & 0x3ff, x;
+    if (e == 0) {
+        float v = (float) m * (1.0f / 16777216.0f);
+        return sign ? -v : v;
+    }
+    x = sign | (e == 31 ? 0x7f800000 | (m << 13) : ((e + 112) << 23) | (m << 13));
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+void k_quantize_q4(q4_block_t *dst, const float *src, size_t n) {
+    for (size_t i = 0; i < n; i += Q4_BLOCK, dst++) {
+        float v[Q4_BLOCK] = { 0 }, m = 0;
+        size_t len = n - i < Q4_BLOCK ? n - i : Q4_BLOCK;
+        memcpy(v, src + i, len * sizeof(*v));
+        for (size_t j = 0; j < len; j++) if (fabsf(v[j]) > fabsf(m)) m = v[j];
+        // the value of largest magnitude maps to -8 (the end of [-8, 7] with a code to spare); the inverse is taken
+        // from the stored (rounded) scale so the rounding error stays within half a step
+        dst->scale = k_f32_to_f16(m / -8);
+        float d = k_f16_to_f32(dst->scale), inv = d != 0 ? 1 / d : 0;
+        for (size_t j = 0; j < Q4_BLOCK / 2; j++) {
+            long lo = lrintf(v[j] * inv) + 8, hi = lrintf(v[j + Q4_BLOCK / 2] * inv) + 8;
+            lo = lo < 0 ? 0 : lo > 15 ? 15 : lo;
+            hi = hi < 0 ? 0 : hi > 15 ? 15 : hi;
+            dst->qs[j] = (uint8_t) (lo | hi << 4);
+        }
+    }
+}
+
+void k_dequantize_q4(float *dst, const q4_block_t *src, size_t n) {
+    for (size_t i = 0; i < n; i += Q4_BLOCK, src++) {
+        float d = k_f16_to_f32(src->scale);
+        for (size_t j = 0; j < Q4_BLOCK && i + j < n; j++) {
+            uint8_t q = j < Q4_BLOCK / 2 ? src->qs[j] & 0xf : src->qs[j - Q4_BLOCK / 2] >> 4;
+            dst[i + j] = d * (float) ((int) q - 8);
+        }
+    }
+}
+
+// unpacks a block to 4 x 8 values (q - 8, as floats) and returns their dot product with xv
+AVX2 static inline __m256 q4_block_dot(const q4_block_t *b, const __m256 xv[4]) {
+    const __m128i mask = _mm_set1_epi8(0xf), eight = _mm_set1_epi8(8);
+    __m128i q = _mm_loadu_si128((const __m128i *) b->qs);
+    __m128i lo = _mm_sub_epi8(_mm_and_si128(q, mask), eight);
+    __m128i hi = _mm_sub_epi8(_mm_and_si128(_mm_srli_epi16(q, 4), mask), eight);
+    __m256 s0 = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(lo)), xv[0]);
+    __m256 s1 = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(hi)), xv[2]);
+    s0 = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(lo, 8))), xv[1], s0);
+    s1 = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(hi, 8))), xv[3], s1);
+    return _mm256_add_ps(s0, s1);
+}
+
+// four rows at a time (like gemv_avx2) so each block of x is loaded once for four rows of blocks; the blocks are
+// only ever expanded in registers
+AVX2 static void gemv_q4_avx2(float *y, const q4_block_t *m, size_t rs, const float *x, size_t rows, size_t nb) {
+    size_t i = 0;
+    for (; i + 4 <= rows; i += 4) {
+        const q4_block_t *m0 = m + i * rs, *m1 = m0 + rs, *m2 = m1 + rs, *m3 = m2 + rs;
+        __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps(), a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+        for (size_t j = 0; j < nb; j++) {
+            const float *xb = x + j * Q4_BLOCK;
+            __m256 xv[4] = { _mm256_loadu_ps(xb), _mm256_loadu_ps(xb + 8), _mm256_loadu_ps(xb + 16), _mm256_loadu_ps(xb + 24) };
+            a0 = _mm256_fmadd_ps(_mm256_set1_ps(_cvtsh_ss(m0[j].scale)), q4_block_dot(&m0[j], xv), a0);
+            a1 = _mm256_fmadd_ps(_mm256_set1_ps(_cvtsh_ss(m1[j].scale)), q4_block_dot(&m1[j], xv), a1);
+            a2 = _mm256_fmadd_ps(_mm256_set1_ps(_cvtsh_ss(m2[j].scale)), q4_block_dot(&m2[j], xv), a2);
+            a3 = _mm256_fmadd_ps(_mm256_set1_ps(_cvtsh_ss(m3[j].scale)), q4_block_dot(&m3[j], xv), a3);
+        }
+        __m256 s = _mm256_hadd_ps(_mm256_hadd_ps(a0, a1), _mm256_hadd_ps(a2, a3));
+        _mm_storeu_ps(y + i, _mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1)));
+    }
+    for (; i < rows; i++) {
+        const q4_block_t *m0 = m + i * rs;
+        __m256 a0 = _mm256_setzero_ps();
+        for (size_t j = 0; j < nb; j++) {
+            const float *xb = x + j * Q4_BLOCK;
+            __m256 xv[4] = { _mm256_loadu_ps(xb), _mm256_loadu_ps(xb + 8), _mm256_loadu_ps(xb + 16), _mm256_loadu_ps(xb + 24) };
+            a0 = _mm256_fmadd_ps(_mm256_set1_ps(_cvtsh_ss(m0[j].scale)), q4_block_dot(&m0[j], xv), a0);
+        }
+        __m128 h = _mm_add_ps(_mm256_castps256_ps128(a0), _mm256_extractf128_ps(a0, 1));
+        h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+        y[i] = _mm_cvtss_f32(_mm_add_ss(h, _mm_movehdup_ps(h)));
+    }
+}
+
+static void gemv_q4_scalar(float *y, const q4_block_t *m, size_t rs, const float *x, size_t rows, size_t nb) {
+    for (size_t i = 0; i < rows; i++) {
+        float acc = 0;
+        for (size_t j = 0; j < nb; j++) {
+            const q4_block_t *b = m + i * rs + j;
+            const float *xb = x + j * Q4_BLOCK;
+            float s = 0;
+            for (size_t k = 0; k < Q4_BLOCK / 2; k++) {
+                s += (float) ((b->qs[k] & 0xf) - 8) * xb[k] + (float) ((b->qs[k] >> 4) - 8) * xb[k + Q4_BLOCK / 2];
+            }
+            acc += k_f16_to_f32(b->scale) * s;
+        }
+        y[i] = acc;
+    }
+}
+
+/************************* CONV *************************/
+
+// adds a tile of n (<= CONV_NR) output channels to out
+AVX2 static inline void conv_store(float *out, __m256 a0, __m256 a1, size_t n) {
+    if (n >= CONV_NR) {
+        _mm256_storeu_ps(out, _mm256_add_ps(_mm256_loadu_ps(out), a0));
+        _mm256_storeu_ps(out + 8, _mm256_add_ps(_mm256_loadu_ps(out + 8), a1));
+        return;
+    }
+    float t[CONV_NR];
+    _mm256_storeu_ps(t, a0);
+    _mm256_storeu_ps(t + 8, a1);
+    for (size_t j = 0; j < n; j++) out[j] += t[j];
+}
+
+_Static_assert(CONV_NR == 16, "conv_avx2 computes 16 output channels at a time");
+
+// tiles of 4 pixels x 16 output channels: every weight load feeds 4 fmas and every input value 2
+AVX2 static void conv_avx2(float *out, const float *const *in, const float *const *w, size_t ntaps, size_t sx, size_t c, size_t o, size_t npix) {
+    size_t op = (o + CONV_NR - 1) / CONV_NR * CONV_NR;
+    for (size_t o0 = 0; o0 < o; o0 += CONV_NR) {
+        size_t p = 0;
+        for (; p + 4 <= npix; p += 4) {
+            __m256 a00 = _mm256_setzero_ps(), a01 = _mm256_setzero_ps(), a10 = _mm256_setzero_ps(), a11 = _mm256_setzero_ps();
+            __m256 a20 = _mm256_setzero_ps(), a21 = _mm256_setzero_ps(), a30 = _mm256_setzero_ps(), a31 = _mm256_setzero_ps();
+            for (size_t t = 0; t < ntaps; t++) {
+                const float *x = in[t] + p * sx, *wt = w[t] + o0;
+                for (size_t i = 0; i < c; i++) {
+                    __m256 w0 = _mm256_loadu_ps(wt + i * op), w1 = _mm256_loadu_ps(wt + i * op + 8);
+                    __m256 x0 = _mm256_broadcast_ss(x + i), x1 = _mm256_broadcast_ss(x + sx + i);
+                    __m256 x2 = _mm256_broadcast_ss(x + 2 * sx + i), x3 = _mm256_broadcast_ss(x + 3 * sx + i);
+                    a00 = _mm256_fmadd_ps(x0, w0, a00);
+                    a01 = _mm256_fmadd_ps(x0, w1, a01);
+                    a10 = _mm256_fmadd_ps(x1, w0, a10);
+                    a11 = _mm256_fmadd_ps(x1, w1, a11);
+                    a20 = _mm256_fmadd_ps(x2, w0, a20);
+                    a21 = _mm256_fmadd_ps(x2, w1, a21);
+                    a30 = _mm256_fmadd_ps(x3, w0, a30);
+                    a31 = _mm256_fmadd_ps(x3, w1, a31);
+                }
+            }
+            conv_store(out + p * o + o0, a00, a01, o - o0);
+            conv_store(out + (p + 1) * o + o0, a10, a11, o - o0);
+            conv_store(out + (p + 2) * o + o0, a20, a21, o - o0);
+            conv_store(out + (p + 3) * o + o0, a30, a31, o - o0);
+        }
+        for (; p < npix; p++) {
+            __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+            for (size_t t = 0; t < ntaps; t++) {
+                const float *x = in[t] + p * sx, *wt = w[t] + o0;
+                for (size_t i = 0; i < c; i++) {
+                    __m256 xi = _mm256_broadcast_ss(x + i);
+                    a0 = _mm256_fmadd_ps(xi, _mm256_loadu_ps(wt + i * op), a0);
+                    a1 = _mm256_fmadd_ps(xi, _mm256_loadu_ps(wt + i * op + 8), a1);
+                }
+            }
+            conv_store(out + p * o + o0, a0, a1, o - o0);
+        }
+    }
+}
+
+static void conv_scalar(float *out, const float *const *in, const float *const *w, size_t ntaps, size_t sx, size_t c, size_t o, size_t npix) {
+    size_t op = (o + CONV_NR - 1) / CONV_NR * CONV_NR;
+    for (size_t p = 0; p < npix; p++) {
+        for (size_t t = 0; t < ntaps; t++) {
+            for (size_t i = 0; i < c; i++) {
+                float x = in[t][p * sx + i];
+                for (size_t j = 0; j < o; j++) out[p * o + j] += x * w[t][i * op + j];
+            }
+        }
+    }
+}
+
+AVX2 static void conv_dw_avx2(float *out, const float *const *in, const float *const *w, size_t ntaps, size_t sx, size_t c, size_t o, size_t npix) {
+    (void) o;
+    for (size_t p = 0; p < npix; p++) {
+        float *y = out + p * c;
+        size_t i = 0;
+        for (; i + 8 <= c; i += 8) {
+            __m256 acc = _mm256_loadu_ps(y + i);
+            for (size_t t = 0; t < ntaps; t++) acc = _mm256_fmadd_ps(_mm256_loadu_ps(in[t] + p * sx + i), _mm256_loadu_ps(w[t] + i), acc);
+            _mm256_storeu_ps(y + i, acc);
+        }
+        for (; i < c; i++) {
+            for (size_t t = 0; t < ntaps; t++) y[i] = fmaf(in[t][p * sx + i], w[t][i], y[i]);
+        }
+    }
+}
+
+static void conv_dw_scalar(float *out, const float *const *in, const float *const *w, size_t ntaps, size_t sx, size_t c, size_t o, size_t npix) {
+    (void) o;
+    for (size_t p = 0; p < npix; p++) {
+        for (size_t t = 0; t < ntaps; t++) {
+            for (size_t i = 0; i < c; i++) out[p * c + i] += in[t][p * sx + i] * w[t][i];
+        }
+    }
+}
+
+/************************* SOFTMAX *************************/
+
+// lanes [k, 8) of the result are -inf (they add nothing to the sums)
+AVX2 static inline __m256 v_load_part(const float *src, size_t k) {
+    if (k >= 8) return _mm256_loadu_ps(src);
+    __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32((int) k), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    return _mm256_blendv_ps(_mm256_set1_ps(-INFINITY), _mm256_maskload_ps(src, mask), _mm256_castsi256_ps(mask));
+}
+
+AVX2 static inline void v_store_part(float *dst, __m256 v, size_t k) {
+    if (k >= 8) _mm256_storeu_ps(dst, v);
+    else _mm256_maskstore_ps(dst, _mm256_cmpgt_epi32(_mm256_set1_epi32((int) k), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)), v);
+}
+
+// online max and sum: every lane keeps a running max m and the sum s of exp(x - m) over the values it has seen;
+// folding 4 vectors at once rescales s once for all of them (m starts at -FLT_MAX so -inf values add 0, not nan)
+AVX2 static inline void softmax_fold4(__m256 *m, __m256 *s, __m256 x0, __m256 x1, __m256 x2, __m256 x3) {
+    __m256 mn = _mm256_max_ps(*m, _mm256_max_ps(_mm256_max_ps(x0, x1), _mm256_max_ps(x2, x3)));
+    __m256 e = _mm256_add_ps(_mm256_add_ps(v_exp(_mm256_sub_ps(x0, mn)), v_exp(_mm256_sub_ps(x1, mn))),
+                             _mm256_add_ps(v_exp(_mm256_sub_ps(x2, mn)), v_exp(_mm256_sub_ps(x3, mn))));
+    *s = _mm256_fmadd_ps(*s, v_exp(_mm256_sub_ps(*m, mn)), e);
+    *m = mn;
+}
+
+AVX2 static inline void softmax_fold(__m256 *m, __m256 *s, __m256 x) {
+    __m256 mn = _mm256_max_ps(*m, x);
+    *s = _mm256_fmadd_ps(*s, v_exp(_mm256_sub_ps(*m, mn)), v_exp(_mm256_sub_ps(x, mn)));
+    *m = mn;
+}
+
+// second pass: dst = exp(x - m) / s (softmax) or x - m - log s (log-softmax), with c = 1 / s or log s (x - m
+// first: it is exact when x is close to m, where m + log s would round)
+AVX2 static inline __m256 softmax_out(tensor_op_t op, __m256 x, __m256 m, __m256 c) {
+    if (op == OP_SOFTMAX) return _mm256_mul_ps(v_exp(_mm256_sub_ps(x, m)), c);
+    return _mm256_sub_ps(_mm256_sub_ps(x, m), c);
+}
+
+// one contiguous row: the lanes run along the row and are merged before the second pass
+AVX2 static inline void softmax_row_avx2(tensor_op_t op, float *dst, const float *src, size_t n) {
+    __m256 m = _mm256_set1_ps(-FLT_MAX), s = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        softmax_fold4(&m, &s, _mm256_loadu_ps(src + i), _mm256_loadu_ps(src + i + 8), _mm256_loadu_ps(src + i + 16), _mm256_loadu_ps(src + i + 24));
+    }
+    for (; i < n; i += 8) softmax_fold(&m, &s, v_load_part(src + i, n - i));
+
+    float lanes[8], mx = -FLT_MAX;
+    _mm256_storeu_ps(lanes, m);
+    for (int l = 0; l < 8; l++) mx = lanes[l] > mx ? lanes[l] : mx;
+    __m256 vm = _mm256_set1_ps(mx), v = _mm256_mul_ps(s, v_exp(_mm256_sub_ps(m, vm)));
+    __m128 h = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+    h = _mm_add_ss(h, _mm_movehdup_ps(h));
+    float sum = _mm_cvtss_f32(h);
+
+    if (op == OP_LOGSUMEXP) {
+        *dst = mx + logf(sum);
+        return;
+    }
+    __m256 c = _mm256_set1_ps(op == OP_SOFTMAX ? 1.0f / sum : logf(sum));
+    for (i = 0; i + 8 <= n; i += 8) _mm256_storeu_ps(dst + i, softmax_out(op, _mm256_loadu_ps(src + i), vm, c));
+    if (i < n) v_store_part(dst + i, softmax_out(op, v_load_part(src + i, n - i), vm, c), n - i);
+}
+
+#define COL_VECS 32 // vectors of columns the column kernels (softmax, moments) run along the dim at once
+
+// w columns of n values ds apart: every lane is a column, so nothing is merged; up to COL_VECS vectors of
+// columns are walked together so every row is read in whole cache lines
+AVX2 static inline void softmax_cols_avx2(tensor_op_t op, float *dst, const float *src, size_t n, size_t ds, size_t w) {
+    for (size_t i0 = 0; i0 < w; i0 += 8 * COL_VECS) {
+        size_t nv = (w - i0 + 7) / 8 < COL_VECS ? (w - i0 + 7) / 8 : COL_VECS;
+        const float *x = src + i0;
+        __m256 m[COL_VECS], s[COL_VECS], c[COL_VECS];
+        for (size_t v = 0; v < nv; v++) m[v] = _mm256_set1_ps(-FLT_MAX), s[v] = _mm256_setzero_ps();
+        size_t j = 0;
+        for (; j + 4 <= n; j += 4) {
+            for (size_t v = 0; v < nv; v++) {
+                size_t k = w - i0 - 8 * v;
+                const float *xv = x + j * ds + 8 * v;
+                softmax_fold4(&m[v], &s[v], v_load_part(xv, k), v_load_part(xv + ds, k), v_load_part(xv + 2 * ds, k), v_load_part(xv + 3 * ds, k));
+            }
+        }
+        for (; j < n; j++) {
+            for (size_t v = 0; v < nv; v++) softmax_fold(&m[v], &s[v], v_load_part(x + j * ds + 8 * v, w - i0 - 8 * v));
+        }
+
+        for (size_t v = 0; v < nv; v++) {
+            if (op == OP_LOGSUMEXP) v_store_part(dst + i0 + 8 * v, _mm256_add_ps(m[v], v_log_full(s[v])), w - i0 - 8 * v);
+            else c[v] = op == OP_SOFTMAX ? _mm256_div_ps(_mm256_set1_ps(1.0f), s[v]) : v_log_full(s[v]);
+        }
+        if (op == OP_LOGSUMEXP) continue;
+        for (j = 0; j < n; j++) {
+            for (size_t v = 0; v < nv; v++) {
+                size_t k = w - i0 - 8 * v, o = j * ds + 8 * v;
+                v_store_part(dst + i0 + o, softmax_out(op, v_load_part(x + o, k), m[v], c[v]), k);
+            }
+        }
+    }
+}
+
+// columns like softmax_cols_avx2, one at a time
+static inline void softmax_scalar(tensor_op_t op, float *dst, const float *src, size_t n, size_t ds, size_t w) {
+    for (size_t i = 0; i < w; i++) {
+        float m = -FLT_MAX, s = 0;
+        for (size_t j = 0; j < n; j++) {
+            float x = src[j * ds + i], mn = x > m ? x : m;
+            s = s * expf(m - mn) + expf(x - mn);
+            m = mn;
+        }
+        if (op == OP_LOGSUMEXP) {
+            dst[i] = m + logf(s);
+            continue;
+        }
+        float c = op == OP_SOFTMAX ? 1.0f / s : logf(s);
+        for (size_t j = 0; j < n; j++) {
+            float x = src[j * ds + i];
+            dst[j * ds + i] = op == OP_SOFTMAX ? expf(x - m) * c : x - m - c;
+        }
+    }
+}
+
+#define SOFTMAX(OP) \
+    AVX2 static void softmax_avx2_##OP(float *dst, const float *src, size_t n, size_t ds, size_t w) { \
+        if (w == 1 && ds == 1) softmax_row_avx2(OP, dst, src, n); \
+        else softmax_cols_avx2(OP, dst, src, n, ds, w); \
+    } \
+    static void softmax_scalar_##OP(float *dst, const float *src, size_t n, size_t ds, size_t w) { \
+        softmax_scalar(OP, dst, src, n, ds, w); \
+    }
+
+SOFTMAX(OP_SOFTMAX)
+SOFTMAX(OP_LOG_SOFTMAX)
+SOFTMAX(OP_LOGSUMEXP)
+
+/************************* NORM *************************/
+
+// mean of x - k and sum of squared deviations of n contiguous values (Welford): 4 vectors of lanes run their own
+// updates (all with the same count, so 1 / count is shared), then merge (equal counts: the mean is the mean of the
+// lane means and m2 gains count * the squared deviations of the lane means); the last values are folded in one by
+// one. Shifting by a value of the row (k) keeps the rounding of the running means relative to the spread of the
+// values instead of their magnitude
+AVX2 static inline void welford_row_avx2(const float *x, size_t n, float k, float *mean, float *m2) {
+    __m256 vk = _mm256_set1_ps(k);
+    __m256 mu0 = _mm256_setzero_ps(), mu1 = _mm256_setzero_ps(), mu2 = _mm256_setzero_ps(), mu3 = _mm256_setzero_ps();
+    __m256 q0 = _mm256_setzero_ps(), q1 = _mm256_setzero_ps(), q2 = _mm256_setzero_ps(), q3 = _mm256_setzero_ps();
+    size_t i = 0, c = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256 r = _mm256_set1_ps(1.0f / (float) ++c);
+        __m256 x0 = _mm256_sub_ps(_mm256_loadu_ps(x + i), vk), x1 = _mm256_sub_ps(_mm256_loadu_ps(x + i + 8), vk);
+        __m256 x2 = _mm256_sub_ps(_mm256_loadu_ps(x + i + 16), vk), x3 = _mm256_sub_ps(_mm256_loadu_ps(x + i + 24), vk);
+        __m256 d0 = _mm256_sub_ps(x0, mu0), d1 = _mm256_sub_ps(x1, mu1), d2 = _mm256_sub_ps(x2, mu2), d3 = _mm256_sub_ps(x3, mu3);
+        mu0 = _mm256_fmadd_ps(d0, r, mu0);
+        mu1 = _mm256_fmadd_ps(d1, r, mu1);
+        mu2 = _mm256_fmadd_ps(d2, r, mu2);
+        mu3 = _mm256_fmadd_ps(d3, r, mu3);
+        q0 = _mm256_fmadd_ps(d0, _mm256_sub_ps(x0, mu0), q0);
+        q1 = _mm256_fmadd_ps(d1, _mm256_sub_ps(x1, mu1), q1);
+        q2 = _mm256_fmadd_ps(d2, _mm256_sub_ps(x2, mu2), q2);
+        q3 = _mm256_fmadd_ps(d3, _mm256_sub_ps(x3, mu3), q3);
+    }
+    float mu = 0, q = 0;
+    if (c > 0) {
+        float lm[32], lq[32];
+        _mm256_storeu_ps(lm, mu0);
+        _mm256_storeu_ps(lm + 8, mu1);
+        _mm256_storeu_ps(lm + 16, mu2);
+        _mm256_storeu_ps(lm + 24, mu3);
+        _mm256_storeu_ps(lq, _mm256_add_ps(_mm256_add_ps(q0, q1), _mm256_add_ps(q2, q3)));
+        for (int l = 0; l < 32; l++) mu += lm[l];
+        mu /= 32;
+        float dev = 0;
+        for (int l = 0; l < 32; l++) dev += (lm[l] - mu) * (lm[l] - mu);
+        for (int l = 0; l < 8; l++) q += lq[l];
+        q += (float) c * dev;
+    }
+    for (c *= 32; i < n; i++) {
+        float d = x[i] - k - mu;
+        mu += d / (float) ++c;
+        q += d * (x[i] - k - mu);
+    }
+    *mean = mu;
+    *m2 = q;
+}
+
+// w columns of n values ds apart, each shifted by its first value: every lane is a column (all lanes have the same
+// count), COL_VECS vectors of columns at a time so every row is read in whole cache lines
+AVX2 static inline void welford_cols_avx2(float *mean, float *m2, const float *src, size_t n, size_t ds, size_t w) {
+    for (size_t i0 = 0; i0 < w; i0 += 8 * COL_VECS) {
+        size_t nv = (w - i0 + 7) / 8 < COL_VECS ? (w - i0 + 7) / 8 : COL_VECS;
+        const float *x = src + i0;
+        __m256 k[COL_VECS], mu[COL_VECS], q[COL_VECS];
+        for (size_t v = 0; v < nv; v++) {
+            k[v] = v_load_part(x + 8 * v, w - i0 - 8 * v);
+            mu[v] = q[v] = _mm256_setzero_ps();
+        }
+        for (size_t j = 1; j < n; j++) {
+            __m256 r = _mm256_set1_ps(1.0f / (float) (j + 1));
+            for (size_t v = 0; v < nv; v++) {
+                __m256 xv = _mm256_sub_ps(v_load_part(x + j * ds + 8 * v, w - i0 - 8 * v), k[v]), d = _mm256_sub_ps(xv, mu[v]);
+                mu[v] = _mm256_fmadd_ps(d, r, mu[v]);
+                q[v] = _mm256_fmadd_ps(d, _mm256_sub_ps(xv, mu[v]), q[v]);
+            }
+        }
+        for (size_t v = 0; v < nv; v++) {
+            v_store_part(mean + i0 + 8 * v, mu[v], w - i0 - 8 * v);
+            v_store_part(m2 + i0 + 8 * v, q[v], w - i0 - 8 * v);
+        }
+    }
+}
+
+AVX2 static void moments_avx2(float *mean, float *m2, const float *src, size_t n, size_t ds, size_t w) {
+    if (w == 1 && ds == 1) welford_row_avx2(src, n, src[0], mean, m2);
+    else welford_cols_avx2(mean, m2, src, n, ds, w);
+}
+
+static void moments_scalar(float *mean, float *m2, const float *src, size_t n, size_t ds, size_t w) {
+    for (size_t i = 0; i < w; i++) {
+        float k = src[i], mu = 0, q = 0;
+        for (size_t j = 1; j < n; j++) {
+            float x = src[j * ds + i] - k, d = x - mu;
+            mu += d / (float) (j + 1);
+            q += d * (x - mu);
+        }
+        mean[i] = mu;
+        m2[i] = q;
+    }
+}
+
+// dst = (x - k - mean) * rstd, then * gamma + beta (either may be NULL)
+AVX2 static inline void norm_apply_avx2(float *dst, const float *x, size_t n, float k, float mean, float rstd, const float *gamma, const float *beta) {
+    __m256 vk = _mm256_set1_ps(k), vm = _mm256_set1_ps(mean), vr = _mm256_set1_ps(rstd), one = _mm256_set1_ps(1), zero = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 y = _mm256_mul_ps(_mm256_sub_ps(_mm256_sub_ps(_mm256_loadu_ps(x + i), vk), vm), vr);
+        y = _mm256_fmadd_ps(y, gamma != NULL ? _mm256_loadu_ps(gamma + i) : one, beta != NULL ? _mm256_loadu_ps(beta + i) : zero);
+        _mm256_storeu_ps(dst + i, y);
+    }
+    for (; i < n; i++) dst[i] = fmaf((x[i] - k - mean) * rstd, gamma != NULL ? gamma[i] : 1, beta != NULL ? beta[i] : 0);
+}
+
+// rows are read once for the statistics and once more (from L1 for rows up to a few thousand values) to write
+// the output: layernorm scales by 1 / sqrt(var + eps) around the mean, rmsnorm by 1 / sqrt(mean(x^2) + eps)
+AVX2 static void layernorm_avx2(float *dst, const float *x, size_t rows, size_t n, const float *gamma, const float *beta, float eps) {
+    for (size_t r = 0; r < rows; r++, x += n, dst += n) {
+        float mean, m2;
+        welford_row_avx2(x, n, x[0], &mean, &m2);
+        norm_apply_avx2(dst, x, n, x[0], mean, 1.0f / sqrtf(m2 / (float) n + eps), gamma, beta);
+    }
+}
+
+AVX2 static void rmsnorm_avx2(float *dst, const float *x, size_t rows, size_t n, const float *gamma, const float *beta, float eps) {
+    (void) beta;
+    for (size_t r = 0; r < rows; r++, x += n, dst += n) {
+        float ss = dot_avx2(x, 1, x, 1, n);
+        norm_apply_avx2(dst, x, n, 0, 0, 1.0f / sqrtf(ss / (float) n + eps), gamma, NULL);
+    }
+}
+
+static void layernorm_scalar(float *dst, const float *x, size_t rows, size_t n, const float *gamma, const float *beta, float eps) {
+    for (size_t r = 0; r < rows; r++, x += n, dst += n) {
+        float k = x[0], mean, m2;
+        moments_scalar(&mean, &m2, x, n, 1, 1);
+        float rstd = 1.0f / sqrtf(m2 / (float) n + eps);
+        for (size_t i = 0; i < n; i++) dst[i] = fmaf((x[i] - k - mean) * rstd, gamma != NULL ? gamma[i] : 1, beta != NULL ? beta[i] : 0);
+    }
+}
+
+static void rmsnorm_scalar(float *dst, const float *x, size_t rows, size_t n, const float *gamma, const float *beta, float eps) {
+    (void) beta;
+    for (size_t r = 0; r < rows; r++, x += n, dst += n) {
+        float ss = 0;
+        for (size_t i = 0; i < n; i++) ss += x[i] * x[i];
+        float rms = 1.0f / sqrtf(ss / (float) n + eps);
+        for (size_t i = 0; i < n; i++) dst[i] = x[i] * rms * (gamma != NULL ? gamma[i] : 1);
+    }
+}
+
+/************************* REGISTRATION *************************/
+
+#define REG_UNARY(OP) \
+    kernel_register(OP, DTYPE_F32, ISA_SCALAR, LAYOUT_CONTIGUOUS, (kernel_t){ .unary = unary_scalar_##OP }); \
+    kernel_register(OP, DTYPE_F32, ISA_AVX2, LAYOUT_CONTIGUOUS, (kernel_t){ .unary = unary_avx2_##OP })
+
+#define REG_SOFTMAX(OP) \
+    kernel_register(OP, DTYPE_F32, ISA_SCALAR, LAYOUT_CONTIGUOUS, (kernel_t){ .softmax = softmax_scalar_##OP }); \
+    kernel_register(OP, DTYPE_F32, ISA_AVX2, LAYOUT_CONTIGUOUS, (kernel_t){ .softmax = softmax_avx2_##OP })
+
+#define REG_BINARY(OP) \
+    kernel_register(OP, DTYPE_F32, ISA_SCALAR, LAYOUT_STRIDED, (kernel_t){ .binary = binary_scalar_##OP }); \
+    kernel_register(OP, DTYPE_F32, ISA_AVX2, LAYOUT_CONTIGUOUS, (kernel_t){ .binary = binary_avx2_##OP }); \
+    kernel_register(OP, DTYPE_F32, ISA_AVX2, LAYOUT_BROADCAST, (kernel_t){ .binary = binary_avx2_bcast_##OP })
+
+// registers the kernels above (called once by the dispatcher)
+void kernels_init() {
+    REG_UNARY(OP_EXP);
+    REG_UNARY(OP_LOG);
+    REG_UNARY(OP_TANH);
+    REG_UNARY(OP_SIGMOID);
+    REG_UNARY(OP_SQRT);
+    REG_UNARY(OP_RELU);
+    REG_UNARY(OP_GELU);
+
+    REG_BINARY(OP_ADD);
+    REG_BINARY(OP_MUL);
+    REG_BINARY(OP_SUB);
+    REG_BINARY(OP_DIV);
+    REG_BINARY(OP_MAXIMUM);
+    REG_BINARY(OP_MINIMUM);
+    REG_BINARY(OP_EQ);
+    REG_BINARY(OP_LT);
+    REG_BINARY(OP_GT);
+    kernel_register(OP_POW, DTYPE_F32, ISA_SCALAR, LAYOUT_STRIDED, (kernel_t){ .binary = binary_scalar_OP_POW });
+
+    kernel_register(OP_WHERE, DTYPE_F32, ISA_SCALAR, LAYOUT_STRIDED, (kernel_t){ .ternary = where_scalar });
+    kernel_register(OP_WHERE, DTYPE_F32, ISA_AVX2, LAYOUT_BROADCAST, (kernel_t){ .ternary = where_avx2 });
+    kernel_register(OP_FMA, DTYPE_F32, ISA_SCALAR, LAYOUT_STRIDED, (kernel_t){ .ternary = fma_scalar });
+    kernel_register(OP_FMA, DTYPE_F32, ISA_AVX2, LAYOUT_BROADCAST, (kernel_t){ .ternary = fma_avx2 });
+
+    kernel_register(OP_SUM, DTYPE_F32, ISA_SCALAR, LAYOUT_STRIDED, (kernel_t){ .reduce = sum_scalar });
+    kernel_register(OP_SUM, DTYPE_F32, ISA_AVX2, LAYOUT_CONTIGUOUS, (kernel_t){ .reduce = sum_avx2 });
+    kernel_register(OP_MIN, DTYPE_F32, ISA_SCALAR, LAYOUT_STRIDED, (kernel_t){ .reduce = min_scalar });
+    kernel_register(OP_MIN, DTYPE_F32, ISA_AVX2, LAYOUT_CONTIGUOUS, (kernel_t){ .reduce = min_avx2 });
+    kernel_register(OP_MAX, DTYPE_F32, ISA_SCALAR, LAYOUT_STRIDED, (kernel_t){ .reduce = max_scalar });
+    kernel_register(OP_MAX, DTYPE_F32, ISA_AVX2, LAYOUT_CONTIGUOUS, (kernel_t){ .reduce = max_avx2 });
+
+    // the micro-kernels only see packed (contiguous) panels
+    kernel_register(OP_MATMUL, DTYPE_F32, ISA_SCALAR, LAYOUT_CONTIGUOUS, (kernel_t){ .gemm = gemm_scalar });
+    kernel_register(OP_MATMUL, DTYPE_F32, ISA_AVX2, LAYOUT_CONTIGUOUS, (kernel_t){ .gemm = gemm_avx2 });
+    kernel_register(OP_DOT, DTYPE_F32, ISA_SCALAR, LAYOUT_STRIDED, (kernel_t){ .dot = dot_scalar });
+    kernel_register(OP_DOT, DTYPE_F32, ISA_AVX2, LAYOUT_CONTIGUOUS, (kernel_t){ .dot = dot_avx2 });
+    kernel_register(OP_GEMV, DTYPE_F32, ISA_SCALAR, LAYOUT_CONTIGUOUS, (kernel_t){ .gemv = gemv_scalar });
+    kernel_register(OP_GEMV, DTYPE_F32, ISA_AVX2, LAYOUT_CONTIGUOUS, (kernel_t){ .gemv = gemv_avx2 });
+    kernel_register(OP_GEMV_T, DTYPE_F32, ISA_SCALAR, LAYOUT_CONTIGUOUS, (kernel_t){ .gemv = gemv_t_scalar });
+    kernel_register(OP_GEMV_T, DTYPE_F32, ISA_AVX2, LAYOUT_CONTIGUOUS, (kernel_t){ .gemv = gemv_t_avx2 });
+
+    kernel_register(OP_MATMUL_Q8, DTYPE_I8, ISA_SCALAR, LAYOUT_CONTIGUOUS, (kernel_t){ .gemm_q8 = gemm_q8_scalar });
+    kernel_register(OP_MATMUL_Q8, DTYPE_I8, ISA_AVX2, LAYOUT_CONTIGUOUS, (kernel_t){ .gemm_q8 = gemm_q8_avx2 });
+    kernel_register(OP_MATMUL_Q8, DTYPE_I8, ISA_AVXVNNI, LAYOUT_CONTIGUOUS, (kernel_t){ .gemm_q8 = gemm_q8_avxvnni });
+    kernel_register(OP_QUANTIZE, DTYPE_I8, ISA_SCALAR, LAYOUT_CONTIGUOUS, (kernel_t){ .quantize = quantize_scalar });
+    kernel_register(OP_QUANTIZE, DTYPE_I8, ISA_AVX2, LAYOUT_CONTIGUOUS, (kernel_t){ .quantize = quantize_avx2 });
+    kernel_register(OP_DEQUANTIZE, DTYPE_I8, ISA_SCALAR, LAYOUT_CONTIGUOUS, (kernel_t){ .dequantize = dequantize_scalar });
+    kernel_register(OP_DEQUANTIZE, DTYPE_I8, ISA_AVX2, LAYOUT_CONTIGUOUS, (kernel_t){ .dequantize = dequantize_avx2 });
+
+    kernel_register(OP_GEMV_Q4, DTYPE_Q4, ISA_SCALAR, LAYOUT_CONTIGUOUS, (kernel_t){ .gemv_q4 = gemv_q4_scalar });
+    kernel_register(OP_GEMV_Q4, DTYPE_Q4, ISA_AVX2, LAYOUT_CONTIGUOUS, (kernel_t){ .gemv_q4 = gemv_q4_avx2 });
+
+    kernel_register(OP_CONV, DTYPE_F32, ISA_SCALAR, LAYOUT_CONTIGUOUS, (kernel_t){ .conv = conv_scalar });
+    kernel_register(OP_CONV, DTYPE_F32, ISA_AVX2, LAYOUT_CONTIGUOUS, (kernel_t){ .conv = conv_avx2 });
+    kernel_register(OP_CONV_DW, DTYPE_F32, ISA_SCALAR, LAYOUT_CONTIGUOUS, (kernel_t){ .conv = conv_dw_scalar });
+    kernel_register(OP_CONV_DW, DTYPE_F32, ISA_AVX2, LAYOUT_CONTIGUOUS, (kernel_t){ .conv = conv_dw_avx2 });
+
+    REG_SOFTMAX(OP_SOFTMAX);
+    REG_SOFTMAX(OP_LOG_SOFTMAX);
+    REG_SOFTMAX(OP_LOGSUMEXP);
+    kernel_register(OP_MOMENTS, DTYPE_F32, ISA_SCALAR, LAYOUT_CONTIGUOUS, (kernel_t){ .moments = moments_scalar });
+    kernel_register(OP_MOMENTS, DTYPE_F32, ISA_AVX2, LAYOUT_CONTIGUOUS, (kernel_t){ .moments = moments_avx2 });
+    kernel_register(OP_LAYERNORM, DTYPE_F32, ISA_SCALAR, LAYOUT_CONTIGUOUS, (kernel_t){ .norm = layernorm_scalar });
+    kernel_register(OP_LAYERNORM, DTYPE_F32, ISA_AVX2, LAYOUT_CONTIGUOUS, (kernel_t){ .norm = layernorm_avx2 });
+    kernel_register(OP_RMSNORM, DTYPE_F32, ISA_SCALAR, LAYOUT_CONTIGUOUS, (kernel_t){ .norm = rmsnorm_scalar });
+    kernel_register(OP_RMSNORM, DTYPE_F32, ISA_AVX2, LAYOUT_CONTIGUOUS, (kernel_t){ .norm = rmsnorm_avx2 });
+}
@@ -0,0 +1,67 @@
+#ifndef __KERNELS_H__
+#define __KERNELS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "tensor.h"
+
+// true if the cpu supports AVX2, FMA and F16C (the SIMD kernels are compiled for it and picked at runtime)
+bool cpu_avx2();
+// true if the cpu also supports AVX-VNNI (the VEX encoded int8 dot products)
+bool cpu_avxvnni();
+
+// dst[i] = value
+void k_fill(float *dst, size_t n, float value);
+// dst[i] = start + (first + i) * step (each element computed from its index, no running sum)
+void k_arange(float *dst, size_t n, float start, float step, size_t first);
+
+// Philox4x32-10 counter-based generator: ctr is replaced by the 128 random bits for (ctr, key)
+void k_philox(uint32_t ctr[4], uint64_t key);
+// element i of stream (key, stream) only depends on (key, stream, first + i): chunks of a tensor can be generated
+// independently (and in any order) and give the same values; the SIMD and scalar paths give the same bits
+void k_rand_uniform(float *dst, size_t n, uint64_t key, uint64_t stream, size_t first, float low, float high);
+void k_rand_normal(float *dst, size_t n, uint64_t key, uint64_t stream, size_t first, float mean, float std);
+void k_rand_int(float *dst, size_t n, uint64_t key, uint64_t stream, size_t first, int32_t low, uint32_t range);
+
+#define GEMM_MR 6 // rows of the tile computed by a gemm micro-kernel
+#define GEMM_NR 16 // columns of the tile computed by a gemm micro-kernel
+
+// packs the mc x kc block of a (strides rs and cs between rows and columns) into panels of GEMM_MR rows:
+// element (r, p) goes to dst[(r / GEMM_MR) * GEMM_MR * kc + p * GEMM_MR + r % GEMM_MR], the last panel is padded
+// with zeros (dst needs room for mc rounded up to GEMM_MR times kc floats)
+void k_pack_a(float *dst, const float *a, size_t rs, size_t cs, size_t mc, size_t kc);
+// packs the kc x nc block of b into panels of GEMM_NR columns: element (p, c) goes to
+// dst[(c / GEMM_NR) * GEMM_NR * kc + p * GEMM_NR + c % GEMM_NR], padded with zeros like k_pack_a
+void k_pack_b(float *dst, const float *b, size_t rs, size_t cs, size_t kc, size_t nc);
+
+#define Q8_MR 4 // rows of the tile computed by an int8 gemm micro-kernel
+#define Q8_NR 16 // columns of the tile computed by an int8 gemm micro-kernel
+#define Q8_MAX 127 // quantized values are in [-Q8_MAX, Q8_MAX] (never -128, so |a * b| fits the AVX2 int16 pairs)
+#define Q8_MAX_K (INT32_MAX / (Q8_MAX * Q8_MAX)) // longest int8 dot product whose int32 sum cannot overflow
+
+// packs mc rows of a (rs apart, k contiguous bytes each) into panels of Q8_MR rows with k in groups of 4:
+// byte (r, p) goes to dst[(r / Q8_MR) * Q8_MR * kp + (p / 4) * Q8_MR * 4 + (r % Q8_MR) * 4 + p % 4] where kp is k
+// rounded up to 4 (padding is zero); sum[r] gets the sum of row r
+void k_pack_q8_a(int8_t *dst, int32_t *sum, const int8_t *a, size_t rs, size_t mc, size_t k);
+// packs the k x nc block of b (rows rs apart, contiguous columns) into panels of Q8_NR columns the same way:
+// byte (p, c) goes to dst[(c / Q8_NR) * Q8_NR * kp + (p / 4) * Q8_NR * 4 + (c % Q8_NR) * 4 + p % 4]; sum[c] gets
+// the sum of column c (nc rounded up to Q8_NR sums, padding is zero)
+void k_pack_q8_b(int8_t *dst, int32_t *sum, const int8_t *b, size_t rs, size_t k, size_t nc);
+
+#define CONV_NR 16 // output channels computed at a time by the direct convolution kernels
+
+// IEEE half conversions (round to nearest even, like F16C)
+uint16_t k_f32_to_f16(float f);
+float k_f16_to_f32(uint16_t h);
+// quantizes n values into blocks of Q4_BLOCK (the last one is padded with zeros): each block gets the scale that
+// maps its value of largest magnitude to -8 and q = clamp(round(x / scale) + 8, 0, 15)
+void k_quantize_q4(q4_block_t *dst, const float *src, size_t n);
+// dst[i] = scale * (q_i - 8) for the first n values of the blocks
+void k_dequantize_q4(float *dst, const q4_block_t *src, size_t n);
+
+// registers the elementwise, reduction and gemm kernels with the dispatcher (see dispatch.h)
+void kernels_init();
+
+#endif
@@ -0,0 +1,500 @@
+#include "tensor.h"
+#include "mem.h"
+#include "parallel.h"
+
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#define POISON(p, n) ASAN_POISON_MEMORY_REGION(p, n)
+#define UNPOISON(p, n) ASAN_UNPOISON_MEMORY_REGION(p, n)
+#else
+#define POISON(p, n) ((void) (p), (void) (n))
+#define UNPOISON(p, n) ((void) (p), (void) (n))
+#endif
+
+#define MEM_MAX_OPS 64 // ops beyond this are only accounted in the global counters
+#define MEM_MIN_BLOCK 64 // smallest size class
+#define MEM_CLASS_STEPS 4 // size classes per power of two (sizes are rounded up to the next quarter power of two)
+#define MEM_NCLASSES (64 * MEM_CLASS_STEPS)
+#define MEM_CACHE_LIMIT ((size_t) 512 << 20) // default max bytes held in the cache (TENSOR_CACHE_LIMIT overrides it)
+#define MEM_ZERO_PAGES ((size_t) 1 << 20) // zeroed blocks from this size on are fresh (lazily zeroed) pages
+#define MEM_ZERO_GRAIN ((size_t) 1 << 18) // minimum bytes a cleared cached block hands to each thread
+#define SCRATCH_CHUNK 4096 // default size of a scratch arena chunk
+#define SCRATCH_ALIGN 16
+#define POOL_MAX 256 // max tensor headers kept in each thread's free list
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+// header in front of every block; padded to MEM_ALIGN so the returned pointer stays aligned
+typedef union {
+    struct {
+        size_t bytes; // requested size (what is accounted as live)
+        size_t cap; // usable size of the block (its size class)
+        uint32_t cls; // size class index
+        bool mapped; // the block was mmap'ed (and must be munmap'ed) instead of coming from posix_memalign
+        void *next; // next block in the size class free list (only while cached)
+    };
+    char pad[MEM_ALIGN];
+} block_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    block_t *head;
+} freelist_t;
+
+typedef struct chunk {
+    struct chunk *next;
+    size_t cap;
+    size_t used;
+    _Alignas(SCRATCH_ALIGN) char data[];
+} chunk_t;
+
+// a pooled tensor header reuses its first bytes as the free list link
+typedef union pooled {
+    union pooled *next;
+    tensor_t t;
+} pooled_t;
+
+typedef struct {
+    _Atomic(const char *) op;
+    atomic_uint_fast64_t tensors;
+    atomic_uint_fast64_t allocs;
+    atomic_uint_fast64_t bytes;
+} mem_op_t;
+
+static atomic_uint_fast64_t _mem_tensors; // live tensors
+static atomic_uint_fast64_t _mem_bytes; // live bytes
+static atomic_uint_fast64_t _mem_peak; // high-water mark of live bytes
+static atomic_uint_fast64_t _mem_allocs; // number of allocations since start
+static mem_op_t _mem_ops[MEM_MAX_OPS];
+
+static freelist_t _mem_free[MEM_NCLASSES];
+static atomic_size_t _mem_cached; // bytes held by cached blocks
+static atomic_size_t _mem_limit = MEM_CACHE_LIMIT;
+static atomic_uint_fast64_t _mem_hits; // allocations served from the cache
+static atomic_uint_fast64_t _mem_misses; // allocations that went to the system allocator
+
+static pthread_once_t _mem_once = PTHREAD_ONCE_INIT;
+
+static _Thread_local chunk_t *_scratch_head; // first chunk of the calling thread's arena
+static _Thread_local chunk_t *_scratch_cur; // chunk currently being bumped
+static pthread_key_t _scratch_key; // only used to free the arena when its thread exits
+static pthread_once_t _scratch_once = PTHREAD_ONCE_INIT;
+
+static _Thread_local pooled_t *_pool_head; // free tensor headers of the calling thread
+static _Thread_local uint32_t _pool_len;
+static pthread_key_t _pool_key; // only used to free the pool when its thread exits
+static pthread_once_t _pool_once = PTHREAD_ONCE_INIT;
+
+static void mem_report_atexit() {
+    tensor_mem_report(stderr);
+}
+
+// registers the at-exit report when TENSOR_MEM_REPORT is set to anything but 0 and reads TENSOR_CACHE_LIMIT
+static void mem_init() {
+    for (uint32_t i = 0; i < MEM_NCLASSES; i++) pthread_mutex_init(&_mem_free[i].lock, NULL);
+
+    const char *s = getenv("TENSOR_MEM_REPORT");
+    if (s != NULL && strcmp(s, "0") != 0) atexit(mem_report_atexit);
+
+    s = getenv("TENSOR_CACHE_LIMIT");
+    if (s != NULL) {
+        errno = 0;
+        char *e;
+        unsigned long long val = strtoull(s, &e, 10);
+        if (e == s || *e != '\0' || errno == ERANGE) fprintf(stderr, "invalid value for TENSOR_CACHE_LIMIT=\"%s\"; ignoring\n", s);
+        else atomic_store(&_mem_limit, (size_t) val);
+    }
+}
+
+// rounds bytes up to its size class and returns the class index
+static uint32_t size_class(size_t bytes, size_t *cap) {
+    if (bytes <= MEM_MIN_BLOCK) {
+        *cap = MEM_MIN_BLOCK;
+        return 0;
+    }
+    // 2^k < bytes <= 2^(k+1); split that range into MEM_CLASS_STEPS equal steps
+    uint32_t k = 63 - __builtin_clzll(bytes - 1);
+    size_t base = (size_t) 1 << k, step = base / MEM_CLASS_STEPS;
+    size_t q = (bytes - base + step - 1) / step;
+    *cap = base + q * step;
+    return (k - __builtin_ctzll(MEM_MIN_BLOCK)) * MEM_CLASS_STEPS + q;
+}
+
+static block_t *cache_pop(uint32_t cls) {
+    freelist_t *fl = &_mem_free[cls];
+    pthread_mutex_lock(&fl->lock);
+    block_t *b = fl->head;
+    if (b != NULL) fl->head = b->next;
+    pthread_mutex_unlock(&fl->lock);
+    if (b != NULL) atomic_fetch_sub_explicit(&_mem_cached, b->cap, memory_order_relaxed);
+    return b;
+}
+
+// keeps the block for reuse unless that would exceed the cache limit; returns false if it was not cached
+static bool cache_push(block_t *b) {
+    size_t limit = atomic_load_explicit(&_mem_limit, memory_order_relaxed);
+    size_t cached = atomic_fetch_add_explicit(&_mem_cached, b->cap, memory_order_relaxed) + b->cap;
+    if (cached > limit) {
+        atomic_fetch_sub_explicit(&_mem_cached, b->cap, memory_order_relaxed);
+        return false;
+    }
+    freelist_t *fl = &_mem_free[b->cls];
+    pthread_mutex_lock(&fl->lock);
+    b->next = fl->head;
+    fl->head = b;
+    POISON(b + 1, b->cap); // the header stays readable so leak checkers can follow the free list
+    pthread_mutex_unlock(&fl->lock);
+    return true;
+}
+
+// hands a block back to the system
+static void block_release(block_t *b) {
+    if (b->mapped) munmap(b, sizeof(block_t) + b->cap);
+    else free(b);
+}
+
+// releases cached blocks (largest classes first) until at most keep bytes stay cached
+static void cache_release(size_t keep) {
+    for (int32_t cls = MEM_NCLASSES-1; cls >= 0 && atomic_load(&_mem_cached) > keep; cls--) {
+        block_t *b;
+        while (atomic_load(&_mem_cached) > keep && (b = cache_pop(cls)) != NULL) block_release(b);
+    }
+}
+
+// finds (or claims) the stats slot of an op; ops are matched by name so the same op from different
+// translation units shares a slot
+static mem_op_t *op_slot(const char *op) {
+    for (uint32_t i = 0; i < MEM_MAX_OPS; i++) {
+        const char *cur = atomic_load_explicit(&_mem_ops[i].op, memory_order_acquire);
+        if (cur == NULL) {
+            if (atomic_compare_exchange_strong(&_mem_ops[i].op, &cur, op)) return &_mem_ops[i];
+        }
+        if (cur == op || strcmp(cur, op) == 0) return &_mem_ops[i];
+    }
+    return NULL;
+}
+
+// charges an allocation of bytes to op and updates the live/peak bytes
+static void account(const char *op, size_t bytes) {
+    uint64_t live = atomic_fetch_add_explicit(&_mem_bytes, bytes, memory_order_relaxed) + bytes;
+    uint64_t peak = atomic_load_explicit(&_mem_peak, memory_order_relaxed);
+    while (live > peak && !atomic_compare_exchange_weak_explicit(&_mem_peak, &peak, live, memory_order_relaxed, memory_order_relaxed));
+    atomic_fetch_add_explicit(&_mem_allocs, 1, memory_order_relaxed);
+
+    mem_op_t *s = op_slot(op);
+    if (s != NULL) {
+        atomic_fetch_add_explicit(&s->allocs, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&s->bytes, bytes, memory_order_relaxed);
+    }
+}
+
+/**
+ * Allocates tracked memory (accounted in the live/peak bytes and charged to op).
+ * Blocks are rounded up to a size class and reused from the cache when possible.
+ *
+ * @param op name of the op the allocation is charged to
+ * @param bytes number of bytes to allocate
+ * @return pointer to the allocated memory (aligned to MEM_ALIGN)
+ */
+void *mem_alloc(const char *op, size_t bytes) {
+    assert(op != NULL);
+    pthread_once(&_mem_once, mem_init);
+
+    size_t cap;
+    uint32_t cls = size_class(bytes, &cap);
+    assert(cls < MEM_NCLASSES);
+    block_t *b = cache_pop(cls);
+    if (b != NULL) {
+        atomic_fetch_add_explicit(&_mem_hits, 1, memory_order_relaxed);
+        UNPOISON(b + 1, cap);
+    } else {
+        atomic_fetch_add_explicit(&_mem_misses, 1, memory_order_relaxed);
+        if (posix_memalign((void **) &b, MEM_ALIGN, sizeof(block_t) + cap) != 0) b = NULL;
+        assert(b != NULL);
+        b->cap = cap;
+        b->cls = cls;
+        b->mapped = false;
+    }
+    b->bytes = bytes;
+    b->next = NULL;
+    account(op, bytes);
+
+    return b + 1;
+}
+
+// gives a block back to the cache (or to the system if it is full) without touching the live bytes
+static void block_free(block_t *b) {
+    if (!cache_push(b)) block_release(b);
+}
+
+static void zero_chunk(void *ctx, size_t start, size_t end) {
+    memset((char *) ctx + start, 0, end - start);
+}
+
+/**
+ * Allocates tracked memory set to zero. Cached blocks are reused and cleared (in parallel when large); large
+ * blocks missing from the cache map fresh pages from the kernel, which are already zero, so they cost nothing
+ * until touched.
+ *
+ * @param op name of the op the allocation is charged to
+ * @param bytes number of bytes to allocate
+ * @return pointer to the zeroed memory (aligned to MEM_ALIGN)
+ */
+void *mem_alloc_zeroed(const char *op, size_t bytes) {
+    if (bytes < MEM_ZERO_PAGES) {
+        void *p = mem_alloc(op, bytes);
+        memset(p, 0, bytes);
+        return p;
+    }
+
+    pthread_once(&_mem_once, mem_init);
+    size_t cap;
+    uint32_t cls = size_class(bytes, &cap);
+    assert(cls < MEM_NCLASSES);
+    block_t *b = cache_pop(cls);
+    if (b != NULL) {
+        atomic_fetch_add_explicit(&_mem_hits, 1, memory_order_relaxed);
+        UNPOISON(b + 1, cap);
+        parallel_for(bytes, MEM_ZERO_GRAIN, zero_chunk, b + 1);
+    } else {
+        b = mmap(NULL, sizeof(block_t) + cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(b != MAP_FAILED);
+        atomic_fetch_add_explicit(&_mem_misses, 1, memory_order_relaxed);
+        b->cap = cap;
+        b->cls = cls;
+        b->mapped = true;
+    }
+    b->bytes = bytes;
+    b->next = NULL;
+    account(op, bytes);
+
+    return b + 1;
+}
+
+/**
+ * Frees memory allocated with mem_alloc (the block goes back to the cache if within the cache limit)
+ *
+ * @param p pointer to free (NULL is a no-op)
+ */
+void mem_free(void *p) {
+    if (p == NULL) return;
+    block_t *b = (block_t *) p - 1;
+    atomic_fetch_sub_explicit(&_mem_bytes, b->bytes, memory_order_relaxed);
+    block_free(b);
+}
+
+static void scratch_destroy(void *head) {
+    for (chunk_t *c = head, *next; c != NULL; c = next) {
+        next = c->next;
+        free(c);
+    }
+}
+
+static void scratch_init() {
+    int rc = pthread_key_create(&_scratch_key, scratch_destroy);
+    assert(rc == 0);
+    (void) rc;
+}
+
+static chunk_t *chunk_new(size_t cap, chunk_t *next) {
+    chunk_t *c = malloc(sizeof(chunk_t) + cap);
+    assert(c != NULL);
+    c->next = next;
+    c->cap = cap;
+    c->used = 0;
+    return c;
+}
+
+/**
+ * Allocates memory from the calling thread's scratch arena (freed by scratch_reset, never by free)
+ *
+ * @param bytes number of bytes to allocate
+ * @return pointer to the memory (aligned to SCRATCH_ALIGN)
+ */
+void *scratch_alloc(size_t bytes) {
+    bytes = (bytes + SCRATCH_ALIGN - 1) & ~(size_t) (SCRATCH_ALIGN - 1);
+    if (_scratch_head == NULL) {
+        pthread_once(&_scratch_once, scratch_init);
+        _scratch_head = _scratch_cur = chunk_new(MAX(bytes, SCRATCH_CHUNK), NULL);
+        pthread_setspecific(_scratch_key, _scratch_head);
+    }
+    chunk_t *c = _scratch_cur;
+    // chunks past the current one were released by a reset and are reused before growing the arena
+    while (c->used + bytes > c->cap) {
+        if (c->next == NULL || c->next->cap < bytes) c->next = chunk_new(MAX(bytes, SCRATCH_CHUNK), c->next);
+        c = c->next;
+        c->used = 0;
+    }
+    _scratch_cur = c;
+    void *p = &c->data[c->used];
+    c->used += bytes;
+    return p;
+}
+
+/**
+ * Returns the current position of the calling thread's scratch arena
+ */
+scratch_mark_t scratch_mark() {
+    return (scratch_mark_t) { .chunk = _scratch_cur, .used = _scratch_cur != NULL ? _scratch_cur->used : 0 };
+}
+
+/**
+ * Releases everything allocated from the calling thread's scratch arena after mark was taken
+ *
+ * @param mark position to rewind to
+ */
+void scratch_reset(scratch_mark_t mark) {
+    if (mark.chunk == NULL) {
+        if (_scratch_head != NULL) _scratch_head->used = 0;
+        _scratch_cur = _scratch_head;
+    } else {
+        _scratch_cur = mark.chunk;
+        _scratch_cur->used = mark.used;
+    }
+}
+
+/**
+ * Returns every cached block to the system allocator
+ */
+void tensor_cache_trim() {
+    pthread_once(&_mem_once, mem_init);
+    cache_release(0);
+}
+
+/**
+ * Sets the maximum number of bytes the allocator keeps cached for reuse (0 disables caching),
+ * releasing cached blocks if the cache is already above the new limit
+ *
+ * @param bytes new limit
+ * @return previous limit
+ */
+size_t tensor_cache_limit(size_t bytes) {
+    pthread_once(&_mem_once, mem_init);
+    size_t prev = atomic_exchange(&_mem_limit, bytes);
+    cache_release(bytes);
+    return prev;
+}
+
+static void pool_destroy(void *head) {
+    for (pooled_t *p = head, *next; p != NULL; p = next) {
+        UNPOISON(p, sizeof(*p));
+        next = p->next;
+        block_free((block_t *) p - 1); // pooled headers are no longer accounted as live
+    }
+}
+
+static void pool_init() {
+    int rc = pthread_key_create(&_pool_key, pool_destroy);
+    assert(rc == 0);
+    (void) rc;
+}
+
+/**
+ * Allocates a tensor header (uninitialized) from the calling thread's free list, charging it to op
+ *
+ * @param op name of the op the tensor is charged to
+ * @return tensor header
+ */
+tensor_t *mem_tensor_alloc(const char *op) {
+    pooled_t *p = _pool_head;
+    if (p != NULL) {
+        UNPOISON(p, sizeof(*p));
+        _pool_head = p->next;
+        _pool_len--;
+        pthread_setspecific(_pool_key, _pool_head);
+        account(op, sizeof(*p));
+    } else {
+        p = mem_alloc(op, sizeof(*p));
+    }
+
+    atomic_fetch_add_explicit(&_mem_tensors, 1, memory_order_relaxed);
+    mem_op_t *s = op_slot(op);
+    if (s != NULL) atomic_fetch_add_explicit(&s->tensors, 1, memory_order_relaxed);
+
+    return &p->t;
+}
+
+/**
+ * Returns a tensor header to the calling thread's free list (or to the allocator once the list is full)
+ *
+ * @param t tensor header (whatever it points to must already be freed)
+ */
+void mem_tensor_free(tensor_t *t) {
+    pooled_t *p = (pooled_t *) t;
+    atomic_fetch_sub_explicit(&_mem_tensors, 1, memory_order_relaxed);
+    if (_pool_len >= POOL_MAX) {
+        mem_free(p);
+        return;
+    }
+    pthread_once(&_pool_once, pool_init);
+    atomic_fetch_sub_explicit(&_mem_bytes, sizeof(*p), memory_order_relaxed);
+    p->next = _pool_head;
+    POISON((char *) p + sizeof(p->next), sizeof(*p) - sizeof(p->next));
+    _pool_head = p;
+    _pool_len++;
+    pthread_setspecific(_pool_key, _pool_head);
+}
+
+/**
+ * Takes a snapshot of the global memory counters (each counter is read atomically, but not all of them at once)
+ *
+ * @param stats where to store the counters
+ */
+void tensor_mem_stats(tensor_mem_stats_t *stats) {
+    assert(stats != NULL);
+    stats->tensors = atomic_load_explicit(&_mem_tensors, memory_order_relaxed);
+    stats->bytes = atomic_load_explicit(&_mem_bytes, memory_order_relaxed);
+    stats->peak = atomic_load_explicit(&_mem_peak, memory_order_relaxed);
+    stats->allocs = atomic_load_explicit(&_mem_allocs, memory_order_relaxed);
+    stats->cached = atomic_load_explicit(&_mem_cached, memory_order_relaxed);
+    stats->hits = atomic_load_explicit(&_mem_hits, memory_order_relaxed);
+    stats->misses = atomic_load_explicit(&_mem_misses, memory_order_relaxed);
+}
+
+/**
+ * Copies the per-op allocation counters
+ *
+ * @param stats array to store the counters into
+ * @param n capacity of stats
+ * @return number of ops stored
+ */
+uint32_t tensor_mem_op_stats(tensor_op_stats_t *stats, uint32_t n) {
+    assert(stats != NULL || n == 0);
+    uint32_t k = 0;
+    for (uint32_t i = 0; i < MEM_MAX_OPS && k < n; i++) {
+        const char *op = atomic_load_explicit(&_mem_ops[i].op, memory_order_acquire);
+        if (op == NULL) break;
+        stats[k].op = op;
+        stats[k].tensors = atomic_load_explicit(&_mem_ops[i].tensors, memory_order_relaxed);
+        stats[k].allocs = atomic_load_explicit(&_mem_ops[i].allocs, memory_order_relaxed);
+        stats[k].bytes = atomic_load_explicit(&_mem_ops[i].bytes, memory_order_relaxed);
+        k++;
+    }
+    return k;
+}
+
+/**
+ * Prints the global memory counters followed by the per-op allocation counters
+ *
+ * @param stream stream to print to
+ */
+void tensor_mem_report(FILE *stream) {
+    tensor_mem_stats_t s;
+    tensor_mem_stats(&s);
+    fprintf(stream, "tensor memory: live tensors=%lu live bytes=%lu peak bytes=%lu allocs=%lu\n",
+            (unsigned long) s.tensors, (unsigned long) s.bytes, (unsigned long) s.peak, (unsigned long) s.allocs);
+    fprintf(stream, "tensor cache: cached bytes=%lu hits=%lu misses=%lu\n",
+            (unsigned long) s.cached, (unsigned long) s.hits, (unsigned long) s.misses);
+
+    tensor_op_stats_t ops[MEM_MAX_OPS];
+    uint32_t n = tensor_mem_op_stats(ops, MEM_MAX_OPS);
+    if (n > 0) fprintf(stream, "  %-16s %12s %12s %16s\n", "op", "tensors", "allocs", "bytes");
+    for (uint32_t i = 0; i < n; i++) {
+        fprintf(stream, "  %-16s %12lu %12lu %16lu\n", ops[i].op,
+                (unsigned long) ops[i].tensors, (unsigned long) ops[i].allocs, (unsigned long) ops[i].bytes);
+    }
+}
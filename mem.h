@@ -0,0 +1,31 @@
+#ifndef __MEM_H__
+#define __MEM_H__
+
+#include <stddef.h>
+
+#include "tensor.h"
+
+#define MEM_ALIGN 64 // alignment of every pointer returned by mem_alloc (a cache line; enough for any SIMD load)
+
+// tracked, cached allocations for tensor headers and data buffers; op is the name of the op the memory is
+// charged to (a string literal such as __func__)
+void *mem_alloc(const char *op, size_t bytes);
+void *mem_alloc_zeroed(const char *op, size_t bytes);
+void mem_free(void *p);
+
+// thread-local bump arena for short-lived op metadata (shapes, indices, ...); take a mark on op entry and
+// reset to it on exit, everything allocated in between is released at once (marks nest)
+typedef struct {
+    void *chunk;
+    size_t used;
+} scratch_mark_t;
+
+void *scratch_alloc(size_t bytes);
+scratch_mark_t scratch_mark();
+void scratch_reset(scratch_mark_t mark);
+
+// tensor headers come from a per-thread free list (and count as live tensors, charged per op)
+tensor_t *mem_tensor_alloc(const char *op);
+void mem_tensor_free(tensor_t *t);
+
+#endif
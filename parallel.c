@@ -0,0 +1,186 @@
+#include "tensor.h"
+#include "parallel.h"
+
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define PAR_CHUNKS_PER_THREAD 4 // chunks handed out per thread (some slack for uneven chunks)
+
+static pthread_mutex_t _par_submit = PTHREAD_MUTEX_INITIALIZER; // held for the whole duration of a parallel_for
+static pthread_mutex_t _par_lock = PTHREAD_MUTEX_INITIALIZER; // protects the job and the worker state below
+static pthread_cond_t _par_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t _par_done = PTHREAD_COND_INITIALIZER;
+
+static uint32_t _par_threads; // configured number of threads (including the caller); 0 until initialized
+static pthread_t *_par_workers;
+static uint32_t _par_nworkers; // running workers (_par_threads - 1 once started)
+static uint64_t _par_gen; // incremented for every job (and to stop the workers)
+static bool _par_stop;
+static uint32_t _par_active; // workers still busy with the current job
+
+static parallel_fn_t _par_fn;
+static void *_par_ctx;
+static size_t _par_n, _par_chunk, _par_nchunks;
+static atomic_size_t _par_next; // next chunk to hand out
+
+static _Thread_local bool _par_inside; // the thread is a worker or is running a parallel_for
+
+static uint32_t default_threads() {
+    const char *s = getenv("TENSOR_THREADS");
+    if (s != NULL) {
+        char *e;
+        long val = strtol(s, &e, 10);
+        if (e != s && *e == '\0' && val > 0 && val <= 1024) return (uint32_t) val;
+        fprintf(stderr, "invalid value for TENSOR_THREADS=\"%s\"; using the number of cpus\n", s);
+    }
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (uint32_t) n : 1;
+}
+
+static void run_chunks() {
+    size_t c;
+    while ((c = atomic_fetch_add_explicit(&_par_next, 1, memory_order_relaxed)) < _par_nchunks) {
+        size_t start = c * _par_chunk;
+        size_t end = start + _par_chunk < _par_n ? start + _par_chunk : _par_n;
+        _par_fn(_par_ctx, start, end);
+    }
+}
+
+// arg is the job generation when the worker was created (jobs published later are never missed)
+static void *worker(void *arg) {
+    _par_inside = true;
+    uint64_t seen = (uint64_t) (uintptr_t) arg;
+    pthread_mutex_lock(&_par_lock);
+    for (;;) {
+        while (_par_gen == seen) pthread_cond_wait(&_par_start, &_par_lock);
+        seen = _par_gen;
+        if (_par_stop) break;
+        pthread_mutex_unlock(&_par_lock);
+        run_chunks();
+        pthread_mutex_lock(&_par_lock);
+        if (--_par_active == 0) pthread_cond_signal(&_par_done);
+    }
+    pthread_mutex_unlock(&_par_lock);
+    return NULL;
+}
+
+// workers do not survive a fork; the child starts its own on its next parallel_for
+static void atfork_child() {
+    pthread_mutex_init(&_par_submit, NULL);
+    pthread_mutex_init(&_par_lock, NULL);
+    pthread_cond_init(&_par_start, NULL);
+    pthread_cond_init(&_par_done, NULL);
+    free(_par_workers);
+    _par_workers = NULL;
+    _par_nworkers = 0;
+    _par_stop = false;
+}
+
+// starts the workers (called with _par_submit held)
+static void pool_start() {
+    static bool registered = false;
+    if (!registered) {
+        pthread_atfork(NULL, NULL, atfork_child);
+        registered = true;
+    }
+    if (_par_threads == 0) _par_threads = default_threads();
+    if (_par_nworkers == _par_threads - 1) return;
+
+    _par_workers = malloc((_par_threads - 1) * sizeof(*_par_workers));
+    assert(_par_workers != NULL || _par_threads == 1);
+    pthread_mutex_lock(&_par_lock);
+    uint64_t gen = _par_gen;
+    pthread_mutex_unlock(&_par_lock);
+    uint32_t started = 0;
+    for (; started < _par_threads - 1; started++) {
+        int rc = pthread_create(&_par_workers[started], NULL, worker, (void *) (uintptr_t) gen);
+        assert(rc == 0);
+        if (rc != 0) break;
+    }
+    // run on the workers that could be started
+    _par_threads = started + 1;
+    _par_nworkers = started;
+}
+
+// stops and joins the workers (called with _par_submit held)
+static void pool_stop() {
+    if (_par_nworkers == 0) return;
+    pthread_mutex_lock(&_par_lock);
+    _par_stop = true;
+    _par_gen++;
+    pthread_cond_broadcast(&_par_start);
+    pthread_mutex_unlock(&_par_lock);
+    for (uint32_t i = 0; i < _par_nworkers; i++) pthread_join(_par_workers[i], NULL);
+    free(_par_workers);
+    _par_workers = NULL;
+    _par_nworkers = 0;
+    _par_stop = false;
+}
+
+void parallel_for(size_t n, size_t grain, parallel_fn_t fn, void *ctx) {
+    assert(fn != NULL);
+    if (n == 0) return;
+    if (grain == 0) grain = 1;
+    if (n <= grain || _par_inside || pthread_mutex_trylock(&_par_submit) != 0) {
+        fn(ctx, 0, n);
+        return;
+    }
+    pool_start();
+    if (_par_threads == 1) {
+        pthread_mutex_unlock(&_par_submit);
+        fn(ctx, 0, n);
+        return;
+    }
+
+    size_t nchunks = (n + grain - 1) / grain;
+    if (nchunks > (size_t) _par_threads * PAR_CHUNKS_PER_THREAD) nchunks = (size_t) _par_threads * PAR_CHUNKS_PER_THREAD;
+    _par_fn = fn;
+    _par_ctx = ctx;
+    _par_n = n;
+    _par_chunk = (n + nchunks - 1) / nchunks;
+    _par_nchunks = (n + _par_chunk - 1) / _par_chunk;
+    atomic_store(&_par_next, 0);
+
+    pthread_mutex_lock(&_par_lock);
+    _par_active = _par_nworkers;
+    _par_gen++;
+    pthread_cond_broadcast(&_par_start);
+    pthread_mutex_unlock(&_par_lock);
+
+    _par_inside = true;
+    run_chunks();
+    _par_inside = false;
+
+    pthread_mutex_lock(&_par_lock);
+    while (_par_active > 0) pthread_cond_wait(&_par_done, &_par_lock);
+    pthread_mutex_unlock(&_par_lock);
+
+    pthread_mutex_unlock(&_par_submit);
+}
+
+/**
+ * Returns the number of threads ops run on (TENSOR_THREADS or the number of cpus by default)
+ */
+uint32_t tensor_threads() {
+    pthread_mutex_lock(&_par_submit);
+    if (_par_threads == 0) _par_threads = default_threads();
+    uint32_t n = _par_threads;
+    pthread_mutex_unlock(&_par_submit);
+    return n;
+}
+
+/**
+ * Sets the number of threads ops run on (including the calling thread)
+ *
+ * @param n number of threads (> 0)
+ */
+void tensor_set_threads(uint32_t n) {
+    assert(n > 0);
+    pthread_mutex_lock(&_par_submit);
+    if (n != _par_threads) {
+        pool_stop();
+        _par_threads = n;
+    }
+    pthread_mutex_unlock(&_par_submit);
+}
@@ -0,0 +1,14 @@
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// processes the range [start, end) of a parallel_for
+typedef void (*parallel_fn_t)(void *ctx, size_t start, size_t end);
+
+// splits [0, n) into chunks of at least grain items and runs fn on them from the worker threads (and the caller);
+// runs inline when n is small, when called from a worker or when another parallel_for is already running
+void parallel_for(size_t n, size_t grain, parallel_fn_t fn, void *ctx);
+
+#endif
@@ -1,17 +1,111 @@
 #include "tensor.h"
 #include "debug.h"
+#include "mem.h"
+#include "parallel.h"
+#include "kernels.h"
+#include "dispatch.h"
 #include "color.h"
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define SWAP(a, b) do { typeof(a) tmp = (a); (a) = (b); (b) = tmp; } while (0)
 
+#define VIEW_HDR MEM_ALIGN // view_t header in front of the data (padded so data stays aligned)
+#define FILL_GRAIN (1 << 16) // minimum number of elements a constructor hands to each thread
+#define BINARY_GRAIN (1 << 15) // minimum number of elements a binary op hands to each thread
+#define UNARY_GRAIN (1 << 14) // minimum number of elements a unary op hands to each thread
+#define UNARY_TILE 256 // strided runs are gathered into tiles of this many elements
+#define EW_TILE 128 // elements an elementwise program processes at a time (its registers stay in L1)
+#define EW_GRAIN (1 << 14) // minimum number of elements an elementwise program hands to each thread
+#define GEMM_MC 72 // rows of the packed blocks of a matmul (a multiple of GEMM_MR; the panel of a stays in L2)
+#define GEMM_NC 256 // columns of the packed blocks of a matmul (a multiple of GEMM_NR)
+#define GEMM_KC 256 // depth of the packed blocks of a matmul (a micro-kernel's panels stay in L1)
+#define GEMM_GRAIN (1 << 18) // minimum multiply-adds a matmul hands to each thread
+#define GEMV_GRAIN (1 << 16) // minimum matrix elements a matrix-vector product hands to each thread
+#define DOT_BLOCK (1 << 15) // elements of the blocks a dot product is split into
+#define CONV_GRAIN (1 << 18) // minimum multiply-adds a direct convolution hands to each thread
+#define POOL_GRAIN (1 << 14) // minimum window elements a pooling op hands to each thread
+#define SOFTMAX_GRAIN (1 << 14) // minimum elements a softmax hands to each thread
+#define NORM_GRAIN (1 << 14) // minimum elements a layernorm or rmsnorm hands to each thread
+#define MOMENTS_GRAIN (1 << 15) // minimum elements a mean or variance hands to each thread
+#define MOMENTS_BLOCK 4096 // values along the reduced dim folded by a kernel call (the blocks merge in double)
+#define DIM_COLS 64 // columns handed to a thread at a time by softmax and moments along a dim that is not the innermost
+#define Q8_GRAIN (1 << 19) // minimum int8 multiply-adds a quantized matmul hands to each thread
+#define QTENSOR_HDR 64 // header of a quantized tensor, in front of its arrays (shape, scales, zero points, data)
+
+static bool _fast_math; // unary ops use the cheaper approximations (see tensor_set_fast_math)
+
 #define BUFF_SIZE 512
-static char buff[BUFF_SIZE];
+static _Thread_local char buff[BUFF_SIZE]; // per-thread so ops can log (and tfinfo) concurrently
 
 // static void elementfmt(float elem, char *buff, size_t len);
 static size_t tinfo2str(tensor_t *t, char *dst, const size_t dstlen);
 static size_t tuple2str(void *tuple, const size_t numel, const size_t szel, const char *const fmtel, char *dst, const size_t dstlen);
+static tensor_t *talloc(const char *op, dim_t ndim, dim_sz_t *shape);
+static tensor_t *talloc_ex(const char *op, dim_t ndim, dim_sz_t *shape, bool zero);
+static uint8_t broadcast_into(dim_t andim, dim_sz_t *asrc, dim_sz_t *adst, dim_t bndim, dim_sz_t *bsrc, dim_sz_t *bdst);
+static void tresize(tensor_t *t, dim_t ndim);
+static void tdata_alloc(const char *op, tensor_t *t, bool zero);
+static void tdata_free(tensor_t *t);
+static tensor_t *tview(const char *op, tensor_t *t, dim_t ndim);
+static stride_t *expand_strides(tensor_t *t, dim_t ndim, const dim_sz_t *shape);
+static dim_t broadcast_shapes(uint32_t n, tensor_t *const *ts, dim_sz_t *shape);
+
+#define ITER_MAX_OPS (EW_MAX_INPUTS + 1)
+
+// walks the outer dims of one or more strided operands sharing a shape; the innermost dim is left to the caller
+// as a run of ITER_RUN(it) elements (with stride ITER_STRIDE(it, op)) so kernels loop over whole rows
+typedef struct {
+    dim_t ndim; // dims left after dropping size 1 dims and merging contiguous ones (at least 1)
+    uint32_t nops;
+    dim_sz_t *shape;
+    dim_sz_t *index;
+    stride_t *stride[ITER_MAX_OPS];
+    size_t off[ITER_MAX_OPS]; // offset (in elements) of the current run of each operand
+} iter_t;
+
+#define ITER_RUN(it) ((it)->shape[(it)->ndim-1])
+#define ITER_STRIDE(it, op) ((it)->stride[op][(it)->ndim-1])
+
+#define PLAN_CACHE_SIZE 64 // entries of the per-thread plan cache (direct mapped; a power of 2)
+#define PLAN_MAX_OPS 4 // plans are cached for ops with up to 3 inputs (of at most TENSOR_INLINE_DIM dims)
+
+// cached plan of an elementwise op (see ew_plan): the key is the op with the shapes and strides of its inputs
+typedef struct {
+    uint64_t hash;
+    tensor_op_t op;
+    uint32_t gen; // dispatch generation fn was resolved in
+    uint32_t nin; // 0 for an empty entry
+    dim_t in_ndim[PLAN_MAX_OPS-1];
+    dim_sz_t in_shape[PLAN_MAX_OPS-1][TENSOR_INLINE_DIM];
+    stride_t in_stride[PLAN_MAX_OPS-1][TENSOR_INLINE_DIM];
+
+    dim_t ndim; // output shape
+    dim_sz_t shape[TENSOR_INLINE_DIM];
+    dim_t it_ndim; // iterator over the output and the inputs (dims merged)
+    dim_sz_t it_shape[TENSOR_INLINE_DIM];
+    stride_t it_stride[PLAN_MAX_OPS][TENSOR_INLINE_DIM];
+    kernel_t fn;
+} plan_t;
+
+static _Thread_local plan_t _plans[PLAN_CACHE_SIZE];
+static _Thread_local tensor_plan_stats_t _plan_stats;
+
+static void iter_init(iter_t *it, dim_t ndim, const dim_sz_t *shape, uint32_t nops, stride_t *const *strides);
+static bool iter_next(iter_t *it);
+static dim_t ew_plan(tensor_op_t op, uint32_t nin, tensor_t *const *in, dim_sz_t **shape, iter_t *it, kernel_t *fn);
+static void gemv_into(float *y, const float *m, size_t rows, size_t cols, size_t rs, size_t cs, const float *x, size_t xs);
+static void materialize(float *dst, stride_t *dstride, tensor_t *t);
+
+static const char *const opnames[] = {
+    "add", "mul", "sub", "div", "pow", "maximum", "minimum", "eq", "lt", "gt",
+    "exp", "log", "tanh", "sigmoid", "sqrt", "relu", "gelu", "fma", "where", "const", "sum", "min", "max",
+    "matmul", "dot", "gemv", "gemv_t", "matmul_q8", "gemv_q4", "quantize", "dequantize",
+    "conv", "conv_dw", "softmax", "log_softmax", "logsumexp",
+    "layernorm", "rmsnorm", "moments"
+};
+_Static_assert(sizeof(opnames) / sizeof(*opnames) == OP_NOPS, "opnames must have a name for every op");
+_Static_assert(GEMM_MC % GEMM_MR == 0 && GEMM_NC % GEMM_NR == 0, "matmul blocks must hold whole tiles");
 
 /**
  * Creates a tensor and allocates the required memory for it
@@ -21,6 +115,16 @@ static size_t tuple2str(void *tuple, const size_t numel, const size_t szel, cons
  * @return pointer to the created tensor
  */
 tensor_t *tensor_alloc(dim_t ndim, dim_sz_t *shape) {
+    return talloc(__func__, ndim, shape);
+}
+
+// allocates a tensor charging its memory to op (see tensor_mem_op_stats)
+static tensor_t *talloc(const char *op, dim_t ndim, dim_sz_t *shape) {
+    return talloc_ex(op, ndim, shape, false);
+}
+
+// allocates a tensor whose data is set to zero when zero is true (left uninitialized otherwise)
+static tensor_t *talloc_ex(const char *op, dim_t ndim, dim_sz_t *shape, bool zero) {
     assert(ndim > 0); // TODO: should tensors be allowed to have 0 dimensions (for single values)?
     assert(shape != NULL);
 
@@ -28,34 +132,126 @@ tensor_t *tensor_alloc(dim_t ndim, dim_sz_t *shape) {
     // because 0 or negative dimension sized does not make sense here we must check for there aren't any
     for (dim_t i = 0; i < ndim; i++) assert(shape[i] > 0);
 
-    tensor_t *t = malloc(sizeof(tensor_t));
-    assert(t != NULL);
+    tensor_t *t = mem_tensor_alloc(op);
 
+    t->ndim = 0;
+    t->shape = t->_shape;
+    t->stride = t->_stride;
+    tresize(t, ndim);
     t->ndim = ndim;
-    t->shape = malloc(ndim * sizeof(*t->shape));
-    assert(t->shape != NULL);
     memcpy(t->shape, shape, ndim * sizeof(*t->shape));
 
-    t->stride = malloc(ndim * sizeof(*t->stride));
-    assert(t->stride != NULL);
     t->stride[ndim-1] = 1;
     for (dim_t i = ndim-2; i >= 0; i--) t->stride[i] = t->stride[i+1] * t->shape[i+1];
 
     t->numel = 0;
     for (dim_t i = 0; i < ndim; i++) t->numel = (t->numel > 0 ? t->numel : 1) * t->shape[i];
 
-    t->data = malloc(t->numel * sizeof(*t->data));
-    assert(t->data != NULL);
+    tdata_alloc(op, t, zero);
 
-    DBG(1, {
+    DBG(DBG_ALLOC, 1, {
         assert(tinfo2str(t, buff, BUFF_SIZE) != 0);
-        uint64_t sz = sizeof(tensor_t) + t->ndim * (sizeof(*t->shape) + sizeof(*t->stride)) + t->numel * sizeof(*t->data);
-        printf("%s numel=%u sz=%llu", buff, t->numel, sz);
+        size_t sz = sizeof(tensor_t) + (t->data != &t->_scalar ? t->numel * sizeof(*t->data) : 0);
+        dbg("%s numel=%u sz=%zu op=%s", buff, t->numel, sz, op);
     });
 
     return t;
 }
 
+// makes room for ndim dims in t's shape and stride keeping the values of the leading dims (does not change t->ndim);
+// tensors with up to TENSOR_INLINE_DIM dims use the storage inside tensor_t
+static void tresize(tensor_t *t, dim_t ndim) {
+    bool inl = t->shape == t->_shape;
+    dim_t keep = MIN(t->ndim, ndim);
+    if (ndim <= TENSOR_INLINE_DIM) {
+        if (!inl) {
+            memcpy(t->_shape, t->shape, keep * sizeof(*t->shape));
+            memcpy(t->_stride, t->stride, keep * sizeof(*t->stride));
+            free(t->shape);
+            free(t->stride);
+            t->shape = t->_shape;
+            t->stride = t->_stride;
+        }
+    } else if (inl) {
+        t->shape = malloc(ndim * sizeof(*t->shape));
+        assert(t->shape != NULL);
+        memcpy(t->shape, t->_shape, keep * sizeof(*t->shape));
+        t->stride = malloc(ndim * sizeof(*t->stride));
+        assert(t->stride != NULL);
+        memcpy(t->stride, t->_stride, keep * sizeof(*t->stride));
+    } else {
+        t->shape = realloc(t->shape, ndim * sizeof(*t->shape));
+        assert(t->shape != NULL);
+        t->stride = realloc(t->stride, ndim * sizeof(*t->stride));
+        assert(t->stride != NULL);
+    }
+}
+
+// allocates a shared data buffer with room for numel elements (the view_t header shares its allocation);
+// the data is zeroed when zero is true
+static view_t *view_alloc(const char *op, uint32_t numel, bool zero) {
+    size_t bytes = VIEW_HDR + numel * sizeof(float);
+    view_t *v = zero ? mem_alloc_zeroed(op, bytes) : mem_alloc(op, bytes);
+    v->refs = 1;
+    v->data = (float *) ((char *) v + VIEW_HDR);
+    return v;
+}
+
+static void view_release(view_t *v) {
+    if (v != NULL && __atomic_sub_fetch(&v->refs, 1, __ATOMIC_ACQ_REL) == 0) mem_free(v);
+}
+
+// allocates the data for t->numel elements (single element tensors use the storage inside tensor_t)
+static void tdata_alloc(const char *op, tensor_t *t, bool zero) {
+    if (t->numel == 1) {
+        t->view = NULL;
+        t->data = &t->_scalar;
+        if (zero) t->_scalar = 0;
+    } else {
+        t->view = view_alloc(op, t->numel, zero);
+        t->data = t->view->data;
+    }
+}
+
+static void tdata_free(tensor_t *t) {
+    view_release(t->view);
+    t->view = NULL;
+}
+
+// returns t's storage with one more reference; an inline scalar is moved to a view first so it can be shared
+static view_t *tshare(tensor_t *t) {
+    if (t->view == NULL) {
+        assert(t->data == &t->_scalar);
+        t->view = view_alloc(__func__, 1, false);
+        t->view->data[0] = t->_scalar;
+        t->data = t->view->data;
+    }
+    __atomic_add_fetch(&t->view->refs, 1, __ATOMIC_RELAXED);
+    return t->view;
+}
+
+// creates a tensor header with room for ndim dims that shares t's data (shape and stride are left to the caller)
+static tensor_t *tview(const char *op, tensor_t *t, dim_t ndim) {
+    tensor_t *v = mem_tensor_alloc(op);
+    v->ndim = 0;
+    v->shape = v->_shape;
+    v->stride = v->_stride;
+    tresize(v, ndim);
+    v->ndim = ndim;
+    v->numel = t->numel;
+    v->view = tshare(t);
+    v->data = t->data;
+    return v;
+}
+
+// new view of t with a dimension of size 1 inserted at dim (unlike unsqueeze, t itself is left untouched)
+static tensor_t *unsqueeze_view(const char *op, tensor_t *t, dim_t dim) {
+    tensor_t *v = tview(op, t, t->ndim);
+    memcpy(v->shape, t->shape, t->ndim * sizeof(*t->shape));
+    memcpy(v->stride, t->stride, t->ndim * sizeof(*t->stride));
+    return unsqueeze(v, dim);
+}
+
 /**
  * Frees all of the memory allocated to the tensor and sets its internal pointers to NULL.
  * The memory for the tensor_t struct is freed but it is not responsible for setting any variables pointing to it to NULL.
@@ -64,30 +260,233 @@ tensor_t *tensor_alloc(dim_t ndim, dim_sz_t *shape) {
  */
 void tensor_free(tensor_t *t) {
     if (t != NULL) {
-        DBG(1, {
+        DBG(DBG_ALLOC, 1, {
             assert(tinfo2str(t, buff, BUFF_SIZE) != 0);
-            uint64_t sz = sizeof(tensor_t) + t->ndim * (sizeof(*t->shape) + sizeof(*t->stride)) + t->numel * sizeof(*t->data);
-            printf("%s numel=%u sz=%llu", buff, t->numel, sz);
+            size_t sz = sizeof(tensor_t) + (t->data != &t->_scalar ? t->numel * sizeof(*t->data) : 0);
+            dbg("%s numel=%u sz=%zu", buff, t->numel, sz);
         });
-        if (t->shape != NULL) {
-            free(t->shape);
-            t->shape = NULL;
-        }
-        if (t->stride != NULL) {
-            free(t->stride);
-            t->stride = NULL;
-        }
+        if (t->shape != NULL && t->shape != t->_shape) free(t->shape);
+        t->shape = NULL;
+        if (t->stride != NULL && t->stride != t->_stride) free(t->stride);
+        t->stride = NULL;
         if (t->data != NULL) {
-            free(t->data);
+            tdata_free(t);
             t->data = NULL;
         }
-        free(t);
+        mem_tensor_free(t);
     }
 }
 
+typedef struct {
+    float *dst;
+    float value; // fill value (or start of the range)
+    float step; // arange step
+} fill_ctx_t;
+
+static void fill_chunk(void *ctx, size_t start, size_t end) {
+    fill_ctx_t *c = ctx;
+    k_fill(c->dst + start, end - start, c->value);
+}
+
+static void arange_chunk(void *ctx, size_t start, size_t end) {
+    fill_ctx_t *c = ctx;
+    k_arange(c->dst + start, end - start, c->value, c->step, start);
+}
+
+/**
+ * Creates a tensor with every element set to value
+ *
+ * @param ndim number of dimensions
+ * @param shape shape of the tensor
+ * @param value value to set all elements to
+ * @return filled tensor
+ */
+tensor_t *full(dim_t ndim, dim_sz_t *shape, float value) {
+    tensor_t *t = talloc(__func__, ndim, shape);
+    fill_ctx_t ctx = { .dst = t->data, .value = value };
+    parallel_for(t->numel, FILL_GRAIN, fill_chunk, &ctx);
+    return t;
+}
+
+/**
+ * Creates a tensor filled with zeros (large tensors reuse a cached buffer cleared in parallel, or get fresh pages
+ * from the system, which are zero already)
+ *
+ * @param ndim number of dimensions
+ * @param shape shape of the tensor
+ * @return zeroed tensor
+ */
+tensor_t *zeros(dim_t ndim, dim_sz_t *shape) {
+    return talloc_ex(__func__, ndim, shape, true);
+}
+
+/**
+ * Creates a tensor filled with ones
+ *
+ * @param ndim number of dimensions
+ * @param shape shape of the tensor
+ * @return tensor of ones
+ */
+tensor_t *ones(dim_t ndim, dim_sz_t *shape) {
+    return full(ndim, shape, 1);
+}
+
 /**
  * Creates a tensor with the range [start, end) and the specified step size.
- * The number of elements in the tensor will be: (end - start) / step
+ * The number of elements in the tensor will be: ceil((end - start) / step)
+ * Every element is computed from its index (start + i * step) so there is no accumulated rounding error.
+ *
+ * @param start start value (first element)
+ * @param end stop value (not included)
+ * @param step step value (difference between any two contiguous elements; can be negative)
+ * @return tensor filled with the specified range
+ */
+tensor_t *arange(float start, float end, float step) {
+    assert(step != 0);
+    double n = ceil(((double) end - start) / step);
+    assert(n >= 1 && n <= INT32_MAX); // dims are int32
+    tensor_t *t = talloc(__func__, 1, (dim_sz_t[]){(dim_sz_t) n});
+    fill_ctx_t ctx = { .dst = t->data, .value = start, .step = step };
+    parallel_for(t->numel, FILL_GRAIN, arange_chunk, &ctx);
+    return t;
+}
+
+/**
+ * Creates a tensor with n evenly spaced values from start to end (both included)
+ *
+ * @param start first element
+ * @param end last element
+ * @param n number of elements
+ * @return tensor filled with the specified values
+ */
+tensor_t *linspace(float start, float end, uint32_t n) {
+    assert(n > 0 && n <= INT32_MAX); // dims are int32
+    tensor_t *t = talloc(__func__, 1, (dim_sz_t[]){n});
+    fill_ctx_t ctx = { .dst = t->data, .value = start, .step = n > 1 ? (end - start) / (n - 1) : 0 };
+    parallel_for(t->numel, FILL_GRAIN, arange_chunk, &ctx);
+    if (n > 1) t->data[n-1] = end;
+    return t;
+}
+
+static uint64_t _rng_seed; // key of the generator (see tensor_seed)
+static uint64_t _rng_stream; // stream of the next random tensor
+
+typedef struct {
+    float *dst;
+    uint64_t key, stream;
+    float a, b; // low and high (uniform) or mean and std (normal)
+    int32_t low;
+    uint32_t range;
+} rand_ctx_t;
+
+static void uniform_chunk(void *ctx, size_t start, size_t end) {
+    rand_ctx_t *c = ctx;
+    k_rand_uniform(c->dst + start, end - start, c->key, c->stream, start, c->a, c->b);
+}
+
+static void normal_chunk(void *ctx, size_t start, size_t end) {
+    rand_ctx_t *c = ctx;
+    k_rand_normal(c->dst + start, end - start, c->key, c->stream, start, c->a, c->b);
+}
+
+static void randint_chunk(void *ctx, size_t start, size_t end) {
+    rand_ctx_t *c = ctx;
+    k_rand_int(c->dst + start, end - start, c->key, c->stream, start, c->low, c->range);
+}
+
+// allocates a tensor and fills it from the next stream of the generator (in parallel; the values do not depend
+// on how the tensor is split between threads)
+static tensor_t *trandom(const char *op, dim_t ndim, dim_sz_t *shape, parallel_fn_t fn, rand_ctx_t *ctx) {
+    tensor_t *t = talloc(op, ndim, shape);
+    ctx->dst = t->data;
+    ctx->key = __atomic_load_n(&_rng_seed, __ATOMIC_RELAXED);
+    ctx->stream = __atomic_fetch_add(&_rng_stream, 1, __ATOMIC_RELAXED);
+    parallel_for(t->numel, FILL_GRAIN, fn, ctx);
+    return t;
+}
+
+/**
+ * Seeds the random number generator. Every random tensor created afterwards takes the next stream of a
+ * counter-based generator (Philox4x32-10), so the same seed and sequence of calls give the same tensors
+ * regardless of the number of threads.
+ *
+ * @param seed new seed (the generator starts seeded with 0)
+ */
+void tensor_seed(uint64_t seed) {
+    __atomic_store_n(&_rng_seed, seed, __ATOMIC_RELAXED);
+    __atomic_store_n(&_rng_stream, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * Creates a tensor with values drawn uniformly from [low, high) (24 random bits per value; values that round
+ * up to high are clamped to the float just below it)
+ *
+ * @param ndim number of dimensions
+ * @param shape shape of the tensor
+ * @param low lower bound
+ * @param high upper bound
+ * @return random tensor
+ */
+tensor_t *tuniform(dim_t ndim, dim_sz_t *shape, float low, float high) {
+    assert(low < high);
+    rand_ctx_t ctx = { .a = low, .b = high };
+    return trandom(__func__, ndim, shape, uniform_chunk, &ctx);
+}
+
+/**
+ * Creates a tensor with values drawn from a normal distribution (Box-Muller)
+ *
+ * @param ndim number of dimensions
+ * @param shape shape of the tensor
+ * @param mean mean of the distribution
+ * @param std standard deviation of the distribution
+ * @return random tensor
+ */
+tensor_t *tnormal(dim_t ndim, dim_sz_t *shape, float mean, float std) {
+    assert(std >= 0);
+    rand_ctx_t ctx = { .a = mean, .b = std };
+    return trandom(__func__, ndim, shape, normal_chunk, &ctx);
+}
+
+/**
+ * Creates a tensor with values drawn uniformly from [0, 1)
+ *
+ * @param ndim number of dimensions
+ * @param shape shape of the tensor
+ * @return random tensor
+ */
+tensor_t *trand(dim_t ndim, dim_sz_t *shape) {
+    return tuniform(ndim, shape, 0, 1);
+}
+
+/**
+ * Creates a tensor with values drawn from the standard normal distribution
+ *
+ * @param ndim number of dimensions
+ * @param shape shape of the tensor
+ * @return random tensor
+ */
+tensor_t *trandn(dim_t ndim, dim_sz_t *shape) {
+    return tnormal(ndim, shape, 0, 1);
+}
+
+/**
+ * Creates a tensor with integers drawn uniformly from [low, high)
+ *
+ * @param ndim number of dimensions
+ * @param shape shape of the tensor
+ * @param low lowest integer
+ * @param high upper bound (not included)
+ * @return random tensor
+ */
+tensor_t *trandint(dim_t ndim, dim_sz_t *shape, int32_t low, int32_t high) {
+    assert(low < high);
+    rand_ctx_t ctx = { .low = low, .range = (uint32_t) ((int64_t) high - low) };
+    return trandom(__func__, ndim, shape, randint_chunk, &ctx);
+}
+
+/**
+ * Creates a tensor with the range [start, end) and the specified step size (same as arange).
  * 
  * @param start start value (first element)
  * @param end stop value (value after the last element)
@@ -95,15 +494,7 @@ void tensor_free(tensor_t *t) {
  * @return tensor filled with the specified range
  */
 tensor_t *range(float start, float end, float step) {
-    assert(start < end);
-    uint32_t numel = (end - start) / step;
-    tensor_t *t = tensor_alloc(1, (dim_sz_t[]){numel});
-    float acc = start;
-    for (uint32_t i = 0; i < t->numel; i++) {
-        t->data[i] = acc;
-        acc += step;
-    }
-    return t;
+    return arange(start, end, step);
 }
 
 /**
@@ -115,9 +506,7 @@ tensor_t *range(float start, float end, float step) {
  */
 tensor_t *fill(uint32_t numel, float value) {
     assert(numel > 0);
-    tensor_t *t = tensor_alloc(1, (dim_sz_t[]){numel});
-    memset(t->data, value, t->numel * sizeof(value));
-    return t;
+    return full(1, (dim_sz_t[]){numel}, value);
 }
 
 /**
@@ -132,9 +521,9 @@ tensor_t *transpose(tensor_t *t, dim_t dim1, dim_t dim2) {
     assert(t != NULL);
     dim1 = resolve_dim(t->ndim, dim1);
     dim2 = resolve_dim(t->ndim, dim2);
-    DBG(1, {
+    DBG(DBG_SHAPE, 1, {
         assert(tinfo2str(t, buff, BUFF_SIZE) > 0);
-        printf("%s - [%d, %d]", buff, dim1, dim2);
+        dbg("%s - [%d, %d]", buff, dim1, dim2);
     });
     if (dim1 != dim2) {
         // swap both shape and stride for the specified dimensions
@@ -156,16 +545,64 @@ bool is_contiguous(tensor_t *t) {
     bool ret = true;
     dim_sz_t mul = 1;
     for (dim_t i = t->ndim-1; i >= 0 && ret; i--) {
+        if (t->shape[i] == 1) continue; // the stride of a size 1 dim is never used
         if (t->stride[i] != mul) ret = false;
         else mul *= t->shape[i];
     }
-    DBG(2, {
+    DBG(DBG_SHAPE, 2, {
         assert(tinfo2str(t, buff, BUFF_SIZE) > 0);
-        printf("%s %s", buff, ret ? GRN "true" : RED "false");
+        dbg("%s %s", buff, ret ? GRN "true" : RED "false");
     });
     return ret;
 }
 
+#define COPY_TILE 32 // side of the square tiles used when source and destination are contiguous on different dims
+
+// copies the elements of t into dst (laid out with the row-major strides dstride) choosing the loop order:
+// when the source's stride 1 dim is not the innermost one (e.g. a permuted NCHW <-> NHWC tensor) the copy walks
+// COPY_TILE x COPY_TILE tiles of the plane formed by both stride 1 dims, so reads and writes stay sequential
+static void materialize(float *dst, stride_t *dstride, tensor_t *t) {
+    scratch_mark_t m = scratch_mark();
+    iter_t it;
+    iter_init(&it, t->ndim, t->shape, 2, (stride_t *[]){dstride, t->stride});
+
+    // find the (merged) dim the source reads with stride 1
+    dim_t k = -1;
+    for (dim_t d = 0; d < it.ndim-1 && k < 0; d++) if (it.stride[1][d] == 1) k = d;
+
+    dim_sz_t n = ITER_RUN(&it);
+    stride_t ss = ITER_STRIDE(&it, 1);
+    if (k < 0 || ss == 1) {
+        do {
+            float *dp = dst + it.off[0];
+            const float *sp = t->data + it.off[1];
+            if (ss == 1) memcpy(dp, sp, n * sizeof(*dp));
+            else for (dim_sz_t i = 0; i < n; i++) dp[i] = sp[i * ss];
+        } while (iter_next(&it));
+    } else {
+        // walk every dim but k and the innermost one, and copy the (k, innermost) plane tile by tile
+        dim_sz_t nk = it.shape[k];
+        stride_t dk = it.stride[0][k];
+        iter_t outer;
+        it.shape[k] = 1;
+        iter_init(&outer, it.ndim, it.shape, 2, it.stride);
+        do {
+            float *dp = dst + outer.off[0];
+            const float *sp = t->data + outer.off[1];
+            for (dim_sz_t i0 = 0; i0 < nk; i0 += COPY_TILE) {
+                dim_sz_t i1 = MIN(i0 + COPY_TILE, nk);
+                for (dim_sz_t j0 = 0; j0 < n; j0 += COPY_TILE) {
+                    dim_sz_t j1 = MIN(j0 + COPY_TILE, n);
+                    for (dim_sz_t i = i0; i < i1; i++) {
+                        for (dim_sz_t j = j0; j < j1; j++) dp[i * dk + j] = sp[i + j * ss];
+                    }
+                }
+            }
+        } while (iter_next(&outer));
+    }
+    scratch_reset(m);
+}
+
 /**
  * Converts the tensor into a contiguous tensor (creates a new data buffer and copies data).
  * 
@@ -177,37 +614,25 @@ tensor_t *contiguous(tensor_t *t) {
     assert(t->shape != NULL);
     assert(t->stride != NULL);
     bool c = is_contiguous(t);
-    DBG(1, {
+    DBG(DBG_SHAPE, 1, {
         assert(tinfo2str(t, buff, BUFF_SIZE) != 0);
-        printf("%s %s", buff, c ? GRN "nocopy" RST : RED "copy" RST);
+        dbg("%s %s", buff, c ? GRN "nocopy" RST : RED "copy" RST);
     });
     if (!c) {
-        dim_sz_t *index = malloc(t->ndim * sizeof(*index));
-        assert(index != NULL);
-        memset(index, 0, t->ndim * sizeof(*index));
-
-        float *data = malloc(t->numel * sizeof(*data));
-        assert(data != NULL);
-
-        size_t idx = 0;
-        for (uint32_t i = 0; i < t->numel; i++) {
-            data[i] = t->data[idx];
-            // increase the index for the last dimension and carry the overflow to the previous ones
-            for (dim_t d = t->ndim-1; d >= 0; d--) {
-                index[d]++;
-                idx += t->stride[d]; // increase idx by the current dimension's stride
-                if (index[d] < t->shape[d]) break;
-                index[d] = 0;
-                idx -= t->stride[d] * t->shape[d]; // rollback idx to the previous dimension's base
-            }
-        }
-
-        free(index);
-        free(t->data);
-        t->data = data;
-        // recalculate strides and tensor is now contiguous
-        t->stride[t->ndim-1] = 1;
-        for (dim_t d = t->ndim-2; d >= 0; d--) t->stride[d] = t->shape[d+1] * t->stride[d+1];
+        // single element tensors are always contiguous, so the copy always goes to a new view
+        scratch_mark_t m = scratch_mark();
+        view_t *v = view_alloc(__func__, t->numel, false);
+        stride_t *stride = scratch_alloc(t->ndim * sizeof(*stride));
+        stride[t->ndim-1] = 1;
+        for (dim_t d = t->ndim-2; d >= 0; d--) stride[d] = t->shape[d+1] * stride[d+1];
+
+        materialize(v->data, stride, t);
+
+        tdata_free(t);
+        t->view = v;
+        t->data = v->data;
+        memcpy(t->stride, stride, t->ndim * sizeof(*stride));
+        scratch_reset(m);
     }
 
     return t;
@@ -237,22 +662,22 @@ dim_t resolve_shape(uint32_t numel, dim_t ndim, dim_sz_t *shape) {
     }
 
     int8_t lvl = 3;
+    scratch_mark_t m = scratch_mark();
     dim_sz_t *prev = NULL;
-    if (dbglvl() >= lvl) {
-        prev = malloc(ndim * sizeof(*prev));
-        assert(prev);
+    if (dbglvl(DBG_SHAPE) >= lvl) {
+        prev = scratch_alloc(ndim * sizeof(*prev));
         memcpy(prev, shape, ndim * sizeof(*prev));
     }
 
     if (dim > 0) shape[dim] = numel / mul;
 
-    DBG(lvl, {
+    DBG(DBG_SHAPE, lvl, {
         assert(tuple2str(prev, ndim, sizeof(*prev), "%d", buff, BUFF_SIZE) > 0);
-        printf("%s -> ", buff);
+        dbg("%s -> ", buff);
         assert(tuple2str(shape, ndim, sizeof(*shape), "%d", buff, BUFF_SIZE) > 0);
-        printf("%s", buff);
-        free(prev);
+        dbg("%s", buff);
     });
+    scratch_reset(m);
 
     return dim;
 }
@@ -267,7 +692,7 @@ dim_t resolve_shape(uint32_t numel, dim_t ndim, dim_sz_t *shape) {
  */
 dim_t resolve_dim(dim_t ndim, dim_t dim) {
     dim_t d = dim >= 0 ? dim : dim + ndim;
-    DBG(3, { printf("%d [0..%d] -> %d", dim, ndim, d); });
+    DBG(DBG_SHAPE, 3, { dbg("%d [0..%d] -> %d", dim, ndim, d); });
     assert(d < ndim);
     return d;
 }
@@ -292,20 +717,17 @@ tensor_t *reshape(tensor_t *t, dim_t ndim, dim_sz_t *shape) {
     //       according to ChatGPT: https://chatgpt.com/share/68d57068-038c-8004-bb0b-56be52f7577a
     //       keeping it simple for now but definitely interesting to explore
     bool c = is_contiguous(t);
-    DBG(1, {
+    DBG(DBG_SHAPE, 1, {
         assert(tinfo2str(t, buff, BUFF_SIZE) > 0);
-        printf("%s %s", buff, c ? GRN "stride only" RST : RED "copy" RST);
+        dbg("%s %s", buff, c ? GRN "stride only" RST : RED "copy" RST);
     });
     if (!c) contiguous(t);
 
-    t->stride = realloc(t->stride, ndim * sizeof(*t->stride));
-    assert(t->stride != NULL);
+    tresize(t, ndim);
     t->stride[ndim-1] = 1;
     for (dim_t i = ndim-2; i >= 0; i--) t->stride[i] = t->stride[i+1] * shape[i+1];
 
     t->ndim = ndim;
-    t->shape = realloc(t->shape, t->ndim * sizeof(*t->shape));
-    assert(t->shape != NULL);
     memcpy(t->shape, shape, ndim * sizeof(*shape));
 
     return t;
@@ -330,31 +752,42 @@ uint8_t broadcast(dim_t andim, dim_sz_t *asrc, dim_sz_t **adst, dim_t bndim, dim
     assert(bsrc != NULL);
 
     dim_t ndim = MAX(andim, bndim);
-    dim_t offa = ndim - andim, offb = ndim - bndim;
+    dim_sz_t *ashape = NULL, *bshape = NULL;
+    if (adst != NULL) {
+        ashape = malloc(ndim * sizeof(*asrc));
+        assert(ashape != NULL);
+    }
+    if (bdst != NULL) {
+        bshape = malloc(ndim * sizeof(*bsrc));
+        assert(bshape != NULL);
+    }
+
+    ndim = broadcast_into(andim, asrc, ashape, bndim, bsrc, bshape);
+    if (ndim == 0) {
+        free(ashape);
+        free(bshape);
+        ashape = bshape = NULL;
+    }
+    if (adst != NULL) *adst = ashape;
+    if (bdst != NULL) *bdst = bshape;
+
+    return ndim;
+}
 
-    dim_sz_t *ashape = malloc(ndim * sizeof(*asrc));
-    assert(ashape != NULL);
-    dim_sz_t *bshape = malloc(ndim * sizeof(*bsrc));
-    assert(bshape != NULL);
+// same as broadcast but writes the new shapes into caller provided buffers of MAX(andim, bndim) elements (or NULL)
+static uint8_t broadcast_into(dim_t andim, dim_sz_t *asrc, dim_sz_t *adst, dim_t bndim, dim_sz_t *bsrc, dim_sz_t *bdst) {
+    dim_t ndim = MAX(andim, bndim);
+    dim_t offa = ndim - andim, offb = ndim - bndim;
 
     // align each shape src to the right and check if each of their size match (or is 1)
     for (dim_t i = 0; i < ndim; i++) {
         dim_sz_t sa = i < offa ? 1 : asrc[i - offa];
         dim_sz_t sb = i < offb ? 1 : bsrc[i - offb];
-        if (sa != sb && sa != 1 && sb != 1) {
-            free(ashape);
-            free(bshape);
-            return 0;
-        }
-        ashape[i] = sa;
-        bshape[i] = sb;
+        if (sa != sb && sa != 1 && sb != 1) return 0;
+        if (adst != NULL) adst[i] = sa;
+        if (bdst != NULL) bdst[i] = sb;
     }
 
-    if (adst != NULL) *adst = ashape;
-    else free(ashape);
-    if (bdst != NULL) *bdst = bshape;
-    else free(bshape);
-
     return ndim;
 }
 
@@ -395,32 +828,219 @@ tensor_t *unsqueeze(tensor_t *t, dim_t dim) {
     dim_t ndim = t->ndim + 1;
     dim_t d = resolve_dim(ndim, dim);
 
-    dim_sz_t *shape = malloc(ndim * sizeof(*shape));
-    assert(shape != NULL);
-    memcpy(shape, t->shape, t->ndim * sizeof(*shape));
-
-    stride_t *stride = malloc(ndim * sizeof(*stride));
-    assert(stride != NULL);
-    memcpy(stride, t->stride, t->ndim * sizeof(*stride));
+    // grow in place (inline storage up to TENSOR_INLINE_DIM dims) and shift the trailing dims
+    tresize(t, ndim);
 
     for (dim_t i = t->ndim; i > d; i--) {
-        shape[i] = shape[i-1];
-        stride[i] = stride[i-1];
+        t->shape[i] = t->shape[i-1];
+        t->stride[i] = t->stride[i-1];
     }
-    shape[d] = 1;
-    stride[d] = d+1 < ndim ? shape[d+1] * stride[d+1] : 1;
-
-    free(t->shape);
-    t->shape = shape;
-    free(t->stride);
-    t->stride = stride;
+    t->shape[d] = 1;
+    t->stride[d] = d+1 < ndim ? t->shape[d+1] * t->stride[d+1] : 1;
     t->ndim = ndim;
 
     return t;
 }
 
+// broadcasts the shapes of n tensors together into shape (room for the largest ndim); returns the number of dims
+// of the result or 0 if the shapes are not compatible
+static dim_t broadcast_shapes(uint32_t n, tensor_t *const *ts, dim_sz_t *shape) {
+    dim_t ndim = 0;
+    for (uint32_t k = 0; k < n; k++) ndim = MAX(ndim, ts[k]->ndim);
+    for (dim_t d = 0; d < ndim; d++) {
+        shape[d] = 1;
+        for (uint32_t k = 0; k < n; k++) {
+            dim_t off = ndim - ts[k]->ndim;
+            dim_sz_t sz = d < off ? 1 : ts[k]->shape[d - off];
+            if (sz == 1) continue;
+            if (shape[d] != 1 && shape[d] != sz) return 0;
+            shape[d] = sz;
+        }
+    }
+    return ndim;
+}
+
+// strides to read t as if it had the (broadcast compatible) shape of ndim dims: size 1 dims that get
+// broadcast and the missing leading dims get stride 0 (allocated from the scratch arena)
+static stride_t *expand_strides(tensor_t *t, dim_t ndim, const dim_sz_t *shape) {
+    assert(ndim >= t->ndim);
+    stride_t *stride = scratch_alloc(ndim * sizeof(*stride));
+    dim_t off = ndim - t->ndim;
+    for (dim_t d = 0; d < ndim; d++) {
+        if (d < off) stride[d] = 0;
+        else if (t->shape[d - off] == 1 && shape[d] != 1) stride[d] = 0;
+        else stride[d] = t->stride[d - off];
+    }
+    return stride;
+}
+
+/**
+ * Returns a view of the tensor broadcast to a bigger shape (without copying data).
+ * Dims of size 1 (and new leading dims) can be expanded to any size and are read with stride 0;
+ * a size of -1 keeps the size of the existing dim.
+ *
+ * @param t tensor to expand
+ * @param ndim number of dimensions of the new shape (at least t->ndim)
+ * @param shape new shape
+ * @return new tensor sharing t's data
+ */
+tensor_t *expand(tensor_t *t, dim_t ndim, dim_sz_t *shape) {
+    assert(t != NULL);
+    assert(shape != NULL);
+    assert(ndim >= t->ndim);
+
+    dim_t off = ndim - t->ndim;
+    tensor_t *v = tview(__func__, t, ndim);
+    v->numel = 1;
+    for (dim_t d = 0; d < ndim; d++) {
+        dim_sz_t src = d < off ? 1 : t->shape[d - off];
+        dim_sz_t sz = shape[d] < 0 && d >= off ? src : shape[d];
+        assert(sz > 0);
+        assert(sz == src || src == 1);
+        v->shape[d] = sz;
+        v->stride[d] = sz == src && d >= off ? t->stride[d - off] : 0;
+        v->numel *= sz;
+    }
+
+    DBG(DBG_SHAPE, 1, {
+        assert(tinfo2str(t, buff, BUFF_SIZE) > 0);
+        dbg("%s -> ", buff);
+        assert(tinfo2str(v, buff, BUFF_SIZE) > 0);
+        dbg("%s", buff);
+    });
+
+    return v;
+}
+
+/**
+ * Returns a view of the tensor with its dimensions reordered (without copying data); dimension i of the
+ * result is dimension perm[i] of t
+ *
+ * @param t tensor to permute
+ * @param perm new order of the dimensions (t->ndim elements, negative dims allowed)
+ * @return new tensor sharing t's data
+ */
+tensor_t *permute(tensor_t *t, dim_t *perm) {
+    assert(t != NULL);
+    assert(perm != NULL);
+
+    scratch_mark_t m = scratch_mark();
+    bool *seen = scratch_alloc(t->ndim * sizeof(*seen));
+    memset(seen, 0, t->ndim * sizeof(*seen));
+
+    tensor_t *v = tview(__func__, t, t->ndim);
+    for (dim_t i = 0; i < t->ndim; i++) {
+        dim_t d = resolve_dim(t->ndim, perm[i]);
+        assert(!seen[d]); // every dim must appear exactly once
+        seen[d] = true;
+        v->shape[i] = t->shape[d];
+        v->stride[i] = t->stride[d];
+    }
+    scratch_reset(m);
+
+    DBG(DBG_SHAPE, 1, {
+        assert(tinfo2str(t, buff, BUFF_SIZE) > 0);
+        dbg("%s -> ", buff);
+        assert(tinfo2str(v, buff, BUFF_SIZE) > 0);
+        dbg("%s", buff);
+    });
+
+    return v;
+}
+
+/**
+ * Returns a view of the elements [start, stop) of a dimension taking every step-th element (without copying data).
+ * Negative start/stop count from the end of the dimension and both are clamped to it (like python slices).
+ *
+ * @param t tensor to slice
+ * @param dim dimension to slice
+ * @param start first index (inclusive)
+ * @param stop last index (exclusive)
+ * @param step distance between taken indices (> 0)
+ * @return new tensor sharing t's data
+ */
+tensor_t *slice(tensor_t *t, dim_t dim, dim_sz_t start, dim_sz_t stop, dim_sz_t step) {
+    assert(t != NULL);
+    assert(step > 0);
+    dim = resolve_dim(t->ndim, dim);
+
+    dim_sz_t sz = t->shape[dim];
+    if (start < 0) start += sz;
+    if (stop < 0) stop += sz;
+    start = MIN(MAX(start, 0), sz);
+    stop = MIN(MAX(stop, start), sz);
+    dim_sz_t len = (stop - start + step - 1) / step;
+    assert(len > 0); // tensors can't have empty dims
+
+    tensor_t *v = tview(__func__, t, t->ndim);
+    memcpy(v->shape, t->shape, t->ndim * sizeof(*t->shape));
+    memcpy(v->stride, t->stride, t->ndim * sizeof(*t->stride));
+    v->data = t->data + (size_t) start * t->stride[dim]; // the storage offset lives in the data pointer
+    v->shape[dim] = len;
+    v->stride[dim] = t->stride[dim] * step;
+    v->numel = t->numel / sz * len;
+
+    DBG(DBG_SHAPE, 1, {
+        assert(tinfo2str(t, buff, BUFF_SIZE) > 0);
+        dbg("%s [%d] %d:%d:%d -> ", buff, dim, start, stop, step);
+        assert(tinfo2str(v, buff, BUFF_SIZE) > 0);
+        dbg("%s", buff);
+    });
+
+    return v;
+}
+
+/**
+ * Returns a view of length elements of a dimension starting at start (same as slice(t, dim, start, start + length, 1))
+ *
+ * @param t tensor to narrow
+ * @param dim dimension to narrow
+ * @param start first index (negative counts from the end)
+ * @param length number of elements to keep
+ * @return new tensor sharing t's data
+ */
+tensor_t *narrow(tensor_t *t, dim_t dim, dim_sz_t start, dim_sz_t length) {
+    assert(t != NULL);
+    assert(length > 0);
+    dim = resolve_dim(t->ndim, dim);
+    if (start < 0) start += t->shape[dim];
+    assert(start >= 0 && start + length <= t->shape[dim]);
+    return slice(t, dim, start, start + length, 1);
+}
+
+/**
+ * Returns a view of a single index of a dimension, removing that dimension (1-d tensors keep a dimension of size 1)
+ *
+ * @param t tensor to select from
+ * @param dim dimension to select from
+ * @param index index to select (negative counts from the end)
+ * @return new tensor sharing t's data
+ */
+tensor_t *tselect(tensor_t *t, dim_t dim, dim_sz_t index) {
+    assert(t != NULL);
+    dim = resolve_dim(t->ndim, dim);
+    if (index < 0) index += t->shape[dim];
+    assert(index >= 0 && index < t->shape[dim]);
+    return squeeze(slice(t, dim, index, index + 1, 1), dim);
+}
+
 // TODO: add argmin/argmax and amin/amax
-// TODO: min/max functions can be simplified with ops (they are the exact same except for one symbol; like ewop)
+
+// folds every element of t with a reduction kernel (resolved once for the layout of the innermost run)
+static float reduce(tensor_t *t, tensor_op_t op, float init) {
+    scratch_mark_t m = scratch_mark();
+    iter_t it;
+    iter_init(&it, t->ndim, t->shape, 1, &t->stride);
+    dim_sz_t n = ITER_RUN(&it);
+    stride_t s = ITER_STRIDE(&it, 0);
+    reduce_fn_t fn = kernel_resolve(op, DTYPE_F32, layout_of(1, &s)).reduce;
+    float acc = init;
+    do {
+        acc = fn(t->data + it.off[0], s, n, acc);
+    } while (iter_next(&it));
+    scratch_reset(m);
+    return acc;
+}
 
 /**
  * Returns the minimum value in a tensor
@@ -433,13 +1053,12 @@ tensor_t *min(tensor_t *t) {
     assert(t->shape != NULL);
     assert(t->data != NULL);
     assert(t->numel >= 1);
-    tensor_t *r = tensor_alloc(1, (dim_sz_t[]){1});
-    float m = t->data[0];
-    for (uint32_t i = 1; i < t->numel; i++) if (t->data[i] < m) m = t->data[i];
+    tensor_t *r = talloc(__func__, 1, (dim_sz_t[]){1});
+    float m = reduce(t, OP_MIN, t->data[0]);
     *r->data = m;
-    DBG(1, {
+    DBG(DBG_REDUCE, 1, {
         assert(tinfo2str(t, buff, BUFF_SIZE) != 0);
-        printf("%s -> %f", buff, m);
+        dbg("%s -> %f", buff, m);
     });
     return r;
 }
@@ -455,13 +1074,12 @@ tensor_t *max(tensor_t *t) {
     assert(t->shape != NULL);
     assert(t->data != NULL);
     assert(t->numel >= 1);
-    tensor_t *r = tensor_alloc(1, (dim_sz_t[]){1});
-    float m = t->data[0];
-    for (uint32_t i = 1; i < t->numel; i++) if (t->data[i] > m) m = t->data[i];
+    tensor_t *r = talloc(__func__, 1, (dim_sz_t[]){1});
+    float m = reduce(t, OP_MAX, t->data[0]);
     *r->data = m;
-    DBG(1, {
+    DBG(DBG_REDUCE, 1, {
         assert(tinfo2str(t, buff, BUFF_SIZE) != 0);
-        printf("%s -> %f", buff, m);
+        dbg("%s -> %f", buff, m);
     });
     return r;
 }
@@ -476,23 +1094,11 @@ tensor_t *sumall(tensor_t *t) {
     assert(t != NULL);
     assert(t->shape != NULL);
     assert(t->data != NULL);
-    tensor_t *r = tensor_alloc(1, (dim_sz_t[]){1});
-    float acc = 0;
-    for (uint32_t i = 0; i < t->numel; i++) acc += t->data[i];
-    *r->data = acc;
+    tensor_t *r = talloc(__func__, 1, (dim_sz_t[]){1});
+    *r->data = reduce(t, OP_SUM, 0);
     return r;
 }
 
-
-
-
-
-// **** code below does not work/untested with strides
-
-
-
-
-
 /**
  * Returns the sum of all the elements along the specified dimension of a tensor
  * 
@@ -507,98 +1113,77 @@ tensor_t *sum(tensor_t *t, dim_t dim, bool keepdim) {
     assert(t->data != NULL);
 
     dim = resolve_dim(t->ndim, dim);
-    dim_sz_t *shape = malloc(t->ndim * sizeof(*shape));
-    assert(shape != NULL);
+    scratch_mark_t m = scratch_mark();
+    dim_sz_t *shape = scratch_alloc(t->ndim * sizeof(*shape));
     memcpy(shape, t->shape, t->ndim * sizeof(*shape));
     shape[dim] = 1;
-    tensor_t *r = tensor_alloc(t->ndim, shape);
-    free(shape);
-
-    // dim_t *index = malloc(t->ndim * sizeof(*index));
-    // assert(index != NULL);
-    // memset(index, 0, t->ndim * sizeof(*index));
-
-    // for (uint32_t i = 0; i < t->numel; i++) {
-    //     assert(tuple2str(index, t->ndim, sizeof(*index), "%u", buff, BUFF_SIZE) > 0);
-    //     printf("%3u: %s\n", i, buff);
-    //     for (dim_t j = t->ndim-1; j >= 0; j--) {
-    //         if (++index[j] < t->shape[j]) break;
-    //         index[j] = 0;
-    //     }
-    // }
-
-    // TODO: write about new reduce implementation in sum.ipynb
-    uint32_t outer = 1, dimsz = t->shape[dim], inner = 1;
-    for (dim_t i = 0; i < dim; i++) outer *= t->shape[i];
-    for (dim_t i = dim+1; i < t->ndim; i++) inner *= t->shape[i];
-
-    uint32_t ostride = dim == 0 ? 1 : t->stride[dim-1];
-    uint32_t dstride = t->stride[dim];
-    uint32_t istride = dim == t->ndim-1 ? 1 : t->stride[dim+1];
-    // istride = 1;
-
-    tinfo(t);
-    printf("    dim: %d\n", dim);
-    printf("  outer: %d\n", outer);
-    printf("  dimsz: %d\n", dimsz);
-    printf("  inner: %d\n", inner);
-    printf("ostride: %d\n", ostride);
-    printf("dstride: %d\n", dstride);
-    printf("istride: %d\n", istride);
-
-    for (uint32_t o = 0; o < outer; o++) {
-        for (uint32_t i = 0; i < inner; i++) {
-            float acc = 0;
-            printf("r[%d] = ", o * inner + i);
-            for (uint32_t d = 0; d < dimsz; d++) {
-                // uint32_t idx = o * dimsz * inner + d * inner + i;
-                uint32_t idx = o * ostride + d * dstride + i * istride;
-                printf("%2d", idx);
-                // acc += t->data[idx];
-                if (d < dimsz-1) printf(" + ");
-            }
-            printf("\n");
-            r->data[o * inner + i] = acc;
-        }
-    }
+    tensor_t *r = talloc(__func__, t->ndim, shape);
+
+    // walk the output (the summed dim has size 1 so the iterator skips it) and add every slice along dim into it;
+    // the summed dim is the outer loop so the inner one runs over a whole row of the output
+    iter_t it;
+    iter_init(&it, t->ndim, r->shape, 2, (stride_t *[]){r->stride, t->stride});
+    dim_sz_t n = ITER_RUN(&it), dimsz = t->shape[dim];
+    stride_t rs = ITER_STRIDE(&it, 0), ts = ITER_STRIDE(&it, 1), ds = t->stride[dim];
+    binary_fn_t add = kernel_resolve(OP_ADD, DTYPE_F32, layout_of(3, (stride_t[]){rs, rs, ts})).binary;
+    do {
+        float *dst = r->data + it.off[0];
+        const float *src = t->data + it.off[1];
+        for (dim_sz_t i = 0; i < n; i++) dst[i * rs] = 0;
+        for (dim_sz_t d = 0; d < dimsz; d++) add(dst, dst, rs, src + d * ds, ts, n);
+    } while (iter_next(&it));
+    scratch_reset(m);
+
+    DBG(DBG_REDUCE, 1, {
+        assert(tinfo2str(t, buff, BUFF_SIZE) != 0);
+        dbg("%s dim=%d keepdim=%d", buff, dim, keepdim);
+    });
 
     return keepdim ? r : squeeze(r, dim);
 }
 
 // element wise operation
+typedef struct {
+    binary_fn_t fn;
+    float *dst;
+    const float *a, *b;
+    stride_t as, bs;
+} binary_ctx_t;
+
+static void binary_chunk(void *ctx, size_t start, size_t end) {
+    binary_ctx_t *c = ctx;
+    c->fn(c->dst + start, c->a + start * c->as, c->as, c->b + start * c->bs, c->bs, end - start);
+}
+
 static tensor_t *ewop(tensor_t *a, tensor_t *b, tensor_op_t op) {
     assert(a != NULL);
     assert(b != NULL);
-
-    dim_sz_t *ashape, *bshape;
-    dim_t ndim = broadcast(a->ndim, a->shape, &ashape, b->ndim, b->shape, &bshape);
+    assert(OP_IS_BINARY(op));
+
+    // broadcasted dims of a and b are read with stride 0; c is contiguous so its runs have stride 1
+    scratch_mark_t m = scratch_mark();
+    dim_sz_t *cshape;
+    iter_t it;
+    kernel_t fn;
+    dim_t ndim = ew_plan(op, 2, (tensor_t *[]){a, b}, &cshape, &it, &fn);
     assert(ndim > 0);
+    tensor_t *c = talloc(opnames[op], ndim, cshape);
+    DBG(DBG_EWOP, 1, {
+        assert(tinfo2str(a, buff, BUFF_SIZE) != 0);
+        dbg("%s %s ", buff, opnames[op]);
+        assert(tinfo2str(b, buff, BUFF_SIZE) != 0);
+        dbg("%s", buff);
+    });
 
-    dim_sz_t *cshape = malloc(ndim * sizeof(*cshape));
-    assert(cshape != NULL);
-    for (dim_t i = 0; i < ndim; i++) cshape[i] = MAX(ashape[i], bshape[i]);
-    tensor_t *c = tensor_alloc(ndim, cshape);
-    free(ashape);
-    free(bshape);
-    free(cshape);
-
-    for (uint32_t cidx = 0; cidx < c->numel; cidx++) {
-        float aval = a->data[cidx % a->numel];
-        float bval = b->data[cidx % b->numel];
-        switch (op) {
-            case OP_ADD: {
-                c->data[cidx] = aval + bval;
-                break;
-            }
-            case OP_MUL: {
-                c->data[cidx] = aval * bval;
-                break;
-            }
-            default: {
-                break;
-            }
-        }
-    }
+    dim_sz_t n = ITER_RUN(&it);
+    binary_ctx_t ctx = { .fn = fn.binary, .as = ITER_STRIDE(&it, 1), .bs = ITER_STRIDE(&it, 2) };
+    do {
+        ctx.dst = c->data + it.off[0];
+        ctx.a = a->data + it.off[1];
+        ctx.b = b->data + it.off[2];
+        parallel_for(n, BINARY_GRAIN, binary_chunk, &ctx);
+    } while (iter_next(&it));
+    scratch_reset(m);
 
     return c;
 }
@@ -611,32 +1196,2027 @@ tensor_t *mul(tensor_t *a, tensor_t *b) {
     return ewop(a, b, OP_MUL);
 }
 
-/************************* HELPER FUNCTIONS *************************/
+tensor_t *sub(tensor_t *a, tensor_t *b) {
+    return ewop(a, b, OP_SUB);
+}
 
-static uint8_t int_digits(double a) {
-    uint8_t n = (uint8_t) fabs(a);
-    if (n == 0) return 1;
-    return (uint8_t) log10(n) + 1;
+tensor_t *tdiv(tensor_t *a, tensor_t *b) {
+    return ewop(a, b, OP_DIV);
 }
 
-static bool has_decimals(double x) {
-    double intpart;
-    double frac = modf(x, &intpart);
-    return frac != 0.0;
+// powf element by element (not vectorized)
+tensor_t *tpow(tensor_t *a, tensor_t *b) {
+    return ewop(a, b, OP_POW);
 }
 
-static size_t tuple2str(void *tuple, const size_t numel, const size_t szel, const char *const fmtel, char *dst, const size_t dstlen) {
-    int w = 0; // number of written characters by snprintf
-    size_t o = 0; // dst current offset and length
+// elementwise max (nan if either element is nan)
+tensor_t *maximum(tensor_t *a, tensor_t *b) {
+    return ewop(a, b, OP_MAXIMUM);
+}
 
-    w = snprintf(&dst[o], dstlen-o, "(");
-    if (w < 0 || o+w+1 >= dstlen) return 0;
-    o += w;
+// elementwise min (nan if either element is nan)
+tensor_t *minimum(tensor_t *a, tensor_t *b) {
+    return ewop(a, b, OP_MINIMUM);
+}
 
-    for (size_t i = 0; i < numel; i++) {
-        if (szel == 0 || tuple == NULL) {
-            w = snprintf(&dst[o], dstlen-o, "%s", fmtel);
-        } else if (szel == sizeof(uint8_t)) {
+// 1 where a == b, 0 elsewhere
+tensor_t *eq(tensor_t *a, tensor_t *b) {
+    return ewop(a, b, OP_EQ);
+}
+
+// 1 where a < b, 0 elsewhere
+tensor_t *lt(tensor_t *a, tensor_t *b) {
+    return ewop(a, b, OP_LT);
+}
+
+// 1 where a > b, 0 elsewhere
+tensor_t *gt(tensor_t *a, tensor_t *b) {
+    return ewop(a, b, OP_GT);
+}
+
+/**
+ * Selects elements from a where cond is not 0 and from b elsewhere (the three tensors are broadcast together)
+ *
+ * @param cond condition (usually a mask from eq/lt/gt)
+ * @param a elements where cond != 0
+ * @param b elements where cond == 0
+ * @return tensor with the selected elements
+ */
+tensor_t *where(tensor_t *cond, tensor_t *a, tensor_t *b) {
+    assert(cond != NULL && a != NULL && b != NULL);
+
+    scratch_mark_t m = scratch_mark();
+    dim_sz_t *shape;
+    iter_t it;
+    kernel_t fn;
+    dim_t ndim = ew_plan(OP_WHERE, 3, (tensor_t *[]){cond, a, b}, &shape, &it, &fn);
+    assert(ndim > 0);
+    tensor_t *r = talloc(__func__, ndim, shape);
+    DBG(DBG_EWOP, 1, {
+        assert(tinfo2str(cond, buff, BUFF_SIZE) != 0);
+        dbg("%s ? ", buff);
+        assert(tinfo2str(a, buff, BUFF_SIZE) != 0);
+        dbg("%s : ", buff);
+        assert(tinfo2str(b, buff, BUFF_SIZE) != 0);
+        dbg("%s", buff);
+    });
+
+    dim_sz_t n = ITER_RUN(&it);
+    stride_t cs = ITER_STRIDE(&it, 1), as = ITER_STRIDE(&it, 2), bs = ITER_STRIDE(&it, 3);
+    do {
+        fn.ternary(r->data + it.off[0], cond->data + it.off[1], cs, a->data + it.off[2], as, b->data + it.off[3], bs, n);
+    } while (iter_next(&it));
+    scratch_reset(m);
+
+    return r;
+}
+
+typedef struct {
+    unary_fn_t fn;
+    bool fast;
+    float *dst;
+    const float *src;
+} unary_ctx_t;
+
+static void unary_chunk(void *ctx, size_t start, size_t end) {
+    unary_ctx_t *c = ctx;
+    c->fn(c->dst + start, c->src + start, end - start, c->fast);
+}
+
+// applies a unary op elementwise (vectorized; max error of the approximations against a double reference, in ulps
+// rounded to whole ones, measured over all floats by test_ulp_sweep with make ulp; 0 is correctly rounded):
+//
+//            exact   fast
+//   exp        1      73    (fast: inputs clamped to [-87, 88])
+//   log        1     207    (fast: positive normal inputs only)
+//   tanh       2      26
+//   sigmoid    3      72    (fast: inputs clamped to [-87, 88])
+//   sqrt       0       0
+//   relu       0       0
+//
+// without AVX2 every op goes through libm one element at a time
+static tensor_t *uop(tensor_t *t, tensor_op_t op) {
+    assert(t != NULL);
+    assert(OP_IS_UNARY(op));
+
+    // r is contiguous so its runs always have stride 1; strided runs of t are gathered first
+    scratch_mark_t m = scratch_mark();
+    dim_sz_t *shape;
+    iter_t it;
+    kernel_t fn;
+    dim_t ndim = ew_plan(op, 1, &t, &shape, &it, &fn);
+    tensor_t *r = talloc(opnames[op], ndim, shape);
+    DBG(DBG_EWOP, 1, {
+        assert(tinfo2str(t, buff, BUFF_SIZE) != 0);
+        dbg("%s %s", opnames[op], buff);
+    });
+
+    dim_sz_t n = ITER_RUN(&it);
+    stride_t ts = ITER_STRIDE(&it, 1);
+    unary_ctx_t ctx = { .fn = fn.unary, .fast = tensor_fast_math() };
+    float tile[UNARY_TILE];
+    do {
+        float *rp = r->data + it.off[0];
+        const float *tp = t->data + it.off[1];
+        if (ts == 1) {
+            ctx.dst = rp;
+            ctx.src = tp;
+            parallel_for(n, UNARY_GRAIN, unary_chunk, &ctx);
+        } else {
+            for (dim_sz_t i = 0; i < n; i += UNARY_TILE) {
+                dim_sz_t len = MIN(UNARY_TILE, n - i);
+                for (dim_sz_t j = 0; j < len; j++) tile[j] = tp[(i + j) * ts];
+                ctx.fn(rp + i, tile, len, ctx.fast);
+            }
+        }
+    } while (iter_next(&it));
+    scratch_reset(m);
+
+    return r;
+}
+
+tensor_t *texp(tensor_t *t) {
+    return uop(t, OP_EXP);
+}
+
+tensor_t *tlog(tensor_t *t) {
+    return uop(t, OP_LOG);
+}
+
+tensor_t *ttanh(tensor_t *t) {
+    return uop(t, OP_TANH);
+}
+
+tensor_t *sigmoid(tensor_t *t) {
+    return uop(t, OP_SIGMOID);
+}
+
+tensor_t *tsqrt(tensor_t *t) {
+    return uop(t, OP_SQRT);
+}
+
+tensor_t *relu(tensor_t *t) {
+    return uop(t, OP_RELU);
+}
+
+// x * sigmoid(2u) with u = sqrt(2/pi) * (x + 0.044715 x^3), the same as 0.5x(1 + tanh(u)) without its cancellation
+tensor_t *gelu(tensor_t *t) {
+    return uop(t, OP_GELU);
+}
+
+typedef struct {
+    uint32_t ninputs, ninstr;
+    const ew_instr_t *prog;
+    kernel_t fn[EW_MAX_INSTR]; // kernel of every instruction
+    bool fast;
+    float *dst; // current run of the output (stride 1)
+    const float *src[EW_MAX_INPUTS]; // current run of every input
+    stride_t stride[EW_MAX_INPUTS];
+} ew_ctx_t;
+
+// runs the program over [start, end) of the current run, EW_TILE elements at a time: inputs are read in place
+// (with their strides), intermediate registers live in a tile on the stack and the last instruction writes
+// straight to the output
+static void ew_chunk(void *ctx, size_t start, size_t end) {
+    ew_ctx_t *c = ctx;
+    float tiles[EW_MAX_INSTR][EW_TILE];
+    float gather[EW_TILE];
+    const float *reg[EW_MAX_INPUTS + EW_MAX_INSTR];
+    stride_t rs[EW_MAX_INPUTS + EW_MAX_INSTR];
+
+    for (size_t i = start; i < end; i += EW_TILE) {
+        size_t n = MIN(EW_TILE, end - i);
+        for (uint32_t k = 0; k < c->ninputs; k++) {
+            reg[k] = c->src[k] + i * c->stride[k];
+            rs[k] = c->stride[k];
+        }
+        for (uint32_t k = 0; k < c->ninstr; k++) {
+            const ew_instr_t *in = &c->prog[k];
+            uint32_t r = c->ninputs + k;
+            float *dst = k == c->ninstr - 1 ? c->dst + i : tiles[k];
+            if (in->op == OP_CONST) {
+                // constants are read with stride 0, only the output needs them spelled out
+                if (k == c->ninstr - 1) k_fill(dst, n, in->imm);
+                reg[r] = &in->imm;
+                rs[r] = 0;
+                continue;
+            }
+            if (OP_IS_BINARY(in->op)) {
+                c->fn[k].binary(dst, reg[in->a], rs[in->a], reg[in->b], rs[in->b], n);
+            } else if (OP_IS_UNARY(in->op)) {
+                const float *src = reg[in->a];
+                if (rs[in->a] != 1) {
+                    for (size_t j = 0; j < n; j++) gather[j] = src[j * rs[in->a]];
+                    src = gather;
+                }
+                c->fn[k].unary(dst, src, n, c->fast);
+            } else {
+                c->fn[k].ternary(dst, reg[in->a], rs[in->a], reg[in->b], rs[in->b], reg[in->c], rs[in->c], n);
+            }
+            reg[r] = dst;
+            rs[r] = 1;
+        }
+    }
+}
+
+/**
+ * Evaluates an elementwise program over broadcast inputs in a single pass (no intermediate tensors).
+ * Example: a * x + b with x of shape (n, k) and a, b of shape (k):
+ *     ewprog(3, (tensor_t *[]){x, a, b}, 1, (ew_instr_t[]){{ .op = OP_FMA, .a = 0, .b = 1, .c = 2 }})
+ *
+ * @param ninputs number of input tensors (at most EW_MAX_INPUTS)
+ * @param inputs input tensors (broadcast together)
+ * @param ninstr number of instructions (at most EW_MAX_INSTR)
+ * @param prog instructions (see ew_instr_t)
+ * @return tensor with the value of the last instruction
+ */
+tensor_t *ewprog(uint32_t ninputs, tensor_t **inputs, uint32_t ninstr, const ew_instr_t *prog) {
+    assert(ninputs > 0 && ninputs <= EW_MAX_INPUTS);
+    assert(ninstr > 0 && ninstr <= EW_MAX_INSTR);
+    assert(inputs != NULL && prog != NULL);
+    for (uint32_t k = 0; k < ninstr; k++) {
+        // operands can only be inputs or the results of earlier instructions
+        tensor_op_t op = prog[k].op;
+        uint32_t nargs = op == OP_CONST ? 0 : OP_IS_BINARY(op) ? 2 : OP_IS_UNARY(op) ? 1 : 3;
+        assert(op <= OP_CONST);
+        assert(nargs < 1 || prog[k].a < ninputs + k);
+        assert(nargs < 2 || prog[k].b < ninputs + k);
+        assert(nargs < 3 || prog[k].c < ninputs + k);
+    }
+
+    for (uint32_t k = 0; k < ninputs; k++) assert(inputs[k] != NULL);
+
+    // the plan only covers the iteration (OP_CONST stands for any program), kernels are resolved below
+    scratch_mark_t m = scratch_mark();
+    dim_sz_t *shape;
+    iter_t it;
+    kernel_t none;
+    dim_t ndim = ew_plan(OP_CONST, ninputs, inputs, &shape, &it, &none);
+    assert(ndim > 0);
+    tensor_t *r = talloc(ninstr == 1 ? opnames[prog[0].op] : __func__, ndim, shape);
+    DBG(DBG_EWOP, 1, {
+        dbg("ninputs=%u ninstr=%u ", ninputs, ninstr);
+        for (uint32_t k = 0; k < ninstr; k++) dbg("%s%s", k > 0 ? "," : "", opnames[prog[k].op]);
+        assert(tinfo2str(r, buff, BUFF_SIZE) != 0);
+        dbg(" -> %s", buff);
+    });
+
+    dim_sz_t n = ITER_RUN(&it);
+    ew_ctx_t ctx = { .ninputs = ninputs, .ninstr = ninstr, .prog = prog, .fast = tensor_fast_math() };
+    for (uint32_t k = 0; k < ninputs; k++) ctx.stride[k] = ITER_STRIDE(&it, k + 1);
+
+    // the stride of every register is known up front (inputs keep theirs, constants are 0 and results 1), so
+    // every kernel is resolved here and not per tile
+    stride_t rs[EW_MAX_INPUTS + EW_MAX_INSTR];
+    memcpy(rs, ctx.stride, ninputs * sizeof(*rs));
+    for (uint32_t k = 0; k < ninstr; k++) {
+        const ew_instr_t *in = &prog[k];
+        rs[ninputs + k] = in->op == OP_CONST ? 0 : 1;
+        if (in->op == OP_CONST) continue;
+        layout_t l = OP_IS_UNARY(in->op) ? LAYOUT_CONTIGUOUS // strided operands are gathered
+                   : OP_IS_BINARY(in->op) ? layout_of(2, (stride_t[]){rs[in->a], rs[in->b]})
+                   : layout_of(3, (stride_t[]){rs[in->a], rs[in->b], rs[in->c]});
+        ctx.fn[k] = kernel_resolve(in->op, DTYPE_F32, l);
+    }
+    do {
+        ctx.dst = r->data + it.off[0];
+        for (uint32_t k = 0; k < ninputs; k++) ctx.src[k] = inputs[k]->data + it.off[k + 1];
+        parallel_for(n, EW_GRAIN, ew_chunk, &ctx);
+    } while (iter_next(&it));
+    scratch_reset(m);
+
+    return r;
+}
+
+/**
+ * Computes a * b + c elementwise with a single rounding (hardware fma) and in a single pass (broadcasting
+ * the three tensors together)
+ *
+ * @param a first factor
+ * @param b second factor
+ * @param c addend
+ * @return result tensor
+ */
+tensor_t *tfma(tensor_t *a, tensor_t *b, tensor_t *c) {
+    return ewprog(3, (tensor_t *[]){ a, b, c }, 1, (ew_instr_t[]){{ .op = OP_FMA, .a = 0, .b = 1, .c = 2 }});
+}
+
+typedef struct {
+    gemm_fn_t fn;
+    const float *a, *b;
+    float *c;
+    const size_t *aoff, *boff; // offset of the matrices of every batch in a and b
+    size_t m, n, k;
+    size_t ars, acs, brs, bcs; // row and column strides of the matrices of a and b
+    size_t mtiles, ntiles; // blocks of GEMM_MC rows and GEMM_NC columns per batch
+
+    // epilogue (see matmul_fused); bias and res are read like a and b, with offsets per batch and strides
+    bool epilogue;
+    float scale;
+    const float *bias, *res;
+    const size_t *biasoff, *resoff;
+    size_t biasrs, biascs, resrs, rescs;
+    ternary_fn_t bias_fn; // c * scale + bias
+    binary_fn_t scale_fn; // c * scale (no bias)
+    unary_fn_t act_fn;
+    binary_fn_t res_fn; // c + res
+    bool fast;
+} gemm_ctx_t;
+
+// applies the epilogue to the mr x nr tile of batch at row i and column j of the output while it is still in L1
+static void gemm_epilogue(const gemm_ctx_t *g, float *c, size_t batch, size_t i, size_t j, size_t mr, size_t nr) {
+    for (size_t r = 0; r < mr; r++) {
+        float *row = c + r * g->n;
+        if (g->bias != NULL) {
+            const float *bias = g->bias + g->biasoff[batch] + (i + r) * g->biasrs + j * g->biascs;
+            g->bias_fn(row, row, 1, &g->scale, 0, bias, g->biascs, nr);
+        } else if (g->scale_fn != NULL) {
+            g->scale_fn(row, row, 1, &g->scale, 0, nr);
+        }
+        if (g->act_fn != NULL) g->act_fn(row, row, nr, g->fast);
+        if (g->res != NULL) g->res_fn(row, row, 1, g->res + g->resoff[batch] + (i + r) * g->resrs + j * g->rescs, g->rescs, nr);
+    }
+}
+
+// computes the output blocks [start, end) (numbered batch by batch, then by block column and block row so
+// consecutive blocks share their panel of b); each block loops over k in steps of GEMM_KC, packing both
+// operands into the thread's scratch arena and running the micro-kernel over every GEMM_MR x GEMM_NR tile
+static void gemm_chunk(void *ctx, size_t start, size_t end) {
+    gemm_ctx_t *g = ctx;
+    scratch_mark_t m = scratch_mark();
+    float *pa = scratch_alloc(GEMM_MC * GEMM_KC * sizeof(*pa));
+    float *pb = scratch_alloc(GEMM_KC * GEMM_NC * sizeof(*pb));
+    float tile[GEMM_MR * GEMM_NR];
+    size_t packed = SIZE_MAX; // block column whose panel of b is in pb (when k fits in a single step)
+
+    for (size_t t = start; t < end; t++) {
+        size_t batch = t / (g->mtiles * g->ntiles), bt = t % (g->mtiles * g->ntiles);
+        size_t i0 = (bt % g->mtiles) * GEMM_MC, j0 = (bt / g->mtiles) * GEMM_NC;
+        size_t mc = MIN(GEMM_MC, g->m - i0), nc = MIN(GEMM_NC, g->n - j0);
+        const float *a = g->a + g->aoff[batch] + i0 * g->ars;
+        const float *b = g->b + g->boff[batch] + j0 * g->bcs;
+        float *c = g->c + batch * g->m * g->n + i0 * g->n + j0;
+
+        for (size_t p0 = 0; p0 < g->k; p0 += GEMM_KC) {
+            size_t kc = MIN(GEMM_KC, g->k - p0);
+            bool last = p0 + kc == g->k;
+            if (g->k > GEMM_KC || packed != t / g->mtiles) k_pack_b(pb, b + p0 * g->brs, g->brs, g->bcs, kc, nc);
+            packed = t / g->mtiles;
+            k_pack_a(pa, a + p0 * g->acs, g->ars, g->acs, mc, kc);
+            for (size_t jr = 0; jr < nc; jr += GEMM_NR) {
+                for (size_t ir = 0; ir < mc; ir += GEMM_MR) {
+                    const float *ap = pa + ir * kc, *bp = pb + jr * kc;
+                    float *cp = c + ir * g->n + jr;
+                    size_t mr = MIN(GEMM_MR, mc - ir), nr = MIN(GEMM_NR, nc - jr);
+                    if (mr == GEMM_MR && nr == GEMM_NR) {
+                        g->fn(kc, ap, bp, cp, g->n, p0 > 0);
+                    } else {
+                        // edge tiles go through a full tile on the stack
+                        g->fn(kc, ap, bp, tile, GEMM_NR, false);
+                        for (size_t r = 0; r < mr; r++) {
+                            for (size_t j = 0; j < nr; j++) cp[r * g->n + j] = p0 > 0 ? cp[r * g->n + j] + tile[r * GEMM_NR + j] : tile[r * GEMM_NR + j];
+                        }
+                    }
+                    if (last && g->epilogue) gemm_epilogue(g, cp, batch, i0 + ir, j0 + jr, mr, nr);
+                }
+            }
+        }
+    }
+    scratch_reset(m);
+}
+
+// runs the nbatch products of g over the threads (set up everything but the block counts first)
+static void gemm_run(gemm_ctx_t *g, size_t nbatch) {
+    g->mtiles = (g->m + GEMM_MC - 1) / GEMM_MC;
+    g->ntiles = (g->n + GEMM_NC - 1) / GEMM_NC;
+    size_t work = MIN(g->m, GEMM_MC) * MIN(g->n, GEMM_NC) * g->k; // multiply-adds per block
+    parallel_for(nbatch * g->mtiles * g->ntiles, (GEMM_GRAIN + work - 1) / work, gemm_chunk, g);
+}
+
+// offsets of the matrices of every batch (the batch dims are the first nbdim of shape and stride gives their
+// strides; 0 for broadcast dims)
+static size_t *batch_offsets(dim_t nbdim, const dim_sz_t *shape, size_t nbatch, const stride_t *stride) {
+    size_t *off = scratch_alloc(nbatch * sizeof(*off));
+    for (size_t i = 0; i < nbatch; i++) {
+        size_t rem = i;
+        off[i] = 0;
+        for (dim_t d = nbdim-1; d >= 0; d--) {
+            off[i] += (rem % shape[d]) * stride[d];
+            rem /= shape[d];
+        }
+    }
+    return off;
+}
+
+// batch offsets and row/column strides to read t broadcast to the output of a matmul (ndim dims, of which
+// the first nbdim are batch dims, followed by the rows and the columns when the output has them)
+static size_t *epilogue_operand(tensor_t *t, dim_t ndim, const dim_sz_t *shape, dim_t nbdim, size_t nbatch, bool rows, bool cols, size_t *rs, size_t *cs) {
+    assert(t->ndim <= ndim);
+    for (dim_t d = 0; d < t->ndim; d++) assert(t->shape[d] == 1 || t->shape[d] == shape[ndim - t->ndim + d]);
+    stride_t *stride = expand_strides(t, ndim, shape);
+    *rs = rows ? stride[nbdim] : 0;
+    *cs = cols ? stride[ndim-1] : 0;
+    return batch_offsets(nbdim, shape, nbatch, stride);
+}
+
+/**
+ * Matrix product over the last two dims of a and b; the leading (batch) dims are broadcast together like
+ * the elementwise ops, so a (B, H, M, K) tensor can be multiplied by a (B, H, K, N) one or by a (K, N) one
+ * expanded over the batch (read with stride 0, never copied). A 1-d a is a row vector and a 1-d b a column
+ * vector; their dim is dropped from the result.
+ * The output is split into blocks per batch and the blocks of all the batches are spread over the threads, so
+ * many small products keep every thread busy.
+ *
+ * @param a tensor of shape (..., M, K)
+ * @param b tensor of shape (..., K, N)
+ * @return tensor of shape (..., M, N)
+ */
+tensor_t *matmul(tensor_t *a, tensor_t *b) {
+    return matmul_fused(a, b, NULL);
+}
+
+/**
+ * Matrix product (see matmul) followed by an epilogue applied to each output tile right after it is computed,
+ * while it is still in cache: act(scale * (a @ b) + bias) + residual. Saves the passes over the output
+ * (and the temporary tensors) of separate mul, add and activation ops.
+ *
+ * @param a tensor of shape (..., M, K)
+ * @param b tensor of shape (..., K, N)
+ * @param ep epilogue (NULL or a zeroed one for none)
+ * @return tensor of shape (..., M, N)
+ */
+tensor_t *matmul_fused(tensor_t *a, tensor_t *b, const matmul_epilogue_t *ep) {
+    assert(a != NULL && b != NULL);
+
+    // 1-d operands are read as (1, K) and (K, 1) matrices
+    size_t m = a->ndim > 1 ? (size_t) a->shape[a->ndim-2] : 1, k = a->shape[a->ndim-1];
+    size_t ars = a->ndim > 1 ? a->stride[a->ndim-2] : 0, acs = a->stride[a->ndim-1];
+    size_t n = b->ndim > 1 ? (size_t) b->shape[b->ndim-1] : 1, kb = b->shape[MAX(b->ndim-2, 0)];
+    size_t brs = b->stride[MAX(b->ndim-2, 0)], bcs = b->ndim > 1 ? b->stride[b->ndim-1] : 0;
+    assert(k == kb);
+
+    scratch_mark_t mk = scratch_mark();
+    dim_t andim = MAX(a->ndim-2, 0), bndim = MAX(b->ndim-2, 0), nbdim = MAX(andim, bndim);
+    dim_t ndim = nbdim + (a->ndim > 1) + (b->ndim > 1);
+    dim_sz_t *shape = scratch_alloc((MAX(ndim, 1) + 2) * sizeof(*shape));
+    dim_sz_t *ashape = scratch_alloc((nbdim + 1) * sizeof(*ashape));
+    dim_sz_t *bshape = scratch_alloc((nbdim + 1) * sizeof(*bshape));
+    if (nbdim > 0) {
+        dim_t bd = broadcast_into(andim, a->shape, ashape, bndim, b->shape, bshape);
+        assert(bd == nbdim);
+        (void) bd;
+    }
+
+    // broadcast (and missing) batch dims are read with stride 0
+    size_t nbatch = 1;
+    stride_t *astride = scratch_alloc((nbdim + 1) * sizeof(*astride));
+    stride_t *bstride = scratch_alloc((nbdim + 1) * sizeof(*bstride));
+    for (dim_t d = 0; d < nbdim; d++) {
+        shape[d] = MAX(ashape[d], bshape[d]);
+        nbatch *= shape[d];
+        dim_t da = d - (nbdim - andim), db = d - (nbdim - bndim);
+        astride[d] = da >= 0 && ashape[d] > 1 ? a->stride[da] : 0;
+        bstride[d] = db >= 0 && bshape[d] > 1 ? b->stride[db] : 0;
+    }
+
+    dim_t d = nbdim;
+    if (a->ndim > 1) shape[d++] = m;
+    if (b->ndim > 1) shape[d++] = n;
+    if (ndim == 0) shape[ndim++] = 1; // vector . vector
+    tensor_t *c = talloc("matmul", ndim, shape);
+    DBG(DBG_EWOP, 1, {
+        assert(tinfo2str(a, buff, BUFF_SIZE) != 0);
+        dbg("%s @ ", buff);
+        assert(tinfo2str(b, buff, BUFF_SIZE) != 0);
+        dbg("%s%s", buff, ep != NULL ? " (fused)" : "");
+    });
+
+    gemm_ctx_t ctx = {
+        .fn = kernel_resolve(OP_MATMUL, DTYPE_F32, LAYOUT_CONTIGUOUS).gemm,
+        .a = a->data, .b = b->data, .c = c->data,
+        .aoff = batch_offsets(nbdim, shape, nbatch, astride), .boff = batch_offsets(nbdim, shape, nbatch, bstride),
+        .m = m, .n = n, .k = k, .ars = ars, .acs = acs, .brs = brs, .bcs = bcs,
+        .scale = ep != NULL && ep->scaled ? ep->scale : 1, .fast = tensor_fast_math(),
+    };
+    if (ep != NULL) {
+        static const tensor_op_t acts[] = { [MATMUL_ACT_RELU] = OP_RELU, [MATMUL_ACT_GELU] = OP_GELU, [MATMUL_ACT_SIGMOID] = OP_SIGMOID };
+        assert(ep->act < MATMUL_NACTS);
+        bool rows = a->ndim > 1, cols = b->ndim > 1;
+        if (ep->bias != NULL) {
+            ctx.bias = ep->bias->data;
+            ctx.biasoff = epilogue_operand(ep->bias, ndim, shape, nbdim, nbatch, rows, cols, &ctx.biasrs, &ctx.biascs);
+            ctx.bias_fn = kernel_resolve(OP_FMA, DTYPE_F32, layout_of(3, (stride_t[]){1, 0, ctx.biascs})).ternary;
+        } else if (ctx.scale != 1) {
+            ctx.scale_fn = kernel_resolve(OP_MUL, DTYPE_F32, LAYOUT_BROADCAST).binary;
+        }
+        if (ep->act != MATMUL_ACT_NONE) ctx.act_fn = kernel_resolve(acts[ep->act], DTYPE_F32, LAYOUT_CONTIGUOUS).unary;
+        if (ep->residual != NULL) {
+            ctx.res = ep->residual->data;
+            ctx.resoff = epilogue_operand(ep->residual, ndim, shape, nbdim, nbatch, rows, cols, &ctx.resrs, &ctx.rescs);
+            ctx.res_fn = kernel_resolve(OP_ADD, DTYPE_F32, layout_of(2, (stride_t[]){1, ctx.rescs})).binary;
+        }
+        ctx.epilogue = ctx.bias_fn != NULL || ctx.scale_fn != NULL || ctx.act_fn != NULL || ctx.res_fn != NULL;
+    }
+    if (ep == NULL && nbatch == 1 && (m == 1 || n == 1)) {
+        // a single matrix times a vector is memory bound: stream the matrix once instead of packing it
+        if (n == 1) gemv_into(c->data, a->data, m, k, ars, acs, b->data, brs);
+        else gemv_into(c->data, b->data, n, k, bcs, brs, a->data, acs);
+    } else {
+        gemm_run(&ctx, nbatch);
+    }
+    scratch_reset(mk);
+
+    return c;
+}
+
+typedef struct {
+    kernel_t fn;
+    float *y;
+    const float *m, *x;
+    size_t n; // length of the dot products (or number of columns summed)
+    size_t rs, cs;
+} gemv_ctx_t;
+
+// y[r] = row r of m . x
+static void gemv_rows_chunk(void *ctx, size_t start, size_t end) {
+    gemv_ctx_t *g = ctx;
+    g->fn.gemv(g->y + start, g->m + start * g->rs, g->rs, g->x, end - start, g->n);
+}
+
+// same for strided rows
+static void gemv_dot_chunk(void *ctx, size_t start, size_t end) {
+    gemv_ctx_t *g = ctx;
+    for (size_t r = start; r < end; r++) g->y[r] = g->fn.dot(g->m + r * g->rs, g->cs, g->x, 1, g->n);
+}
+
+// y[start, end) = sum over j of x[j] * column j of m (columns are contiguous, cs apart)
+static void gemv_cols_chunk(void *ctx, size_t start, size_t end) {
+    gemv_ctx_t *g = ctx;
+    g->fn.gemv(g->y + start, g->m + start, g->cs, g->x, g->n, end - start);
+}
+
+// y = m x for a rows x cols matrix (strides rs and cs) and a vector x (stride xs): dot products of the rows with
+// x when the rows are contiguous and sums of the columns scaled by x when the columns are, so the matrix is
+// always read once and in memory order; the threads split the rows (x is gathered first if strided)
+static void gemv_into(float *y, const float *m, size_t rows, size_t cols, size_t rs, size_t cs, const float *x, size_t xs) {
+    scratch_mark_t mk = scratch_mark();
+    if (xs != 1) {
+        float *xc = scratch_alloc(cols * sizeof(*xc));
+        for (size_t j = 0; j < cols; j++) xc[j] = x[j * xs];
+        x = xc;
+    }
+    gemv_ctx_t g = { .y = y, .m = m, .x = x, .n = cols, .rs = rs, .cs = cs };
+    size_t grain = (GEMV_GRAIN + cols - 1) / cols;
+    if (rs == 1 && cs != 1) {
+        g.fn = kernel_resolve(OP_GEMV_T, DTYPE_F32, LAYOUT_CONTIGUOUS);
+        parallel_for(rows, grain, gemv_cols_chunk, &g);
+    } else if (cs == 1) {
+        g.fn = kernel_resolve(OP_GEMV, DTYPE_F32, LAYOUT_CONTIGUOUS);
+        parallel_for(rows, grain, gemv_rows_chunk, &g);
+    } else {
+        g.fn = kernel_resolve(OP_DOT, DTYPE_F32, LAYOUT_STRIDED);
+        parallel_for(rows, grain, gemv_dot_chunk, &g);
+    }
+    scratch_reset(mk);
+}
+
+typedef struct {
+    dot_fn_t fn;
+    const float *a, *b;
+    stride_t as, bs;
+    size_t n;
+    float *partial; // sum of every block of DOT_BLOCK elements
+} dot_ctx_t;
+
+static void dot_chunk(void *ctx, size_t start, size_t end) {
+    dot_ctx_t *d = ctx;
+    for (size_t blk = start; blk < end; blk++) {
+        size_t i = blk * DOT_BLOCK;
+        d->partial[blk] = d->fn(d->a + i * d->as, d->as, d->b + i * d->bs, d->bs, MIN(DOT_BLOCK, d->n - i));
+    }
+}
+
+/**
+ * Dot product of two vectors (with any strides). Long vectors are summed in blocks (in parallel) whose sums are
+ * added in order, so the result does not depend on the number of threads.
+ *
+ * @param a vector
+ * @param b vector of the same length
+ * @return tensor of shape (1) with the dot product
+ */
+tensor_t *dot(tensor_t *a, tensor_t *b) {
+    assert(a != NULL && b != NULL);
+    assert(a->ndim == 1 && b->ndim == 1);
+    assert(a->shape[0] == b->shape[0]);
+
+    scratch_mark_t m = scratch_mark();
+    tensor_t *r = talloc(__func__, 1, (dim_sz_t[]){1});
+    dot_ctx_t ctx = { .a = a->data, .b = b->data, .as = a->stride[0], .bs = b->stride[0], .n = a->shape[0] };
+    ctx.fn = kernel_resolve(OP_DOT, DTYPE_F32, layout_of(2, (stride_t[]){ctx.as, ctx.bs})).dot;
+    size_t nblocks = (ctx.n + DOT_BLOCK - 1) / DOT_BLOCK;
+    ctx.partial = scratch_alloc(nblocks * sizeof(*ctx.partial));
+    parallel_for(nblocks, 1, dot_chunk, &ctx);
+    r->data[0] = 0;
+    for (size_t blk = 0; blk < nblocks; blk++) r->data[0] += ctx.partial[blk];
+    scratch_reset(m);
+
+    return r;
+}
+
+/**
+ * Matrix-vector product m x (see gemv_into for how the matrix is streamed)
+ *
+ * @param m matrix of shape (R, C) (any strides)
+ * @param x vector of shape (C)
+ * @return tensor of shape (R)
+ */
+tensor_t *gemv(tensor_t *m, tensor_t *x) {
+    assert(m != NULL && x != NULL);
+    assert(m->ndim == 2 && x->ndim == 1);
+    assert(x->shape[0] == m->shape[1]);
+
+    tensor_t *y = talloc(__func__, 1, (dim_sz_t[]){m->shape[0]});
+    gemv_into(y->data, m->data, m->shape[0], m->shape[1], m->stride[0], m->stride[1], x->data, x->stride[0]);
+    return y;
+}
+
+/**
+ * Transposed matrix-vector product m^T x, without transposing m
+ *
+ * @param m matrix of shape (R, C) (any strides)
+ * @param x vector of shape (R)
+ * @return tensor of shape (C)
+ */
+tensor_t *gemv_t(tensor_t *m, tensor_t *x) {
+    assert(m != NULL && x != NULL);
+    assert(m->ndim == 2 && x->ndim == 1);
+    assert(x->shape[0] == m->shape[0]);
+
+    tensor_t *y = talloc(__func__, 1, (dim_sz_t[]){m->shape[1]});
+    gemv_into(y->data, m->data, m->shape[1], m->shape[0], m->stride[1], m->stride[0], x->data, x->stride[0]);
+    return y;
+}
+
+/************************* CONVOLUTION *************************/
+
+typedef struct {
+    size_t n, c, h, w; // input (N, C, H, W)
+    size_t o, kh, kw, groups; // weights (O, C / groups, KH, KW)
+    size_t oh, ow; // output (N, O, OH, OW)
+    size_t sh, sw, ph, pw, dh, dw; // stride, padding and dilation
+} conv_geom_t;
+
+typedef struct {
+    conv_fn_t fn;
+    conv_geom_t g;
+    const float *x; // (N, H, W, C)
+    const float *w; // packed per tap (see conv_fn_t)
+    size_t wtap; // floats per tap in w
+    const float *bias;
+    stride_t bs;
+    float *y; // (N, OH, OW, O)
+} conv_ctx_t;
+
+// (N, C, H, W) tensor stored as (N, H, W, C); size 1 dims can have any stride
+static bool is_channels_last(tensor_t *t) {
+    static const dim_t order[] = { 1, 3, 2, 0 }; // innermost first
+    size_t s = 1;
+    for (uint32_t i = 0; i < 4; i++) {
+        dim_t d = order[i];
+        if (t->shape[d] > 1 && t->stride[d] != s) return false;
+        s *= t->shape[d];
+    }
+    return true;
+}
+
+// computes the output rows [start, end) (numbered over the batch and the output height): the pixels whose
+// window lies inside the input go to the kernel in a single call, the ones along the left and right borders
+// one by one with their valid taps only (the padding is never materialized)
+static void conv_chunk(void *ctx, size_t start, size_t end) {
+    conv_ctx_t *cx = ctx;
+    const conv_geom_t *g = &cx->g;
+    scratch_mark_t m = scratch_mark();
+    const float **in = scratch_alloc(g->kh * g->kw * sizeof(*in)), **w = scratch_alloc(g->kh * g->kw * sizeof(*w));
+    ptrdiff_t lo = MIN((g->pw + g->sw - 1) / g->sw, g->ow);
+    ptrdiff_t last = (ptrdiff_t) (g->w - 1 + g->pw) - (ptrdiff_t) ((g->kw - 1) * g->dw); // last input column a window can start at
+    ptrdiff_t hi = last < 0 ? 0 : MIN((size_t) last / g->sw + 1, g->ow);
+
+    for (size_t row = start; row < end; row++) {
+        size_t n = row / g->oh, oy = row % g->oh;
+        float *y = cx->y + row * g->ow * g->o;
+        for (size_t p = 0; p < g->ow; p++) {
+            for (size_t j = 0; j < g->o; j++) y[p * g->o + j] = cx->bias != NULL ? cx->bias[j * cx->bs] : 0;
+        }
+        for (ptrdiff_t ox = 0; ox < (ptrdiff_t) g->ow; ox++) {
+            bool inner = ox == lo && hi > lo; // the taps of the first inner pixel, then the kernel walks the rest
+            size_t ntaps = 0;
+            for (size_t ky = 0; ky < g->kh; ky++) {
+                ptrdiff_t iy = (ptrdiff_t) (oy * g->sh + ky * g->dh) - (ptrdiff_t) g->ph;
+                if (iy < 0 || iy >= (ptrdiff_t) g->h) continue;
+                for (size_t kx = 0; kx < g->kw; kx++) {
+                    ptrdiff_t ix = (ptrdiff_t) (ox * g->sw + kx * g->dw) - (ptrdiff_t) g->pw;
+                    if (ix < 0 || ix >= (ptrdiff_t) g->w) continue;
+                    in[ntaps] = cx->x + ((n * g->h + iy) * g->w + ix) * g->c;
+                    w[ntaps++] = cx->w + (ky * g->kw + kx) * cx->wtap;
+                }
+            }
+            if (inner) {
+                cx->fn(y + ox * g->o, in, w, ntaps, g->sw * g->c, g->c, g->o, hi - lo);
+                ox = hi - 1;
+            } else {
+                cx->fn(y + ox * g->o, in, w, ntaps, 0, g->c, g->o, 1);
+            }
+        }
+    }
+    scratch_reset(m);
+}
+
+// direct convolution of a channels last x (3x3 or depthwise) into a channels last output, threaded over the
+// output rows of every image
+static tensor_t *conv_direct(tensor_t *x, tensor_t *w, tensor_t *bias, const conv_geom_t *g) {
+    scratch_mark_t m = scratch_mark();
+    bool dw = g->groups > 1;
+    size_t ntaps = g->kh * g->kw, op = (g->o + CONV_NR - 1) / CONV_NR * CONV_NR;
+    conv_ctx_t ctx = {
+        .fn = kernel_resolve(dw ? OP_CONV_DW : OP_CONV, DTYPE_F32, LAYOUT_CONTIGUOUS).conv,
+        .g = *g, .x = x->data, .wtap = dw ? g->c : g->c * op,
+        .bias = bias != NULL ? bias->data : NULL, .bs = bias != NULL ? bias->stride[0] : 0,
+    };
+    // weights by tap, then input channel, then output channel (w[t][i][j] = w[j, i, ky, kx]; w[t][i] for depthwise)
+    float *wp = scratch_alloc(ntaps * ctx.wtap * sizeof(*wp));
+    for (size_t t = 0; t < ntaps; t++) {
+        const float *src = w->data + (t / g->kw) * w->stride[2] + (t % g->kw) * w->stride[3];
+        for (size_t i = 0; i < g->c; i++) {
+            if (dw) {
+                wp[t * ctx.wtap + i] = src[i * w->stride[0]];
+                continue;
+            }
+            float *dst = wp + t * ctx.wtap + i * op;
+            for (size_t j = 0; j < op; j++) dst[j] = j < g->o ? src[j * w->stride[0] + i * w->stride[1]] : 0;
+        }
+    }
+    ctx.w = wp;
+
+    tensor_t *y = talloc("conv2d", 4, (dim_sz_t[]){g->n, g->oh, g->ow, g->o});
+    ctx.y = y->data;
+    size_t work = g->ow * g->o * ntaps * (dw ? 1 : g->c); // multiply-adds per output row
+    parallel_for(g->n * g->oh, (CONV_GRAIN + work - 1) / work, conv_chunk, &ctx);
+    scratch_reset(m);
+
+    tensor_t *r = permute(y, (dim_t[]){0, 3, 1, 2});
+    tensor_free(y);
+    return r;
+}
+
+// im2col: the windows are read through a strided view of the (padded) input and copied into a matrix of
+// (C / groups * KH * KW) rows by (OH * OW) columns per image and group, then multiplied by the weights with the
+// matmul kernels (the bias is added by the gemm epilogue)
+static tensor_t *conv_im2col(tensor_t *x, tensor_t *w, tensor_t *bias, const conv_geom_t *g) {
+    scratch_mark_t m = scratch_mark();
+    size_t cg = g->c / g->groups, og = g->o / g->groups, kg = cg * g->kh * g->kw, ohw = g->oh * g->ow;
+    size_t nb = g->n * g->groups;
+
+    // the padding is the only part that is copied twice
+    const float *src = x->data;
+    stride_t xs[4] = { x->stride[0], x->stride[1], x->stride[2], x->stride[3] };
+    float *pad = NULL;
+    if (g->ph > 0 || g->pw > 0) {
+        size_t hp = g->h + 2 * g->ph, wp = g->w + 2 * g->pw;
+        pad = mem_alloc_zeroed("conv2d", g->n * g->c * hp * wp * sizeof(*pad));
+        xs[3] = 1, xs[2] = wp, xs[1] = hp * wp, xs[0] = g->c * hp * wp;
+        materialize(pad + g->ph * wp + g->pw, xs, x);
+        src = pad;
+    }
+    tensor_t v = {
+        .ndim = 7, .numel = nb * kg * ohw, .data = (float *) src,
+        ._shape = { g->n, g->groups, cg, g->kh, g->kw, g->oh, g->ow },
+        ._stride = { xs[0], cg * xs[1], xs[1], g->dh * xs[2], g->dw * xs[3], g->sh * xs[2], g->sw * xs[3] },
+    };
+    v.shape = v._shape;
+    v.stride = v._stride;
+    stride_t cs[7];
+    cs[6] = 1;
+    for (dim_t d = 5; d >= 0; d--) cs[d] = cs[d+1] * v.shape[d+1];
+    float *col = mem_alloc("conv2d", v.numel * sizeof(*col));
+    materialize(col, cs, &v);
+    mem_free(pad);
+
+    // weights as (groups, O / groups, kg) matrices
+    const float *wd = w->data;
+    if (!is_contiguous(w)) {
+        float *wc = scratch_alloc(w->numel * sizeof(*wc));
+        stride_t ws[4] = { kg, g->kh * g->kw, g->kw, 1 };
+        materialize(wc, ws, w);
+        wd = wc;
+    }
+
+    tensor_t *y = talloc("conv2d", 4, (dim_sz_t[]){g->n, g->o, g->oh, g->ow});
+    gemm_ctx_t ctx = {
+        .fn = kernel_resolve(OP_MATMUL, DTYPE_F32, LAYOUT_CONTIGUOUS).gemm,
+        .a = wd, .b = col, .c = y->data,
+        .m = og, .n = ohw, .k = kg, .ars = kg, .acs = 1, .brs = ohw, .bcs = 1, .scale = 1,
+    };
+    size_t *aoff = scratch_alloc(nb * sizeof(*aoff)), *boff = scratch_alloc(nb * sizeof(*boff));
+    for (size_t b = 0; b < nb; b++) {
+        aoff[b] = (b % g->groups) * og * kg;
+        boff[b] = b * kg * ohw;
+    }
+    ctx.aoff = aoff, ctx.boff = boff;
+    if (bias != NULL) {
+        size_t *biasoff = scratch_alloc(nb * sizeof(*biasoff));
+        for (size_t b = 0; b < nb; b++) biasoff[b] = (b % g->groups) * og * bias->stride[0];
+        ctx.bias = bias->data, ctx.biasoff = biasoff, ctx.biasrs = bias->stride[0], ctx.biascs = 0;
+        ctx.bias_fn = kernel_resolve(OP_FMA, DTYPE_F32, LAYOUT_BROADCAST).ternary;
+        ctx.epilogue = true;
+    }
+    gemm_run(&ctx, nb);
+    mem_free(col);
+    scratch_reset(m);
+    return y;
+}
+
+/**
+ * 2-d convolution (cross-correlation, like the usual deep learning frameworks) with stride, zero padding,
+ * dilation and groups.
+ * A channels last x (shape (N, C, H, W) stored as (N, H, W, C), e.g. a permuted (N, H, W, C) tensor) with a 3x3
+ * kernel or a depthwise one (groups == C == O) runs a direct kernel vectorized over the channels and gives a
+ * channels last output; everything else goes through im2col and the matmul kernels and gives an (N, O, OH, OW)
+ * contiguous output.
+ *
+ * @param x input of shape (N, C, H, W) (any strides)
+ * @param w weights of shape (O, C / groups, KH, KW)
+ * @param bias bias of shape (O) (NULL for none)
+ * @param p stride, padding, dilation and groups (NULL for the defaults)
+ * @return tensor of shape (N, O, OH, OW) with OH = (H + 2 * padding - dilation * (KH - 1) - 1) / stride + 1 (same
+ * for OW)
+ */
+tensor_t *conv2d(tensor_t *x, tensor_t *w, tensor_t *bias, const conv_params_t *p) {
+    assert(x != NULL && w != NULL);
+    assert(x->ndim == 4 && w->ndim == 4);
+    conv_params_t d = p != NULL ? *p : (conv_params_t){ 0 };
+    conv_geom_t g = {
+        .n = x->shape[0], .c = x->shape[1], .h = x->shape[2], .w = x->shape[3],
+        .o = w->shape[0], .kh = w->shape[2], .kw = w->shape[3], .groups = d.groups > 0 ? d.groups : 1,
+        .sh = d.stride[0] > 0 ? d.stride[0] : 1, .sw = d.stride[1] > 0 ? d.stride[1] : 1,
+        .ph = d.padding[0], .pw = d.padding[1],
+        .dh = d.dilation[0] > 0 ? d.dilation[0] : 1, .dw = d.dilation[1] > 0 ? d.dilation[1] : 1,
+    };
+    assert(d.padding[0] >= 0 && d.padding[1] >= 0);
+    assert(g.c % g.groups == 0 && g.o % g.groups == 0);
+    assert((size_t) w->shape[1] == g.c / g.groups);
+    assert(bias == NULL || (bias->ndim == 1 && (size_t) bias->shape[0] == g.o));
+    size_t eh = g.dh * (g.kh - 1) + 1, ew = g.dw * (g.kw - 1) + 1; // extent of the windows
+    assert(g.h + 2 * g.ph >= eh && g.w + 2 * g.pw >= ew);
+    g.oh = (g.h + 2 * g.ph - eh) / g.sh + 1;
+    g.ow = (g.w + 2 * g.pw - ew) / g.sw + 1;
+
+    bool direct = is_channels_last(x) && ((g.kh == 3 && g.kw == 3 && g.groups == 1) || (g.groups == g.c && g.o == g.c));
+    DBG(DBG_EWOP, 1, {
+        assert(tinfo2str(x, buff, BUFF_SIZE) != 0);
+        dbg("%s * ", buff);
+        assert(tinfo2str(w, buff, BUFF_SIZE) != 0);
+        dbg("%s %s", buff, direct ? "direct" : "im2col");
+    });
+    return direct ? conv_direct(x, w, bias, &g) : conv_im2col(x, w, bias, &g);
+}
+
+/**
+ * 1-d convolution (see conv2d; runs as a conv2d of height 1, so channels last inputs take the direct path when
+ * the convolution is depthwise)
+ *
+ * @param x input of shape (N, C, L) (any strides)
+ * @param w weights of shape (O, C / groups, K)
+ * @param bias bias of shape (O) (NULL for none)
+ * @param p stride, padding and dilation in their first entry, and groups (NULL for the defaults)
+ * @return tensor of shape (N, O, OL)
+ */
+tensor_t *conv1d(tensor_t *x, tensor_t *w, tensor_t *bias, const conv_params_t *p) {
+    assert(x != NULL && w != NULL);
+    assert(x->ndim == 3 && w->ndim == 3);
+    conv_params_t q = { 0 };
+    if (p != NULL) {
+        q.stride[1] = p->stride[0];
+        q.padding[1] = p->padding[0];
+        q.dilation[1] = p->dilation[0];
+        q.groups = p->groups;
+    }
+    tensor_t *x4 = unsqueeze_view(__func__, x, 2), *w4 = unsqueeze_view(__func__, w, 2);
+    tensor_t *y = conv2d(x4, w4, bias, &q);
+    tensor_free(x4);
+    tensor_free(w4);
+    return squeeze(y, 2);
+}
+
+/************************* POOLING *************************/
+
+typedef struct {
+    bool max; // max pooling (avg otherwise)
+    bool adaptive, count_pad;
+    bool last; // channels last
+    size_t n, c, h, w, oh, ow;
+    size_t kh, kw, sh, sw, ph, pw;
+    const float *x;
+    stride_t xs[4];
+    float *y;
+    binary_fn_t fold_fn; // maximum or add of an input row into the column folds
+    binary_fn_t fn; // maximum or add of contiguous runs
+    binary_fn_t div_fn; // run / count
+} pool_ctx_t;
+
+// window [*lo, *hi) of output index i along a dim of in elements (out outputs); returns the divisor of avg pooling
+static size_t pool_window(const pool_ctx_t *p, size_t i, size_t in, size_t out, size_t k, size_t s, size_t pad, size_t *lo, size_t *hi) {
+    if (p->adaptive) {
+        *lo = i * in / out;
+        *hi = ((i + 1) * in + out - 1) / out;
+        return *hi - *lo;
+    }
+    ptrdiff_t a = (ptrdiff_t) (i * s) - (ptrdiff_t) pad, b = a + (ptrdiff_t) k;
+    *lo = MAX(a, 0);
+    *hi = MIN(b, (ptrdiff_t) in);
+    return p->count_pad ? (size_t) (MIN(b, (ptrdiff_t) (in + pad)) - a) : *hi - *lo;
+}
+
+// folds the input rows [y0, y1) of image n (and channel c when channels first) into v: one value per input column,
+// or one run of channels per column when channels last
+static void pool_fold_rows(const pool_ctx_t *p, float *v, size_t n, size_t c, size_t y0, size_t y1) {
+    const float *base = p->x + n * p->xs[0] + (p->last ? 0 : c * p->xs[1]);
+    size_t run = p->last ? p->c : 1; // contiguous values per column
+    bool flat = p->xs[3] == run; // the columns of a row are one run
+    for (size_t iy = y0; iy < y1; iy++) {
+        const float *row = base + iy * p->xs[2];
+        if (iy == y0) {
+            if (flat) memcpy(v, row, p->w * run * sizeof(*v));
+            else for (size_t ix = 0; ix < p->w; ix++) memcpy(v + ix * run, row + ix * p->xs[3], run * sizeof(*v));
+        } else if (flat || !p->last) {
+            p->fold_fn(v, v, 1, row, p->xs[3] / run, p->w * run);
+        } else {
+            for (size_t ix = 0; ix < p->w; ix++) p->fold_fn(v + ix * run, v + ix * run, 1, row + ix * p->xs[3], 1, run);
+        }
+    }
+}
+
+// output rows [start, end) of a pooling (numbered over the batch, the channels when channels first, and the
+// output height). Windows are separable: the input rows of the window are folded first (whole rows at a time),
+// then each output folds its columns. Channels first, the columns of the full windows are folded for every
+// input column at once (a sliding window over contiguous runs) and the outputs pick theirs with the stride;
+// the other outputs (and every output channels last) fold their columns one at a time (a run of channels at a
+// time channels last). Every window is folded left to right with the same kernel, so both layouts give the same
+// values, nan included.
+static void pool_chunk(void *ctx, size_t start, size_t end) {
+    pool_ctx_t *p = ctx;
+    scratch_mark_t m = scratch_mark();
+    size_t run = p->last ? p->c : 1;
+    float *v = scratch_alloc(p->w * run * sizeof(*v)), *h = p->last ? NULL : scratch_alloc(p->w * sizeof(*h));
+    bool sliding = !p->last && !p->adaptive && p->w >= p->kw; // full windows exist
+    size_t nh = sliding ? p->w - p->kw + 1 : 0; // full windows
+    for (size_t row = start; row < end; row++) {
+        size_t oy = row % p->oh, c = p->last ? 0 : row / p->oh % p->c, n = row / p->oh / (p->last ? 1 : p->c), y0, y1, x0, x1;
+        size_t cy = pool_window(p, oy, p->h, p->oh, p->kh, p->sh, p->ph, &y0, &y1);
+        pool_fold_rows(p, v, n, c, y0, y1);
+        if (sliding) {
+            memcpy(h, v, nh * sizeof(*h));
+            for (size_t kx = 1; kx < p->kw; kx++) p->fn(h, h, 1, v + kx, 1, nh);
+        }
+        float *y = p->y + row * p->ow * run;
+        // outputs [lo, hi) have full windows (channels first, they just pick theirs)
+        size_t lo = sliding ? (p->pw + p->sw - 1) / p->sw : p->ow, hi = sliding ? MAX(lo, MIN((p->w + p->pw - p->kw) / p->sw + 1, p->ow)) : p->ow;
+        for (size_t ox = lo; ox < hi; ox++) y[ox] = h[ox * p->sw - p->pw];
+        if (!p->max && lo < hi) {
+            float cnt = (float) (cy * p->kw);
+            p->div_fn(y + lo, y + lo, 1, &cnt, 0, hi - lo);
+        }
+        for (size_t ox = lo == 0 ? hi : 0; ox < p->ow; ox = ox + 1 == lo ? hi : ox + 1) {
+            float cnt = (float) (cy * pool_window(p, ox, p->w, p->ow, p->kw, p->sw, p->pw, &x0, &x1));
+            float *yo = y + ox * run;
+            memcpy(yo, v + x0 * run, run * sizeof(*yo));
+            for (size_t ix = x0 + 1; ix < x1; ix++) p->fn(yo, yo, 1, v + ix * run, 1, run);
+            if (!p->max) p->div_fn(yo, yo, 1, &cnt, 0, run);
+        }
+    }
+    scratch_reset(m);
+}
+
+// pools the last two dims of x (N, C, H, W) into (OH, OW): vectorized over the channels when x is channels
+// last (and then so is the output), over the input rows otherwise. the windows are separable, so rather than
+// reducing a strided window view (as conv_im2col gathers one) the rows of each window are folded first and the
+// columns after, with kh + kw instead of kh * kw reads per output
+static tensor_t *pool2d(const char *op, tensor_t *x, pool_ctx_t *p) {
+    assert(x != NULL && x->ndim == 4);
+    p->n = x->shape[0], p->c = x->shape[1], p->h = x->shape[2], p->w = x->shape[3];
+    memcpy(p->xs, x->stride, sizeof(p->xs));
+    p->x = x->data;
+    p->last = x->stride[1] == 1 && p->c > 1;
+    DBG(DBG_REDUCE, 1, {
+        assert(tinfo2str(x, buff, BUFF_SIZE) != 0);
+        dbg("%s -> (%zu, %zu)%s", buff, p->oh, p->ow, p->last ? " channels last" : "");
+    });
+
+    tensor_op_t fold = p->max ? OP_MAXIMUM : OP_ADD;
+    // stride of the rows folded in: channels last they are folded a contiguous run of channels at a time, channels
+    // first with the stride of the columns (0 for an expanded width)
+    stride_t fs = p->last ? 1 : p->xs[3];
+    p->fold_fn = kernel_resolve(fold, DTYPE_F32, layout_of(2, (stride_t[]){1, fs})).binary;
+    p->fn = kernel_resolve(fold, DTYPE_F32, LAYOUT_CONTIGUOUS).binary;
+    p->div_fn = kernel_resolve(OP_DIV, DTYPE_F32, LAYOUT_BROADCAST).binary;
+
+    size_t run = p->last ? p->c : 1, rows = p->n * p->oh * (p->last ? 1 : p->c);
+    size_t work = (p->w + p->ow) * run * (p->adaptive ? (p->h + p->oh - 1) / p->oh : p->kh); // values folded per row
+    tensor_t *y = p->last ? talloc(op, 4, (dim_sz_t[]){p->n, p->oh, p->ow, p->c}) : talloc(op, 4, (dim_sz_t[]){p->n, p->c, p->oh, p->ow});
+    p->y = y->data;
+    parallel_for(rows, (POOL_GRAIN + work - 1) / work, pool_chunk, p);
+    if (!p->last) return y;
+    tensor_t *r = permute(y, (dim_t[]){0, 3, 1, 2});
+    tensor_free(y);
+    return r;
+}
+
+// fills the window geometry of p from the pooling parameters and the size of x
+static void pool_geometry(pool_ctx_t *p, tensor_t *x, const pool_params_t *pp) {
+    assert(x != NULL && x->ndim == 4);
+    assert(pp != NULL);
+    p->kh = pp->kernel[0], p->kw = pp->kernel[1];
+    p->sh = pp->stride[0] > 0 ? pp->stride[0] : pp->kernel[0];
+    p->sw = pp->stride[1] > 0 ? pp->stride[1] : pp->kernel[1];
+    p->ph = pp->padding[0], p->pw = pp->padding[1];
+    p->count_pad = pp->count_pad;
+    assert(pp->kernel[0] > 0 && pp->kernel[1] > 0);
+    assert(pp->padding[0] >= 0 && pp->padding[1] >= 0 && 2 * p->ph <= p->kh && 2 * p->pw <= p->kw);
+    assert((size_t) x->shape[2] + 2 * p->ph >= p->kh && (size_t) x->shape[3] + 2 * p->pw >= p->kw);
+    p->oh = (x->shape[2] + 2 * p->ph - p->kh) / p->sh + 1;
+    p->ow = (x->shape[3] + 2 * p->pw - p->kw) / p->sw + 1;
+}
+
+/**
+ * 2-d max pooling (padded elements never win)
+ *
+ * @param x input of shape (N, C, H, W) (any strides; channels last inputs give channels last outputs)
+ * @param p window size, stride and padding
+ * @return tensor of shape (N, C, OH, OW) with OH = (H + 2 * padding - kernel) / stride + 1 (same for OW)
+ */
+tensor_t *maxpool2d(tensor_t *x, const pool_params_t *p) {
+    pool_ctx_t ctx = { .max = true };
+    pool_geometry(&ctx, x, p);
+    return pool2d(__func__, x, &ctx);
+}
+
+/**
+ * 2-d average pooling (the padding is left out of the averages unless p->count_pad is set)
+ *
+ * @param x input of shape (N, C, H, W) (any strides; channels last inputs give channels last outputs)
+ * @param p window size, stride and padding
+ * @return tensor of shape (N, C, OH, OW) (see maxpool2d)
+ */
+tensor_t *avgpool2d(tensor_t *x, const pool_params_t *p) {
+    pool_ctx_t ctx = { 0 };
+    pool_geometry(&ctx, x, p);
+    return pool2d(__func__, x, &ctx);
+}
+
+/**
+ * 2-d adaptive average pooling: output (i, j) averages the input rows [floor(i * H / OH), ceil((i + 1) * H / OH))
+ * and the columns likewise
+ *
+ * @param x input of shape (N, C, H, W) (any strides; channels last inputs give channels last outputs)
+ * @param oh output height
+ * @param ow output width
+ * @return tensor of shape (N, C, OH, OW)
+ */
+tensor_t *adaptive_avgpool2d(tensor_t *x, dim_sz_t oh, dim_sz_t ow) {
+    assert(oh > 0 && ow > 0);
+    return pool2d(__func__, x, &(pool_ctx_t){ .adaptive = true, .oh = oh, .ow = ow });
+}
+
+// 1-d pooling parameters as 2-d ones over a height of 1
+static pool_params_t pool_params_1d(const pool_params_t *p) {
+    assert(p != NULL);
+    return (pool_params_t){
+        .kernel = {1, p->kernel[0]}, .stride = {1, p->stride[0]}, .padding = {0, p->padding[0]}, .count_pad = p->count_pad,
+    };
+}
+
+/**
+ * 1-d max pooling (see maxpool2d)
+ *
+ * @param x input of shape (N, C, L) (any strides)
+ * @param p window size, stride and padding in their first entries
+ * @return tensor of shape (N, C, OL)
+ */
+tensor_t *maxpool1d(tensor_t *x, const pool_params_t *p) {
+    assert(x != NULL && x->ndim == 3);
+    pool_params_t q = pool_params_1d(p);
+    tensor_t *x4 = unsqueeze_view(__func__, x, 2), *y = maxpool2d(x4, &q);
+    tensor_free(x4);
+    return squeeze(y, 2);
+}
+
+/**
+ * 1-d average pooling (see avgpool2d)
+ *
+ * @param x input of shape (N, C, L) (any strides)
+ * @param p window size, stride and padding in their first entries
+ * @return tensor of shape (N, C, OL)
+ */
+tensor_t *avgpool1d(tensor_t *x, const pool_params_t *p) {
+    assert(x != NULL && x->ndim == 3);
+    pool_params_t q = pool_params_1d(p);
+    tensor_t *x4 = unsqueeze_view(__func__, x, 2), *y = avgpool2d(x4, &q);
+    tensor_free(x4);
+    return squeeze(y, 2);
+}
+
+/**
+ * 1-d adaptive average pooling (see adaptive_avgpool2d)
+ *
+ * @param x input of shape (N, C, L) (any strides)
+ * @param ol output length
+ * @return tensor of shape (N, C, OL)
+ */
+tensor_t *adaptive_avgpool1d(tensor_t *x, dim_sz_t ol) {
+    assert(x != NULL && x->ndim == 3);
+    tensor_t *x4 = unsqueeze_view(__func__, x, 2), *y = adaptive_avgpool2d(x4, 1, ol);
+    tensor_free(x4);
+    return squeeze(y, 2);
+}
+
+/************************* SOFTMAX *************************/
+
+typedef struct {
+    softmax_fn_t fn;
+    float *dst;
+    const float *src; // row-major
+    size_t n, inner; // size of the dim and number of elements after it
+    size_t cols; // blocks of DIM_COLS columns per index of the dims before it
+    bool reduced; // dst has a single value per column
+} softmax_ctx_t;
+
+// blocks [start, end) of columns (numbered over the dims before the softmax dim, then the columns); the
+// neighbouring blocks of a slice go to the kernel in a single call
+static void softmax_chunk(void *ctx, size_t start, size_t end) {
+    softmax_ctx_t *p = ctx;
+    for (size_t b = start; b < end;) {
+        size_t o = b / p->cols, c0 = b % p->cols, c1 = MIN(p->cols, c0 + end - b), i = c0 * DIM_COLS;
+        const float *src = p->src + o * p->n * p->inner + i;
+        float *dst = p->dst + o * (p->reduced ? 1 : p->n) * p->inner + i;
+        p->fn(dst, src, p->n, p->inner, MIN(c1 * DIM_COLS, p->inner) - i);
+        b += c1 - c0;
+    }
+}
+
+// runs a fused softmax kernel along dim: one pass for the running max and sum of exponentials, one more for the
+// output; along the innermost dim each row is one call, along outer dims the kernels walk contiguous columns
+// (threads take DIM_COLS of them at a time; inputs that are not row-major are copied first)
+static tensor_t *softmax_dim(const char *op, tensor_op_t kop, tensor_t *t, dim_t dim, bool keepdim) {
+    assert(t != NULL && t->numel > 0);
+    dim = resolve_dim(t->ndim, dim);
+    bool reduced = kop == OP_LOGSUMEXP;
+    scratch_mark_t m = scratch_mark();
+    dim_sz_t *shape = scratch_alloc(t->ndim * sizeof(*shape));
+    memcpy(shape, t->shape, t->ndim * sizeof(*shape));
+    if (reduced) shape[dim] = 1;
+    tensor_t *r = talloc(op, t->ndim, shape);
+
+    softmax_ctx_t ctx = {
+        .fn = kernel_resolve(kop, DTYPE_F32, LAYOUT_CONTIGUOUS).softmax,
+        .dst = r->data, .src = t->data, .n = t->shape[dim], .inner = 1, .reduced = reduced,
+    };
+    for (dim_t d = dim + 1; d < t->ndim; d++) ctx.inner *= t->shape[d];
+    ctx.cols = (ctx.inner + DIM_COLS - 1) / DIM_COLS;
+    float *tmp = NULL;
+    if (!is_contiguous(t)) {
+        // the kernels work in place, so the copy can go straight to the output (unless it is smaller)
+        stride_t *stride = scratch_alloc(t->ndim * sizeof(*stride));
+        stride[t->ndim-1] = 1;
+        for (dim_t d = t->ndim-2; d >= 0; d--) stride[d] = t->shape[d+1] * stride[d+1];
+        float *dst = reduced ? (tmp = mem_alloc(op, t->numel * sizeof(*tmp))) : r->data;
+        materialize(dst, stride, t);
+        ctx.src = dst;
+    }
+    DBG(DBG_REDUCE, 1, {
+        assert(tinfo2str(t, buff, BUFF_SIZE) != 0);
+        dbg("%s %s dim=%d%s", opnames[kop], buff, dim, tmp != NULL || ctx.src == r->data ? " copy" : "");
+    });
+
+    size_t blocks = t->numel / ctx.n / ctx.inner * ctx.cols, work = ctx.n * MIN(ctx.inner, DIM_COLS);
+    parallel_for(blocks, (SOFTMAX_GRAIN + work - 1) / work, softmax_chunk, &ctx);
+    mem_free(tmp);
+    scratch_reset(m);
+    return reduced && !keepdim ? squeeze(r, dim) : r;
+}
+
+/**
+ * Softmax along a dim: exp(x - max) / sum(exp(x - max)) over every slice along dim, computed in two passes over
+ * the input without temporaries (rows where every value is -inf give nan, like the unfused formula)
+ *
+ * @param t input tensor (any strides)
+ * @param dim dimension to normalize along (negative counts from the end)
+ * @return contiguous tensor of the same shape as t
+ */
+tensor_t *softmax(tensor_t *t, dim_t dim) {
+    return softmax_dim(__func__, OP_SOFTMAX, t, dim, true);
+}
+
+/**
+ * Log-softmax along a dim: x - logsumexp(x) over every slice along dim (see softmax)
+ *
+ * @param t input tensor (any strides)
+ * @param dim dimension to normalize along (negative counts from the end)
+ * @return contiguous tensor of the same shape as t
+ */
+tensor_t *log_softmax(tensor_t *t, dim_t dim) {
+    return softmax_dim(__func__, OP_LOG_SOFTMAX, t, dim, true);
+}
+
+/**
+ * Log of the sum of the exponentials along a dim, max + log(sum(exp(x - max))) so it never overflows
+ * (slices where every value is -inf give -inf)
+ *
+ * @param t input tensor (any strides)
+ * @param dim dimension to reduce (negative counts from the end)
+ * @param keepdim true to keep the reduced dimension with a 1, false to squeeze it
+ * @return tensor with the reduced values
+ */
+tensor_t *logsumexp(tensor_t *t, dim_t dim, bool keepdim) {
+    return softmax_dim(__func__, OP_LOGSUMEXP, t, dim, keepdim);
+}
+
+/************************* NORMALIZATION *************************/
+
+typedef struct {
+    norm_fn_t fn;
+    float *dst;
+    const float *src; // row-major
+    size_t n; // row length
+    const float *gamma, *beta;
+    float eps;
+} norm_ctx_t;
+
+static void norm_chunk(void *ctx, size_t start, size_t end) {
+    norm_ctx_t *p = ctx;
+    p->fn(p->dst + start * p->n, p->src + start * p->n, end - start, p->n, p->gamma, p->beta, p->eps);
+}
+
+// the n values of a 1-d parameter tensor, copied to scratch memory if they are not contiguous
+static const float *norm_param(tensor_t *t, size_t n) {
+    if (t == NULL) return NULL;
+    assert(t->ndim == 1 && (size_t) t->shape[0] == n);
+    if (t->stride[0] == 1 || n == 1) return t->data;
+    float *p = scratch_alloc(n * sizeof(*p));
+    for (size_t i = 0; i < n; i++) p[i] = t->data[i * t->stride[0]];
+    return p;
+}
+
+// normalizes x over its last dim with a fused kernel, one thread handling whole rows (inputs that are not
+// row-major are copied to the output first and normalized in place)
+static tensor_t *norm_rows(const char *op, tensor_op_t kop, tensor_t *x, tensor_t *gamma, tensor_t *beta, float eps) {
+    assert(x != NULL && x->numel > 0);
+    assert(eps >= 0);
+    scratch_mark_t m = scratch_mark();
+    tensor_t *r = talloc(op, x->ndim, x->shape);
+    norm_ctx_t ctx = {
+        .fn = kernel_resolve(kop, DTYPE_F32, LAYOUT_CONTIGUOUS).norm,
+        .dst = r->data, .src = x->data, .n = x->shape[x->ndim-1], .eps = eps,
+    };
+    ctx.gamma = norm_param(gamma, ctx.n);
+    ctx.beta = norm_param(beta, ctx.n);
+    if (!is_contiguous(x)) {
+        materialize(r->data, r->stride, x);
+        ctx.src = r->data;
+    }
+    DBG(DBG_REDUCE, 1, {
+        assert(tinfo2str(x, buff, BUFF_SIZE) != 0);
+        dbg("%s %s eps=%g%s", opnames[kop], buff, eps, ctx.src == r->data ? " copy" : "");
+    });
+
+    parallel_for(x->numel / ctx.n, (NORM_GRAIN + ctx.n - 1) / ctx.n, norm_chunk, &ctx);
+    scratch_reset(m);
+    return r;
+}
+
+/**
+ * Layer normalization over the last dim: every row is shifted by its mean and scaled by 1 / sqrt(var + eps)
+ * (biased variance), then multiplied by gamma and shifted by beta. The statistics come from a single Welford pass
+ * and the output from a second pass over the same (cache resident) row.
+ *
+ * @param x input tensor (any strides)
+ * @param gamma scale of shape (D) where D is the size of the last dim of x (NULL for none)
+ * @param beta shift of shape (D) (NULL for none)
+ * @param eps added to the variance
+ * @return contiguous tensor of the same shape as x
+ */
+tensor_t *layernorm(tensor_t *x, tensor_t *gamma, tensor_t *beta, float eps) {
+    return norm_rows(__func__, OP_LAYERNORM, x, gamma, beta, eps);
+}
+
+/**
+ * RMS normalization over the last dim: every row is scaled by 1 / sqrt(mean(x^2) + eps), then multiplied by gamma
+ *
+ * @param x input tensor (any strides)
+ * @param gamma scale of shape (D) where D is the size of the last dim of x (NULL for none)
+ * @param eps added to the mean of the squares
+ * @return contiguous tensor of the same shape as x
+ */
+tensor_t *rmsnorm(tensor_t *x, tensor_t *gamma, float eps) {
+    return norm_rows(__func__, OP_RMSNORM, x, gamma, NULL, eps);
+}
+
+/************************* MOMENTS *************************/
+
+typedef enum {
+    MOMENT_MEAN,
+    MOMENT_VAR,
+    MOMENT_STD,
+} moment_t;
+
+// count, mean and sum of squared deviations of a set of values
+typedef struct {
+    double n, mean, m2;
+} moments_t;
+
+// merges b into a (Chan et al.)
+static void moments_merge(moments_t *a, const moments_t *b) {
+    double n = a->n + b->n, d = b->mean - a->mean;
+    a->mean += d * (b->n / n);
+    a->m2 += b->m2 + d * d * (a->n * b->n / n);
+    a->n = n;
+}
+
+// the requested moment of a set of values
+static float moments_value(const moments_t *acc, moment_t what, dim_sz_t correction) {
+    double v = acc->m2 / (acc->n - correction > 0 ? acc->n - correction : 0);
+    return what == MOMENT_MEAN ? acc->mean : what == MOMENT_VAR ? v : sqrt(v);
+}
+
+typedef struct {
+    moments_fn_t fn;
+    const float *src; // row-major
+    size_t n, inner; // size of the reduced dim and number of elements after it
+    size_t nblk, cols; // blocks of MOMENTS_BLOCK values along the dim and of DIM_COLS columns
+    moments_t *part; // moments of every block: part[(o * nblk + blk) * inner + i] for column i of outer index o
+    float *dst; // with a single block there is nothing to merge: the results go straight to dst (part is NULL)
+    moment_t what;
+    dim_sz_t correction;
+} moments_ctx_t;
+
+// units [start, end) numbered over the outer indices, the blocks along the dim and the column blocks; the
+// neighbouring column blocks of a dim block go to the kernel in a single call
+static void moments_chunk(void *ctx, size_t start, size_t end) {
+    moments_ctx_t *p = ctx;
+    scratch_mark_t m = scratch_mark();
+    size_t cap = MIN(p->inner, (end - start) * DIM_COLS);
+    float *mu = scratch_alloc(cap * sizeof(*mu)), *m2 = scratch_alloc(cap * sizeof(*m2));
+    for (size_t u = start; u < end;) {
+        size_t ob = u / p->cols, c0 = u % p->cols, c1 = MIN(p->cols, c0 + end - u);
+        size_t o = ob / p->nblk, j = ob % p->nblk * MOMENTS_BLOCK, len = MIN(MOMENTS_BLOCK, p->n - j);
+        size_t i = c0 * DIM_COLS, w = MIN(c1 * DIM_COLS, p->inner) - i;
+        const float *src = p->src + (o * p->n + j) * p->inner + i;
+        p->fn(mu, m2, src, len, p->inner, w);
+        if (p->part == NULL) {
+            float *dst = p->dst + o * p->inner + i;
+            for (size_t l = 0; l < w; l++) dst[l] = moments_value(&(moments_t){ len, (double) src[l] + mu[l], m2[l] }, p->what, p->correction);
+        } else {
+            moments_t *part = p->part + ob * p->inner + i;
+            for (size_t l = 0; l < w; l++) part[l] = (moments_t){ len, (double) src[l] + mu[l], m2[l] };
+        }
+        u += c1 - c0;
+    }
+    scratch_reset(m);
+}
+
+// mean, variance or standard deviation of t along dim (moments_all flattens t first to reduce every element): one
+// Welford pass per block of the dim (in parallel), then the blocks are merged in order, so the result does not
+// depend on the number of threads
+static tensor_t *moments_dim(const char *op, tensor_t *t, dim_t dim, bool keepdim, moment_t what, dim_sz_t correction) {
+    assert(t != NULL && t->numel > 0);
+    assert(correction >= 0);
+    dim = resolve_dim(t->ndim, dim);
+    scratch_mark_t m = scratch_mark();
+    dim_sz_t *shape = scratch_alloc(t->ndim * sizeof(*shape));
+    memcpy(shape, t->shape, t->ndim * sizeof(*shape));
+    shape[dim] = 1;
+    tensor_t *r = talloc(op, t->ndim, shape);
+
+    moments_ctx_t ctx = {
+        .fn = kernel_resolve(OP_MOMENTS, DTYPE_F32, LAYOUT_CONTIGUOUS).moments,
+        .src = t->data, .n = t->shape[dim], .inner = 1, .dst = r->data, .what = what, .correction = correction,
+    };
+    for (dim_t d = dim + 1; d < t->ndim; d++) ctx.inner *= t->shape[d];
+    ctx.nblk = (ctx.n + MOMENTS_BLOCK - 1) / MOMENTS_BLOCK;
+    ctx.cols = (ctx.inner + DIM_COLS - 1) / DIM_COLS;
+    size_t outer = t->numel / ctx.n / ctx.inner;
+    float *tmp = NULL;
+    if (!is_contiguous(t)) {
+        stride_t *stride = scratch_alloc(t->ndim * sizeof(*stride));
+        stride[t->ndim-1] = 1;
+        for (dim_t d = t->ndim-2; d >= 0; d--) stride[d] = t->shape[d+1] * stride[d+1];
+        ctx.src = tmp = mem_alloc(op, t->numel * sizeof(*tmp));
+        materialize(tmp, stride, t);
+    }
+    DBG(DBG_REDUCE, 1, {
+        assert(tinfo2str(t, buff, BUFF_SIZE) != 0);
+        dbg("%s dim=%d correction=%d keepdim=%d%s", buff, dim, correction, keepdim, tmp != NULL ? " copy" : "");
+    });
+
+    if (ctx.nblk > 1) ctx.part = mem_alloc(op, outer * ctx.nblk * ctx.inner * sizeof(*ctx.part));
+    size_t work = MIN(ctx.n, MOMENTS_BLOCK) * MIN(ctx.inner, DIM_COLS);
+    parallel_for(outer * ctx.nblk * ctx.cols, (MOMENTS_GRAIN + work - 1) / work, moments_chunk, &ctx);
+    for (size_t o = 0; o < outer && ctx.part != NULL; o++) {
+        for (size_t i = 0; i < ctx.inner; i++) {
+            moments_t acc = ctx.part[o * ctx.nblk * ctx.inner + i];
+            for (size_t b = 1; b < ctx.nblk; b++) moments_merge(&acc, &ctx.part[(o * ctx.nblk + b) * ctx.inner + i]);
+            r->data[o * ctx.inner + i] = moments_value(&acc, what, correction);
+        }
+    }
+    mem_free(ctx.part);
+    mem_free(tmp);
+    scratch_reset(m);
+    return keepdim ? r : squeeze(r, dim);
+}
+
+// moments_dim over every element of t
+static tensor_t *moments_all(const char *op, tensor_t *t, moment_t what, dim_sz_t correction) {
+    assert(t != NULL);
+    tensor_t *v = tview(op, t, t->ndim); // flattened (reshape copies it if needed)
+    memcpy(v->shape, t->shape, t->ndim * sizeof(*t->shape));
+    memcpy(v->stride, t->stride, t->ndim * sizeof(*t->stride));
+    reshape(v, 1, (dim_sz_t[]){t->numel});
+    tensor_t *r = moments_dim(op, v, 0, true, what, correction);
+    tensor_free(v);
+    return r;
+}
+
+/**
+ * Returns the mean of all the elements of a tensor
+ *
+ * @param t tensor to average
+ * @return new tensor with the mean of t as its single element
+ */
+tensor_t *meanall(tensor_t *t) {
+    return moments_all(__func__, t, MOMENT_MEAN, 0);
+}
+
+/**
+ * Returns the mean of the elements along the specified dimension of a tensor
+ *
+ * @param t tensor to average
+ * @param dim dimension to average along
+ * @param keepdim true to keep the reduced dimension with a 1, false to squeeze it
+ * @return tensor with the means along the specified dimension
+ */
+tensor_t *mean(tensor_t *t, dim_t dim, bool keepdim) {
+    return moments_dim(__func__, t, dim, keepdim, MOMENT_MEAN, 0);
+}
+
+/**
+ * Returns the variance of all the elements of a tensor: the sum of the squared deviations from the mean divided
+ * by N - correction (computed with Welford's algorithm, so it stays accurate when the mean is large)
+ *
+ * @param t tensor to compute the variance of
+ * @param correction 0 for the population variance, 1 for the sample variance
+ * @return new tensor with the variance of t as its single element (nan if N <= correction)
+ */
+tensor_t *varall(tensor_t *t, dim_sz_t correction) {
+    return moments_all(__func__, t, MOMENT_VAR, correction);
+}
+
+/**
+ * Returns the variance of the elements along the specified dimension of a tensor (see varall)
+ *
+ * @param t tensor to compute the variance of
+ * @param dim dimension to reduce
+ * @param correction 0 for the population variance, 1 for the sample variance
+ * @param keepdim true to keep the reduced dimension with a 1, false to squeeze it
+ * @return tensor with the variances along the specified dimension
+ */
+tensor_t *var(tensor_t *t, dim_t dim, dim_sz_t correction, bool keepdim) {
+    return moments_dim(__func__, t, dim, keepdim, MOMENT_VAR, correction);
+}
+
+/**
+ * Returns the standard deviation of all the elements of a tensor (the square root of varall)
+ *
+ * @param t tensor to compute the standard deviation of
+ * @param correction 0 for the population variance, 1 for the sample variance
+ * @return new tensor with the standard deviation of t as its single element
+ */
+tensor_t *stdall(tensor_t *t, dim_sz_t correction) {
+    return moments_all(__func__, t, MOMENT_STD, correction);
+}
+
+/**
+ * Returns the standard deviation of the elements along the specified dimension of a tensor (see varall)
+ *
+ * @param t tensor to compute the standard deviation of
+ * @param dim dimension to reduce
+ * @param correction 0 for the population variance, 1 for the sample variance
+ * @param keepdim true to keep the reduced dimension with a 1, false to squeeze it
+ * @return tensor with the standard deviations along the specified dimension
+ */
+tensor_t *std(tensor_t *t, dim_t dim, dim_sz_t correction, bool keepdim) {
+    return moments_dim(__func__, t, dim, keepdim, MOMENT_STD, correction);
+}
+
+/************************* QUANTIZATION *************************/
+
+_Static_assert(sizeof(qtensor_t) <= QTENSOR_HDR, "qtensor_t must fit its header");
+
+// allocates a quantized tensor and its arrays as a single block (nq scales and zero points)
+static qtensor_t *qalloc(dim_t ndim, const dim_sz_t *shape, uint32_t numel, dim_t axis, uint32_t nq) {
+    size_t shape_sz = ((ndim * sizeof(dim_sz_t)) + 15) & ~(size_t) 15, q_sz = (nq * sizeof(float) + 15) & ~(size_t) 15;
+    char *p = mem_alloc("quantize", QTENSOR_HDR + shape_sz + 2 * q_sz + numel);
+    qtensor_t *q = (qtensor_t *) p;
+    q->ndim = ndim;
+    q->shape = (dim_sz_t *) (p + QTENSOR_HDR);
+    memcpy(q->shape, shape, ndim * sizeof(*shape));
+    q->numel = numel;
+    q->axis = axis;
+    q->scale = (float *) (p + QTENSOR_HDR + shape_sz);
+    q->zero = (int32_t *) (p + QTENSOR_HDR + shape_sz + q_sz);
+    q->data = (int8_t *) (p + QTENSOR_HDR + shape_sz + 2 * q_sz);
+    return q;
+}
+
+// quantizes t with one scale and zero point per index of axis (the whole tensor for axis -1): the range of each
+// channel (widened to include 0, so zero is exact) is mapped onto [-Q8_MAX, Q8_MAX]
+static qtensor_t *quantize_axis(tensor_t *t, dim_t axis) {
+    assert(t != NULL);
+    scratch_mark_t m = scratch_mark();
+    const float *src = t->data;
+    if (!is_contiguous(t)) {
+        float *dst = scratch_alloc(t->numel * sizeof(*dst));
+        stride_t *stride = scratch_alloc(t->ndim * sizeof(*stride));
+        stride[t->ndim-1] = 1;
+        for (dim_t d = t->ndim-2; d >= 0; d--) stride[d] = t->shape[d+1] * stride[d+1];
+        materialize(dst, stride, t);
+        src = dst;
+    }
+
+    // channel c is made of outer runs of inner contiguous elements, nc * inner apart
+    size_t nc = axis < 0 ? 1 : t->shape[axis], inner = axis < 0 ? t->numel : 1;
+    for (dim_t d = axis + 1; axis >= 0 && d < t->ndim; d++) inner *= t->shape[d];
+    size_t outer = t->numel / (nc * inner);
+    qtensor_t *q = qalloc(t->ndim, t->shape, t->numel, axis, nc);
+    reduce_fn_t fmin = kernel_resolve(OP_MIN, DTYPE_F32, LAYOUT_CONTIGUOUS).reduce;
+    reduce_fn_t fmax = kernel_resolve(OP_MAX, DTYPE_F32, LAYOUT_CONTIGUOUS).reduce;
+    quantize_fn_t fq = kernel_resolve(OP_QUANTIZE, DTYPE_I8, LAYOUT_CONTIGUOUS).quantize;
+    for (size_t c = 0; c < nc; c++) {
+        float lo = 0, hi = 0;
+        for (size_t o = 0; o < outer; o++) {
+            const float *run = src + (o * nc + c) * inner;
+            lo = fmin(run, 1, inner, lo);
+            hi = fmax(run, 1, inner, hi);
+        }
+        float scale = (hi - lo) / (2 * Q8_MAX);
+        if (scale == 0 || !isfinite(scale)) scale = 1;
+        q->scale[c] = scale;
+        q->zero[c] = (int32_t) lrintf(-Q8_MAX - lo / scale);
+        for (size_t o = 0; o < outer; o++) {
+            size_t off = (o * nc + c) * inner;
+            fq(q->data + off, src + off, inner, 1 / scale, q->zero[c]);
+        }
+    }
+    DBG(DBG_EWOP, 1, {
+        assert(tinfo2str(t, buff, BUFF_SIZE) != 0);
+        dbg("%s axis=%d scale=%g zero=%d%s", buff, axis, q->scale[0], q->zero[0], nc > 1 ? ",..." : "");
+    });
+    scratch_reset(m);
+    return q;
+}
+
+/**
+ * Quantizes a tensor to int8 with a single scale and zero point (asymmetric, covering the range of t and 0)
+ *
+ * @param t tensor to quantize (any strides)
+ * @return quantized tensor (free with qtensor_free)
+ */
+qtensor_t *quantize(tensor_t *t) {
+    return quantize_axis(t, -1);
+}
+
+/**
+ * Quantizes a tensor to int8 with a scale and zero point per channel of axis (e.g. the output channels of a
+ * weight matrix), which keeps the resolution of small channels next to large ones
+ *
+ * @param t tensor to quantize (any strides)
+ * @param axis dimension of the channels (negative counts from the end)
+ * @return quantized tensor (free with qtensor_free)
+ */
+qtensor_t *quantize_channels(tensor_t *t, dim_t axis) {
+    assert(t != NULL);
+    return quantize_axis(t, resolve_dim(t->ndim, axis));
+}
+
+/**
+ * Converts a quantized tensor back to floats
+ *
+ * @param q quantized tensor
+ * @return contiguous tensor of the same shape
+ */
+tensor_t *dequantize(qtensor_t *q) {
+    assert(q != NULL);
+    tensor_t *t = talloc(__func__, q->ndim, q->shape);
+    size_t nc = q->axis < 0 ? 1 : q->shape[q->axis], inner = q->axis < 0 ? q->numel : 1;
+    for (dim_t d = q->axis + 1; q->axis >= 0 && d < q->ndim; d++) inner *= q->shape[d];
+    dequantize_fn_t fn = kernel_resolve(OP_DEQUANTIZE, DTYPE_I8, LAYOUT_CONTIGUOUS).dequantize;
+    for (size_t i = 0, c = 0; i < q->numel; i += inner, c = (c + 1) % nc) {
+        fn(t->data + i, q->data + i, inner, q->scale[c], q->zero[c]);
+    }
+    return t;
+}
+
+/**
+ * Frees a quantized tensor
+ *
+ * @param q quantized tensor (NULL is a no-op)
+ */
+void qtensor_free(qtensor_t *q) {
+    mem_free(q);
+}
+
+typedef struct {
+    gemm_q8_fn_t fn;
+    const int8_t *a, *b; // packed panels
+    const int32_t *asum, *bsum; // row sums of a and column sums of b
+    const qtensor_t *qa, *qb;
+    float *c;
+    size_t m, n, k, kp;
+    size_t mtiles;
+} q8_ctx_t;
+
+// computes tiles [start, end) (column panel major, so a panel of b is reused by consecutive tiles) and rescales
+// them: with a = sa (A - za) and b = sb (B - zb), a b = sa sb (A B - zb rowsum(A) - za colsum(B) + k za zb)
+static void q8_chunk(void *ctx, size_t start, size_t end) {
+    q8_ctx_t *q = ctx;
+    int32_t tile[Q8_MR * Q8_NR];
+    for (size_t t = start; t < end; t++) {
+        size_t i0 = (t % q->mtiles) * Q8_MR, j0 = (t / q->mtiles) * Q8_NR;
+        q->fn(q->kp / 4, q->a + i0 * q->kp, q->b + j0 * q->kp, q->bsum + j0, tile, Q8_NR);
+        for (size_t i = i0; i < MIN(i0 + Q8_MR, q->m); i++) {
+            float sa = q->qa->scale[q->qa->axis < 0 ? 0 : i];
+            int64_t za = q->qa->zero[q->qa->axis < 0 ? 0 : i];
+            for (size_t j = j0; j < MIN(j0 + Q8_NR, q->n); j++) {
+                float sb = q->qb->scale[q->qb->axis < 0 ? 0 : j];
+                int64_t zb = q->qb->zero[q->qb->axis < 0 ? 0 : j];
+                int64_t acc = tile[(i - i0) * Q8_NR + j - j0] - zb * q->asum[i] - za * q->bsum[j] + (int64_t) q->k * za * zb;
+                q->c[i * q->n + j] = sa * sb * (float) acc;
+            }
+        }
+    }
+}
+
+/**
+ * Matrix product of two int8 tensors with int32 accumulation (exact until the final rescale to float, as long as
+ * K <= Q8_MAX_K so the int32 dot products cannot overflow). a can be quantized per row and b per column (the
+ * scales then factor out of every dot product).
+ *
+ * @param a quantized tensor of shape (M, K), per tensor or per channel of axis 0
+ * @param b quantized tensor of shape (K, N), per tensor or per channel of axis 1
+ * @return tensor of shape (M, N)
+ */
+tensor_t *matmul_q8(qtensor_t *a, qtensor_t *b) {
+    assert(a != NULL && b != NULL);
+    assert(a->ndim == 2 && b->ndim == 2);
+    assert(a->shape[1] == b->shape[0]);
+    assert(a->shape[1] <= Q8_MAX_K);
+    assert(a->axis < 1 && (b->axis < 0 || b->axis == 1));
+
+    scratch_mark_t mk = scratch_mark();
+    size_t m = a->shape[0], n = b->shape[1], k = a->shape[1], kp = (k + 3) & ~(size_t) 3;
+    q8_ctx_t ctx = {
+        .fn = kernel_resolve(OP_MATMUL_Q8, DTYPE_I8, LAYOUT_CONTIGUOUS).gemm_q8,
+        .qa = a, .qb = b, .m = m, .n = n, .k = k, .kp = kp, .mtiles = (m + Q8_MR - 1) / Q8_MR,
+    };
+    size_t ntiles = (n + Q8_NR - 1) / Q8_NR;
+    int8_t *ap = scratch_alloc(ctx.mtiles * Q8_MR * kp), *bp = scratch_alloc(ntiles * Q8_NR * kp);
+    int32_t *asum = scratch_alloc(m * sizeof(*asum)), *bsum = scratch_alloc(ntiles * Q8_NR * sizeof(*bsum));
+    k_pack_q8_a(ap, asum, a->data, k, m, k);
+    k_pack_q8_b(bp, bsum, b->data, n, k, n);
+    ctx.a = ap, ctx.b = bp, ctx.asum = asum, ctx.bsum = bsum;
+
+    tensor_t *c = talloc(__func__, 2, (dim_sz_t[]){m, n});
+    DBG(DBG_EWOP, 1, { dbg("(%zu, %zu) @ (%zu, %zu)", m, k, k, n); });
+    ctx.c = c->data;
+    size_t work = Q8_MR * Q8_NR * kp;
+    parallel_for(ctx.mtiles * ntiles, (Q8_GRAIN + work - 1) / work, q8_chunk, &ctx);
+    scratch_reset(mk);
+
+    return c;
+}
+
+typedef struct {
+    q4tensor_t *q;
+    const float *src;
+    size_t rs, cs;
+} q4_quant_ctx_t;
+
+static void q4_quant_chunk(void *ctx, size_t start, size_t end) {
+    q4_quant_ctx_t *c = ctx;
+    size_t cols = c->q->cols;
+    scratch_mark_t m = scratch_mark();
+    float *row = c->cs != 1 ? scratch_alloc(cols * sizeof(*row)) : NULL;
+    for (size_t r = start; r < end; r++) {
+        const float *src = c->src + r * c->rs;
+        if (row != NULL) {
+            for (size_t j = 0; j < cols; j++) row[j] = src[j * c->cs];
+            src = row;
+        }
+        k_quantize_q4(c->q->blocks + r * c->q->nblocks, src, cols);
+    }
+    scratch_reset(m);
+}
+
+/**
+ * Quantizes a matrix to 4 bits per value in blocks of Q4_BLOCK along its rows, each with a half precision scale
+ * (4.5 bits per value); magnitudes must stay below 8 * 65504 (the largest half times 8)
+ *
+ * @param t tensor of shape (R, C) (any strides)
+ * @return 4-bit tensor (free with q4tensor_free)
+ */
+q4tensor_t *quantize_q4(tensor_t *t) {
+    assert(t != NULL);
+    assert(t->ndim == 2);
+    _Static_assert(sizeof(q4tensor_t) <= QTENSOR_HDR, "q4tensor_t must fit its header");
+    uint32_t nblocks = (t->shape[1] + Q4_BLOCK - 1) / Q4_BLOCK;
+    char *p = mem_alloc("quantize_q4", QTENSOR_HDR + (size_t) t->shape[0] * nblocks * sizeof(q4_block_t));
+    q4tensor_t *q = (q4tensor_t *) p;
+    q->rows = t->shape[0];
+    q->cols = t->shape[1];
+    q->nblocks = nblocks;
+    q->blocks = (q4_block_t *) (p + QTENSOR_HDR);
+    DBG(DBG_EWOP, 1, {
+        assert(tinfo2str(t, buff, BUFF_SIZE) != 0);
+        dbg("%s -> %u blocks", buff, q->rows * nblocks);
+    });
+
+    q4_quant_ctx_t ctx = { .q = q, .src = t->data, .rs = t->stride[0], .cs = t->stride[1] };
+    parallel_for(q->rows, (FILL_GRAIN + q->cols - 1) / q->cols, q4_quant_chunk, &ctx);
+    return q;
+}
+
+/**
+ * Converts a 4-bit matrix back to floats
+ *
+ * @param q 4-bit tensor
+ * @return contiguous tensor of shape (R, C)
+ */
+tensor_t *dequantize_q4(q4tensor_t *q) {
+    assert(q != NULL);
+    tensor_t *t = talloc(__func__, 2, (dim_sz_t[]){q->rows, q->cols});
+    for (dim_sz_t r = 0; r < q->rows; r++) k_dequantize_q4(t->data + (size_t) r * q->cols, q->blocks + (size_t) r * q->nblocks, q->cols);
+    return t;
+}
+
+/**
+ * Frees a 4-bit tensor
+ *
+ * @param q 4-bit tensor (NULL is a no-op)
+ */
+void q4tensor_free(q4tensor_t *q) {
+    mem_free(q);
+}
+
+typedef struct {
+    gemv_q4_fn_t fn;
+    float *y;
+    const q4tensor_t *m;
+    const float *x;
+} gemv_q4_ctx_t;
+
+static void gemv_q4_chunk(void *ctx, size_t start, size_t end) {
+    gemv_q4_ctx_t *g = ctx;
+    g->fn(g->y + start, g->m->blocks + start * g->m->nblocks, g->m->nblocks, g->x, end - start, g->m->nblocks);
+}
+
+/**
+ * Matrix-vector product with a 4-bit matrix. The blocks are expanded in registers as the rows stream by, so the
+ * matrix is read at 4.5 bits per value (about 1/7 of the traffic of a float matrix) and never converted in memory.
+ *
+ * @param m 4-bit tensor of shape (R, C)
+ * @param x vector of shape (C)
+ * @return tensor of shape (R)
+ */
+tensor_t *gemv_q4(q4tensor_t *m, tensor_t *x) {
+    assert(m != NULL && x != NULL);
+    assert(x->ndim == 1 && x->shape[0] == m->cols);
+
+    scratch_mark_t mk = scratch_mark();
+    size_t n = (size_t) m->nblocks * Q4_BLOCK;
+    const float *xp = x->data;
+    if (x->stride[0] != 1 || n != (size_t) m->cols) {
+        // the kernels read whole blocks: gather x and pad it with zeros (the padding of the blocks is zero too)
+        float *xc = scratch_alloc(n * sizeof(*xc));
+        for (dim_sz_t j = 0; j < m->cols; j++) xc[j] = x->data[j * x->stride[0]];
+        memset(xc + m->cols, 0, (n - m->cols) * sizeof(*xc));
+        xp = xc;
+    }
+    tensor_t *y = talloc(__func__, 1, (dim_sz_t[]){m->rows});
+    gemv_q4_ctx_t g = { .fn = kernel_resolve(OP_GEMV_Q4, DTYPE_Q4, LAYOUT_CONTIGUOUS).gemv_q4, .y = y->data, .m = m, .x = xp };
+    parallel_for(m->rows, (GEMV_GRAIN + n - 1) / n, gemv_q4_chunk, &g);
+    scratch_reset(mk);
+
+    return y;
+}
+
+/**
+ * Makes the unary ops use cheaper approximations (exp, log, tanh, sigmoid and gelu; see uop for the accuracy
+ * of the first four)
+ *
+ * @param on true to use the fast approximations, false for the accurate ones (the default)
+ */
+void tensor_set_fast_math(bool on) {
+    __atomic_store_n(&_fast_math, on, __ATOMIC_RELAXED);
+}
+
+/**
+ * Returns true if the unary ops use the fast approximations
+ */
+bool tensor_fast_math() {
+    return __atomic_load_n(&_fast_math, __ATOMIC_RELAXED);
+}
+
+/************************* HELPER FUNCTIONS *************************/
+
+static void iter_alloc(iter_t *it, dim_t cap, uint32_t nops) {
+    assert(nops > 0 && nops <= ITER_MAX_OPS);
+    it->nops = nops;
+    it->shape = scratch_alloc(cap * sizeof(*it->shape));
+    it->index = scratch_alloc(cap * sizeof(*it->index));
+    for (uint32_t o = 0; o < nops; o++) {
+        it->stride[o] = scratch_alloc(cap * sizeof(*it->stride[o]));
+        it->off[o] = 0;
+    }
+}
+
+// shape and strides are copied into the scratch arena (the caller owns the mark)
+static void iter_init(iter_t *it, dim_t ndim, const dim_sz_t *shape, uint32_t nops, stride_t *const *strides) {
+    iter_alloc(it, MAX(ndim, 1), nops);
+
+    // a dim can be merged into the previous (outer) one when, for every operand, stepping the outer dim once is
+    // the same as stepping the inner one shape times
+    dim_t n = 0;
+    for (dim_t d = 0; d < ndim; d++) {
+        if (shape[d] == 1) continue;
+        bool merge = n > 0;
+        for (uint32_t o = 0; o < nops && merge; o++) merge = it->stride[o][n-1] == strides[o][d] * (stride_t) shape[d];
+        if (merge) {
+            it->shape[n-1] *= shape[d];
+            for (uint32_t o = 0; o < nops; o++) it->stride[o][n-1] = strides[o][d];
+        } else {
+            it->shape[n] = shape[d];
+            for (uint32_t o = 0; o < nops; o++) it->stride[o][n] = strides[o][d];
+            n++;
+        }
+    }
+    if (n == 0) {
+        it->shape[0] = 1;
+        for (uint32_t o = 0; o < nops; o++) it->stride[o][0] = 0;
+        n = 1;
+    }
+    it->ndim = n;
+    memset(it->index, 0, n * sizeof(*it->index));
+}
+
+// moves to the next run (increasing the index of the outer dims); returns false once all runs were visited
+static bool iter_next(iter_t *it) {
+    for (dim_t d = it->ndim-2; d >= 0; d--) {
+        it->index[d]++;
+        for (uint32_t o = 0; o < it->nops; o++) it->off[o] += it->stride[o][d];
+        if (it->index[d] < it->shape[d]) return true;
+        it->index[d] = 0;
+        for (uint32_t o = 0; o < it->nops; o++) it->off[o] -= (size_t) it->stride[o][d] * it->shape[d];
+    }
+    return false;
+}
+
+// FNV-1a
+static uint64_t plan_hash(uint64_t h, const void *data, size_t len) {
+    const uint8_t *p = data;
+    for (size_t i = 0; i < len; i++) h = (h ^ p[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+static bool plan_matches(const plan_t *p, uint64_t hash, tensor_op_t op, uint32_t gen, uint32_t nin, tensor_t *const *in) {
+    if (p->hash != hash || p->op != op || p->gen != gen || p->nin != nin) return false;
+    for (uint32_t k = 0; k < nin; k++) {
+        if (p->in_ndim[k] != in[k]->ndim) return false;
+        if (memcmp(p->in_shape[k], in[k]->shape, in[k]->ndim * sizeof(*in[k]->shape)) != 0) return false;
+        if (memcmp(p->in_stride[k], in[k]->stride, in[k]->ndim * sizeof(*in[k]->stride)) != 0) return false;
+    }
+    return true;
+}
+
+// plans an elementwise op over nin broadcast inputs: sets shape to the output shape (in the scratch arena, the
+// caller owns the mark), it to an iterator over the (contiguous) output followed by the inputs and fn to the
+// kernel for the layout of the innermost run (not resolved for OP_CONST, used by ewprog which resolves per
+// instruction); returns the number of dims of the output or 0 if the shapes are not compatible.
+// Plans only depend on the shapes and strides of the inputs, so the last ones are kept in a small per-thread
+// cache and a repeated call costs a hash and a compare instead of broadcasting, merging dims and resolving.
+static dim_t ew_plan(tensor_op_t op, uint32_t nin, tensor_t *const *in, dim_sz_t **shape, iter_t *it, kernel_t *fn) {
+    assert(nin > 0 && nin < ITER_MAX_OPS);
+    uint32_t gen = dispatch_generation();
+    plan_t *p = NULL;
+    uint64_t h = 0;
+    bool cacheable = nin < PLAN_MAX_OPS;
+    for (uint32_t k = 0; k < nin && cacheable; k++) cacheable = in[k]->ndim <= TENSOR_INLINE_DIM;
+    if (cacheable) {
+        h = plan_hash(0xcbf29ce484222325ULL, &op, sizeof(op));
+        for (uint32_t k = 0; k < nin; k++) {
+            h = plan_hash(h, &in[k]->ndim, sizeof(in[k]->ndim));
+            h = plan_hash(h, in[k]->shape, in[k]->ndim * sizeof(*in[k]->shape));
+            h = plan_hash(h, in[k]->stride, in[k]->ndim * sizeof(*in[k]->stride));
+        }
+        p = &_plans[h & (PLAN_CACHE_SIZE - 1)];
+        if (plan_matches(p, h, op, gen, nin, in)) {
+            _plan_stats.hits++;
+            *shape = scratch_alloc(p->ndim * sizeof(**shape));
+            memcpy(*shape, p->shape, p->ndim * sizeof(**shape));
+            iter_alloc(it, p->it_ndim, nin + 1);
+            it->ndim = p->it_ndim;
+            memcpy(it->shape, p->it_shape, p->it_ndim * sizeof(*it->shape));
+            for (uint32_t o = 0; o <= nin; o++) memcpy(it->stride[o], p->it_stride[o], p->it_ndim * sizeof(*it->stride[o]));
+            memset(it->index, 0, p->it_ndim * sizeof(*it->index));
+            *fn = p->fn;
+            return p->ndim;
+        }
+    }
+    _plan_stats.misses++;
+
+    dim_t maxdim = 0;
+    for (uint32_t k = 0; k < nin; k++) maxdim = MAX(maxdim, in[k]->ndim);
+    *shape = scratch_alloc(maxdim * sizeof(**shape));
+    dim_t ndim = broadcast_shapes(nin, in, *shape);
+    if (ndim == 0) return 0;
+
+    // the output is allocated contiguous by the caller
+    stride_t *strides[ITER_MAX_OPS];
+    strides[0] = scratch_alloc(ndim * sizeof(*strides[0]));
+    strides[0][ndim-1] = 1;
+    for (dim_t d = ndim-2; d >= 0; d--) strides[0][d] = strides[0][d+1] * (*shape)[d+1];
+    for (uint32_t k = 0; k < nin; k++) strides[k + 1] = expand_strides(in[k], ndim, *shape);
+    iter_init(it, ndim, *shape, nin + 1, strides);
+
+    // unary kernels only take contiguous runs (strided ones are gathered first)
+    fn->any = NULL;
+    if (OP_IS_UNARY(op)) *fn = kernel_resolve(op, DTYPE_F32, LAYOUT_CONTIGUOUS);
+    else if (op != OP_CONST) {
+        stride_t rs[ITER_MAX_OPS];
+        for (uint32_t k = 0; k < nin; k++) rs[k] = ITER_STRIDE(it, k + 1);
+        *fn = kernel_resolve(op, DTYPE_F32, layout_of(nin, rs));
+    }
+
+    if (p != NULL) {
+        p->hash = h;
+        p->op = op;
+        p->gen = gen;
+        p->nin = nin;
+        for (uint32_t k = 0; k < nin; k++) {
+            p->in_ndim[k] = in[k]->ndim;
+            memcpy(p->in_shape[k], in[k]->shape, in[k]->ndim * sizeof(*in[k]->shape));
+            memcpy(p->in_stride[k], in[k]->stride, in[k]->ndim * sizeof(*in[k]->stride));
+        }
+        p->ndim = ndim;
+        memcpy(p->shape, *shape, ndim * sizeof(*p->shape));
+        p->it_ndim = it->ndim;
+        memcpy(p->it_shape, it->shape, it->ndim * sizeof(*it->shape));
+        for (uint32_t o = 0; o <= nin; o++) memcpy(p->it_stride[o], it->stride[o], it->ndim * sizeof(*it->stride[o]));
+        p->fn = *fn;
+    }
+    return ndim;
+}
+
+/**
+ * Returns how often the elementwise ops of the calling thread found their plan in the plan cache
+ *
+ * @param stats where to store the counters
+ */
+void tensor_plan_stats(tensor_plan_stats_t *stats) {
+    assert(stats != NULL);
+    *stats = _plan_stats;
+}
+
+static uint8_t int_digits(double a) {
+    uint8_t n = (uint8_t) fabs(a);
+    if (n == 0) return 1;
+    return (uint8_t) log10(n) + 1;
+}
+
+static bool has_decimals(double x) {
+    double intpart;
+    double frac = modf(x, &intpart);
+    return frac != 0.0;
+}
+
+static size_t tuple2str(void *tuple, const size_t numel, const size_t szel, const char *const fmtel, char *dst, const size_t dstlen) {
+    int w = 0; // number of written characters by snprintf
+    size_t o = 0; // dst current offset and length
+
+    w = snprintf(&dst[o], dstlen-o, "(");
+    if (w < 0 || o+w+1 >= dstlen) return 0;
+    o += w;
+
+    for (size_t i = 0; i < numel; i++) {
+        if (szel == 0 || tuple == NULL) {
+            w = snprintf(&dst[o], dstlen-o, "%s", fmtel);
+        } else if (szel == sizeof(uint8_t)) {
             w = snprintf(&dst[o], dstlen-o, fmtel, *(uint8_t*)(tuple + i*szel));
         } else if (szel == sizeof(uint16_t)) {
             w = snprintf(&dst[o], dstlen-o, fmtel, *(uint16_t*)(tuple + i*szel));
@@ -713,20 +3293,30 @@ void tfprint(FILE *stream, tensor_t *t) {
     assert(t->stride != NULL);
     assert(t->data != NULL);
 
+    scratch_mark_t m = scratch_mark();
+
     // find out how many digits we need to print each element
     float maxel = t->data[0];
-    for (uint32_t i = 1; i < t->numel; i++) if (t->data[i] > maxel) maxel = t->data[i];
-    uint8_t ndigits = int_digits(maxel);
     bool decimals = false;
-    for (uint32_t i = 0; i < t->numel && !decimals; i++) decimals = has_decimals(t->data[i]);
+    iter_t it;
+    iter_init(&it, t->ndim, t->shape, 1, &t->stride);
+    dim_sz_t n = ITER_RUN(&it);
+    stride_t s = ITER_STRIDE(&it, 0);
+    do {
+        const float *p = t->data + it.off[0];
+        for (dim_sz_t i = 0; i < n; i++) {
+            if (p[i * s] > maxel) maxel = p[i * s];
+            if (!decimals) decimals = has_decimals(p[i * s]);
+        }
+    } while (iter_next(&it));
+    uint8_t ndigits = int_digits(maxel);
     char *fmt = "%*g";
     if (decimals) {
         fmt = "%*.4f";
         ndigits += 5;
     }
 
-    dim_t *index = malloc(t->ndim * sizeof(*index));
-    assert(index != NULL);
+    dim_t *index = scratch_alloc(t->ndim * sizeof(*index));
     memset(index, 0, t->ndim * sizeof(*index));
 
     dim_t nnln = 0; // number of new lines to print closing
@@ -758,9 +3348,9 @@ void tfprint(FILE *stream, tensor_t *t) {
             nnln++; // for each dimension, a new line should be printed, but only after all closing ]
         }
     }
-    printf("\n");
+    fprintf(stream, "\n");
 
-    free(index);
+    scratch_reset(m);
 }
 
 void tprint(tensor_t *t) {
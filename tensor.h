@@ -15,7 +15,9 @@ typedef int32_t dim_t;
 typedef int32_t dim_sz_t; // TODO: int32_t or int64_t?
 typedef uint32_t stride_t;
 
-// TODO: add view_t to tensor_t to allow multiple tensors to point to the same data (good idea?)
+#define TENSOR_INLINE_DIM 8 // tensors with up to this many dims keep their shape and stride inside tensor_t
+
+// data buffer shared by a tensor and all of its views
 typedef struct {
     uint32_t refs; // number of tensors that point to this view (0 -> data should be freed)
     float *data;
@@ -27,18 +29,175 @@ typedef struct {
     dim_sz_t *shape;
     stride_t *stride;
     uint32_t numel;
-    float *data;
+    float *data; // first element (views point somewhere inside their view's data)
+    view_t *view; // storage data points into (NULL when data is _scalar)
+    dim_sz_t _shape[TENSOR_INLINE_DIM]; // storage for shape when ndim <= TENSOR_INLINE_DIM
+    stride_t _stride[TENSOR_INLINE_DIM]; // storage for stride when ndim <= TENSOR_INLINE_DIM
+    float _scalar; // storage for data when numel == 1
 } tensor_t;
 
 typedef enum {
+    // binary (ewop)
     OP_ADD,
-    OP_MUL
+    OP_MUL,
+    OP_SUB,
+    OP_DIV,
+    OP_POW,
+    OP_MAXIMUM,
+    OP_MINIMUM,
+    OP_EQ, // masks: 1 where true, 0 elsewhere
+    OP_LT,
+    OP_GT,
+    // unary (uop)
+    OP_EXP,
+    OP_LOG,
+    OP_TANH,
+    OP_SIGMOID,
+    OP_SQRT,
+    OP_RELU,
+    OP_GELU, // tanh approximation
+    // ternary
+    OP_FMA, // a * b + c (single rounding)
+    OP_WHERE, // a != 0 ? b : c
+    // ewprog only
+    OP_CONST, // broadcast constant (ew_instr_t.imm)
+    // reductions
+    OP_SUM,
+    OP_MIN,
+    OP_MAX,
+    // matrix products
+    OP_MATMUL,
+    OP_DOT,
+    OP_GEMV,
+    OP_GEMV_T,
+    OP_MATMUL_Q8,
+    OP_GEMV_Q4,
+    // int8 conversions
+    OP_QUANTIZE,
+    OP_DEQUANTIZE,
+    // convolutions (direct, channels last)
+    OP_CONV,
+    OP_CONV_DW, // depthwise
+    // normalizations along a dim
+    OP_SOFTMAX,
+    OP_LOG_SOFTMAX,
+    OP_LOGSUMEXP,
+    OP_LAYERNORM,
+    OP_RMSNORM,
+    OP_MOMENTS, // mean and variance
+    OP_NOPS
 } tensor_op_t;
 
+#define EW_MAX_INPUTS 7 // tensors an elementwise program can read
+#define EW_MAX_INSTR 16 // instructions in an elementwise program
+
+// instruction of an elementwise program (see ewprog): registers 0 to ninputs-1 hold the inputs and
+// instruction i writes register ninputs + i; the last instruction gives the result
+typedef struct {
+    tensor_op_t op; // any binary, unary or ternary op, or OP_CONST
+    uint8_t a, b, c; // operand registers (b and c only for the ops that take them)
+    float imm; // value of OP_CONST
+} ew_instr_t;
+
+typedef enum {
+    MATMUL_ACT_NONE,
+    MATMUL_ACT_RELU,
+    MATMUL_ACT_GELU, // tanh approximation (see gelu)
+    MATMUL_ACT_SIGMOID,
+    MATMUL_NACTS
+} matmul_act_t;
+
+// applied to every output element of matmul_fused: act(scale * (a @ b) + bias) + residual; bias and residual are
+// broadcast to the output shape (a bias is usually of shape (N)). A zeroed epilogue does nothing.
+typedef struct {
+    bool scaled; // scale is only applied when set
+    float scale;
+    tensor_t *bias; // NULL for none
+    matmul_act_t act;
+    tensor_t *residual; // NULL for none
+} matmul_epilogue_t;
+
+typedef struct {
+    uint64_t tensors; // live tensors
+    uint64_t bytes; // live bytes (tensor headers and data buffers)
+    uint64_t peak; // high-water mark of live bytes
+    uint64_t allocs; // total number of allocations
+    uint64_t cached; // bytes held by the allocator cache for reuse
+    uint64_t hits; // allocations served from the cache
+    uint64_t misses; // allocations that went to the system allocator
+} tensor_mem_stats_t;
+
+typedef struct {
+    uint64_t hits; // elementwise ops that reused a cached plan
+    uint64_t misses; // elementwise ops that had to plan (and cache the result when it fits)
+} tensor_plan_stats_t;
+
+// hyperparameters of conv1d/conv2d, per spatial dim (height then width; conv1d only reads the first entries)
+typedef struct {
+    dim_sz_t stride[2]; // 0 is read as 1
+    dim_sz_t padding[2]; // zeros added on both sides
+    dim_sz_t dilation[2]; // 0 is read as 1
+    dim_sz_t groups; // 0 is read as 1
+} conv_params_t;
+
+// window of the pooling ops, per spatial dim (height then width; the 1-d ops only read the first entries)
+typedef struct {
+    dim_sz_t kernel[2];
+    dim_sz_t stride[2]; // 0 is read as the kernel size
+    dim_sz_t padding[2]; // at most half the kernel; padded elements are ignored
+    bool count_pad; // avg pooling divides by the whole window, padding included
+} pool_params_t;
+
+// int8 tensor (row-major, contiguous): element i stands for scale * (data[i] - zero) with a single scale and zero
+// point for the whole tensor (axis -1) or one per index of axis (per channel); values are in [-127, 127]
+typedef struct {
+    dim_t ndim;
+    dim_sz_t *shape;
+    uint32_t numel;
+    int8_t *data;
+    dim_t axis; // -1 for per tensor
+    float *scale; // shape[axis] scales (1 per tensor)
+    int32_t *zero; // zero points, like scale
+} qtensor_t;
+
+#define Q4_BLOCK 32 // values per block of a 4-bit tensor
+
+// block of a 4-bit tensor: value j is scale * (q_j - 8) where q_j is the low nibble of qs[j] for j < 16 and the
+// high nibble of qs[j - 16] otherwise; scale is an IEEE half (18 bytes for 32 values)
+typedef struct {
+    uint16_t scale;
+    uint8_t qs[Q4_BLOCK / 2];
+} q4_block_t;
+
+// 4-bit matrix: each row is cut into blocks of Q4_BLOCK values (the last one padded with zeros)
+typedef struct {
+    dim_sz_t rows, cols;
+    uint32_t nblocks; // blocks per row
+    q4_block_t *blocks;
+} q4tensor_t;
+
+typedef struct {
+    const char *op; // name of the op
+    uint64_t tensors; // tensors created by the op
+    uint64_t allocs; // allocations charged to the op
+    uint64_t bytes; // bytes allocated by the op (cumulative)
+} tensor_op_stats_t;
+
 tensor_t *tensor_alloc(dim_t ndim, dim_sz_t *shape);
 void tensor_free(tensor_t *t);
 tensor_t *range(float start, float end, float step);
 tensor_t *fill(uint32_t numel, float value);
+tensor_t *zeros(dim_t ndim, dim_sz_t *shape);
+tensor_t *ones(dim_t ndim, dim_sz_t *shape);
+tensor_t *full(dim_t ndim, dim_sz_t *shape, float value);
+tensor_t *arange(float start, float end, float step);
+tensor_t *linspace(float start, float end, uint32_t n);
+void tensor_seed(uint64_t seed);
+tensor_t *trand(dim_t ndim, dim_sz_t *shape);
+tensor_t *trandn(dim_t ndim, dim_sz_t *shape);
+tensor_t *trandint(dim_t ndim, dim_sz_t *shape, int32_t low, int32_t high);
+tensor_t *tuniform(dim_t ndim, dim_sz_t *shape, float low, float high);
+tensor_t *tnormal(dim_t ndim, dim_sz_t *shape, float mean, float std);
 bool is_contiguous(tensor_t *t);
 tensor_t *contiguous(tensor_t *t);
 dim_t resolve_shape(uint32_t numel, dim_t ndim, dim_sz_t *shape);
@@ -48,17 +207,83 @@ tensor_t *squeeze(tensor_t *t, dim_t dim);
 tensor_t *unsqueeze(tensor_t *t, dim_t dim);
 tensor_t *transpose(tensor_t *t, dim_t dim1, dim_t dim2);
 tensor_t *reshape(tensor_t *t, dim_t ndim, dim_sz_t *shape);
+tensor_t *expand(tensor_t *t, dim_t ndim, dim_sz_t *shape);
+tensor_t *permute(tensor_t *t, dim_t *perm);
+tensor_t *slice(tensor_t *t, dim_t dim, dim_sz_t start, dim_sz_t stop, dim_sz_t step);
+tensor_t *narrow(tensor_t *t, dim_t dim, dim_sz_t start, dim_sz_t length);
+tensor_t *tselect(tensor_t *t, dim_t dim, dim_sz_t index);
 
 tensor_t *min(tensor_t *t);
 tensor_t *max(tensor_t *t);
 tensor_t *sumall(tensor_t *t);
 tensor_t *sum(tensor_t *t, dim_t dim, bool keepdim);
+tensor_t *meanall(tensor_t *t);
+tensor_t *mean(tensor_t *t, dim_t dim, bool keepdim);
+tensor_t *varall(tensor_t *t, dim_sz_t correction);
+tensor_t *var(tensor_t *t, dim_t dim, dim_sz_t correction, bool keepdim);
+tensor_t *stdall(tensor_t *t, dim_sz_t correction);
+tensor_t *std(tensor_t *t, dim_t dim, dim_sz_t correction, bool keepdim);
 tensor_t *add(tensor_t *a, tensor_t *b);
 tensor_t *mul(tensor_t *a, tensor_t *b);
+tensor_t *sub(tensor_t *a, tensor_t *b);
+tensor_t *tdiv(tensor_t *a, tensor_t *b);
+tensor_t *tpow(tensor_t *a, tensor_t *b);
+tensor_t *maximum(tensor_t *a, tensor_t *b);
+tensor_t *minimum(tensor_t *a, tensor_t *b);
+tensor_t *eq(tensor_t *a, tensor_t *b);
+tensor_t *lt(tensor_t *a, tensor_t *b);
+tensor_t *gt(tensor_t *a, tensor_t *b);
+tensor_t *where(tensor_t *cond, tensor_t *a, tensor_t *b);
+tensor_t *tfma(tensor_t *a, tensor_t *b, tensor_t *c);
+tensor_t *ewprog(uint32_t ninputs, tensor_t **inputs, uint32_t ninstr, const ew_instr_t *prog);
+tensor_t *texp(tensor_t *t);
+tensor_t *tlog(tensor_t *t);
+tensor_t *ttanh(tensor_t *t);
+tensor_t *sigmoid(tensor_t *t);
+tensor_t *tsqrt(tensor_t *t);
+tensor_t *relu(tensor_t *t);
+tensor_t *gelu(tensor_t *t);
+tensor_t *matmul(tensor_t *a, tensor_t *b);
+tensor_t *matmul_fused(tensor_t *a, tensor_t *b, const matmul_epilogue_t *ep);
+tensor_t *dot(tensor_t *a, tensor_t *b);
+tensor_t *gemv(tensor_t *m, tensor_t *x);
+tensor_t *gemv_t(tensor_t *m, tensor_t *x);
+tensor_t *conv1d(tensor_t *x, tensor_t *w, tensor_t *bias, const conv_params_t *p);
+tensor_t *conv2d(tensor_t *x, tensor_t *w, tensor_t *bias, const conv_params_t *p);
+tensor_t *maxpool1d(tensor_t *x, const pool_params_t *p);
+tensor_t *maxpool2d(tensor_t *x, const pool_params_t *p);
+tensor_t *avgpool1d(tensor_t *x, const pool_params_t *p);
+tensor_t *avgpool2d(tensor_t *x, const pool_params_t *p);
+tensor_t *adaptive_avgpool1d(tensor_t *x, dim_sz_t ol);
+tensor_t *adaptive_avgpool2d(tensor_t *x, dim_sz_t oh, dim_sz_t ow);
+tensor_t *softmax(tensor_t *t, dim_t dim);
+tensor_t *log_softmax(tensor_t *t, dim_t dim);
+tensor_t *logsumexp(tensor_t *t, dim_t dim, bool keepdim);
+tensor_t *layernorm(tensor_t *x, tensor_t *gamma, tensor_t *beta, float eps);
+tensor_t *rmsnorm(tensor_t *x, tensor_t *gamma, float eps);
+qtensor_t *quantize(tensor_t *t);
+qtensor_t *quantize_channels(tensor_t *t, dim_t axis);
+tensor_t *dequantize(qtensor_t *q);
+void qtensor_free(qtensor_t *q);
+tensor_t *matmul_q8(qtensor_t *a, qtensor_t *b);
+q4tensor_t *quantize_q4(tensor_t *t);
+tensor_t *dequantize_q4(q4tensor_t *q);
+void q4tensor_free(q4tensor_t *q);
+tensor_t *gemv_q4(q4tensor_t *m, tensor_t *x);
+void tensor_set_fast_math(bool on);
+void tensor_plan_stats(tensor_plan_stats_t *stats);
+bool tensor_fast_math();
 void tfinfo(FILE *stream, tensor_t *t);
 void tinfo(tensor_t *t);
 void tfprint(FILE *stream, tensor_t *t);
 void tprint(tensor_t *t);
+void tensor_mem_stats(tensor_mem_stats_t *stats);
+uint32_t tensor_mem_op_stats(tensor_op_stats_t *stats, uint32_t n);
+void tensor_mem_report(FILE *stream);
+void tensor_cache_trim();
+size_t tensor_cache_limit(size_t bytes);
+uint32_t tensor_threads();
+void tensor_set_threads(uint32_t n);
 void tprint_shape(uint32_t n, dim_sz_t *shape);
 void tfprint_shape(FILE *stream, uint32_t n, dim_sz_t *shape);
 void tprint_stride(uint32_t n, stride_t *stride);
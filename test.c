@@ -1,10 +1,20 @@
 #include "tensor.h"
+#include "debug.h"
+#include "mem.h"
+#include "parallel.h"
+#include "kernels.h"
+#include "dispatch.h"
+#include <pthread.h>
 #include <assert.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <float.h>
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 #define CHECK_ABORT(code) do { \
     pid_t pid = fork(); \
@@ -263,6 +273,7 @@ const char *test_sum_dim4() {
         tensor_t *r = sum(t, 0, false);
         assert(r->numel == numel);
         for (uint32_t i = 0; i < numel; i++) assert(expected[i] == r->data[i]);
+        tensor_free(r);
     }
 
     {
@@ -271,6 +282,7 @@ const char *test_sum_dim4() {
         tensor_t *r = sum(t, 1, false);
         assert(r->numel == numel);
         for (uint32_t i = 0; i < numel; i++) assert(expected[i] == r->data[i]);
+        tensor_free(r);
     }
 
     {
@@ -279,6 +291,7 @@ const char *test_sum_dim4() {
         tensor_t *r = sum(t, 2, false);
         assert(r->numel == numel);
         for (uint32_t i = 0; i < numel; i++) assert(expected[i] == r->data[i]);
+        tensor_free(r);
     }
 
     {
@@ -287,36 +300,1659 @@ const char *test_sum_dim4() {
         tensor_t *r = sum(t, 3, false);
         assert(r->numel == numel);
         for (uint32_t i = 0; i < numel; i++) assert(expected[i] == r->data[i]);
+        tensor_free(r);
     }
 
+    tensor_free(t);
+
     return __func__;
 }
 
-const char *(*fnx[])(void) = {
-    // test_transpose,
-    // test_is_contiguous,
-    // test_reshape,
-    // test_broadcast,
-    // test_squeeze_unqueeze,
-    // test_min_max,
-    // test_sumall,
-    test_sum_dim0, test_sum_dim1_keepdim, test_sum_negative_dim, test_sum_dim_out_of_range, test_sum_dim4,
-};
+/********************* EXPAND *********************/
 
-int main(int argc, char **argv) {
-    // for (uint32_t i = 0; i < sizeof(fnx) / sizeof(*fnx); i++) printf("%s\n", fnx[i]());
+const char *test_expand() {
+    tensor_t *t = tensor_alloc(2, (dim_sz_t[]){3, 1});
+    for (uint32_t i = 0; i < t->numel; i++) t->data[i] = i + 1; // [[1], [2], [3]]
+
+    tensor_t *e = expand(t, 3, (dim_sz_t[]){2, -1, 4});
+    assert(e->ndim == 3 && e->numel == 24);
+    assert(memcmp(e->shape, (dim_sz_t[]){2, 3, 4}, e->ndim * sizeof(dim_sz_t)) == 0);
+    assert(memcmp(e->stride, (stride_t[]){0, 1, 0}, e->ndim * sizeof(stride_t)) == 0);
+    assert(e->data == t->data);
+    assert(!is_contiguous(e));
+
+    // reductions and elementwise ops read the view without materializing it
+    tensor_t *s = sumall(e);
+    assert(*s->data == 2 * 4 * (1 + 2 + 3));
+    tensor_t *s1 = sum(e, 1, false);
+    assert(s1->ndim == 2 && s1->numel == 8);
+    for (uint32_t i = 0; i < s1->numel; i++) assert(s1->data[i] == 6);
+    tensor_t *mx = max(e);
+    assert(*mx->data == 3);
+
+    tensor_t *b = tensor_alloc(1, (dim_sz_t[]){4});
+    for (uint32_t i = 0; i < b->numel; i++) b->data[i] = 10 * (i + 1);
+    tensor_t *c = add(t, b); // (3, 1) + (4) -> (3, 4)
+    assert(c->ndim == 2 && c->shape[0] == 3 && c->shape[1] == 4);
+    for (uint32_t i = 0; i < 3; i++) {
+        for (uint32_t j = 0; j < 4; j++) assert(c->data[i * 4 + j] == (i + 1) + 10 * (j + 1));
+    }
+
+    // the view keeps the data alive after the original tensor is freed
+    tensor_free(t);
+    contiguous(e);
+    assert(is_contiguous(e));
+    for (uint32_t i = 0; i < e->numel; i++) assert(e->data[i] == (i / 4) % 3 + 1);
+
+    // expanding a scalar shares it too
+    tensor_t *one = tensor_alloc(1, (dim_sz_t[]){1});
+    *one->data = 5;
+    tensor_t *ones = expand(one, 2, (dim_sz_t[]){2, 2});
+    *one->data = 7;
+    assert(ones->data[0] == 7);
+
+    FILE *null = fopen("/dev/null", "w");
+    tfprint(null, ones);
+    fclose(null);
+
+    tensor_free(one);
+    tensor_free(ones);
+    tensor_free(e);
+    tensor_free(s);
+    tensor_free(s1);
+    tensor_free(mx);
+    tensor_free(b);
+    tensor_free(c);
+
+    return __func__;
+}
+
+/********************* PERMUTE *********************/
+
+const char *test_permute() {
+    // NCHW -> NHWC with sizes that are not multiples of the copy tile
+    const dim_sz_t N = 2, C = 3, H = 37, W = 45;
+    tensor_t *t = reshape(range(0, N * C * H * W, 1), 4, (dim_sz_t[]){N, C, H, W});
+    tensor_t *p = permute(t, (dim_t[]){0, 2, 3, -3});
+    assert(memcmp(p->shape, (dim_sz_t[]){N, H, W, C}, p->ndim * sizeof(dim_sz_t)) == 0);
+    assert(memcmp(p->stride, (stride_t[]){C * H * W, W, 1, H * W}, p->ndim * sizeof(stride_t)) == 0);
+    assert(p->data == t->data);
+
+    contiguous(p);
+    assert(is_contiguous(p));
+    for (dim_sz_t n = 0; n < N; n++)
+        for (dim_sz_t h = 0; h < H; h++)
+            for (dim_sz_t w = 0; w < W; w++)
+                for (dim_sz_t c = 0; c < C; c++)
+                    assert(p->data[((n * H + h) * W + w) * C + c] == t->data[((n * C + c) * H + h) * W + w]);
+
+    // and back
+    tensor_t *q = contiguous(permute(p, (dim_t[]){0, 3, 1, 2}));
+    assert(memcmp(q->data, t->data, t->numel * sizeof(float)) == 0);
+
+    CHECK_ABORT({ permute(t, (dim_t[]){0, 1, 1, 2}); });
+
+    tensor_free(t);
+    tensor_free(p);
+    tensor_free(q);
+
+    return __func__;
+}
+
+/********************* SLICE *********************/
+
+const char *test_slice() {
+    tensor_t *t = reshape(range(0, 24, 1), 2, (dim_sz_t[]){4, 6});
+
+    // every other column from 1: [[1, 3, 5], [7, 9, 11], ...]
+    tensor_t *s = slice(t, 1, 1, 6, 2);
+    assert(s->numel == 12);
+    assert(memcmp(s->shape, (dim_sz_t[]){4, 3}, s->ndim * sizeof(dim_sz_t)) == 0);
+    assert(memcmp(s->stride, (stride_t[]){6, 2}, s->ndim * sizeof(stride_t)) == 0);
+    assert(s->data == t->data + 1);
+    tensor_t *ss = sumall(s);
+    assert(*ss->data == (1 + 3 + 5) * 4 + 6 * 3 * (0 + 1 + 2 + 3));
+
+    // negative bounds count from the end
+    tensor_t *n = narrow(t, 0, -2, 2);
+    assert(n->shape[0] == 2 && n->data == t->data + 12);
+    tensor_t *r = tselect(n, 0, 1);
+    assert(r->ndim == 1 && r->shape[0] == 6 && r->data[0] == 18);
+    tensor_t *c = tselect(t, -1, 5); // column 5: [5, 11, 17, 23]
+    assert(c->ndim == 1 && c->shape[0] == 4 && c->stride[0] == 6);
+    tensor_t *d = add(r, r);
+    for (uint32_t i = 0; i < 6; i++) assert(d->data[i] == 2 * (18 + i));
+
+    // writes through a view land in the original tensor
+    c->data[c->stride[0] * 3] = -1;
+    assert(t->data[23] == -1);
+
+    tensor_free(t);
+    contiguous(c);
+    assert(memcmp(c->data, (float[]){5, 11, 17, -1}, 4 * sizeof(float)) == 0);
+
+    tensor_free(s);
+    tensor_free(ss);
+    tensor_free(n);
+    tensor_free(r);
+    tensor_free(c);
+    tensor_free(d);
+
+    return __func__;
+}
+
+/********************* MEMORY *********************/
+
+static const tensor_op_stats_t *find_op(const tensor_op_stats_t *ops, uint32_t n, const char *op) {
+    for (uint32_t i = 0; i < n; i++) if (strcmp(ops[i].op, op) == 0) return &ops[i];
+    return NULL;
+}
+
+const char *test_mem_stats() {
+    tensor_mem_stats_t s0, s1, s2;
+    tensor_mem_stats(&s0);
+
+    tensor_t *a = tensor_alloc(2, (dim_sz_t[]){4, 8});
+    tensor_t *b = tensor_alloc(2, (dim_sz_t[]){4, 8});
+    tensor_t *c = add(a, b);
+    tensor_mem_stats(&s1);
+    assert(s1.tensors == s0.tensors + 3);
+    assert(s1.bytes == s0.bytes + 3 * (sizeof(tensor_t) + MEM_ALIGN + 32 * sizeof(float))); // header, view, data
+    assert(s1.peak >= s1.bytes);
+    assert(s1.allocs == s0.allocs + 6);
+
+    tensor_op_stats_t ops[64];
+    uint32_t n = tensor_mem_op_stats(ops, 64);
+    const tensor_op_stats_t *op = find_op(ops, n, "add");
+    assert(op != NULL && op->tensors >= 1 && op->bytes >= sizeof(tensor_t) + MEM_ALIGN + 32 * sizeof(float));
+
+    tensor_free(a);
+    tensor_free(b);
+    tensor_free(c);
+    tensor_mem_stats(&s2);
+    assert(s2.tensors == s0.tensors);
+    assert(s2.bytes == s0.bytes);
+    assert(s2.peak == s1.peak);
+
+    return __func__;
+}
+
+const char *test_mem_cache() {
+    tensor_mem_stats_t s0, s1;
+    tensor_cache_trim();
+
+    // a freed buffer is reused by the next allocation of the same size class
+    tensor_t *t = tensor_alloc(2, (dim_sz_t[]){500, 1024});
+    float *data = t->data;
+    tensor_free(t);
+    tensor_mem_stats(&s0);
+    assert(s0.cached >= 500 * 1024 * sizeof(float));
+    t = tensor_alloc(2, (dim_sz_t[]){1000, 510});
+    tensor_mem_stats(&s1);
+    assert(t->data == data);
+    assert(s1.hits == s0.hits + 1); // the header comes from the tensor header pool
+    assert(s1.misses == s0.misses);
+    assert(((uintptr_t) t->data % 64) == 0);
+    tensor_free(t);
+
+    // with the limit at 0 nothing is kept
+    size_t prev = tensor_cache_limit(0);
+    tensor_mem_stats(&s0);
+    assert(s0.cached == 0);
+    t = tensor_alloc(1, (dim_sz_t[]){1024});
+    tensor_free(t);
+    tensor_mem_stats(&s1);
+    assert(s1.cached == 0);
+    assert(s1.misses == s0.misses + 1);
+    tensor_cache_limit(prev);
+
+    return __func__;
+}
+
+const char *test_scalar_pool() {
+    tensor_t *t = tensor_alloc(1, (dim_sz_t[]){4});
+    for (uint32_t i = 0; i < t->numel; i++) t->data[i] = i;
+
+    // scalar results keep their value inside the (pooled) header
+    tensor_t *r = max(t);
+    assert(r->data == &r->_scalar);
+    assert(r->shape == r->_shape);
+    assert(*r->data == 3);
+    tensor_free(r);
+
+    tensor_mem_stats_t s0, s1;
+    tensor_mem_stats(&s0);
+    tensor_t *r2 = min(t);
+    tensor_mem_stats(&s1);
+    assert(r2 == r);
+    assert(*r2->data == 0);
+    assert(s1.tensors == s0.tensors + 1);
+    assert(s1.hits == s0.hits && s1.misses == s0.misses);
+    tensor_free(r2);
+
+    // tensors with many dims move their shape to the heap and back
+    reshape(t, 9, (dim_sz_t[]){1, 1, 1, 1, 1, 1, 1, 2, 2});
+    assert(t->shape != t->_shape);
+    assert(memcmp(t->stride, (stride_t[]){4, 4, 4, 4, 4, 4, 4, 2, 1}, t->ndim * sizeof(stride_t)) == 0);
+    reshape(t, 2, (dim_sz_t[]){2, 2});
+    assert(t->shape == t->_shape);
+    tensor_free(t);
+
+    return __func__;
+}
+
+const char *test_scratch() {
+    scratch_mark_t m0 = scratch_mark();
+    float *a = scratch_alloc(10 * sizeof(float));
+    assert(((uintptr_t) a % 16) == 0);
+
+    // nested marks release only what was allocated after them
+    scratch_mark_t m1 = scratch_mark();
+    char *b = scratch_alloc(3);
+    char *big = scratch_alloc(1 << 16); // larger than a chunk
+    memset(big, 1, 1 << 16);
+    scratch_reset(m1);
+    assert(scratch_alloc(3) == b);
+
+    scratch_reset(m0);
+    assert(scratch_alloc(10 * sizeof(float)) == a);
+    scratch_reset(m0);
+
+    return __func__;
+}
+
+/********************* DEBUG *********************/
+
+#define DBG_NTHREADS 4
+#define DBG_NLINES 64 // DBG_NTHREADS * DBG_NLINES must fit in the ring so nothing is dropped
+
+static void *dbg_worker(void *arg) {
+    int id = (int) (intptr_t) arg;
+    for (int i = 0; i < DBG_NLINES; i++) DBG(DBG_ALLOC, 1, { dbg("worker=%d line=%d", id, i); });
+    return NULL;
+}
+
+const char *test_dbg_threads() {
+    FILE *out = tmpfile();
+    assert(out != NULL);
+    dbgflush();
+    dbgfile(out);
+    dbgset(DBG_NMOD, 0);
+    dbgset(DBG_ALLOC, 1);
+    assert(dbglvl(DBG_ALLOC) == 1);
+    assert(dbglvl(DBG_SHAPE) == 0);
+    uint64_t dropped = dbgdropped();
+
+    pthread_t threads[DBG_NTHREADS];
+    for (int i = 0; i < DBG_NTHREADS; i++) {
+        int rc = pthread_create(&threads[i], NULL, dbg_worker, (void *) (intptr_t) i);
+        assert(rc == 0);
+    }
+    for (int i = 0; i < DBG_NTHREADS; i++) pthread_join(threads[i], NULL);
+    dbgflush();
+
+    dbgset(DBG_ALLOC, 0);
+    dbgfile(stdout);
+    assert(dbgdropped() == dropped);
+
+    // every line arrives whole and exactly once, in per-thread order
+    int next[DBG_NTHREADS] = {0};
+    int nlines = 0;
+    char line[DBG_LINE_SIZE];
+    rewind(out);
+    while (fgets(line, sizeof(line), out) != NULL) {
+        assert(strchr(line, '\n') != NULL);
+        assert(strstr(line, "dbg_worker") != NULL);
+        const char *p = strstr(line, "worker=");
+        int id, i;
+        assert(p != NULL && sscanf(p, "worker=%d line=%d", &id, &i) == 2);
+        assert(id >= 0 && id < DBG_NTHREADS && i == next[id]);
+        next[id]++;
+        nlines++;
+    }
+    assert(nlines == DBG_NTHREADS * DBG_NLINES);
+    fclose(out);
+
+    return __func__;
+}
 
-    tensor_t *t = transpose(reshape(range(0, 48, 1), 3, (dim_sz_t[]){2, 4, 6}), 0, 2);
-    // tensor_t *t = reshape(range(0, 48, 1), 3, (dim_sz_t[]){2, 4, 6});
-    tinfo(t);
-    tprint(t);
+/********************* CONSTRUCTORS *********************/
 
-    tensor_t *r = sum(t, 0, true);
-    tinfo(r);
-    tprint(r);
+const char *test_constructors() {
+    tensor_t *t = fill(100, 2.5f); // memset used to truncate the value to a byte
+    for (uint32_t i = 0; i < t->numel; i++) assert(t->data[i] == 2.5f);
+    tensor_free(t);
+
+    t = full(3, (dim_sz_t[]){2, 3, 4}, -1.0f);
+    assert(t->ndim == 3 && t->numel == 24);
+    for (uint32_t i = 0; i < t->numel; i++) assert(t->data[i] == -1.0f);
+    tensor_free(t);
+
+    t = ones(2, (dim_sz_t[]){1, 1});
+    assert(t->data[0] == 1.0f);
+    tensor_free(t);
+
+    // large enough to come from fresh zero pages
+    t = zeros(2, (dim_sz_t[]){1024, 1024});
+    for (uint32_t i = 0; i < t->numel; i++) assert(t->data[i] == 0.0f);
+    for (uint32_t i = 0; i < t->numel; i++) t->data[i] = 1.0f;
+    float *data = t->data;
+    tensor_free(t);
+    // a dirty cached buffer is reused (and cleared in parallel) instead of mapping fresh pages again
+    tensor_mem_stats_t s0, s1;
+    tensor_mem_stats(&s0);
+    t = zeros(2, (dim_sz_t[]){1024, 1024});
+    tensor_mem_stats(&s1);
+    assert(t->data == data && s1.misses == s0.misses);
+    for (uint32_t i = 0; i < t->numel; i++) assert(t->data[i] == 0.0f);
+    tensor_free(t);
+    t = zeros(1, (dim_sz_t[]){7});
+    for (uint32_t i = 0; i < t->numel; i++) assert(t->data[i] == 0.0f);
+    tensor_free(t);
+
+    t = arange(0, 1, 0.1f);
+    assert(t->numel == 10);
+    for (uint32_t i = 0; i < t->numel; i++) assert(t->data[i] == fmaf(i, 0.1f, 0));
+    tensor_free(t);
+    t = arange(5, 0, -2); // 5 3 1
+    assert(t->numel == 3 && t->data[0] == 5 && t->data[1] == 3 && t->data[2] == 1);
+    tensor_free(t);
+
+    // no drift over long ranges (a running sum is off by thousands here)
+    t = range(0, 1 << 20, 1);
+    assert(t->numel == 1 << 20);
+    for (uint32_t i = 0; i < t->numel; i++) assert(t->data[i] == (float) i);
+    tensor_free(t);
+
+    t = linspace(-1, 1, 5);
+    assert(t->numel == 5);
+    assert(t->data[0] == -1 && t->data[1] == -0.5f && t->data[2] == 0 && t->data[3] == 0.5f && t->data[4] == 1);
+    tensor_free(t);
+    t = linspace(0, 1, 3333);
+    assert(t->data[0] == 0 && t->data[3332] == 1);
+    tensor_free(t);
+
+    CHECK_ABORT({ arange(0, 1, 0); });
+    CHECK_ABORT({ arange(1, 0, 1); });
+    CHECK_ABORT({ arange(0, 3e9f, 1); }); // more elements than an int32 dim holds
+    CHECK_ABORT({ linspace(0, 1, 3000000000u); });
+
+    return __func__;
+}
+
+static void count_chunk(void *ctx, size_t start, size_t end) {
+    uint8_t *seen = ctx;
+    for (size_t i = start; i < end; i++) seen[i]++;
+}
+
+const char *test_parallel_for() {
+    uint32_t threads = tensor_threads();
+    tensor_set_threads(4);
+    assert(tensor_threads() == 4);
+
+    // every index is visited exactly once, whatever the grain
+    size_t n = 100003;
+    uint8_t *seen = calloc(n, 1);
+    size_t grains[] = { 0, 1, 1000, n, 2 * n };
+    for (size_t g = 0; g < sizeof(grains) / sizeof(*grains); g++) {
+        memset(seen, 0, n);
+        parallel_for(n, grains[g], count_chunk, seen);
+        for (size_t i = 0; i < n; i++) assert(seen[i] == 1);
+    }
+    free(seen);
+
+    tensor_t *t = full(1, (dim_sz_t[]){1 << 20}, 3);
+    for (uint32_t i = 0; i < t->numel; i++) assert(t->data[i] == 3);
+    tensor_free(t);
+
+    tensor_set_threads(threads);
+    return __func__;
+}
+
+/********************* RANDOM *********************/
+
+const char *test_philox() {
+    // known answers from the Random123 distribution
+    uint32_t x[4] = { 0, 0, 0, 0 };
+    k_philox(x, 0);
+    assert(x[0] == 0x6627e8d5 && x[1] == 0xe169c58d && x[2] == 0xbc57ac4c && x[3] == 0x9b00dbd8);
+    uint32_t y[4] = { 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff };
+    k_philox(y, UINT64_MAX);
+    assert(y[0] == 0x408f276d && y[1] == 0x41c83b0e && y[2] == 0xa20bc7c6 && y[3] == 0x6d5451fd);
+
+    // values only depend on the element index: single elements (scalar path) match a whole run (SIMD path)
+    size_t n = 1000;
+    float *all = malloc(n * sizeof(float)), *one = malloc(n * sizeof(float));
+    k_rand_normal(all, n, 42, 7, 3, 0, 1);
+    for (size_t i = 0; i < n; i++) k_rand_normal(&one[i], 1, 42, 7, 3 + i, 0, 1);
+    assert(memcmp(all, one, n * sizeof(float)) == 0);
+    k_rand_uniform(all, n, 42, 7, 0, -1, 1);
+    for (size_t i = 0; i < n; i += 13) k_rand_uniform(&one[i], i + 13 < n ? 13 : n - i, 42, 7, i, -1, 1);
+    assert(memcmp(all, one, n * sizeof(float)) == 0);
+    k_rand_int(all, n, 42, 7, 0, -5, 10);
+    for (size_t i = 0; i < n; i++) k_rand_int(&one[i], 1, 42, 7, i, -5, 10);
+    assert(memcmp(all, one, n * sizeof(float)) == 0);
+    free(all);
+    free(one);
+
+    return __func__;
+}
+
+const char *test_random() {
+    uint32_t threads = tensor_threads();
+    dim_sz_t shape[] = { 1000, 1000 };
+
+    // same seed, same tensors (whatever the number of threads)
+    tensor_set_threads(1);
+    tensor_seed(1234);
+    tensor_t *a = trandn(2, shape);
+    tensor_t *b = trandn(2, shape);
+    tensor_set_threads(4);
+    tensor_seed(1234);
+    tensor_t *c = trandn(2, shape);
+    assert(memcmp(a->data, c->data, a->numel * sizeof(float)) == 0);
+    assert(memcmp(a->data, b->data, a->numel * sizeof(float)) != 0);
+
+    double mean = 0, sq = 0;
+    for (uint32_t i = 0; i < a->numel; i++) {
+        assert(isfinite(a->data[i]));
+        mean += a->data[i];
+        sq += (double) a->data[i] * a->data[i];
+    }
+    mean /= a->numel;
+    double var = sq / a->numel - mean * mean;
+    assert(fabs(mean) < 0.01 && fabs(var - 1) < 0.01);
+    tensor_free(a);
+    tensor_free(b);
+    tensor_free(c);
+
+    a = tuniform(2, shape, 2, 4);
+    mean = 0;
+    for (uint32_t i = 0; i < a->numel; i++) {
+        assert(a->data[i] >= 2 && a->data[i] < 4);
+        mean += a->data[i];
+    }
+    assert(fabs(mean / a->numel - 3) < 0.01);
+    tensor_free(a);
+
+    // floats near 2^24 are 2 apart, so half of the draws would round up to high without the clamp
+    a = tuniform(1, (dim_sz_t[]){1000}, 0x1p24f, 0x1p24f + 2);
+    for (uint32_t i = 0; i < a->numel; i++) assert(a->data[i] == 0x1p24f);
+    tensor_free(a);
 
+    a = trandint(1, (dim_sz_t[]){10000}, -3, 3);
+    uint32_t seen[6] = { 0 };
+    for (uint32_t i = 0; i < a->numel; i++) {
+        float v = a->data[i];
+        assert(v == floorf(v) && v >= -3 && v < 3);
+        seen[(int) v + 3]++;
+    }
+    for (int i = 0; i < 6; i++) assert(seen[i] > 1500);
+    tensor_free(a);
+
+    a = trand(1, (dim_sz_t[]){1});
+    assert(a->data[0] >= 0 && a->data[0] < 1);
+    tensor_free(a);
+
+    tensor_set_threads(threads);
+    return __func__;
+}
+
+/********************* UNARY *********************/
+
+static float ref_sigmoid(float x) { return 1 / (1 + exp(-(double) x)); }
+static float ref_gelu(float x) { return x / (1 + exp(-2 * sqrt(2 / M_PI) * (x + 0.044715 * x * x * (double) x))); }
+
+// checks op against a reference within a relative tolerance (on 4001 values from lo to hi)
+static void check_unary(tensor_t *(*op)(tensor_t *), double (*ref)(double), float (*fref)(float), float lo, float hi, double tol) {
+    tensor_t *x = linspace(lo, hi, 4001);
+    tensor_t *y = op(x);
+    for (uint32_t i = 0; i < x->numel; i++) {
+        double r = ref != NULL ? ref(x->data[i]) : fref(x->data[i]);
+        if (isnan(r)) assert(isnan(y->data[i]));
+        else assert(fabs(y->data[i] - r) <= tol * fabs(r) + 1e-30);
+    }
+    tensor_free(x);
+    tensor_free(y);
+}
+
+const char *test_unary() {
+    for (int fast = 0; fast < 2; fast++) {
+        tensor_set_fast_math(fast);
+        assert(tensor_fast_math() == fast);
+        double tol = fast ? 1e-5 : 4e-7;
+        check_unary(texp, exp, NULL, -20, 20, tol);
+        check_unary(tlog, log, NULL, 1e-3f, 100, fast ? 2e-5 : tol);
+        check_unary(ttanh, tanh, NULL, -20, 20, tol);
+        check_unary(sigmoid, NULL, ref_sigmoid, -20, 20, tol);
+        check_unary(tsqrt, sqrt, NULL, 0, 100, 6e-8); // correctly rounded
+        check_unary(gelu, NULL, ref_gelu, -3, 20, fast ? 1e-5 : 2e-6); // error grows with the slope further down
+    }
+    tensor_set_fast_math(false);
+
+    // special values
+    float in[] = { 0, -0.0f, INFINITY, -INFINITY, NAN, -1, 1e-40f, -200, 200, -90 };
+    uint32_t n = sizeof(in) / sizeof(*in);
+    tensor_t *x = tensor_alloc(1, (dim_sz_t[]){n});
+    memcpy(x->data, in, sizeof(in));
+    tensor_t *e = texp(x), *l = tlog(x), *t = ttanh(x), *s = sigmoid(x), *r = relu(x);
+    assert(e->data[0] == 1 && e->data[2] == INFINITY && e->data[3] == 0 && isnan(e->data[4]) && e->data[7] == 0 && e->data[8] == INFINITY);
+    assert(l->data[0] == -INFINITY && l->data[2] == INFINITY && isnan(l->data[4]) && isnan(l->data[5]));
+    assert(fabsf(l->data[6] - logf(1e-40f)) < 1e-5f);
+    assert(t->data[2] == 1 && t->data[3] == -1 && isnan(t->data[4]) && t->data[7] == -1 && t->data[8] == 1);
+    assert(s->data[0] == 0.5f && s->data[2] == 1 && s->data[3] == 0 && s->data[8] == 1);
+    assert(s->data[7] == 0); // e^-200 is below the smallest denormal
+    assert(fabsf(s->data[9] - expf(-90)) < 1e-44f); // but e^-90 is a denormal
+    assert(r->data[0] == 0 && r->data[2] == INFINITY && r->data[3] == 0 && isnan(r->data[4]) && r->data[5] == 0);
+    tensor_free(x);
+    tensor_free(e);
+    tensor_free(l);
+    tensor_free(t);
+    tensor_free(s);
+    tensor_free(r);
+
+    // strided input (gathered) gives the same values as the contiguous one
+    x = transpose(trandn(2, (dim_sz_t[]){37, 300}), 0, 1);
+    tensor_t *a = ttanh(x);
+    tensor_t *b = ttanh(contiguous(x)); // in place
+    assert(memcmp(a->data, b->data, a->numel * sizeof(float)) == 0);
+    tensor_free(x);
+    tensor_free(a);
+    tensor_free(b);
+
+    return __func__;
+}
+
+// exhaustive check of the ulp table above uop (slow, so opt-in: TENSOR_ULP_SWEEP=1, or make ulp): every finite float
+// in the domain of each op goes through the op and is compared with a double reference; the error is measured in
+// ulps of the float spacing at the reference (denormal spacing below FLT_MIN)
+#define ULP_CHUNK (1 << 22)
+
+static double ref_sigmoid_d(double x) { return 1 / (1 + exp(-x)); }
+static double ref_relu(double x) { return x > 0 ? x : 0; }
+
+typedef struct {
+    const float *x, *y;
+    double (*ref)(double);
+    float lo, hi; // domain
+    bool rounded; // the op must give the correctly rounded result
+    uint64_t max; // bits of the largest error so far (non-negative doubles order like their bits)
+} ulp_ctx_t;
+
+static void ulp_chunk(void *ctx, size_t start, size_t end) {
+    ulp_ctx_t *c = ctx;
+    double m = 0;
+    for (size_t i = start; i < end; i++) {
+        float x = c->x[i], got = c->y[i];
+        if (!isfinite(x) || x < c->lo || x > c->hi) continue;
+        double r = c->ref(x);
+        if (!isfinite((float) r)) continue; // the correctly rounded result overflows
+        if (c->rounded) {
+            assert(got == (float) r);
+            continue;
+        }
+        int e = -125;
+        if (r != 0) frexp(r, &e);
+        m = fmax(m, fabs(got - r) / ldexp(1, MAX(e, -125) - 24));
+    }
+    uint64_t bits, cur = __atomic_load_n(&c->max, __ATOMIC_RELAXED);
+    memcpy(&bits, &m, sizeof(bits));
+    while (bits > cur && !__atomic_compare_exchange_n(&c->max, &cur, bits, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+const char *test_ulp_sweep() {
+    if (getenv("TENSOR_ULP_SWEEP") == NULL) return "test_ulp_sweep (skipped; TENSOR_ULP_SWEEP=1 runs it)";
+    const struct {
+        const char *name;
+        tensor_t *(*op)(tensor_t *);
+        double (*ref)(double);
+        float lo[2], hi[2]; // domain (exact, fast)
+        double table[2]; // documented max error in whole ulps (exact, fast); 0 is correctly rounded
+    } ops[] = {
+        { "exp", texp, exp, { -FLT_MAX, -87 }, { FLT_MAX, 88 }, { 1, 73 } },
+        { "log", tlog, log, { FLT_TRUE_MIN, FLT_MIN }, { FLT_MAX, FLT_MAX }, { 1, 207 } },
+        { "tanh", ttanh, tanh, { -FLT_MAX, -FLT_MAX }, { FLT_MAX, FLT_MAX }, { 2, 26 } },
+        { "sigmoid", sigmoid, ref_sigmoid_d, { -FLT_MAX, -87 }, { FLT_MAX, 88 }, { 3, 72 } },
+        { "sqrt", tsqrt, sqrt, { 0, 0 }, { FLT_MAX, FLT_MAX }, { 0, 0 } },
+        { "relu", relu, ref_relu, { -FLT_MAX, -FLT_MAX }, { FLT_MAX, FLT_MAX }, { 0, 0 } },
+    };
+    tensor_t *x = tensor_alloc(1, (dim_sz_t[]){ULP_CHUNK});
+    for (uint32_t k = 0; k < sizeof(ops) / sizeof(*ops); k++) {
+        double err[2];
+        for (int fast = 0; fast < 2; fast++) {
+            tensor_set_fast_math(fast);
+            ulp_ctx_t ctx = { .x = x->data, .ref = ops[k].ref, .lo = ops[k].lo[fast], .hi = ops[k].hi[fast], .rounded = ops[k].table[fast] == 0 };
+            for (uint64_t base = 0; base < ((uint64_t) 1 << 32); base += ULP_CHUNK) {
+                for (uint32_t i = 0; i < ULP_CHUNK; i++) {
+                    uint32_t bits = (uint32_t) (base + i);
+                    memcpy(&x->data[i], &bits, sizeof(bits));
+                }
+                tensor_t *y = ops[k].op(x);
+                ctx.y = y->data;
+                parallel_for(ULP_CHUNK, 1 << 16, ulp_chunk, &ctx);
+                tensor_free(y);
+            }
+            memcpy(&err[fast], &ctx.max, sizeof(err[fast]));
+        }
+        printf("  %-8s %6.1f %6.1f\n", ops[k].name, err[0], err[1]);
+        fflush(stdout);
+        assert(round(err[0]) <= ops[k].table[0] && round(err[1]) <= ops[k].table[1]);
+    }
+    tensor_set_fast_math(false);
+    tensor_free(x);
+    return __func__;
+}
+
+/********************* BINARY *********************/
+
+const char *test_binary() {
+    // (3, 1) op (4): broadcast both ways, long enough rows for the SIMD path
+    tensor_t *a = reshape(range(0, 3, 1), 2, (dim_sz_t[]){3, 1});
+    tensor_t *b = linspace(-2, 2, 20);
+    tensor_t *(*ops[])(tensor_t *, tensor_t *) = { add, mul, sub, tdiv, tpow, maximum, minimum, eq, lt, gt };
+    for (uint32_t o = 0; o < sizeof(ops) / sizeof(*ops); o++) {
+        tensor_t *c = ops[o](a, b);
+        assert(c->ndim == 2 && c->shape[0] == 3 && c->shape[1] == 20);
+        for (dim_sz_t i = 0; i < 3; i++) {
+            for (dim_sz_t j = 0; j < 20; j++) {
+                float x = a->data[i], y = b->data[j], r = c->data[i * 20 + j], e;
+                switch (o) {
+                    case 0: e = x + y; break;
+                    case 1: e = x * y; break;
+                    case 2: e = x - y; break;
+                    case 3: e = x / y; break;
+                    case 4: e = powf(x, y); break;
+                    case 5: e = fmaxf(x, y); break;
+                    case 6: e = fminf(x, y); break;
+                    case 7: e = x == y; break;
+                    case 8: e = x < y; break;
+                    default: e = x > y; break;
+                }
+                assert(r == e || (isnan(r) && isnan(e)));
+            }
+        }
+        tensor_free(c);
+    }
+
+    // strided operand (transposed) and nan propagation in maximum/minimum
+    tensor_t *t = transpose(reshape(range(0, 6, 1), 2, (dim_sz_t[]){2, 3}), 0, 1);
+    tensor_t *d = sub(t, t);
+    for (uint32_t i = 0; i < d->numel; i++) assert(d->data[i] == 0);
+    tensor_t *n = fill(9, NAN);
+    tensor_t *o = fill(9, 1);
+    tensor_t *mx = maximum(n, o), *mn = minimum(o, n), *e = eq(n, n);
+    for (uint32_t i = 0; i < 9; i++) assert(isnan(mx->data[i]) && isnan(mn->data[i]) && e->data[i] == 0);
+
+    tensor_free(a);
+    tensor_free(b);
     tensor_free(t);
+    tensor_free(d);
+    tensor_free(n);
+    tensor_free(o);
+    tensor_free(mx);
+    tensor_free(mn);
+    tensor_free(e);
+
+    CHECK_ABORT({ sub(range(0, 3, 1), range(0, 4, 1)); });
+
+    return __func__;
+}
+
+const char *test_where() {
+    // relu written with a mask: where(x > 0, x, 0)
+    tensor_t *x = linspace(-5, 5, 41);
+    tensor_t *zero = fill(1, 0);
+    tensor_t *mask = gt(x, zero);
+    tensor_t *r = where(mask, x, zero);
+    for (uint32_t i = 0; i < x->numel; i++) assert(r->data[i] == (x->data[i] > 0 ? x->data[i] : 0));
     tensor_free(r);
+    tensor_free(mask);
 
+    // the three operands broadcast together: (2, 1, 1) ? (1, 3, 1) : (1, 1, 4) -> (2, 3, 4)
+    tensor_t *c = reshape(tensor_alloc(1, (dim_sz_t[]){2}), 3, (dim_sz_t[]){2, 1, 1});
+    c->data[0] = 1;
+    c->data[1] = 0;
+    tensor_t *a = reshape(range(0, 3, 1), 3, (dim_sz_t[]){1, 3, 1});
+    tensor_t *b = reshape(range(10, 14, 1), 3, (dim_sz_t[]){1, 1, 4});
+    r = where(c, a, b);
+    assert(r->ndim == 3 && r->shape[0] == 2 && r->shape[1] == 3 && r->shape[2] == 4);
+    for (dim_sz_t i = 0; i < 3; i++) {
+        for (dim_sz_t j = 0; j < 4; j++) {
+            assert(r->data[i * 4 + j] == i);
+            assert(r->data[12 + i * 4 + j] == 10 + j);
+        }
+    }
+
+    tensor_free(x);
+    tensor_free(zero);
+    tensor_free(c);
+    tensor_free(a);
+    tensor_free(b);
+    tensor_free(r);
+
+    return __func__;
+}
+
+/********************* ELEMENTWISE PROGRAMS *********************/
+
+const char *test_fma() {
+    // (300, 5) * (5) + (300, 1)
+    tensor_t *x = trandn(2, (dim_sz_t[]){300, 5});
+    tensor_t *a = trandn(1, (dim_sz_t[]){5});
+    tensor_t *b = trandn(2, (dim_sz_t[]){300, 1});
+    tensor_t *r = tfma(x, a, b);
+    assert(r->ndim == 2 && r->shape[0] == 300 && r->shape[1] == 5);
+    for (dim_sz_t i = 0; i < 300; i++) {
+        for (dim_sz_t j = 0; j < 5; j++) assert(r->data[i * 5 + j] == fmaf(x->data[i * 5 + j], a->data[j], b->data[i]));
+    }
+    tensor_free(x);
+    tensor_free(a);
+    tensor_free(b);
+    tensor_free(r);
+
+    return __func__;
+}
+
+const char *test_ewprog() {
+    // y = 2 * sigmoid(x * w + b) - 1 on a transposed x, in one pass
+    tensor_t *x = transpose(trandn(2, (dim_sz_t[]){400, 3}), 0, 1);
+    tensor_t *w = trandn(2, (dim_sz_t[]){3, 1});
+    tensor_t *b = fill(1, 0.5f);
+    ew_instr_t prog[] = {
+        { .op = OP_FMA, .a = 0, .b = 1, .c = 2 }, // r3
+        { .op = OP_SIGMOID, .a = 3 }, // r4
+        { .op = OP_CONST, .imm = 2 }, // r5
+        { .op = OP_CONST, .imm = -1 }, // r6
+        { .op = OP_FMA, .a = 4, .b = 5, .c = 6 }, // r7
+    };
+    tensor_t *y = ewprog(3, (tensor_t *[]){ x, w, b }, 5, prog);
+    assert(y->ndim == 2 && y->shape[0] == 3 && y->shape[1] == 400);
+
+    // same thing one op at a time
+    tensor_t *t0 = tfma(x, w, b);
+    tensor_t *t1 = sigmoid(t0);
+    tensor_t *two = fill(1, 2), *m1 = fill(1, -1);
+    tensor_t *ref = tfma(t1, two, m1);
+    assert(memcmp(y->data, ref->data, y->numel * sizeof(float)) == 0);
+
+    // a constant as the last instruction fills the output
+    tensor_t *c = ewprog(1, (tensor_t *[]){ x }, 1, (ew_instr_t[]){{ .op = OP_CONST, .imm = 3 }});
+    for (uint32_t i = 0; i < c->numel; i++) assert(c->data[i] == 3);
+
+    tensor_free(x);
+    tensor_free(w);
+    tensor_free(b);
+    tensor_free(y);
+    tensor_free(t0);
+    tensor_free(t1);
+    tensor_free(two);
+    tensor_free(m1);
+    tensor_free(ref);
+    tensor_free(c);
+
+    // operands must be inputs or earlier results
+    CHECK_ABORT({ tensor_t *t = fill(4, 1); ewprog(1, &t, 1, (ew_instr_t[]){{ .op = OP_ADD, .a = 0, .b = 1 }}); });
+
+    return __func__;
+}
+
+/********************* DISPATCH *********************/
+
+static uint32_t _dispatch_calls;
+
+static void counting_add(float *dst, const float *a, stride_t as, const float *b, stride_t bs, size_t n) {
+    _dispatch_calls++;
+    for (size_t i = 0; i < n; i++) dst[i] = a[i * as] + b[i * bs];
+}
+
+const char *test_dispatch() {
+    assert(layout_of(3, (stride_t[]){1, 1, 1}) == LAYOUT_CONTIGUOUS);
+    assert(layout_of(3, (stride_t[]){1, 0, 1}) == LAYOUT_BROADCAST);
+    assert(layout_of(3, (stride_t[]){1, 0, 3}) == LAYOUT_STRIDED);
+
+    // a strided request falls back to the scalar kernel; contiguous ones get the best available
+    kernel_t strided = kernel_resolve(OP_ADD, DTYPE_F32, LAYOUT_STRIDED);
+    assert(strided.any != NULL);
+    assert(kernel_resolve(OP_POW, DTYPE_F32, LAYOUT_CONTIGUOUS).any == kernel_resolve(OP_POW, DTYPE_F32, LAYOUT_STRIDED).any);
+
+    // a registered kernel replaces the built-in one without touching the callers
+    isa_t isa = dispatch_max_isa(ISA_SCALAR);
+    assert(dispatch_isa() == ISA_SCALAR);
+    kernel_register(OP_ADD, DTYPE_F32, ISA_SCALAR, LAYOUT_STRIDED, (kernel_t){ .binary = counting_add });
+    tensor_t *a = range(0, 10, 1);
+    tensor_t *c = add(a, a);
+    assert(_dispatch_calls == 1 && c->data[9] == 18);
+    tensor_free(c);
+    kernel_register(OP_ADD, DTYPE_F32, ISA_SCALAR, LAYOUT_STRIDED, strided);
+
+    // the scalar fallbacks agree with the SIMD kernels
+    tensor_t *x = trandn(2, (dim_sz_t[]){33, 65});
+    tensor_t *y = trandn(1, (dim_sz_t[]){65});
+    tensor_t *s_sum = sumall(x), *s_max = max(x), *s_add = add(x, y), *s_tanh = ttanh(x);
+    dispatch_max_isa(isa);
+    tensor_t *v_sum = sumall(x), *v_max = max(x), *v_add = add(x, y), *v_tanh = ttanh(x);
+
+    // the cap can be lowered and restored but never raised above the cpu or TENSOR_ISA
+    dispatch_max_isa(ISA_NISAS - 1);
+    assert(dispatch_isa() == isa);
+    assert(fabsf(s_sum->data[0] - v_sum->data[0]) < 1e-3f);
+    assert(s_max->data[0] == v_max->data[0]);
+    assert(memcmp(s_add->data, v_add->data, x->numel * sizeof(float)) == 0);
+    for (uint32_t i = 0; i < x->numel; i++) assert(fabsf(s_tanh->data[i] - v_tanh->data[i]) < 1e-6f);
+
+    tensor_t *ts[] = { a, x, y, s_sum, s_max, s_add, s_tanh, v_sum, v_max, v_add, v_tanh };
+    for (uint32_t i = 0; i < sizeof(ts) / sizeof(*ts); i++) tensor_free(ts[i]);
+
+    return __func__;
+}
+
+const char *test_plan_cache() {
+    tensor_t *a = trandn(3, (dim_sz_t[]){3, 5, 7});
+    tensor_t *b = trandn(1, (dim_sz_t[]){7});
+    tensor_plan_stats_t s0, s1, s2;
+
+    // the second call with the same shapes and strides reuses the plan of the first
+    tensor_plan_stats(&s0);
+    tensor_t *c1 = add(a, b);
+    tensor_plan_stats(&s1);
+    tensor_t *c2 = add(a, b);
+    tensor_plan_stats(&s2);
+    assert(s1.hits + s1.misses == s0.hits + s0.misses + 1);
+    assert(s2.hits == s1.hits + 1 && s2.misses == s1.misses);
+    assert(memcmp(c1->data, c2->data, c1->numel * sizeof(float)) == 0);
+    for (uint32_t i = 0; i < c1->numel; i++) assert(c1->data[i] == a->data[i] + b->data[i % 7]);
+
+    // other shapes (and ops) get their own plans
+    tensor_t *d = trandn(2, (dim_sz_t[]){5, 1});
+    tensor_t *c3 = add(a, d), *c4 = mul(a, b);
+    tensor_plan_stats(&s1);
+    assert(s1.misses == s2.misses + 2);
+    for (uint32_t i = 0; i < c3->numel; i++) assert(c3->data[i] == a->data[i] + d->data[(i / 7) % 5]);
+    for (uint32_t i = 0; i < c4->numel; i++) assert(c4->data[i] == a->data[i] * b->data[i % 7]);
+
+    // registering a kernel invalidates the plans that resolved the old one
+    isa_t isa = dispatch_max_isa(ISA_SCALAR);
+    kernel_t strided = kernel_resolve(OP_ADD, DTYPE_F32, LAYOUT_STRIDED);
+    tensor_t *c5 = add(a, b);
+    kernel_register(OP_ADD, DTYPE_F32, ISA_SCALAR, LAYOUT_STRIDED, (kernel_t){ .binary = counting_add });
+    _dispatch_calls = 0;
+    tensor_t *c6 = add(a, b);
+    assert(_dispatch_calls == 15);
+    kernel_register(OP_ADD, DTYPE_F32, ISA_SCALAR, LAYOUT_STRIDED, strided);
+    dispatch_max_isa(isa);
+    assert(memcmp(c5->data, c6->data, c5->numel * sizeof(float)) == 0);
+
+    tensor_t *ts[] = { a, b, c1, c2, d, c3, c4, c5, c6 };
+    for (uint32_t i = 0; i < sizeof(ts) / sizeof(*ts); i++) tensor_free(ts[i]);
+
+    return __func__;
+}
+
+/********************* MATMUL *********************/
+
+// checks c against a naive product of a (m x k, strides ars/acs) and b (k x n, strides brs/bcs) in double
+static void check_matmul(const float *c, const float *a, size_t ars, size_t acs, const float *b, size_t brs, size_t bcs, size_t m, size_t n, size_t k) {
+    for (size_t i = 0; i < m; i++) {
+        for (size_t j = 0; j < n; j++) {
+            double ref = 0, mag = 0;
+            for (size_t p = 0; p < k; p++) {
+                ref += (double) a[i * ars + p * acs] * b[p * brs + j * bcs];
+                mag += fabs((double) a[i * ars + p * acs] * b[p * brs + j * bcs]);
+            }
+            assert(fabs(c[i * n + j] - ref) <= 1e-5 * mag + 1e-6);
+        }
+    }
+}
+
+const char *test_matmul() {
+    // sizes that leave partial tiles and blocks and take more than one step of k
+    tensor_t *a = trandn(2, (dim_sz_t[]){150, 300});
+    tensor_t *b = trandn(2, (dim_sz_t[]){300, 270});
+    tensor_t *c = matmul(a, b);
+    assert(c->ndim == 2 && c->shape[0] == 150 && c->shape[1] == 270);
+    check_matmul(c->data, a->data, 300, 1, b->data, 270, 1, 150, 270, 300);
+
+    // a transposed b is read through its strides
+    tensor_t *bt = trandn(2, (dim_sz_t[]){270, 300});
+    transpose(bt, 0, 1);
+    tensor_t *ct = matmul(a, bt);
+    check_matmul(ct->data, a->data, 300, 1, bt->data, 1, 300, 150, 270, 300);
+
+    // batch dims are broadcast: (2, 3, 7, 19) @ (3, 19, 45) and (2, 3, 7, 19) @ an expanded (19, 45)
+    tensor_t *x = trandn(4, (dim_sz_t[]){2, 3, 7, 19});
+    tensor_t *w = trandn(3, (dim_sz_t[]){3, 19, 45});
+    tensor_t *y = matmul(x, w);
+    assert(y->ndim == 4 && y->shape[0] == 2 && y->shape[1] == 3 && y->shape[2] == 7 && y->shape[3] == 45);
+    for (uint32_t i = 0; i < 6; i++) check_matmul(y->data + i * 7 * 45, x->data + i * 7 * 19, 19, 1, w->data + (i % 3) * 19 * 45, 45, 1, 7, 45, 19);
+    tensor_t *w1 = trandn(2, (dim_sz_t[]){19, 45});
+    tensor_t *we = expand(w1, 4, (dim_sz_t[]){2, 3, 19, 45});
+    tensor_t *ye = matmul(x, we);
+    for (uint32_t i = 0; i < 6; i++) check_matmul(ye->data + i * 7 * 45, x->data + i * 7 * 19, 19, 1, w1->data, 45, 1, 7, 45, 19);
+
+    // vectors drop their dim
+    tensor_t *v = trandn(1, (dim_sz_t[]){300});
+    tensor_t *av = matmul(a, v), *va = matmul(v, b), *vv = matmul(v, v);
+    assert(av->ndim == 1 && av->shape[0] == 150);
+    assert(va->ndim == 1 && va->shape[0] == 270);
+    assert(vv->ndim == 1 && vv->numel == 1);
+    check_matmul(av->data, a->data, 300, 1, v->data, 1, 0, 150, 1, 300);
+    check_matmul(va->data, v->data, 0, 1, b->data, 270, 1, 1, 270, 300);
+    check_matmul(vv->data, v->data, 0, 1, v->data, 1, 0, 1, 1, 300);
+
+    // the scalar micro-kernel gives the same products
+    isa_t isa = dispatch_max_isa(ISA_SCALAR);
+    tensor_t *cs = matmul(a, b);
+    dispatch_max_isa(isa);
+    check_matmul(cs->data, a->data, 300, 1, b->data, 270, 1, 150, 270, 300);
+
+    tensor_t *ts[] = { a, b, c, bt, ct, x, w, y, w1, we, ye, v, av, va, vv, cs };
+    for (uint32_t i = 0; i < sizeof(ts) / sizeof(*ts); i++) tensor_free(ts[i]);
+
+    // inner dims must agree and batch dims broadcast
+    CHECK_ABORT({ matmul(fill(3, 1), fill(2, 1)); });
+
+    return __func__;
+}
+
+const char *test_matmul_fused() {
+    // gelu(0.5 * (x @ w) + bias) + residual gives the same bits as the separate ops (same kernels)
+    tensor_t *x = trandn(2, (dim_sz_t[]){37, 50});
+    tensor_t *w = trandn(2, (dim_sz_t[]){50, 70});
+    tensor_t *bias = trandn(1, (dim_sz_t[]){70});
+    tensor_t *res = trandn(2, (dim_sz_t[]){37, 70});
+    tensor_t *y = matmul_fused(x, w, &(matmul_epilogue_t){ .scaled = true, .scale = 0.5f, .bias = bias, .act = MATMUL_ACT_GELU, .residual = res });
+    tensor_t *half = fill(1, 0.5f);
+    tensor_t *t0 = matmul(x, w), *t1 = tfma(t0, half, bias), *t2 = gelu(t1), *ref = add(t2, res);
+    assert(memcmp(y->data, ref->data, y->numel * sizeof(float)) == 0);
+
+    // a zeroed epilogue does nothing
+    tensor_t *z = matmul_fused(x, w, &(matmul_epilogue_t){ 0 });
+    assert(memcmp(z->data, t0->data, z->numel * sizeof(float)) == 0);
+
+    // per-batch bias, strided residual and scale without bias
+    tensor_t *xb = trandn(3, (dim_sz_t[]){2, 37, 50});
+    tensor_t *bb = trandn(3, (dim_sz_t[]){2, 1, 1});
+    tensor_t *rt = transpose(trandn(2, (dim_sz_t[]){70, 37}), 0, 1);
+    tensor_t *yb = matmul_fused(xb, w, &(matmul_epilogue_t){ .bias = bb, .act = MATMUL_ACT_RELU, .residual = rt });
+    tensor_t *s0 = matmul(xb, w), *s1 = add(s0, bb), *s2 = relu(s1), *refb = add(s2, rt);
+    assert(memcmp(yb->data, refb->data, yb->numel * sizeof(float)) == 0);
+    tensor_t *ys = matmul_fused(x, w, &(matmul_epilogue_t){ .scaled = true, .scale = -2, .act = MATMUL_ACT_SIGMOID });
+    tensor_t *m2 = fill(1, -2), *u0 = mul(t0, m2), *refs = sigmoid(u0);
+    assert(memcmp(ys->data, refs->data, ys->numel * sizeof(float)) == 0);
+
+    // a scale of exactly 0 is applied (only the bias is left)
+    tensor_t *y0 = matmul_fused(x, w, &(matmul_epilogue_t){ .scaled = true, .scale = 0, .bias = bias });
+    for (uint32_t i = 0; i < y0->numel; i++) assert(y0->data[i] == bias->data[i % 70]);
+
+    tensor_t *ts[] = { x, w, bias, res, y, half, t0, t1, t2, ref, z, xb, bb, rt, yb, s0, s1, s2, refb, ys, m2, u0, refs, y0 };
+    for (uint32_t i = 0; i < sizeof(ts) / sizeof(*ts); i++) tensor_free(ts[i]);
+
+    // epilogue operands must broadcast to the output
+    CHECK_ABORT({ matmul_fused(fill(4, 1), trandn(2, (dim_sz_t[]){4, 3}), &(matmul_epilogue_t){ .bias = fill(2, 1) }); });
+
+    return __func__;
+}
+
+const char *test_gemv() {
+    tensor_t *m = trandn(2, (dim_sz_t[]){300, 257});
+    tensor_t *x = trandn(1, (dim_sz_t[]){257});
+    tensor_t *xt = trandn(1, (dim_sz_t[]){300});
+
+    // contiguous rows: dot products; transposed: sums of the contiguous columns
+    tensor_t *y = gemv(m, x), *yt = gemv_t(m, xt);
+    assert(y->ndim == 1 && y->shape[0] == 300 && yt->shape[0] == 257);
+    check_matmul(y->data, m->data, 257, 1, x->data, 1, 0, 300, 1, 257);
+    check_matmul(yt->data, m->data, 1, 257, xt->data, 1, 0, 257, 1, 300);
+    tensor_t *mt = transpose(tensor_alloc(2, (dim_sz_t[]){257, 300}), 0, 1);
+    for (uint32_t i = 0; i < 300; i++) {
+        for (uint32_t j = 0; j < 257; j++) mt->data[i + j * 300] = m->data[i * 257 + j];
+    }
+    tensor_t *z = gemv(mt, x), *zt = gemv_t(mt, xt);
+    check_matmul(z->data, m->data, 257, 1, x->data, 1, 0, 300, 1, 257);
+    check_matmul(zt->data, m->data, 1, 257, xt->data, 1, 0, 257, 1, 300);
+
+    // strided vector
+    tensor_t *x2 = trandn(1, (dim_sz_t[]){514});
+    tensor_t *xs = slice(x2, 0, 0, 514, 2);
+    tensor_t *ys = gemv(m, xs);
+    check_matmul(ys->data, m->data, 257, 1, x2->data, 2, 0, 300, 1, 257);
+
+    // the sum of a long dot product does not depend on the number of threads
+    tensor_t *a = trandn(1, (dim_sz_t[]){200001}), *b = trandn(1, (dim_sz_t[]){200001});
+    uint32_t threads = tensor_threads();
+    tensor_set_threads(1);
+    tensor_t *d1 = dot(a, b);
+    tensor_set_threads(4);
+    tensor_t *d4 = dot(a, b);
+    tensor_set_threads(threads);
+    assert(d1->data[0] == d4->data[0]);
+    check_matmul(d1->data, a->data, 0, 1, b->data, 1, 0, 1, 1, 200001);
+
+    tensor_t *ts[] = { m, x, xt, y, yt, mt, z, zt, x2, xs, ys, a, b, d1, d4 };
+    for (uint32_t i = 0; i < sizeof(ts) / sizeof(*ts); i++) tensor_free(ts[i]);
+
+    CHECK_ABORT({ gemv(trandn(2, (dim_sz_t[]){3, 4}), fill(3, 1)); });
+
+    return __func__;
+}
+
+const char *test_q8() {
+    // round trip: every value comes back within half a step (the range always includes 0, which is exact)
+    tensor_t *t = tuniform(2, (dim_sz_t[]){37, 41}, -3, 5);
+    qtensor_t *q = quantize(t);
+    assert(q->axis == -1 && q->numel == t->numel);
+    tensor_t *d = dequantize(q);
+    float s = q->scale[0];
+    for (uint32_t i = 0; i < t->numel; i++) {
+        assert(q->data[i] >= -Q8_MAX && q->data[i] <= Q8_MAX);
+        assert(fabsf(d->data[i] - t->data[i]) <= s / 2 * 1.001f);
+    }
+    t->data[0] = 0;
+    qtensor_t *q0 = quantize(t);
+    assert(q0->data[0] == q0->zero[0]);
+
+    // per channel (on a transposed tensor): channels with small ranges keep their resolution
+    tensor_t *w = tensor_alloc(2, (dim_sz_t[]){41, 37});
+    for (uint32_t i = 0; i < w->numel; i++) w->data[i] = t->data[i] * (i % 37 == 5 ? 1e-3f : 1);
+    tensor_t *wt = transpose(w, 0, 1);
+    qtensor_t *qc = quantize_channels(wt, 0);
+    assert(qc->axis == 0 && qc->shape[0] == 37 && qc->shape[1] == 41);
+    tensor_t *dc = dequantize(qc);
+    for (uint32_t c = 0; c < 37; c++) {
+        for (uint32_t j = 0; j < 41; j++) {
+            float x = w->data[j * 37 + c];
+            assert(fabsf(dc->data[c * 41 + j] - x) <= qc->scale[c] / 2 * 1.001f);
+        }
+    }
+    assert(qc->scale[5] < qc->scale[4] / 100);
+
+    // the scalar conversions give the same bytes; the int8 product matches the float product of the dequantized
+    // operands, on every isa with the same bits
+    tensor_t *fa = trandn(2, (dim_sz_t[]){45, 70}), *fb = trandn(2, (dim_sz_t[]){70, 35});
+    for (uint32_t i = 0; i < fb->numel; i++) fb->data[i] = fb->data[i] * 0.5f + 0.3f;
+    qtensor_t *qa = quantize_channels(fa, 0), *qb = quantize_channels(fb, 1), *qbt = quantize(fb);
+    tensor_t *da = dequantize(qa), *db = dequantize(qb), *dbt = dequantize(qbt);
+    isa_t isa = dispatch_max_isa(ISA_SCALAR);
+    qtensor_t *sa = quantize_channels(fa, 0);
+    tensor_t *sda = dequantize(sa);
+    assert(memcmp(sa->data, qa->data, qa->numel) == 0);
+    assert(memcmp(sda->data, da->data, da->numel * sizeof(*da->data)) == 0);
+    tensor_t *ref = matmul_q8(qa, qb), *reft = matmul_q8(qa, qbt);
+    check_matmul(ref->data, da->data, 70, 1, db->data, 35, 1, 45, 35, 70);
+    check_matmul(reft->data, da->data, 70, 1, dbt->data, 35, 1, 45, 35, 70);
+    for (isa_t i = ISA_AVX2; i < ISA_NISAS; i++) {
+        dispatch_max_isa(i);
+        tensor_t *c = matmul_q8(qa, qb);
+        assert(memcmp(c->data, ref->data, ref->numel * sizeof(*ref->data)) == 0);
+        tensor_free(c);
+    }
+    dispatch_max_isa(isa);
+
+    tensor_t *ts[] = { t, d, wt, dc, fa, fb, da, db, dbt, sda, ref, reft };
+    for (uint32_t i = 0; i < sizeof(ts) / sizeof(*ts); i++) tensor_free(ts[i]);
+    qtensor_t *qs[] = { q, q0, qc, qa, qb, qbt, sa };
+    for (uint32_t i = 0; i < sizeof(qs) / sizeof(*qs); i++) qtensor_free(qs[i]);
+
+    CHECK_ABORT({ matmul_q8(quantize(fill(3, 1)), quantize(fill(3, 1))); });
+
+    return __func__;
+}
+
+const char *test_q4() {
+    // half conversions: every half survives a round trip and both directions agree with the compiler's _Float16
+    for (uint32_t h = 0; h < 0x10000; h++) {
+        if ((h & 0x7c00) == 0x7c00 && (h & 0x3ff) != 0) continue; // nan
+        _Float16 ref;
+        memcpy(&ref, &h, sizeof(ref));
+        assert(k_f16_to_f32(h) == (float) ref || (h & 0x7fff) == 0);
+        assert(k_f32_to_f16(k_f16_to_f32(h)) == h);
+    }
+    uint32_t bits = 12345;
+    for (uint32_t i = 0; i < 1000000; i++) {
+        bits = bits * 1664525u + 1013904223u;
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        if (isnan(f)) continue;
+        _Float16 ref = (_Float16) f;
+        uint16_t h;
+        memcpy(&h, &ref, sizeof(h));
+        assert(k_f32_to_f16(f) == h);
+    }
+
+    // values come back within half a step of their block (rows that are not a whole number of blocks, and a
+    // transposed input)
+    tensor_t *w = trandn(2, (dim_sz_t[]){100, 37});
+    tensor_t *wt = transpose(w, 0, 1);
+    q4tensor_t *q = quantize_q4(wt);
+    assert(q->rows == 37 && q->cols == 100 && q->nblocks == 4);
+    tensor_t *d = dequantize_q4(q);
+    for (uint32_t r = 0; r < 37; r++) {
+        for (uint32_t b = 0; b < 4; b++) {
+            uint32_t end = b < 3 ? (b + 1) * Q4_BLOCK : 100;
+            float amax = 0;
+            for (uint32_t j = b * Q4_BLOCK; j < end; j++) amax = fmaxf(amax, fabsf(w->data[j * 37 + r]));
+            for (uint32_t j = b * Q4_BLOCK; j < end; j++) {
+                // the far end of [-8, 7] is clamped to 7 (a whole step off)
+                float x = w->data[j * 37 + r], tol = fabsf(x) <= amax * 7.5f / 8 ? amax / 16 : amax / 8;
+                assert(fabsf(d->data[r * 100 + j] - x) <= tol * 1.001f);
+            }
+        }
+    }
+
+    // the fused matvec matches a float one on the dequantized matrix (also with a strided x)
+    tensor_t *x2 = trandn(1, (dim_sz_t[]){200});
+    tensor_t *x = slice(x2, 0, 0, 200, 2);
+    isa_t isa = dispatch_max_isa(ISA_SCALAR);
+    tensor_t *ys = gemv_q4(q, x);
+    dispatch_max_isa(isa);
+    tensor_t *y = gemv_q4(q, x);
+    check_matmul(y->data, d->data, 100, 1, x2->data, 2, 0, 37, 1, 100);
+    check_matmul(ys->data, d->data, 100, 1, x2->data, 2, 0, 37, 1, 100);
+
+    tensor_t *ts[] = { wt, d, x2, x, ys, y };
+    for (uint32_t i = 0; i < sizeof(ts) / sizeof(*ts); i++) tensor_free(ts[i]);
+    q4tensor_free(q);
+
+    CHECK_ABORT({ gemv_q4(quantize_q4(trandn(2, (dim_sz_t[]){3, 4})), fill(3, 1)); });
+
+    return __func__;
+}
+
+// compares y (any strides) with a double precision conv2d of x (any strides) and w (contiguous)
+static void check_conv2d(tensor_t *y, tensor_t *x, tensor_t *w, tensor_t *bias, conv_params_t p) {
+    dim_sz_t groups = p.groups > 0 ? p.groups : 1, cg = x->shape[1] / groups, og = w->shape[0] / groups;
+    dim_sz_t sh = p.stride[0] > 0 ? p.stride[0] : 1, sw = p.stride[1] > 0 ? p.stride[1] : 1;
+    dim_sz_t dh = p.dilation[0] > 0 ? p.dilation[0] : 1, dw = p.dilation[1] > 0 ? p.dilation[1] : 1;
+    dim_sz_t kh = w->shape[2], kw = w->shape[3];
+    assert(y->ndim == 4 && y->shape[0] == x->shape[0] && y->shape[1] == w->shape[0]);
+    assert(y->shape[2] == (x->shape[2] + 2 * p.padding[0] - dh * (kh - 1) - 1) / sh + 1);
+    assert(y->shape[3] == (x->shape[3] + 2 * p.padding[1] - dw * (kw - 1) - 1) / sw + 1);
+    for (dim_sz_t n = 0; n < y->shape[0]; n++) {
+        for (dim_sz_t o = 0; o < y->shape[1]; o++) {
+            for (dim_sz_t oy = 0; oy < y->shape[2]; oy++) {
+                for (dim_sz_t ox = 0; ox < y->shape[3]; ox++) {
+                    double ref = bias != NULL ? bias->data[o] : 0, mag = fabs(ref);
+                    for (dim_sz_t i = 0; i < cg; i++) {
+                        dim_sz_t c = (o / og) * cg + i;
+                        for (dim_sz_t ky = 0; ky < kh; ky++) {
+                            for (dim_sz_t kx = 0; kx < kw; kx++) {
+                                dim_sz_t iy = oy * sh - p.padding[0] + ky * dh, ix = ox * sw - p.padding[1] + kx * dw;
+                                if (iy < 0 || iy >= x->shape[2] || ix < 0 || ix >= x->shape[3]) continue;
+                                double v = (double) x->data[n * x->stride[0] + c * x->stride[1] + iy * x->stride[2] + ix * x->stride[3]]
+                                    * w->data[((o * cg + i) * kh + ky) * kw + kx];
+                                ref += v;
+                                mag += fabs(v);
+                            }
+                        }
+                    }
+                    float got = y->data[n * y->stride[0] + o * y->stride[1] + oy * y->stride[2] + ox * y->stride[3]];
+                    assert(fabs(got - ref) <= 1e-5 * mag + 1e-6);
+                }
+            }
+        }
+    }
+}
+
+const char *test_conv() {
+    // im2col: groups, asymmetric stride, padding and dilation, bias
+    tensor_t *x = trandn(4, (dim_sz_t[]){2, 6, 9, 11});
+    tensor_t *w = trandn(4, (dim_sz_t[]){8, 3, 3, 3});
+    tensor_t *b = trandn(1, (dim_sz_t[]){8});
+    conv_params_t p = { .stride = {2, 1}, .padding = {1, 2}, .dilation = {1, 2}, .groups = 2 };
+    tensor_t *y = conv2d(x, w, b, &p);
+    assert(is_contiguous(y));
+    check_conv2d(y, x, w, b, p);
+
+    // channels last 3x3 (direct) with a partial block of output channels and every border case, on each isa
+    tensor_t *nhwc = trandn(4, (dim_sz_t[]){2, 10, 13, 5});
+    tensor_t *xl = permute(nhwc, (dim_t[]){0, 3, 1, 2});
+    tensor_t *wl = trandn(4, (dim_sz_t[]){20, 5, 3, 3});
+    tensor_t *bl = trandn(1, (dim_sz_t[]){20});
+    conv_params_t pl[] = { { .padding = {1, 1} }, { .stride = {2, 2} }, { .stride = {1, 2}, .padding = {2, 3}, .dilation = {2, 1} } };
+    for (uint32_t i = 0; i < sizeof(pl) / sizeof(*pl); i++) {
+        for (isa_t isa = ISA_SCALAR; isa <= ISA_AVX2; isa++) {
+            isa_t prev = dispatch_max_isa(isa);
+            tensor_t *yl = conv2d(xl, wl, i == 0 ? bl : NULL, &pl[i]);
+            dispatch_max_isa(prev);
+            assert(yl->stride[1] == 1); // channels last too
+            check_conv2d(yl, xl, wl, i == 0 ? bl : NULL, pl[i]);
+            tensor_free(yl);
+        }
+    }
+
+    // depthwise (direct when channels last, im2col otherwise)
+    tensor_t *wd = trandn(4, (dim_sz_t[]){5, 1, 5, 5});
+    conv_params_t pd = { .stride = {2, 2}, .padding = {2, 2}, .groups = 5 };
+    tensor_t *yd = conv2d(xl, wd, NULL, &pd);
+    assert(yd->stride[1] == 1);
+    check_conv2d(yd, xl, wd, NULL, pd);
+    tensor_t *xc = permute(xl, (dim_t[]){0, 1, 2, 3});
+    contiguous(xc);
+    tensor_t *yc = conv2d(xc, wd, NULL, &pd);
+    assert(is_contiguous(yc));
+    check_conv2d(yc, xc, wd, NULL, pd);
+
+    // conv1d (runs as a conv2d of height 1)
+    tensor_t *x1 = trandn(3, (dim_sz_t[]){2, 4, 20});
+    tensor_t *w1 = trandn(3, (dim_sz_t[]){6, 4, 5});
+    conv_params_t p1 = { .stride = {3}, .padding = {2}, .dilation = {1} };
+    tensor_t *b1 = trandn(1, (dim_sz_t[]){6});
+    tensor_t *y1 = conv1d(x1, w1, b1, &p1);
+    assert(y1->ndim == 3 && y1->shape[0] == 2 && y1->shape[1] == 6 && y1->shape[2] == 7);
+    assert(x1->ndim == 3 && w1->ndim == 3);
+    conv_params_t p12 = { .stride = {1, 3}, .padding = {0, 2} };
+    check_conv2d(unsqueeze(y1, 2), unsqueeze(x1, 2), unsqueeze(w1, 2), b1, p12);
+
+    tensor_t *ts[] = { x, w, b, y, nhwc, xl, wl, bl, wd, yd, xc, yc, x1, w1, b1, y1 };
+    for (uint32_t i = 0; i < sizeof(ts) / sizeof(*ts); i++) tensor_free(ts[i]);
+
+    CHECK_ABORT({ conv2d(trandn(4, (dim_sz_t[]){1, 3, 5, 5}), trandn(4, (dim_sz_t[]){4, 2, 3, 3}), NULL, NULL); });
+    CHECK_ABORT({ conv2d(trandn(4, (dim_sz_t[]){1, 3, 2, 2}), trandn(4, (dim_sz_t[]){4, 3, 3, 3}), NULL, NULL); });
+
+    return __func__;
+}
+
+/********************* POOLING *********************/
+
+// compares y (any strides) with a double precision pooling of x (any strides): max if max, avg otherwise, over
+// windows of kh x kw with stride and padding (adaptive windows when kh is 0)
+static void check_pool2d(tensor_t *y, tensor_t *x, bool max, dim_sz_t kh, dim_sz_t kw, dim_sz_t s, dim_sz_t pad, bool count_pad) {
+    dim_sz_t h = x->shape[2], w = x->shape[3], oh = y->shape[2], ow = y->shape[3];
+    assert(y->ndim == 4 && y->shape[0] == x->shape[0] && y->shape[1] == x->shape[1]);
+    if (kh > 0) assert(oh == (h + 2 * pad - kh) / s + 1 && ow == (w + 2 * pad - kw) / s + 1);
+    for (dim_sz_t n = 0; n < x->shape[0]; n++) {
+        for (dim_sz_t c = 0; c < x->shape[1]; c++) {
+            for (dim_sz_t oy = 0; oy < oh; oy++) {
+                for (dim_sz_t ox = 0; ox < ow; ox++) {
+                    dim_sz_t y0 = kh > 0 ? oy * s - pad : oy * h / oh, y1 = kh > 0 ? y0 + kh : ((oy + 1) * h + oh - 1) / oh;
+                    dim_sz_t x0 = kh > 0 ? ox * s - pad : ox * w / ow, x1 = kh > 0 ? x0 + kw : ((ox + 1) * w + ow - 1) / ow;
+                    double ref = max ? -INFINITY : 0, cnt = count_pad ? (MIN(y1, h + pad) - y0) * (MIN(x1, w + pad) - x0) : 0;
+                    for (dim_sz_t iy = y0; iy < y1; iy++) {
+                        for (dim_sz_t ix = x0; ix < x1; ix++) {
+                            if (iy < 0 || iy >= h || ix < 0 || ix >= w) continue;
+                            float v = x->data[n * x->stride[0] + c * x->stride[1] + iy * x->stride[2] + ix * x->stride[3]];
+                            ref = max ? fmax(ref, v) : ref + v;
+                            if (!count_pad) cnt++;
+                        }
+                    }
+                    if (!max) ref /= cnt;
+                    float got = y->data[n * y->stride[0] + c * y->stride[1] + oy * y->stride[2] + ox * y->stride[3]];
+                    assert(max ? got == ref : fabs(got - ref) <= 1e-5 * fabs(ref) + 1e-6);
+                }
+            }
+        }
+    }
+}
+
+// the windows are folded in the same order in both layouts: yc (contiguous) and yl (channels last) have the
+// same bits (nan included)
+static void check_pool_layouts(tensor_t *yc, tensor_t *yl) {
+    assert(yl->stride[1] == 1 && is_contiguous(yc));
+    for (uint32_t j = 0; j < yc->numel; j++) {
+        dim_sz_t ow = yc->shape[3], oh = yc->shape[2], c = yc->shape[1];
+        dim_sz_t n = j / (c * oh * ow), ch = j / (oh * ow) % c, oy = j / ow % oh, ox = j % ow;
+        float v = yl->data[n * yl->stride[0] + ch + oy * yl->stride[2] + ox * yl->stride[3]];
+        assert(isnan(yc->data[j]) ? isnan(v) : yc->data[j] == v);
+    }
+}
+
+const char *test_pool() {
+    tensor_t *x = trandn(4, (dim_sz_t[]){2, 3, 11, 12});
+    tensor_t *nhwc = trandn(4, (dim_sz_t[]){2, 11, 12, 20});
+    tensor_t *xl = permute(nhwc, (dim_t[]){0, 3, 1, 2});
+    tensor_t *xc = permute(xl, (dim_t[]){0, 1, 2, 3});
+    contiguous(xc);
+
+    pool_params_t ps[] = {
+        { .kernel = {2, 2} },
+        { .kernel = {3, 3}, .stride = {2, 2}, .padding = {1, 1} },
+        { .kernel = {3, 3}, .stride = {2, 2}, .padding = {1, 1}, .count_pad = true },
+        { .kernel = {5, 5}, .stride = {3, 3}, .padding = {2, 2} },
+        { .kernel = {9, 9}, .stride = {2, 2}, .padding = {4, 4} }, // border windows of 8 and more columns
+    };
+    for (uint32_t i = 0; i < sizeof(ps) / sizeof(*ps); i++) {
+        for (int max = 0; max < 2; max++) {
+            if (max && ps[i].count_pad) continue;
+            tensor_t *(*pool)(tensor_t *, const pool_params_t *) = max ? maxpool2d : avgpool2d;
+            tensor_t *y = pool(x, &ps[i]), *yl = pool(xl, &ps[i]), *yc = pool(xc, &ps[i]);
+            check_pool2d(y, x, max, ps[i].kernel[0], ps[i].kernel[1], ps[i].stride[0] > 0 ? ps[i].stride[0] : ps[i].kernel[0], ps[i].padding[0], ps[i].count_pad);
+            check_pool2d(yl, xl, max, ps[i].kernel[0], ps[i].kernel[1], ps[i].stride[0] > 0 ? ps[i].stride[0] : ps[i].kernel[0], ps[i].padding[0], ps[i].count_pad);
+
+            check_pool_layouts(yc, yl);
+            tensor_free(y);
+            tensor_free(yl);
+            tensor_free(yc);
+        }
+    }
+
+    // rows with strided columns
+    tensor_t *xt = permute(x, (dim_t[]){0, 1, 3, 2}), *yt = maxpool2d(xt, &ps[1]);
+    check_pool2d(yt, xt, true, 3, 3, 2, 1, false);
+    tensor_free(yt);
+    tensor_free(xt);
+
+    // expanded width (columns 0 apart) folds like its contiguous copy
+    tensor_t *xn = trandn(4, (dim_sz_t[]){2, 3, 5, 1}), *xe = expand(xn, 4, (dim_sz_t[]){2, 3, 5, 40});
+    tensor_t *xec = permute(xe, (dim_t[]){0, 1, 2, 3});
+    contiguous(xec);
+    for (int max = 0; max < 2; max++) {
+        tensor_t *(*pool)(tensor_t *, const pool_params_t *) = max ? maxpool2d : avgpool2d;
+        tensor_t *ye = pool(xe, &ps[1]), *yec = pool(xec, &ps[1]);
+        check_pool2d(ye, xe, max, 3, 3, 2, 1, false);
+        assert(memcmp(ye->data, yec->data, ye->numel * sizeof(float)) == 0);
+        tensor_free(ye);
+        tensor_free(yec);
+    }
+    tensor_free(xn);
+    tensor_free(xe);
+    tensor_free(xec);
+
+    // adaptive windows overlap when the sizes do not divide
+    tensor_t *ya = adaptive_avgpool2d(x, 4, 5), *yal = adaptive_avgpool2d(xl, 1, 1);
+    check_pool2d(ya, x, false, 0, 0, 0, 0, false);
+    check_pool2d(yal, xl, false, 0, 0, 0, 0, false);
+    tensor_t *yac = adaptive_avgpool2d(xc, 2, 3), *yacl = adaptive_avgpool2d(xl, 2, 3);
+    check_pool_layouts(yac, yacl);
+    tensor_free(yac);
+    tensor_free(yacl);
+
+    // a nan reaches every window holding it, in both layouts (border and full windows)
+    xc->data[1 * 12 + 1] = NAN; // (0, 0, 1, 1)
+    nhwc->data[(1 * 12 + 1) * 20] = NAN;
+    for (uint32_t i = 0; i < sizeof(ps) / sizeof(*ps); i++) {
+        for (int max = 0; max < 2; max++) {
+            tensor_t *(*pool)(tensor_t *, const pool_params_t *) = max ? maxpool2d : avgpool2d;
+            tensor_t *yc = pool(xc, &ps[i]), *yl = pool(xl, &ps[i]);
+            assert(isnan(yc->data[0]));
+            check_pool_layouts(yc, yl);
+            tensor_free(yc);
+            tensor_free(yl);
+        }
+    }
+
+    // 1-d
+    tensor_t *x1 = trandn(3, (dim_sz_t[]){2, 4, 17});
+    pool_params_t p1 = { .kernel = {4}, .stride = {3}, .padding = {1} };
+    tensor_t *y1 = maxpool1d(x1, &p1), *z1 = avgpool1d(x1, &p1), *a1 = adaptive_avgpool1d(x1, 6);
+    assert(x1->ndim == 3 && y1->ndim == 3 && y1->shape[2] == 6 && z1->shape[2] == 6 && a1->shape[2] == 6);
+    for (dim_sz_t i = 0; i < 2 * 4 * 6; i++) {
+        dim_sz_t ox = i % 6, lo = MAX(ox * 3 - 1, 0), hi = MIN(ox * 3 + 3, 17);
+        float m = -INFINITY, sum = 0;
+        for (dim_sz_t k = lo; k < hi; k++) {
+            m = fmaxf(m, x1->data[(i / 6) * 17 + k]);
+            sum += x1->data[(i / 6) * 17 + k];
+        }
+        assert(y1->data[i] == m && fabsf(z1->data[i] - sum / (hi - lo)) <= 1e-5f);
+    }
+    check_pool2d(unsqueeze(a1, 2), unsqueeze(x1, 2), false, 0, 0, 0, 0, false);
+
+    tensor_t *ts[] = { x, nhwc, xl, xc, ya, yal, x1, y1, z1, a1 };
+    for (uint32_t i = 0; i < sizeof(ts) / sizeof(*ts); i++) tensor_free(ts[i]);
+
+    CHECK_ABORT({ maxpool2d(trandn(4, (dim_sz_t[]){1, 1, 4, 4}), &(pool_params_t){ .kernel = {2, 2}, .padding = {2, 2} }); });
+
+    return __func__;
+}
+
+/********************* SOFTMAX *********************/
+
+// compares y with a double precision softmax (log-softmax if logp) along dim of the contiguous x, or with the
+// logsumexp if y has a size 1 dim there
+static void check_softmax(tensor_t *y, tensor_t *x, dim_t dim, bool logp) {
+    assert(is_contiguous(x) && is_contiguous(y));
+    dim_sz_t n = x->shape[dim], inner = 1;
+    for (dim_t d = dim + 1; d < x->ndim; d++) inner *= x->shape[d];
+    bool lse = y->numel * n == x->numel && n > 1;
+    for (dim_sz_t o = 0; o < x->numel / n / inner; o++) {
+        for (dim_sz_t i = 0; i < inner; i++) {
+            const float *xs = x->data + o * n * inner + i;
+            double m = -INFINITY, s = 0;
+            for (dim_sz_t j = 0; j < n; j++) m = fmax(m, xs[j * inner]);
+            for (dim_sz_t j = 0; j < n; j++) s += exp(xs[j * inner] - m);
+            if (lse) {
+                double ref = m + log(s);
+                assert(fabs(y->data[o * inner + i] - ref) <= 1e-6 * fabs(ref) + 1e-6);
+                continue;
+            }
+            for (dim_sz_t j = 0; j < n; j++) {
+                double ref = logp ? xs[j * inner] - m - log(s) : exp(xs[j * inner] - m) / s;
+                assert(fabs(y->data[o * n * inner + j * inner + i] - ref) <= 1e-5 * fabs(ref) + (logp ? 1e-6 : 1e-7));
+            }
+        }
+    }
+}
+
+const char *test_softmax() {
+    // rows with and without a vector tail, every dim
+    tensor_t *x = tuniform(3, (dim_sz_t[]){3, 37, 70}, -30, 30);
+    isa_t isa = dispatch_max_isa(ISA_SCALAR);
+    for (int pass = 0; pass < 2; pass++) {
+        for (dim_t d = 0; d < 3; d++) {
+            tensor_t *y = softmax(x, d), *z = log_softmax(x, d), *l = logsumexp(x, d, false), *lk = logsumexp(x, d, true);
+            assert(y->ndim == 3 && l->ndim == 2 && lk->ndim == 3 && lk->shape[d] == 1);
+            check_softmax(y, x, d, false);
+            check_softmax(z, x, d, true);
+            check_softmax(lk, x, d, false);
+            tensor_free(y);
+            tensor_free(z);
+            tensor_free(l);
+            tensor_free(lk);
+        }
+        dispatch_max_isa(isa);
+    }
+
+    // other layouts give the same bits as their row-major copy
+    tensor_t *xp = permute(x, (dim_t[]){2, 0, 1}), *xc = contiguous(permute(x, (dim_t[]){2, 0, 1}));
+    for (dim_t d = -1; d >= -3; d--) {
+        tensor_t *a = softmax(xp, d), *b = softmax(xc, d), *la = logsumexp(xp, d, false), *lb = logsumexp(xc, d, false);
+        for (uint32_t i = 0; i < a->numel; i++) assert(a->data[i] == b->data[i]);
+        for (uint32_t i = 0; i < la->numel; i++) assert(la->data[i] == lb->data[i]);
+        tensor_free(a);
+        tensor_free(b);
+        tensor_free(la);
+        tensor_free(lb);
+    }
+
+    // large values do not overflow and -inf values are left out; a row of -inf has no softmax but a logsumexp of
+    // -inf; nan spreads over its row
+    tensor_t *sp = tensor_alloc(2, (dim_sz_t[]){3, 9});
+    for (uint32_t i = 0; i < 27; i++) sp->data[i] = i % 9 < 3 ? -INFINITY : 1000 + (float) (i % 9);
+    for (uint32_t i = 9; i < 18; i++) sp->data[i] = -INFINITY;
+    sp->data[20] = NAN;
+    tensor_t *ys = softmax(sp, 1), *ls = logsumexp(sp, 1, false);
+    double s = 0;
+    for (uint32_t i = 3; i < 9; i++) s += exp(i - 8.0);
+    for (uint32_t i = 0; i < 9; i++) {
+        assert(i < 3 ? ys->data[i] == 0 : fabs(ys->data[i] - exp(i - 8.0) / s) < 1e-6);
+        assert(isnan(ys->data[9 + i]) && isnan(ys->data[18 + i]));
+    }
+    assert(fabs(ls->data[0] - (1008 + log(s))) < 1e-3 && ls->data[1] == -INFINITY && isnan(ls->data[2]));
+
+    tensor_t *ts[] = { x, xp, xc, sp, ys, ls };
+    for (uint32_t i = 0; i < sizeof(ts) / sizeof(*ts); i++) tensor_free(ts[i]);
+
+    return __func__;
+}
+
+/********************* NORMALIZATION *********************/
+
+// compares y with a double precision layernorm (rmsnorm if rms) of the contiguous x over its last dim
+static void check_norm(tensor_t *y, tensor_t *x, tensor_t *gamma, tensor_t *beta, float eps, bool rms) {
+    dim_sz_t n = x->shape[x->ndim-1];
+    for (dim_sz_t r = 0; r < x->numel / n; r++) {
+        const float *xr = x->data + r * n;
+        double mean = 0, var = 0;
+        for (dim_sz_t i = 0; i < n; i++) mean += xr[i];
+        mean = rms ? 0 : mean / n;
+        for (dim_sz_t i = 0; i < n; i++) var += (xr[i] - mean) * (xr[i] - mean);
+        double rstd = 1 / sqrt(var / n + eps);
+        for (dim_sz_t i = 0; i < n; i++) {
+            double ref = (xr[i] - mean) * rstd * (gamma != NULL ? gamma->data[i * gamma->stride[0]] : 1) + (beta != NULL ? beta->data[i] : 0);
+            assert(fabs(y->data[r * n + i] - ref) <= 1e-5 * fabs(ref) + 1e-5);
+        }
+    }
+}
+
+const char *test_norm() {
+    // rows with and without a vector tail; a large offset the statistics must not lose the variance to
+    tensor_t *x = trandn(3, (dim_sz_t[]){4, 5, 77}), *x2 = trandn(2, (dim_sz_t[]){9, 1000});
+    for (uint32_t i = 0; i < x2->numel; i++) x2->data[i] = x2->data[i] * 0.1f + 1000;
+    tensor_t *g2 = trandn(1, (dim_sz_t[]){154}), *g = slice(g2, 0, 0, 154, 2), *b = trandn(1, (dim_sz_t[]){77});
+    isa_t isa = dispatch_max_isa(ISA_SCALAR);
+    for (int pass = 0; pass < 2; pass++) {
+        tensor_t *y = layernorm(x, g, b, 1e-5f), *y0 = layernorm(x, NULL, NULL, 0), *z = rmsnorm(x, g, 1e-6f);
+        tensor_t *y2 = layernorm(x2, NULL, NULL, 1e-5f), *z2 = rmsnorm(x2, NULL, 0);
+        check_norm(y, x, g, b, 1e-5f, false);
+        check_norm(y0, x, NULL, NULL, 0, false);
+        check_norm(z, x, g, NULL, 1e-6f, true);
+        check_norm(y2, x2, NULL, NULL, 1e-5f, false);
+        check_norm(z2, x2, NULL, NULL, 0, true);
+        tensor_t *ts[] = { y, y0, z, y2, z2 };
+        for (uint32_t i = 0; i < sizeof(ts) / sizeof(*ts); i++) tensor_free(ts[i]);
+        dispatch_max_isa(isa);
+    }
+
+    // other layouts give the same bits as their row-major copy
+    tensor_t *xp = permute(x2, (dim_t[]){1, 0}), *xc = contiguous(permute(x2, (dim_t[]){1, 0}));
+    tensor_t *yp = layernorm(xp, NULL, NULL, 1e-5f), *yc = layernorm(xc, NULL, NULL, 1e-5f);
+    assert(yp->shape[0] == 1000 && yp->shape[1] == 9);
+    for (uint32_t i = 0; i < yp->numel; i++) assert(yp->data[i] == yc->data[i]);
+
+    tensor_t *ts[] = { x, x2, g2, g, b, xp, xc, yp, yc };
+    for (uint32_t i = 0; i < sizeof(ts) / sizeof(*ts); i++) tensor_free(ts[i]);
+
+    CHECK_ABORT({ layernorm(trandn(2, (dim_sz_t[]){3, 4}), trandn(1, (dim_sz_t[]){3}), NULL, 1e-5f); });
+
+    return __func__;
+}
+
+/********************* MOMENTS *********************/
+
+// compares the mean, variance and std of y (mean if correction < 0) with double precision ones along dim of the
+// contiguous x
+static void check_moments(tensor_t *y, tensor_t *x, dim_t dim, dim_sz_t correction, bool sd) {
+    assert(is_contiguous(x) && is_contiguous(y));
+    dim_sz_t n = x->shape[dim], inner = 1;
+    for (dim_t d = dim + 1; d < x->ndim; d++) inner *= x->shape[d];
+    assert(y->numel * n == x->numel);
+    for (dim_sz_t o = 0; o < x->numel / n / inner; o++) {
+        for (dim_sz_t i = 0; i < inner; i++) {
+            const float *xs = x->data + o * n * inner + i;
+            double m = 0, v = 0;
+            for (dim_sz_t j = 0; j < n; j++) m += xs[j * inner];
+            m /= n;
+            for (dim_sz_t j = 0; j < n; j++) v += (xs[j * inner] - m) * (xs[j * inner] - m);
+            v /= n - correction;
+            double ref = correction < 0 ? m : sd ? sqrt(v) : v;
+            assert(fabs(y->data[o * inner + i] - ref) <= 1e-5 * fabs(ref) + 1e-6);
+        }
+    }
+}
+
+const char *test_moments() {
+    // every dim, and dims longer than a block (rows and columns)
+    tensor_t *xs[] = {
+        trandn(3, (dim_sz_t[]){3, 37, 70}), trandn(2, (dim_sz_t[]){2, 10000}), trandn(2, (dim_sz_t[]){9000, 3}),
+    };
+    isa_t isa = dispatch_max_isa(ISA_SCALAR);
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t k = 0; k < sizeof(xs) / sizeof(*xs); k++) {
+            for (dim_t d = 0; d < xs[k]->ndim; d++) {
+                tensor_t *m = mean(xs[k], d, true), *v0 = var(xs[k], d, 0, true), *v1 = var(xs[k], d, 1, false), *s1 = std(xs[k], d, 1, true);
+                assert(m->ndim == xs[k]->ndim && m->shape[d] == 1 && v1->ndim == xs[k]->ndim - 1);
+                check_moments(m, xs[k], d, -1, false);
+                check_moments(v0, xs[k], d, 0, false);
+                check_moments(v1, xs[k], d, 1, false);
+                check_moments(s1, xs[k], d, 1, true);
+                tensor_t *ts[] = { m, v0, v1, s1 };
+                for (uint32_t i = 0; i < sizeof(ts) / sizeof(*ts); i++) tensor_free(ts[i]);
+            }
+        }
+        dispatch_max_isa(isa);
+    }
+
+    // a large mean does not eat the variance (sum(x^2) / n - mean^2 in float would be off by more than the
+    // variance itself), and the blocks merge the same way whatever the number of threads
+    tensor_t *x = trandn(1, (dim_sz_t[]){300001});
+    for (uint32_t i = 0; i < x->numel; i++) x->data[i] = x->data[i] * 0.5f + 10000;
+    uint32_t threads = tensor_threads();
+    tensor_set_threads(1);
+    tensor_t *v1 = varall(x, 1), *m1 = meanall(x);
+    tensor_set_threads(4);
+    tensor_t *v4 = varall(x, 1), *s4 = stdall(x, 1);
+    tensor_set_threads(threads);
+    // std takes the root of the variance in double, before it is rounded to float: within 1 ulp of sqrtf
+    float sd = sqrtf(v4->data[0]);
+    assert(v1->data[0] == v4->data[0] && fabsf(s4->data[0] - sd) <= nextafterf(sd, INFINITY) - sd);
+    tensor_t *x2 = reshape(x, 2, (dim_sz_t[]){1, 300001});
+    check_moments(v1, x2, 1, 1, false);
+    check_moments(m1, x2, 1, -1, false);
+
+    // other layouts give the same bits as their row-major copy; a single value has no sample variance
+    tensor_t *xp = permute(xs[0], (dim_t[]){2, 0, 1}), *xc = contiguous(permute(xs[0], (dim_t[]){2, 0, 1}));
+    tensor_t *a = var(xp, 1, 1, false), *b = var(xc, 1, 1, false), *sa = stdall(xp, 0), *sb = stdall(xc, 0);
+    for (uint32_t i = 0; i < a->numel; i++) assert(a->data[i] == b->data[i]);
+    assert(sa->data[0] == sb->data[0]);
+    tensor_t *one = fill(1, 3), *vn = varall(one, 1), *v0 = varall(one, 0);
+    assert(isnan(vn->data[0]) && v0->data[0] == 0);
+
+    // a short dim has a single block: nothing beyond the result is allocated (no per-column partials)
+    tensor_op_stats_t ops[64];
+    const tensor_op_stats_t *op = find_op(ops, tensor_mem_op_stats(ops, 64), "var");
+    uint64_t bytes = op != NULL ? op->bytes : 0;
+    tensor_t *xw = trandn(2, (dim_sz_t[]){2, 1000}), *vw = var(xw, 0, 1, false);
+    op = find_op(ops, tensor_mem_op_stats(ops, 64), "var");
+    assert(op != NULL && op->bytes - bytes < xw->numel * sizeof(float));
+    check_moments(vw, xw, 0, 1, false);
+
+    tensor_t *ts[] = { xs[0], xs[1], xs[2], x, v1, m1, v4, s4, xp, xc, a, b, sa, sb, one, vn, v0, xw, vw };
+    for (uint32_t i = 0; i < sizeof(ts) / sizeof(*ts); i++) tensor_free(ts[i]);
+
+    return __func__;
+}
+
+const char *(*fnx[])(void) = {
+    test_transpose,
+    test_is_contiguous,
+    test_reshape,
+    test_broadcast,
+    test_squeeze_unqueeze,
+    test_min_max,
+    test_sumall,
+    test_sum_dim0, test_sum_dim1_keepdim, test_sum_negative_dim, test_sum_dim_out_of_range, test_sum_dim4,
+    test_expand,
+    test_permute,
+    test_slice,
+    test_mem_stats,
+    test_mem_cache,
+    test_scalar_pool,
+    test_scratch,
+    test_dbg_threads,
+    test_constructors,
+    test_parallel_for,
+    test_philox,
+    test_random,
+    test_unary,
+    test_ulp_sweep,
+    test_binary,
+    test_where,
+    test_fma,
+    test_ewprog,
+    test_dispatch,
+    test_plan_cache,
+    test_matmul,
+    test_matmul_fused,
+    test_gemv,
+    test_q8,
+    test_q4,
+    test_conv,
+    test_pool,
+    test_softmax,
+    test_norm,
+    test_moments,
+};
+
+int main(int argc, char **argv) {
+    for (uint32_t i = 0; i < sizeof(fnx) / sizeof(*fnx); i++) printf("%s\n", fnx[i]());
     return 0;
-}
\ No newline at end of file
+}